@@ -0,0 +1,267 @@
+#!/bin/sh
+#
+# bench.sh
+#
+# Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+#
+# This software is licensed under the terms of the MIT License.
+# See the included file "LICENSE" for more information.
+#
+
+################################################################
+#  The benchmark suite behind "make bench". Runs every workload
+#  once per configuration, in $BENCH_DIR, and appends a line per
+#  result to $BENCH_OUT, tab-separated:
+#
+#  	label  fs  config  bench  value  unit
+#
+#  label is $BENCH_LABEL (the git revision by default), fs is
+#  what $BENCH_DIR is on. Runs with different labels, on
+#  different filesystems, collect in the same file; -r prints
+#  one as a table with a column per configuration.
+#
+#  Configurations ($BENCH_CONFIGS, separated by spaces):
+#  	plain     no preload: the baseline
+#  	preload   fsfakeroot.so, defaults
+#  	nocache   FSFR_CACHE=0
+#  	prefetch  FSFR_PREFETCH=4
+#  	daemon    FSFR_DAEMON, against a fresh fsfr-faked
+#  	tools     fsfr-chown and fsfr-tar in place of chown -R
+#  	          and tar -c; nothing else
+#  	name:VAR=value,...
+#  	          the preload with those set, for anything else
+#
+#  With -i <type>, the whole run happens on a fresh loop-mounted
+#  image made with mkfs.<type> (needs root): -i ext4. $BENCH_SO
+#  replaces fsfakeroot.so throughout.
+#
+#  -c <a.so> <b.so> compares two builds of the library instead:
+#  size, exported symbols, and call_bench side by side, the best
+#  of $BENCH_ROUNDS runs of each.
+################################################################
+
+set -e
+
+cd "$(dirname "$0")/.."
+TOP=$(pwd)
+SO=${BENCH_SO:-$TOP/fsfakeroot.so}
+
+BENCH_DIR=${BENCH_DIR:-/tmp}
+BENCH_OUT=${BENCH_OUT:-$TOP/bench/results.tsv}
+BENCH_CONFIGS=${BENCH_CONFIGS:-plain preload tools}
+BENCH_CALLS=${BENCH_CALLS:-200000}
+BENCH_SCAN=${BENCH_SCAN:-100000}
+BENCH_TREE=${BENCH_TREE:-20000}
+BENCH_JOBS=${BENCH_JOBS:-$(nproc 2>/dev/null || echo 2)}
+BENCH_IMAGE_SIZE=${BENCH_IMAGE_SIZE:-4G}
+if [ -z "$BENCH_LABEL" ]; then
+	BENCH_LABEL=$(git describe --always --dirty 2>/dev/null || echo current)
+fi
+
+usage() {
+	echo "usage: $0 [-i <fstype>] | -r [label] | -c <a.so> <b.so>" >&2
+	exit 2
+}
+
+# -r: the results for one label (the last by default) as a table
+report() {
+	[ -f "$BENCH_OUT" ] || { echo "$BENCH_OUT: no results" >&2; exit 1; }
+	label=${1:-$(tail -n 1 "$BENCH_OUT" | cut -f 1)}
+	awk -F'\t' -v label="$label" '
+		$1 != label { next }
+		{
+			col = $2 "/" $3
+			row = $4 " (" $6 ")"
+			if (!(col in c)) { c[col] = 1; cols[++ncols] = col }
+			if (!(row in r)) { r[row] = 1; rows[++nrows] = row }
+			v[row, col] = $5
+		}
+		END {
+			printf "%-24s", label
+			for (j = 1; j <= ncols; j++) printf " %16s", cols[j]
+			printf "\n"
+			for (i = 1; i <= nrows; i++) {
+				printf "%-24s", rows[i]
+				for (j = 1; j <= ncols; j++)
+					printf " %16s", ((rows[i], cols[j]) in v) ? v[rows[i], cols[j]] : "-"
+				printf "\n"
+			}
+		}' "$BENCH_OUT"
+}
+
+# -i: run again, from the top, on a scratch filesystem
+image() {
+	img=$BENCH_DIR/fsfr-bench.$1.img
+	mnt=$BENCH_DIR/fsfr-bench.$1.mnt
+	rm -f "$img"
+	truncate -s "$BENCH_IMAGE_SIZE" "$img"
+	mkfs."$1" -q "$img" </dev/null
+	mkdir -p "$mnt"
+	mount -o loop "$img" "$mnt"
+	trap 'umount "$mnt"; rmdir "$mnt"; rm -f "$img"' EXIT
+	BENCH_DIR=$mnt sh "$TOP/bench/bench.sh"
+}
+
+# -c: two builds of the library, call by call
+compare() {
+	for so in "$1" "$2"; do
+		printf '%s: %s bytes of text, %s symbols exported\n' "$so" \
+			"$(size "$so" | awk 'NR==2 { print $1 }')" \
+			"$(nm -D --defined-only "$so" | wc -l)"
+	done
+	rm -f "$W.a" "$W.b"
+	i=0
+	while [ $i -lt "${BENCH_ROUNDS:-3}" ]; do
+		LD_PRELOAD=$1 bench/call_bench "$W.calls" "$BENCH_CALLS" >>"$W.a"
+		LD_PRELOAD=$2 bench/call_bench "$W.calls" "$BENCH_CALLS" >>"$W.b"
+		i=$((i + 1))
+	done
+	awk '
+		FNR == NR {
+			if (!($1 in a)) order[++n] = $1
+			if (!($1 in a) || $2 < a[$1]) a[$1] = $2
+			next
+		}
+		!($1 in b) || $2 < b[$1] { b[$1] = $2 }
+		END {
+			printf "%-10s %12s %12s %8s\n", "ns/op", "a", "b", "change"
+			for (i = 1; i <= n; i++) {
+				k = order[i]
+				printf "%-10s %12.1f %12.1f %+7.1f%%\n", k, a[k], b[k], (b[k] - a[k]) * 100 / a[k]
+			}
+		}' "$W.a" "$W.b"
+	rm -f "$W.a" "$W.b"
+}
+
+W=$BENCH_DIR/fsfr-bench
+
+case "$1" in
+	-r) report "$2"; exit ;;
+	-c) [ -n "$3" ] || usage; compare "$2" "$3"; exit ;;
+	-i) [ -n "$2" ] || usage; image "$2"; exit ;;
+	"") ;;
+	*) usage ;;
+esac
+
+FS=$(df --output=fstype "$BENCH_DIR" 2>/dev/null | tail -n 1)
+[ -n "$FS" ] || FS=$(stat -f -c %T "$BENCH_DIR")
+[ -f "$BENCH_OUT" ] || printf 'label\tfs\tconfig\tbench\tvalue\tunit\n' >"$BENCH_OUT"
+
+now() {
+	date +%s%N
+}
+
+# record <config> <bench> <value> <unit>
+record() {
+	printf '%-10s %-16s %14s %s\n' "$1" "$2" "$3" "$4"
+	printf '%s\t%s\t%s\t%s\t%s\t%s\n' "$BENCH_LABEL" "$FS" "$1" "$2" "$3" "$4" >>"$BENCH_OUT"
+}
+
+# run <bench> <command...>: wall time of one run, in the environment
+# of the current configuration
+run() {
+	name=$1
+	shift
+	t0=$(now)
+	if ! env $ENV "$@" >/dev/null; then
+		echo "$CONFIG: $name failed" >&2
+		return 0
+	fi
+	record "$CONFIG" "$name" $(( ($(now) - t0) / 1000000 )) ms
+}
+
+# the environment for a configuration, into $ENV
+setup() {
+	PROXY=
+	ENV="LD_PRELOAD=$SO"
+	case "$1" in
+		plain) ENV= ;;
+		preload|tools) ;;
+		nocache) ENV="$ENV FSFR_CACHE=0" ;;
+		prefetch) ENV="$ENV FSFR_PREFETCH=4" ;;
+		daemon)
+			rm -f "$W.sock"
+			"$TOP/fsfr-faked" -f "$W.sock" &
+			FAKED=$!
+			while [ ! -S "$W.sock" ]; do sleep 0.1; done
+			ENV="$ENV FSFR_DAEMON=$W.sock"
+			;;
+		*:*) ENV="$ENV $(echo "${1#*:}" | tr , ' ')" ;;
+		*) echo "$1: unknown configuration" >&2; exit 2 ;;
+	esac
+	# the daemon keeps symlinks' owners itself
+	case "$1" in
+		plain|daemon) ;;
+		*) PROXY="FSFR_PROXY_DIR=$W.proxy" ;;
+	esac
+}
+
+teardown() {
+	if [ -n "$FAKED" ]; then
+		kill "$FAKED"
+		wait "$FAKED" || true
+		FAKED=
+		rm -f "$W.sock"
+	fi
+	rm -rf "$W.work" "$W.copy" "$W.rsync" "$W.proxy" "$W.calls" "$W.scan" "$W.tar"
+}
+
+# the trees, made once, without the preload: the same archives
+# get unpacked in every configuration
+rm -rf "$W.src" "$W.links" "$W.src.tar" "$W.links.tar"
+bench/mktree "$W.src" "$BENCH_TREE"
+bench/mktree -l "$W.links" "$BENCH_TREE"
+tar --numeric-owner --owner=1 --group=1 -cf "$W.src.tar" -C "$W.src" .
+tar --numeric-owner --owner=1 --group=1 -cf "$W.links.tar" -C "$W.links" .
+rm -rf "$W.src" "$W.links"
+
+echo "== $BENCH_LABEL on $FS ($BENCH_DIR), into $BENCH_OUT"
+for SPEC in $BENCH_CONFIGS; do
+	CONFIG=${SPEC%%:*}
+	teardown
+	setup "$SPEC"
+	mkdir -p "$W.proxy" "$W.work"
+
+	if [ "$CONFIG" = tools ]; then
+		LD_PRELOAD=$SO tar -xf "$W.src.tar" -C "$W.work"
+		ENV=
+		run chown-R "$TOP/fsfr-chown" -R 7:7 "$W.work"
+		run tar-c "$TOP/fsfr-tar" -f "$W.tar" -C "$W.work" .
+		teardown
+		continue
+	fi
+
+	env $ENV bench/call_bench "$W.calls" "$BENCH_CALLS" |
+	while read -r name value unit; do
+		record "$CONFIG" "$name" "$value" "$unit"
+	done
+
+	env $ENV bench/scan_bench -c "$BENCH_SCAN" "$W.scan"
+	set -- $(env $ENV bench/scan_bench "$W.scan")
+	record "$CONFIG" scan "$5" ns/entry
+	rm -rf "$W.scan"
+
+	set -- $(env $ENV bench/startup_bench)
+	record "$CONFIG" startup "$2" us/exec
+
+	run extract tar -xf "$W.src.tar" -C "$W.work"
+	run find-ls find "$W.work" -ls
+	run cp-a cp -a "$W.work" "$W.copy"
+	if command -v rsync >/dev/null; then
+		run rsync-a rsync -a "$W.work/" "$W.rsync/"
+	fi
+	run make make -s -j"$BENCH_JOBS" -C "$W.work"
+	run chown-R chown -R 7:7 "$W.work"
+	run tar-c tar -cf "$W.tar" -C "$W.work" .
+	rm -rf "$W.work" "$W.copy" "$W.rsync" "$W.tar"
+
+	mkdir -p "$W.work"
+	ENV="$ENV $PROXY"
+	run extract-links tar -xf "$W.links.tar" -C "$W.work"
+	run find-ls-links find "$W.work" -ls
+	run cp-a-links cp -a "$W.work" "$W.copy"
+	run chown-R-links chown -R 7:7 "$W.work"
+
+	teardown
+done
+rm -f "$W.src.tar" "$W.links.tar"
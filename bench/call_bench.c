@@ -0,0 +1,131 @@
+/*
+ * call_bench.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+/****************************************************************
+ *  Per-call cost of the wrapped calls. Run it once plain and
+ *  once with fsfakeroot.so preloaded; the difference is our
+ *  overhead. Everything happens in a scratch directory that is
+ *  removed again afterwards; the calls that create something
+ *  (mknod, mkdir, symlink) make a tenth as many new entries,
+ *  and the cleanup isn't timed. The __xstat row exercises the
+ *  pre-2.33 entry point, which is what older binaries still call.
+ *
+ *  Without the preload and without root, chown fails and mknod
+ *  makes fifos; it's still the cost of the call.
+ ****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+#define BENCH(LABEL,N,EXPR)												\
+	do {																\
+		long i;															\
+		double start = now();											\
+		for (i=0; i<(N); i++) EXPR;										\
+		printf("%-10s %10.1f ns/op\n",LABEL,(now()-start)/(N));			\
+	} while (0)
+
+// names for the entries made by the creating calls, so that
+// formatting them isn't part of the time
+static char **bench_names(const char *dir, const char *prefix, long n)
+{
+	char **names = malloc(n*sizeof(char*));
+	long i;
+	for (i=0; names && i<n; i++)
+		if (asprintf(&names[i],"%s/%s%07li",dir,prefix,i)==-1) exit(1);
+	if (!names) exit(1);
+	return names;
+}
+
+static void bench_free(char **names, long n, int (*rm)(const char *))
+{
+	long i;
+	for (i=0; i<n; i++) {
+		rm(names[i]);
+		free(names[i]);
+	}
+	free(names);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr,"usage: %s <dir> [iterations]\n",argv[0]);
+		return 2;
+	}
+	const char *dir = argv[1];
+	long n = argc > 2 ? atol(argv[2]) : 200000;
+	long nnew = n/10 ? n/10 : 1;
+	char path[PATH_MAX], buf[4096];
+	struct stat st;
+	char **names;
+
+	if (mkdir(dir,0755) && stat(dir,&st)) {
+		perror(dir);
+		return 1;
+	}
+	snprintf(path,sizeof(path),"%s/file",dir);
+	int fd = open(path,O_RDONLY|O_CREAT,0644);
+	if (fd==-1) {
+		perror(path);
+		return 1;
+	}
+	// so that (under the preload) there's metadata to find
+	if (chown(path,1,1)) {}
+
+	BENCH("stat",n,stat(path,&st));
+	BENCH("lstat",n,lstat(path,&st));
+	BENCH("fstat",n,fstat(fd,&st));
+	BENCH("fstatat",n,fstatat(AT_FDCWD,path,&st,0));
+
+	int (*xstat)(int,const char *,struct stat *) = dlsym(RTLD_DEFAULT,"__xstat");
+	if (xstat) BENCH("__xstat",n,xstat(1,path,&st));
+
+	BENCH("chown",n,if (chown(path,1+(i&1),1+(i&1))) {});
+	BENCH("chmod",n,chmod(path,(i&1) ? 0640 : 0644));
+	BENCH("listxattr",n,listxattr(path,buf,sizeof(buf)));
+
+	mode_t nodemode = S_IFCHR|0644;
+	names = bench_names(dir,"n",nnew);
+	if (mknod(names[0],nodemode,makedev(1,3))) nodemode = S_IFIFO|0644;
+	unlink(names[0]);
+	BENCH("mknod",nnew,mknod(names[i],nodemode,makedev(1,3)));
+	bench_free(names,nnew,unlink);
+
+	names = bench_names(dir,"d",nnew);
+	BENCH("mkdir",nnew,mkdir(names[i],0755));
+	bench_free(names,nnew,rmdir);
+
+	names = bench_names(dir,"l",nnew);
+	BENCH("symlink",nnew,symlink("file",names[i]));
+	bench_free(names,nnew,unlink);
+
+	close(fd);
+	unlink(path);
+	rmdir(dir);
+	return 0;
+}
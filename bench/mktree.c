@@ -0,0 +1,102 @@
+/*
+ * mktree.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+/****************************************************************
+ *  A source tree for the macro benchmarks: <count> small files,
+ *  100 to a directory, 16 directories to a group, and a Makefile
+ *  at the top that copies each directory (cp -p, then chmod) into
+ *  out/, one rule per directory, for make -j to chew on. With -l,
+ *  every other entry is a symlink to the file before it, which
+ *  under the preload means a proxy entry for each.
+ ****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define TREE_PERDIR 100
+#define TREE_PERGROUP 16
+
+int main(int argc, char **argv)
+{
+	int links = 0, opt;
+	while ((opt = getopt(argc,argv,"l")) != -1) {
+		switch (opt) {
+		case 'l': links = 1; break;
+		default: goto usage;
+		}
+	}
+	if (optind != argc-2) goto usage;
+	const char *top = argv[optind];
+	long count = atol(argv[optind+1]);
+	long ndirs = (count + TREE_PERDIR-1) / TREE_PERDIR;
+	char path[PATH_MAX], data[4096];
+	long i, d;
+	if (count < 1) goto usage;
+	memset(data,'x',sizeof(data));
+
+	if (mkdir(top,0755)) {
+		perror(top);
+		return 1;
+	}
+	for (i=0; i<count; i++) {
+		d = i / TREE_PERDIR;
+		if (i % TREE_PERDIR == 0) {
+			if (d % TREE_PERGROUP == 0) {
+				snprintf(path,sizeof(path),"%s/g%03li",top,d/TREE_PERGROUP);
+				mkdir(path,0755);
+			}
+			snprintf(path,sizeof(path),"%s/g%03li/d%05li",top,d/TREE_PERGROUP,d);
+			if (mkdir(path,0755)) {
+				perror(path);
+				return 1;
+			}
+		}
+		snprintf(path,sizeof(path),"%s/g%03li/d%05li/f%07li",top,d/TREE_PERGROUP,d,i);
+		if (links && (i & 1)) {
+			char target[24];
+			snprintf(target,sizeof(target),"f%07li",i-1);
+			if (symlink(target,path)) {
+				perror(path);
+				return 1;
+			}
+			continue;
+		}
+		int fd = open(path,O_WRONLY|O_CREAT|O_TRUNC,(i % 7) ? 0644 : 0755);
+		if (fd==-1 || write(fd,data,64 + (i*97) % (sizeof(data)-64)) < 0) {
+			perror(path);
+			return 1;
+		}
+		close(fd);
+	}
+
+	snprintf(path,sizeof(path),"%s/Makefile",top);
+	FILE *mk = fopen(path,"w");
+	if (!mk) {
+		perror(path);
+		return 1;
+	}
+	fprintf(mk,"DIRS =");
+	for (d=0; d<ndirs; d++) fprintf(mk," \\\n\tg%03li/d%05li",d/TREE_PERGROUP,d);
+	fprintf(mk,"\n\nall: $(DIRS:%%=out/%%.stamp)\n\n"
+		"out/%%.stamp: %%\n"
+		"\t@mkdir -p out/$* && cp -pR $*/. out/$* && chmod -R go-w out/$* && touch $@\n");
+	fclose(mk);
+	return 0;
+
+usage:
+	fprintf(stderr,"usage: %s [-l] <dir> <count>\n",argv[0]);
+	return 2;
+}
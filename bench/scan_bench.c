@@ -0,0 +1,93 @@
+/*
+ * scan_bench.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+/****************************************************************
+ *  The ls -l pattern: read a whole directory, then lstat every
+ *  entry in it. With -c <n>, first fill the directory with n
+ *  files and chown each one, so that (under the preload) they
+ *  all carry metadata. Compare FSFR_PREFETCH unset against e.g.
+ *  FSFR_PREFETCH=4.
+ ****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	long create = 0;
+	int opt;
+	while ((opt = getopt(argc,argv,"c:")) != -1) {
+		switch (opt) {
+		case 'c': create = atol(optarg); break;
+		default: goto usage;
+		}
+	}
+	if (optind != argc-1) goto usage;
+	const char *dir = argv[optind];
+	char path[PATH_MAX];
+	long i;
+
+	if (create) {
+		mkdir(dir,0755);
+		for (i=0; i<create; i++) {
+			snprintf(path,PATH_MAX,"%s/f%07li",dir,i);
+			int fd = open(path,O_WRONLY|O_CREAT,0644);
+			if (fd==-1) {
+				perror(path);
+				return 1;
+			}
+			close(fd);
+			chown(path,i%100,i%100);
+		}
+		return 0;
+	}
+
+	double start = now();
+	DIR *d = opendir(dir);
+	if (!d) {
+		perror(dir);
+		return 1;
+	}
+	size_t n = 0, cap = 1024;
+	char **names = malloc(cap*sizeof(char*));
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		if (n==cap) names = realloc(names,(cap*=2)*sizeof(char*));
+		names[n++] = strdup(de->d_name);
+	}
+	struct stat st;
+	for (i=0; i<n; i++) {
+		snprintf(path,PATH_MAX,"%s/%s",dir,names[i]);
+		lstat(path,&st);
+	}
+	closedir(d);
+	double total = now()-start;
+	printf("%zu entries %10.1f ms %10.1f ns/entry\n",n,total/1e6,total/n);
+	return 0;
+
+usage:
+	fprintf(stderr,"usage: %s [-c <count>] <dir>\n",argv[0]);
+	return 2;
+}
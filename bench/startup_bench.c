@@ -0,0 +1,63 @@
+/*
+ * startup_bench.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+/****************************************************************
+ *  Cost of starting a process. Spawns a program (by default
+ *  /bin/true) over and over and reports the average time from
+ *  spawn to exit, which for /bin/true is almost all exec, dynamic
+ *  linking and constructors. Run it once plain and once with
+ *  fsfakeroot.so in LD_PRELOAD; the children inherit it. Any
+ *  further arguments are passed on, so with one iteration it
+ *  also times a single run of a real command.
+ ****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	long n = argc > 1 ? atol(argv[1]) : 2000;
+	char *prog = argc > 2 ? argv[2] : "/bin/true";
+	char *deflt[] = { prog, NULL };
+	char **args = argc > 2 ? argv+2 : deflt;
+	long i;
+	if (n < 1) {
+		fprintf(stderr,"usage: %s [iterations] [program [args...]]\n",argv[0]);
+		return 2;
+	}
+	double start = now();
+	for (i=0; i<n; i++) {
+		pid_t pid;
+		int status;
+		if (posix_spawn(&pid,prog,NULL,NULL,args,environ)) {
+			perror(prog);
+			return 1;
+		}
+		waitpid(pid,&status,0);
+	}
+	const char *label = argc > 3 ? strrchr(prog,'/') ? strrchr(prog,'/')+1 : prog : "startup";
+	printf("%-10s %10.1f us/exec\n",label,(now()-start)/n/1000);
+	return 0;
+}
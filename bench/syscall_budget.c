@@ -0,0 +1,673 @@
+/*
+ * syscall_budget.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+/****************************************************************
+ *  How many real syscalls each wrapped call costs, against a
+ *  budget: "make check". Extra syscalls are what a regression in
+ *  this library looks like, so any case that goes over fails,
+ *  with the syscalls it made listed. A case can also report that
+ *  the call did the wrong thing, which fails it whatever it cost.
+ *
+ *  The cases run in a child with the preload, under ptrace, and
+ *  bracket the call they measure with a marker (a syscall that
+ *  doesn't exist); only what happens in between is counted. Each
+ *  case first runs once on a copy of its files, so that whatever
+ *  the library sets up on first use isn't counted against it.
+ *  The files are prepared beforehand by another child, so every
+ *  case starts with a cold metadata cache. All of the FSFR_*
+ *  variables are cleared, except for FSFR_PROXY_DIR, which
+ *  defaults to a directory of its own; io_uring batching is
+ *  switched off, since it hides the very round trips being
+ *  counted.
+ *
+ *  The budgets are what the code costs today on a filesystem with
+ *  user xattrs (ext4, or tmpfs on a recent kernel). A change that
+ *  makes something cheaper should lower its budget too.
+ ****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+
+#define MARK_NR 0x3fff			// no such syscall, anywhere
+#define MARK_BEGIN 1
+#define MARK_END 2
+#define MAX_SYSCALLS 64
+
+static int mark_case = -1;		// the case being counted, or -1 for a warm-up
+static int mark_wrong = 0;		// set by a case whose call didn't do what it should
+
+#define BEGIN() syscall(MARK_NR,MARK_BEGIN,mark_case)
+#define END() syscall(MARK_NR,MARK_END,mark_case,mark_wrong)
+
+/****************************************************************
+ *  Fixtures
+ *  	Called with the case's base path, in the setup child (with
+ *  	the preload, so chown leaves metadata behind).
+ ****************************************************************/
+static char *cat(const char *p, const char *suffix)
+{
+	static char buf[PATH_MAX];
+	snprintf(buf,sizeof(buf),"%s%s",p,suffix);
+	return buf;
+}
+
+static void mk_none(const char *p)
+{
+}
+
+static void mk_plain(const char *p)
+{
+	int fd = open(p,O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if (fd!=-1) close(fd);
+}
+
+static void mk_owned(const char *p)
+{
+	mk_plain(p);
+	if (chown(p,1,1)) perror(p);
+}
+
+static void mk_dir(const char *p)
+{
+	mkdir(p,0755);
+}
+
+static void mk_symlink(const char *p)
+{
+	mk_plain(cat(p,".target"));
+	if (symlink("target",p)) perror(p);
+	if (lchown(p,1,1)) perror(p);
+}
+
+static void mk_ownedir(const char *p)
+{
+	int i;
+	char name[16];
+	mk_dir(p);
+	if (chown(p,1,1)) perror(p);
+	for (i=0; i<10; i++) {
+		snprintf(name,sizeof(name),"/%i",i);
+		mk_owned(cat(p,name));
+	}
+}
+
+/****************************************************************
+ *  The calls
+ ****************************************************************/
+static void do_stat(const char *p)
+{
+	struct stat st;
+	BEGIN(); stat(p,&st); END();
+}
+
+static void do_stat_twice(const char *p)
+{
+	struct stat st;
+	stat(p,&st);
+	BEGIN(); stat(p,&st); END();
+}
+
+static void do_lstat(const char *p)
+{
+	struct stat st;
+	BEGIN(); lstat(p,&st); END();
+}
+
+static void do_fstat(const char *p)
+{
+	struct stat st;
+	int fd = open(p,O_RDONLY);
+	BEGIN(); fstat(fd,&st); END();
+	close(fd);
+}
+
+static void do_fstatat(const char *p)
+{
+	struct stat st;
+	BEGIN(); fstatat(AT_FDCWD,p,&st,AT_SYMLINK_NOFOLLOW); END();
+}
+
+static void do_statx(const char *p)
+{
+	struct statx stx;
+	BEGIN(); statx(AT_FDCWD,p,0,STATX_BASIC_STATS,&stx); END();
+}
+
+static void do_xstat(const char *p)
+{
+	static int (*xstat)(int,const char *,struct stat *) = NULL;
+	struct stat st;
+	if (!xstat) xstat = dlsym(RTLD_DEFAULT,"__xstat");
+	if (!xstat) xstat = (int (*)(int,const char *,struct stat *))stat;
+	BEGIN(); xstat(1,p,&st); END();
+}
+
+static void do_access(const char *p)
+{
+	BEGIN(); access(p,W_OK); END();
+}
+
+static void do_faccessat(const char *p)
+{
+	BEGIN(); faccessat(AT_FDCWD,p,R_OK|W_OK,AT_EACCESS); END();
+}
+
+static void do_chmod(const char *p)
+{
+	BEGIN(); chmod(p,0600); END();
+}
+
+static void do_fchmod(const char *p)
+{
+	int fd = open(p,O_RDONLY);
+	BEGIN(); fchmod(fd,0600); END();
+	close(fd);
+}
+
+static void do_fchmodat(const char *p)
+{
+	BEGIN(); fchmodat(AT_FDCWD,p,0600,0); END();
+}
+
+static void do_chown(const char *p)
+{
+	BEGIN(); if (chown(p,2,2)) {} END();
+}
+
+static void do_lchown(const char *p)
+{
+	BEGIN(); if (lchown(p,2,2)) {} END();
+}
+
+static void do_fchown(const char *p)
+{
+	int fd = open(p,O_RDONLY);
+	BEGIN(); if (fchown(fd,2,2)) {} END();
+	close(fd);
+}
+
+static void do_fchownat(const char *p)
+{
+	BEGIN(); if (fchownat(AT_FDCWD,p,2,2,AT_SYMLINK_NOFOLLOW)) {} END();
+}
+
+static void do_mknod(const char *p)
+{
+	BEGIN(); mknod(p,S_IFCHR|0600,makedev(1,3)); END();
+}
+
+static void do_mknodat(const char *p)
+{
+	BEGIN(); mknodat(AT_FDCWD,p,S_IFCHR|0600,makedev(1,3)); END();
+}
+
+static void do_mkdir(const char *p)
+{
+	BEGIN(); mkdir(p,0755); END();
+}
+
+static void do_mkdirat(const char *p)
+{
+	BEGIN(); mkdirat(AT_FDCWD,p,0755); END();
+}
+
+static void do_symlink(const char *p)
+{
+	BEGIN(); if (symlink("target",p)) {} END();
+}
+
+static void do_symlinkat(const char *p)
+{
+	BEGIN(); if (symlinkat("target",AT_FDCWD,p)) {} END();
+}
+
+static void do_open(const char *p)
+{
+	BEGIN(); int fd = open(p,O_RDONLY); END();
+	close(fd);
+}
+
+static void do_open_creat(const char *p)
+{
+	BEGIN(); int fd = open(p,O_WRONLY|O_CREAT|O_EXCL,0644); END();
+	close(fd);
+}
+
+static void do_open_trunc(const char *p)
+{
+	BEGIN(); int fd = open(p,O_WRONLY|O_CREAT|O_TRUNC,0644); END();
+	close(fd);
+}
+
+// not a budget so much as the kernel's rules: a directory is EISDIR
+static void do_open_creat_dir(const char *p)
+{
+	BEGIN();
+	int fd = open(p,O_RDONLY|O_CREAT,0644);
+	mark_wrong = fd!=-1 || errno!=EISDIR;
+	END();
+	mark_wrong = 0;
+	if (fd!=-1) close(fd);
+}
+
+static void do_openat_creat(const char *p)
+{
+	BEGIN(); int fd = openat(AT_FDCWD,p,O_WRONLY|O_CREAT|O_EXCL,0644); END();
+	close(fd);
+}
+
+// A file written and closed under FSFR_JOURNAL, then exec()ed by
+// something the library doesn't see (another process, say; here a
+// raw execve), in a child of its own with the journal switched on.
+// The pending entry mustn't keep the file open for writing.
+static int journal_main(const char *p)
+{
+	static const char script[] = "#!/bin/sh\nexit 0\n";
+	extern char **environ;
+	char *argv[] = { (char *)p, NULL };
+	int fd = open(p,O_WRONLY|O_CREAT|O_TRUNC,0755);
+	if (fd==-1 || write(fd,script,sizeof(script)-1)!=sizeof(script)-1
+			|| fchown(fd,1,1) || close(fd)) return 2;
+	syscall(SYS_execve,p,argv,environ);
+	return errno==ETXTBSY ? 1 : 2;
+}
+
+static void do_exec_journaled(const char *p)
+{
+	extern char **environ;
+	static char *env[258];
+	char self[PATH_MAX], journal[PATH_MAX+16];
+	int n = 0, status;
+	ssize_t len = readlink("/proc/self/exe",self,sizeof(self)-1);
+	if (len < 0) return;
+	self[len] = '\0';
+	snprintf(journal,sizeof(journal),"FSFR_JOURNAL=%s.journal",p);
+	mkdir(journal+13,0755);
+	while (environ[n] && n < (int)(sizeof(env)/sizeof(env[0]))-2) {
+		env[n] = environ[n];
+		n++;
+	}
+	env[n++] = journal;
+	env[n] = NULL;
+	char *argv[] = { self, "-J", (char *)p, NULL };
+	pid_t pid = fork();
+	if (pid==0) {
+		execve(self,argv,env);
+		_exit(127);
+	}
+	mark_wrong = pid==-1 || waitpid(pid,&status,0)!=pid || !WIFEXITED(status)
+		|| WEXITSTATUS(status);
+	BEGIN(); END();
+	mark_wrong = 0;
+}
+
+static void do_close(const char *p)
+{
+	int fd = open(p,O_RDONLY);
+	BEGIN(); close(fd); END();
+}
+
+static void do_unlink(const char *p)
+{
+	BEGIN(); unlink(p); END();
+}
+
+static void do_unlinkat(const char *p)
+{
+	BEGIN(); unlinkat(AT_FDCWD,p,0); END();
+}
+
+static void do_rename(const char *p)
+{
+	char to[PATH_MAX];
+	snprintf(to,sizeof(to),"%s.renamed",p);
+	BEGIN(); rename(p,to); END();
+}
+
+static void do_renameat(const char *p)
+{
+	char to[PATH_MAX];
+	snprintf(to,sizeof(to),"%s.renamed",p);
+	BEGIN(); renameat(AT_FDCWD,p,AT_FDCWD,to); END();
+}
+
+static void do_listxattr(const char *p)
+{
+	char buf[4096];
+	BEGIN(); listxattr(p,buf,sizeof(buf)); END();
+}
+
+static void do_llistxattr(const char *p)
+{
+	char buf[4096];
+	BEGIN(); llistxattr(p,buf,sizeof(buf)); END();
+}
+
+static void do_flistxattr(const char *p)
+{
+	char buf[4096];
+	int fd = open(p,O_RDONLY);
+	BEGIN(); flistxattr(fd,buf,sizeof(buf)); END();
+	close(fd);
+}
+
+// the ls -l pattern, over ten entries: per entry, not per directory
+static void do_readdir_lstat(const char *p)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	struct dirent *de;
+	DIR *d = opendir(p);
+	if (!d) return;
+	BEGIN();
+	while ((de = readdir(d))) {
+		snprintf(path,sizeof(path),"%s/%s",p,de->d_name);
+		lstat(path,&st);
+	}
+	END();
+	closedir(d);
+}
+
+/****************************************************************
+ *  The budgets
+ ****************************************************************/
+struct budget_case {
+	const char *name;
+	int budget;
+	void (*setup)(const char *p);
+	void (*run)(const char *p);
+};
+
+static const struct budget_case cases[] = {
+	{ "stat/plain",			2,	mk_plain,	do_stat },
+	{ "stat/owned",			2,	mk_owned,	do_stat },
+	{ "stat/owned/cached",	1,	mk_owned,	do_stat_twice },
+	{ "lstat/owned",		2,	mk_owned,	do_lstat },
+	{ "lstat/symlink",		2,	mk_symlink,	do_lstat },
+	{ "fstat/owned",		2,	mk_owned,	do_fstat },
+	{ "fstatat/owned",		2,	mk_owned,	do_fstatat },
+	{ "statx/owned",		2,	mk_owned,	do_statx },
+	{ "__xstat/owned",		2,	mk_owned,	do_xstat },
+	{ "access/owned",		3,	mk_owned,	do_access },
+	{ "faccessat/owned",	3,	mk_owned,	do_faccessat },
+	{ "chmod/plain",		5,	mk_plain,	do_chmod },
+	{ "chmod/owned",		5,	mk_owned,	do_chmod },
+	{ "fchmod/owned",		3,	mk_owned,	do_fchmod },
+	{ "fchmodat/owned",		5,	mk_owned,	do_fchmodat },
+	{ "chown/plain",		5,	mk_plain,	do_chown },
+	{ "chown/owned",		5,	mk_owned,	do_chown },
+	{ "lchown/symlink",		6,	mk_symlink,	do_lchown },
+	{ "fchown/owned",		3,	mk_owned,	do_fchown },
+	{ "fchownat/owned",		5,	mk_owned,	do_fchownat },
+	{ "mknod",				3,	mk_none,	do_mknod },
+	{ "mknodat",			3,	mk_none,	do_mknodat },
+	{ "mkdir",				2,	mk_none,	do_mkdir },
+	{ "mkdirat",			4,	mk_none,	do_mkdirat },
+	{ "symlink",			6,	mk_none,	do_symlink },
+	{ "symlinkat",			6,	mk_none,	do_symlinkat },
+	{ "open/owned",			1,	mk_owned,	do_open },
+	{ "open/creat",			2,	mk_none,	do_open_creat },
+	{ "openat/creat",		2,	mk_none,	do_openat_creat },
+	{ "open/creat+trunc",	2,	mk_owned,	do_open_trunc },
+	{ "open/creat/dir",		2,	mk_dir,		do_open_creat_dir },
+	{ "close",				1,	mk_owned,	do_close },
+	{ "unlink/owned",		2,	mk_owned,	do_unlink },
+	{ "unlinkat/owned",		2,	mk_owned,	do_unlinkat },
+	{ "rename/owned",		2,	mk_owned,	do_rename },
+	{ "renameat/owned",		2,	mk_owned,	do_renameat },
+	{ "listxattr/owned",	1,	mk_owned,	do_listxattr },
+	{ "llistxattr/symlink",	1,	mk_symlink,	do_llistxattr },
+	{ "flistxattr/owned",	1,	mk_owned,	do_flistxattr },
+	{ "readdir+lstat/x12",	25,	mk_ownedir,	do_readdir_lstat },
+	{ "exec/journaled",		0,	mk_none,	do_exec_journaled },
+};
+#define NCASES ((int)(sizeof(cases)/sizeof(cases[0])))
+
+// a case's files: <dir>/<n>, and <dir>/<n>.warm for the warm-up
+static void case_path(char *buf, const char *dir, int i, int warm)
+{
+	snprintf(buf,PATH_MAX,"%s/%02i%s",dir,i,warm ? ".warm" : "");
+}
+
+static int setup_main(const char *dir)
+{
+	char path[PATH_MAX];
+	int i;
+	for (i=0; i<NCASES; i++) {
+		case_path(path,dir,i,1);
+		cases[i].setup(path);
+		case_path(path,dir,i,0);
+		cases[i].setup(path);
+	}
+	return 0;
+}
+
+static int worker_main(const char *dir)
+{
+	char path[PATH_MAX];
+	int i;
+	for (i=0; i<NCASES; i++) {
+		mark_case = -1;
+		case_path(path,dir,i,1);
+		cases[i].run(path);
+		mark_case = i;
+		case_path(path,dir,i,0);
+		cases[i].run(path);
+	}
+	return 0;
+}
+
+/****************************************************************
+ *  The tracer
+ ****************************************************************/
+static const char *syscall_name(long nr)
+{
+	static char buf[32];
+	switch (nr) {
+#define NAME(N) case SYS_##N: return #N;
+#ifdef SYS_open
+	NAME(open) NAME(stat) NAME(lstat) NAME(access) NAME(chmod) NAME(chown)
+	NAME(lchown) NAME(mkdir) NAME(mknod) NAME(symlink) NAME(unlink)
+	NAME(rename) NAME(readlink)
+#endif
+#ifdef SYS_renameat
+	NAME(renameat)
+#endif
+	NAME(openat) NAME(close) NAME(read) NAME(write) NAME(lseek)
+	NAME(newfstatat) NAME(fstat) NAME(statx) NAME(faccessat) NAME(faccessat2)
+	NAME(getxattr) NAME(lgetxattr) NAME(fgetxattr)
+	NAME(setxattr) NAME(lsetxattr) NAME(fsetxattr)
+	NAME(removexattr) NAME(lremovexattr) NAME(fremovexattr)
+	NAME(listxattr) NAME(llistxattr) NAME(flistxattr)
+	NAME(fchmodat) NAME(fchmod) NAME(fchownat) NAME(fchown)
+	NAME(mknodat) NAME(mkdirat) NAME(symlinkat) NAME(unlinkat) NAME(renameat2)
+	NAME(readlinkat) NAME(getdents64) NAME(fcntl) NAME(ioctl)
+	NAME(mmap) NAME(munmap) NAME(futex) NAME(getpid) NAME(gettid)
+	NAME(getuid) NAME(geteuid) NAME(getgid) NAME(getegid)
+	NAME(socket) NAME(connect) NAME(sendto) NAME(recvfrom)
+	NAME(sendmsg) NAME(recvmsg) NAME(io_uring_enter)
+#undef NAME
+	}
+	snprintf(buf,sizeof(buf),"syscall_%li",nr);
+	return buf;
+}
+
+struct budget_count {
+	int n;
+	int wrong;		// see mark_wrong
+	long nr[MAX_SYSCALLS];
+};
+
+static pid_t spawn(char **argv, char **envp, int traced)
+{
+	pid_t pid = fork();
+	if (pid==0) {
+		if (traced) {
+			ptrace(PTRACE_TRACEME,0,NULL,NULL);
+			raise(SIGSTOP);
+		}
+		execve(argv[0],argv,envp);
+		perror(argv[0]);
+		_exit(127);
+	}
+	return pid;
+}
+
+// the children's environment: the preload, and none of our own settings
+static char **child_env(const char *preload, const char *dir)
+{
+	extern char **environ;
+	static char *env[256];
+	static char ld[PATH_MAX+16], proxy[PATH_MAX+32];
+	int n = 0, i;
+	for (i=0; environ[i] && n<(int)(sizeof(env)/sizeof(env[0]))-3; i++) {
+		if (!strncmp(environ[i],"FSFR_",5) && strncmp(environ[i],"FSFR_PROXY_DIR=",15))
+			continue;
+		if (!strncmp(environ[i],"LD_PRELOAD=",11)) continue;
+		env[n++] = environ[i];
+	}
+	snprintf(ld,sizeof(ld),"LD_PRELOAD=%s",preload);
+	env[n++] = ld;
+	env[n++] = "FSFR_URING=0";
+	if (!getenv("FSFR_PROXY_DIR")) {
+		snprintf(proxy,sizeof(proxy),"FSFR_PROXY_DIR=%s/proxy",dir);
+		env[n++] = proxy;
+	}
+	env[n] = NULL;
+	return env;
+}
+
+static int trace(pid_t pid, struct budget_count *counts)
+{
+	struct __ptrace_syscall_info info;
+	int status, sig = 0, cur = -1;
+	if (waitpid(pid,&status,0)!=pid || !WIFSTOPPED(status)) return -1;
+	ptrace(PTRACE_SETOPTIONS,pid,NULL,PTRACE_O_TRACESYSGOOD|PTRACE_O_EXITKILL);
+	for (;;) {
+		if (ptrace(PTRACE_SYSCALL,pid,NULL,(void *)(long)sig)) return -1;
+		if (waitpid(pid,&status,0)!=pid) return -1;
+		sig = 0;
+		if (WIFEXITED(status)) return WEXITSTATUS(status);
+		if (WIFSIGNALED(status)) return 128+WTERMSIG(status);
+		if (!WIFSTOPPED(status)) continue;
+		if (WSTOPSIG(status)!=(SIGTRAP|0x80)) {
+			// our own SIGSTOP, and the SIGTRAP after the exec, aren't
+			// the child's to see
+			sig = WSTOPSIG(status);
+			if (sig==SIGSTOP || sig==SIGTRAP) sig = 0;
+			continue;
+		}
+		if (ptrace(PTRACE_GET_SYSCALL_INFO,pid,(void *)sizeof(info),&info) <= 0
+				|| info.op!=PTRACE_SYSCALL_INFO_ENTRY) continue;
+		long nr = info.entry.nr;
+		if (nr==MARK_NR) {
+			int c = (int)info.entry.args[1];
+			if (info.entry.args[0]==MARK_BEGIN && c>=0 && c<NCASES) {
+				cur = c;
+				counts[c].n = 0;
+			} else {
+				if (c==cur && cur!=-1) counts[cur].wrong = (int)info.entry.args[2];
+				cur = -1;
+			}
+		} else if (cur!=-1) {
+			if (counts[cur].n < MAX_SYSCALLS) counts[cur].nr[counts[cur].n] = nr;
+			counts[cur].n++;
+		}
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr,"usage: syscall_budget [-v] [-d dir] <fsfakeroot.so> [case...]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static struct budget_count counts[NCASES];
+	char self[PATH_MAX], tmp[] = "/tmp/fsfr-budget.XXXXXX";
+	char *dir = NULL;
+	int verbose = 0, opt, i, j, over = 0, status;
+	while ((opt = getopt(argc,argv,"vd:S:W:J:")) != -1) {
+		switch (opt) {
+		case 'v': verbose = 1; break;
+		case 'd': dir = optarg; break;
+		case 'S': return setup_main(optarg);	// the children
+		case 'W': return worker_main(optarg);
+		case 'J': return journal_main(optarg);
+		default: usage();
+		}
+	}
+	if (optind >= argc) usage();
+	char *preload = realpath(argv[optind++],NULL);
+	ssize_t len = readlink("/proc/self/exe",self,sizeof(self)-1);
+	if (!preload || len < 0) {
+		perror("syscall_budget");
+		return 2;
+	}
+	self[len] = '\0';
+	if (!dir && !(dir = mkdtemp(tmp))) {
+		perror(tmp);
+		return 2;
+	}
+	char **env = child_env(preload,dir);
+	if (!getenv("FSFR_PROXY_DIR")) mkdir(cat(dir,"/proxy"),0755);
+
+	char *setup_argv[] = { self, "-S", dir, NULL };
+	pid_t pid = spawn(setup_argv,env,0);
+	if (pid==-1 || waitpid(pid,&status,0)!=pid || status) {
+		fprintf(stderr,"syscall_budget: setup failed\n");
+		return 2;
+	}
+	for (i=0; i<NCASES; i++) counts[i].n = -1;
+	char *worker_argv[] = { self, "-W", dir, NULL };
+	pid = spawn(worker_argv,env,1);
+	if (pid==-1 || trace(pid,counts)) {
+		fprintf(stderr,"syscall_budget: the traced child failed\n");
+		return 2;
+	}
+
+	for (i=0; i<NCASES; i++) {
+		int want = optind >= argc;
+		for (j=optind; j<argc; j++) want |= !strcmp(argv[j],cases[i].name);
+		if (!want) continue;
+		int n = counts[i].n, bad = n < 0 || n > cases[i].budget || counts[i].wrong;
+		over += bad;
+		printf("%-4s %-20s %3i / %i",bad ? "FAIL" : "ok",cases[i].name,n,cases[i].budget);
+		if (counts[i].wrong) printf("  (wrong result)");
+		if (bad || verbose) {
+			for (j=0; j<n && j<MAX_SYSCALLS; j++)
+				printf("%s%s",j ? " " : "  ",syscall_name(counts[i].nr[j]));
+		}
+		printf("\n");
+	}
+	if (dir==tmp) {
+		char cmd[PATH_MAX+16];
+		snprintf(cmd,sizeof(cmd),"rm -rf '%s'",dir);
+		if (system(cmd)) {}
+	}
+	if (over) printf("%i over budget or wrong\n",over);
+	return over ? 1 : 0;
+}
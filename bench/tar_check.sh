@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# tar_check.sh
+#
+# Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+#
+# This software is licensed under the terms of the MIT License.
+# See the included file "LICENSE" for more information.
+#
+
+################################################################
+#  The other half of "make check": fsfr-tar has to write the
+#  archive "tar --sort=name -cf" writes under the preload, byte
+#  for byte, whether the metadata comes from the files' own
+#  records or from the base index (FSFR_INDEX). Needs GNU tar,
+#  and a directory with user xattrs: $CHECK_DIR, or /tmp.
+#
+#  The tree has a device node, a set-id file, a directory, a
+#  symlink and a hard link. The index case indexes it, then
+#  copies it without its attributes and points FSFR_INDEX_ROOT
+#  at the copy, so nothing there has a record of its own.
+################################################################
+
+set -e
+
+cd "$(dirname "$0")/.."
+TOP=$(pwd)
+SO=$TOP/fsfakeroot.so
+W=$(mktemp -d "${CHECK_DIR:-/tmp}/fsfr-tarcheck.XXXXXX")
+trap 'rm -rf "$W"' EXIT
+FAILED=0
+
+# the same archive both ways, under whatever is in the environment
+compare() {
+	name=$1 dir=$2
+	shift 2
+	env "$@" LD_PRELOAD="$SO" tar --sort=name -cf "$W/tar.tar" -C "$dir" .
+	env "$@" "$TOP/fsfr-tar" -f "$W/fsfr.tar" -C "$dir" .
+	if cmp -s "$W/tar.tar" "$W/fsfr.tar"; then
+		printf 'ok   %s\n' "$name"
+	else
+		printf 'FAIL %s: fsfr-tar and tar differ\n' "$name"
+		FAILED=$((FAILED+1))
+	fi
+	# and the node really is one, not a plain file
+	if ! tar -tvf "$W/fsfr.tar" ./a/dev | grep -q '^c'; then
+		printf 'FAIL %s: a/dev is not a character device\n' "$name"
+		FAILED=$((FAILED+1))
+	fi
+}
+
+mkdir -p "$W/t1/a/sub"
+echo passwd >"$W/t1/a/passwd"
+echo data >"$W/t1/a/sub/data"
+env LD_PRELOAD="$SO" FSFR_PROXY_DIR="$W/proxy" sh -c '
+	cd "$1"
+	mknod a/dev c 1 3
+	chmod 644 a/dev
+	chmod 4755 a/passwd
+	chown 0:0 . a a/sub a/dev a/passwd
+	chown 5:5 a/sub/data
+	ln -s sub/data a/link
+	ln a/sub/data a/hard
+' sh "$W/t1"
+
+compare records "$W/t1" FSFR_PROXY_DIR="$W/proxy"
+
+"$TOP/fsfr-export" -f index -o "$W/base.idx" "$W/t1"
+cp -R --preserve=mode,timestamps,links --no-preserve=xattr "$W/t1" "$W/t2"
+compare index "$W/t2" FSFR_PROXY_DIR="$W/proxy2" FSFR_INDEX="$W/base.idx" \
+	FSFR_INDEX_ROOT="$W/t2" FSFR_IMPLICIT=1
+
+[ "$FAILED" = 0 ] || { echo "$FAILED failed"; exit 1; }
@@ -14,6 +14,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/sysmacros.h>
+#include <pthread.h>
+#include <stdarg.h>
 
 
 #undef __xstat
@@ -24,251 +27,461 @@
 #undef __lxstat64
 #undef _FILE_OFFSET_BITS
 
-__thread void *fsfr_statignore = 0;
+// Everything defined from here on that isn't static stands in for
+// libc, and is what the library exports; the rest of it can be built
+// with -fvisibility=hidden (see "make release")
+#pragma GCC visibility push(default)
 
 /****************************************************************
  *  getuid() et. al.
+ *  	The fake credentials are parsed from FSFR_UID and friends
+ *  	once, when we're loaded, and kept in fsfr_cred from then on;
+ *  	getuid() and co. are just a load. The set*id() calls follow
+ *  	the kernel's rules (root may set anything, others may only
+ *  	shuffle their existing ids) and write the environment back
+ *  	only when something actually changed, so that children
+ *  	started through any exec*() variant or system() inherit it.
  ****************************************************************/
-uid_t fsfr_fetch_uid(char *name) {
+#define FSFR_NGROUPS 64
+
+static struct {
+	uid_t ruid, euid, suid, fsuid;
+	gid_t rgid, egid, sgid, fsgid;
+	int ngroups;
+	gid_t groups[FSFR_NGROUPS];
+	// FSFR_IMPLICIT: what our own files show without a record
+	struct fsfr_implicit imp;
+} fsfr_cred;
+static pthread_mutex_t fsfr_cred_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fsfr_cred_once = PTHREAD_ONCE_INIT;
+
+static uid_t fsfr_fetch_uid(const char *name, uid_t def) {
 	char *id = getenv(name);
-	if (!id) return 0;
+	if (!id || !*id) return def;
 	return (uid_t) strtoll(id,NULL,0);
 }
-void fsfr_set_uid(char *name, uid_t uid) {
+static void fsfr_set_uid(const char *name, uid_t uid) {
 	char buff[22];
-	sprintf(buff,"%i",uid);
+	sprintf(buff,"%u",uid);
 	setenv(name,buff,1);
 }
-// We're faking root; this does the most obvious part of that process
-uid_t getuid(void)  { return fsfr_fetch_uid("FSFR_UID"); }
-uid_t geteuid(void) { return fsfr_fetch_uid("FSFR_EUID"); }
-gid_t getgid(void)  { return (gid_t) fsfr_fetch_uid("FSFR_GID"); }
-gid_t getegid(void) { return (gid_t) fsfr_fetch_uid("FSFR_EGID"); }
-
-// rsync calls these 
-int setresuid(uid_t ruid, uid_t euid, uid_t suid) { 
-	if (ruid >-1) fsfr_set_uid("FSFR_UID",ruid);
-	if (euid >-1) fsfr_set_uid("FSFR_EUID",ruid);
-	if (euid >-1) fsfr_set_uid("FSFR_SUID",ruid);
-	return 0; 
-}
-int setresgid(uid_t ruid, uid_t euid, uid_t suid) { 
-	if (ruid >-1) fsfr_set_uid("FSFR_GID",ruid);
-	if (euid >-1) fsfr_set_uid("FSFR_EGID",ruid);
-	if (euid >-1) fsfr_set_uid("FSFR_SGID",ruid);
-	return 0; 
+
+static void fsfr_cred_load(void)
+{
+	fsfr_cred.ruid = fsfr_fetch_uid("FSFR_UID",0);
+	fsfr_cred.euid = fsfr_fetch_uid("FSFR_EUID",0);
+	fsfr_cred.suid = fsfr_fetch_uid("FSFR_SUID",fsfr_cred.euid);
+	fsfr_cred.fsuid = fsfr_fetch_uid("FSFR_FSUID",fsfr_cred.euid);
+	fsfr_cred.rgid = fsfr_fetch_uid("FSFR_GID",0);
+	fsfr_cred.egid = fsfr_fetch_uid("FSFR_EGID",0);
+	fsfr_cred.sgid = fsfr_fetch_uid("FSFR_SGID",fsfr_cred.egid);
+	fsfr_cred.fsgid = fsfr_fetch_uid("FSFR_FSGID",fsfr_cred.egid);
+	fsfr_implicit_load(&fsfr_cred.imp);
+	// comma-separated; root's usual list is just its own group
+	char *list = getenv("FSFR_GROUPS");
+	fsfr_cred.ngroups = 0;
+	if (!list) {
+		fsfr_cred.groups[fsfr_cred.ngroups++] = fsfr_cred.rgid;
+		return;
+	}
+	while (*list && fsfr_cred.ngroups < FSFR_NGROUPS) {
+		char *end;
+		gid_t g = (gid_t) strtoll(list,&end,0);
+		if (end==list) break;
+		fsfr_cred.groups[fsfr_cred.ngroups++] = g;
+		list = *end==',' ? end+1 : end;
+	}
+}
+
+// a constructor does this up front; the check covers anyone
+// calling in from an earlier constructor of their own
+static void __attribute__((constructor)) fsfr_cred_init(void)
+{
+	pthread_once(&fsfr_cred_once,fsfr_cred_load);
 }
+#define FSFR_CRED(FIELD) (fsfr_cred_init(), __atomic_load_n(&fsfr_cred.FIELD,__ATOMIC_RELAXED))
+
+// called with fsfr_cred_lock held
+static void fsfr_cred_store(uid_t *field, uid_t val, const char *name)
+{
+	if (val==(uid_t)-1 || *field==val) return;
+	__atomic_store_n(field,val,__ATOMIC_RELAXED);
+	fsfr_set_uid(name,val);
+}
+
+// may an unprivileged process switch to id? (one of the three it has)
+static int fsfr_cred_mine(uid_t id, uid_t r, uid_t e, uid_t s)
+{
+	return id==(uid_t)-1 || id==r || id==e || id==s;
+}
+
+// We're faking root; this does the most obvious part of that process
+uid_t getuid(void)  { FSFR_CALL(getuid,NULL,-1); return FSFR_RESULT(FSFR_CRED(ruid)); }
+uid_t geteuid(void) { FSFR_CALL(geteuid,NULL,-1); return FSFR_RESULT(FSFR_CRED(euid)); }
+gid_t getgid(void)  { FSFR_CALL(getgid,NULL,-1); return FSFR_RESULT(FSFR_CRED(rgid)); }
+gid_t getegid(void) { FSFR_CALL(getegid,NULL,-1); return FSFR_RESULT(FSFR_CRED(egid)); }
+
 int getresuid(uid_t *ruid, uid_t *euid, uid_t *suid)
 {
-	if (ruid) *ruid = fsfr_fetch_uid("FSFR_UID");
-	if (euid) *euid = fsfr_fetch_uid("FSFR_EUID");
-	if (suid) *suid = fsfr_fetch_uid("FSFR_SUID");
-	return 0;
+	FSFR_CALL(getresuid,NULL,-1);
+	fsfr_cred_init();
+	pthread_mutex_lock(&fsfr_cred_lock);
+	if (ruid) *ruid = fsfr_cred.ruid;
+	if (euid) *euid = fsfr_cred.euid;
+	if (suid) *suid = fsfr_cred.suid;
+	pthread_mutex_unlock(&fsfr_cred_lock);
+	return FSFR_RESULT(0);
 }
-int getresgid(uid_t *ruid, uid_t *euid, uid_t *suid)
+int getresgid(gid_t *rgid, gid_t *egid, gid_t *sgid)
+{
+	FSFR_CALL(getresgid,NULL,-1);
+	fsfr_cred_init();
+	pthread_mutex_lock(&fsfr_cred_lock);
+	if (rgid) *rgid = fsfr_cred.rgid;
+	if (egid) *egid = fsfr_cred.egid;
+	if (sgid) *sgid = fsfr_cred.sgid;
+	pthread_mutex_unlock(&fsfr_cred_lock);
+	return FSFR_RESULT(0);
+}
+
+// rsync calls these
+int setresuid(uid_t ruid, uid_t euid, uid_t suid)
 {
-	if (ruid) *ruid = fsfr_fetch_uid("FSFR_GID");
-	if (euid) *euid = fsfr_fetch_uid("FSFR_EGID");
-	if (suid) *suid = fsfr_fetch_uid("FSFR_SGID");
+	FSFR_CALL(setresuid,NULL,-1);
+	fsfr_cred_init();
+	pthread_mutex_lock(&fsfr_cred_lock);
+	uid_t r = fsfr_cred.ruid, e = fsfr_cred.euid, s = fsfr_cred.suid;
+	if (e!=0 && !(fsfr_cred_mine(ruid,r,e,s) && fsfr_cred_mine(euid,r,e,s)
+			&& fsfr_cred_mine(suid,r,e,s))) {
+		pthread_mutex_unlock(&fsfr_cred_lock);
+		errno = EPERM;
+		return FSFR_RESULT(-1);
+	}
+	fsfr_cred_store(&fsfr_cred.ruid,ruid,"FSFR_UID");
+	fsfr_cred_store(&fsfr_cred.euid,euid,"FSFR_EUID");
+	fsfr_cred_store(&fsfr_cred.suid,suid,"FSFR_SUID");
+	fsfr_cred_store(&fsfr_cred.fsuid,euid,"FSFR_FSUID");
+	pthread_mutex_unlock(&fsfr_cred_lock);
+	return FSFR_RESULT(0);
+}
+int setresgid(gid_t rgid, gid_t egid, gid_t sgid)
+{
+	FSFR_CALL(setresgid,NULL,-1);
+	fsfr_cred_init();
+	pthread_mutex_lock(&fsfr_cred_lock);
+	gid_t r = fsfr_cred.rgid, e = fsfr_cred.egid, s = fsfr_cred.sgid;
+	if (fsfr_cred.euid!=0 && !(fsfr_cred_mine(rgid,r,e,s)
+			&& fsfr_cred_mine(egid,r,e,s) && fsfr_cred_mine(sgid,r,e,s))) {
+		pthread_mutex_unlock(&fsfr_cred_lock);
+		errno = EPERM;
+		return FSFR_RESULT(-1);
+	}
+	fsfr_cred_store(&fsfr_cred.rgid,rgid,"FSFR_GID");
+	fsfr_cred_store(&fsfr_cred.egid,egid,"FSFR_EGID");
+	fsfr_cred_store(&fsfr_cred.sgid,sgid,"FSFR_SGID");
+	fsfr_cred_store(&fsfr_cred.fsgid,egid,"FSFR_FSGID");
+	pthread_mutex_unlock(&fsfr_cred_lock);
+	return FSFR_RESULT(0);
+}
+
+// the rest reduce to the two above, as in the kernel
+int setreuid(uid_t ruid, uid_t euid)
+{
+	FSFR_CALL(setreuid,NULL,-1);
+	// the saved id follows along if the real id is set, or the
+	// effective one moves away from the real one
+	uid_t suid = -1, r = FSFR_CRED(ruid);
+	if (ruid!=(uid_t)-1 || (euid!=(uid_t)-1 && euid!=r)) suid = euid!=(uid_t)-1 ? euid : FSFR_CRED(euid);
+	return FSFR_RESULT(setresuid(ruid,euid,suid));
+}
+int setregid(gid_t rgid, gid_t egid)
+{
+	FSFR_CALL(setregid,NULL,-1);
+	gid_t sgid = -1, r = FSFR_CRED(rgid);
+	if (rgid!=(gid_t)-1 || (egid!=(gid_t)-1 && egid!=r)) sgid = egid!=(gid_t)-1 ? egid : FSFR_CRED(egid);
+	return FSFR_RESULT(setresgid(rgid,egid,sgid));
+}
+int setuid(uid_t uid)
+{
+	FSFR_CALL(setuid,NULL,-1);
+	if (uid==(uid_t)-1) { errno = EINVAL; return FSFR_RESULT(-1); }
+	if (FSFR_CRED(euid)==0) return FSFR_RESULT(setresuid(uid,uid,uid));
+	return FSFR_RESULT(setresuid(-1,uid,-1));
+}
+int setgid(gid_t gid)
+{
+	FSFR_CALL(setgid,NULL,-1);
+	if (gid==(gid_t)-1) { errno = EINVAL; return FSFR_RESULT(-1); }
+	if (FSFR_CRED(euid)==0) return FSFR_RESULT(setresgid(gid,gid,gid));
+	return FSFR_RESULT(setresgid(-1,gid,-1));
+}
+int seteuid(uid_t euid)
+{
+	FSFR_CALL(seteuid,NULL,-1);
+	if (euid==(uid_t)-1) { errno = EINVAL; return FSFR_RESULT(-1); }
+	return FSFR_RESULT(setresuid(-1,euid,-1));
+}
+int setegid(gid_t egid)
+{
+	FSFR_CALL(setegid,NULL,-1);
+	if (egid==(gid_t)-1) { errno = EINVAL; return FSFR_RESULT(-1); }
+	return FSFR_RESULT(setresgid(-1,egid,-1));
+}
+
+// these return the previous value, and never fail
+int setfsuid(uid_t fsuid)
+{
+	FSFR_CALL(setfsuid,NULL,-1);
+	fsfr_cred_init();
+	pthread_mutex_lock(&fsfr_cred_lock);
+	uid_t old = fsfr_cred.fsuid;
+	if (fsfr_cred.euid==0 || fsfr_cred_mine(fsuid,fsfr_cred.ruid,fsfr_cred.euid,fsfr_cred.suid))
+		fsfr_cred_store(&fsfr_cred.fsuid,fsuid,"FSFR_FSUID");
+	pthread_mutex_unlock(&fsfr_cred_lock);
+	return FSFR_RESULT(old);
+}
+int setfsgid(gid_t fsgid)
+{
+	FSFR_CALL(setfsgid,NULL,-1);
+	fsfr_cred_init();
+	pthread_mutex_lock(&fsfr_cred_lock);
+	gid_t old = fsfr_cred.fsgid;
+	if (fsfr_cred.euid==0 || fsfr_cred_mine(fsgid,fsfr_cred.rgid,fsfr_cred.egid,fsfr_cred.sgid))
+		fsfr_cred_store(&fsfr_cred.fsgid,fsgid,"FSFR_FSGID");
+	pthread_mutex_unlock(&fsfr_cred_lock);
+	return FSFR_RESULT(old);
+}
+
+int getgroups(int size, gid_t list[])
+{
+	FSFR_CALL(getgroups,NULL,-1);
+	fsfr_cred_init();
+	pthread_mutex_lock(&fsfr_cred_lock);
+	int n = fsfr_cred.ngroups;
+	if (size && size < n) {
+		pthread_mutex_unlock(&fsfr_cred_lock);
+		errno = EINVAL;
+		return FSFR_RESULT(-1);
+	}
+	if (size) memcpy(list,fsfr_cred.groups,n*sizeof(gid_t));
+	pthread_mutex_unlock(&fsfr_cred_lock);
+	return FSFR_RESULT(n);
+}
+int setgroups(size_t size, const gid_t *list)
+{
+	FSFR_CALL(setgroups,NULL,-1);
+	char buff[FSFR_NGROUPS*12], *p = buff;
+	int i;
+	if (FSFR_CRED(euid)!=0) { errno = EPERM; return FSFR_RESULT(-1); }
+	if (size > FSFR_NGROUPS) { errno = EINVAL; return FSFR_RESULT(-1); }
+	pthread_mutex_lock(&fsfr_cred_lock);
+	int same = size==fsfr_cred.ngroups && !memcmp(list,fsfr_cred.groups,size*sizeof(gid_t));
+	if (!same) {
+		memcpy(fsfr_cred.groups,list,size*sizeof(gid_t));
+		fsfr_cred.ngroups = size;
+		buff[0] = 0;
+		for (i=0; i<size; i++) p += sprintf(p,i?",%u":"%u",list[i]);
+		setenv("FSFR_GROUPS",buff,1);
+	}
+	pthread_mutex_unlock(&fsfr_cred_lock);
+	return FSFR_RESULT(0);
+}
+// Owner for something we just created. Under FSFR_IMPLICIT, the
+// default owner is implied by the real one and needs no record.
+static void fsfr_meta_owner(struct fsfr_meta *m)
+{
+	uid_t uid = FSFR_CRED(fsuid);
+	gid_t gid = FSFR_CRED(fsgid);
+	if (!fsfr_cred.imp.on || uid!=fsfr_cred.imp.uid) m->uid = uid;
+	if (!fsfr_cred.imp.on || gid!=fsfr_cred.imp.gid) m->gid = gid;
+}
+
+static int fsfr_ingroup(gid_t mygid, gid_t gid)
+{
+	int i;
+	if (gid==mygid) return 1;
+	for (i=0; i<fsfr_cred.ngroups; i++) if (fsfr_cred.groups[i]==gid) return 1;
 	return 0;
 }
+
 /****************************************************************
  *  stat() variations
  *  	Replace returned statistics with those stored in xattrs
  *  	if the xattrs are set.
- *  	Note that we're replacing __xstat() not stat(), which means
- *  	internal calls must use the *system* stat, which in turn calls
- *  	this function. We fsfr_statignore to tell us when to NOT apply
- *  	custom stat values
+ *  	glibc before 2.33 routes stat() through __xstat() and
+ *  	friends; newer versions export stat() et. al. directly.
+ *  	We override both sets. Our own lookups use the fsfr_base_*
+ *  	calls, which never come back through here.
  ****************************************************************/
-#define IMPLEMENT_STAT(NAME,FILETYPE,STATTYPE,GETATTR)						\
+// works on both struct stat and struct stat64; M is all -1 when
+// there's no record, which still matters under FSFR_IMPLICIT
+#define FSFR_APPLY_META(BUF,M)												\
+	do {																	\
+		if ((M).modemask!=-1)												\
+			(BUF)->st_mode = ((BUF)->st_mode & ~(M).modemask)				\
+				| ((M).mode & (M).modemask);								\
+		if ((M).uid!=-1) (BUF)->st_uid = (M).uid;							\
+		else if (FSFR_CRED(imp.on) && (BUF)->st_uid==fsfr_cred.imp.real_uid)	\
+			(BUF)->st_uid = fsfr_cred.imp.uid;								\
+		if ((M).gid!=-1) (BUF)->st_gid = (M).gid;							\
+		else if (FSFR_CRED(imp.on) && (BUF)->st_gid==fsfr_cred.imp.real_gid)	\
+			(BUF)->st_gid = fsfr_cred.imp.gid;								\
+		if ((M).rdev!=-1) (BUF)->st_rdev = (M).rdev;						\
+	} while (0)
+
+#define IMPLEMENT_XSTAT(NAME,FILETYPE,STATTYPE,GETMETA,OP)					\
 int NAME(int ver, FILETYPE file, STATTYPE *buf)								\
 {																			\
-	static int(*fn_orig)(int,FILETYPE,STATTYPE*) = NULL;					\
-	if (NULL==fn_orig) fn_orig = fsfr_dlnext(#NAME);						\
-	if (!fn_orig) { return -1; }											\
-	int rtn = fn_orig(ver,file,buf);										\
-	if (rtn || !buf || (buf==fsfr_statignore)) return rtn;					\
-	int mask = GETATTR(file,XATTR_MODEMASK,buf);							\
-	int uid = GETATTR(file,XATTR_UID,buf);									\
-	int gid = GETATTR(file,XATTR_GID,buf);									\
-	int rdev = GETATTR(file,XATTR_RDEV,buf);								\
-	if (mask!=-1) {															\
-		int mode = GETATTR(file,XATTR_MODE,buf);							\
-		buf->st_mode = (buf->st_mode & ~mask) | (mode & mask);				\
-	}																		\
-	if (uid!=-1) buf->st_uid = uid;											\
-	if (gid!=-1) buf->st_gid = gid;											\
-	if (rdev!=-1) buf->st_rdev = rdev;										\
-	return 0;																\
-}
-IMPLEMENT_STAT(__xstat,		const char*,	struct stat, 	fsfr_getxattr_int_stat)
-IMPLEMENT_STAT(__fxstat,	int,			struct stat, 	fsfr_fgetxattr_int_stat)
-IMPLEMENT_STAT(__lxstat,	const char*, 	struct stat, 	fsfr_lgetxattr_int_stat)
-IMPLEMENT_STAT(__xstat64,	const char*, 	struct stat64,	fsfr_getxattr_int_stat64)
-IMPLEMENT_STAT(__fxstat64,	int,			struct stat64,	fsfr_fgetxattr_int_stat64)
-IMPLEMENT_STAT(__lxstat64,	const char*, 	struct stat64,	fsfr_lgetxattr_int_stat64)
-#undef IMPLEMENT_STAT
-
-/****************************************************************
- *  chown() variations
- *  	Set new UID/GID in the xattrs
- ****************************************************************/
-// we don't even attempt to change REAL ownership -- Even as root,
-// this operates on the "visible" owner, leaving the "real" owner intact
+	FSFR_CALL(OP,FSFR_PATHOF(file),FSFR_FDOF(file));						\
+	int rtn = fsfr_real.NAME(ver,file,buf);									\
+	if (rtn || !buf) return FSFR_RESULT(rtn);								\
+	struct fsfr_meta m;														\
+	GETMETA(file,&m,buf);													\
+	FSFR_APPLY_META(buf,m);													\
+	return FSFR_RESULT(0);													\
+}
+IMPLEMENT_XSTAT(__xstat,	const char*,	struct stat, 	fsfr_getmeta_stat,	stat)
+IMPLEMENT_XSTAT(__fxstat,	int,			struct stat, 	fsfr_fgetmeta_stat,	fstat)
+IMPLEMENT_XSTAT(__lxstat,	const char*, 	struct stat, 	fsfr_lgetmeta_stat,	lstat)
+IMPLEMENT_XSTAT(__xstat64,	const char*, 	struct stat64,	fsfr_getmeta_stat64,	stat)
+IMPLEMENT_XSTAT(__fxstat64,	int,			struct stat64,	fsfr_fgetmeta_stat64,	fstat)
+IMPLEMENT_XSTAT(__lxstat64,	const char*, 	struct stat64,	fsfr_lgetmeta_stat64,	lstat)
+#undef IMPLEMENT_XSTAT
 
-#define IMPLEMENT_CHOWN(NAME,FILETYPE,SETATTR,FSTAT,CHMOD)			\
-int NAME(FILETYPE file, uid_t owner, gid_t group)					\
-{																	\
-	int rtn=0;														\
-	struct stat st;													\
-	FSTAT(file,&st);												\
-	if ((st.st_mode&0600) != 0600)CHMOD(file,st.st_mode & 0777);	\
-	if (owner!=-1) rtn = SETATTR(file,XATTR_UID,owner,&st) || rtn;	\
-	if (group!=-1) rtn = SETATTR(file,XATTR_GID,group,&st) || rtn;	\
-	return rtn?-1:0;												\
-}
-IMPLEMENT_CHOWN(chown,	const char*,fsfr_setxattr_int_stat,fsfr_base_stat,chmod)
-IMPLEMENT_CHOWN(fchown,	int,		fsfr_fsetxattr_int_stat,fsfr_base_fstat,fchmod)
-IMPLEMENT_CHOWN(lchown,	const char*,fsfr_lsetxattr_int_stat,fsfr_base_lstat,lchmod)
-#undef IMPLEMENT_CHOWN
+#define IMPLEMENT_STAT(NAME,FILETYPE,STATTYPE,BASE,GETMETA,OP)				\
+int NAME(FILETYPE file, STATTYPE *buf)										\
+{																			\
+	FSFR_CALL(OP,FSFR_PATHOF(file),FSFR_FDOF(file));						\
+	int rtn = BASE(file,buf);												\
+	if (rtn) return FSFR_RESULT(rtn);										\
+	struct fsfr_meta m;														\
+	GETMETA(file,&m,buf);													\
+	FSFR_APPLY_META(buf,m);													\
+	return FSFR_RESULT(0);													\
+}
+IMPLEMENT_STAT(stat,	const char*,	struct stat,	fsfr_base_stat,		fsfr_getmeta_stat,	stat)
+IMPLEMENT_STAT(fstat,	int,			struct stat,	fsfr_base_fstat,	fsfr_fgetmeta_stat,	fstat)
+IMPLEMENT_STAT(lstat,	const char*,	struct stat,	fsfr_base_lstat,	fsfr_lgetmeta_stat,	lstat)
+IMPLEMENT_STAT(stat64,	const char*,	struct stat64,	fsfr_base_stat64,	fsfr_getmeta_stat64,	stat)
+IMPLEMENT_STAT(fstat64,	int,			struct stat64,	fsfr_base_fstat64,	fsfr_fgetmeta_stat64,	fstat)
+IMPLEMENT_STAT(lstat64,	const char*,	struct stat64,	fsfr_base_lstat64,	fsfr_lgetmeta_stat64,	lstat)
+#undef IMPLEMENT_STAT
 
 /****************************************************************
  *  chmod() variations
  *  	* Set new mode in the xattrs
  *  	* Enforce a minumum accessability standard, so that
  *  	  the user can always access the files (as root could)
+ *  	All of them resolve the file once (see fsfr_target_open)
+ *  	and share a single implementation.
  ****************************************************************/
-// Root wouldn't be able to lock himself out of a directory or file,
-// so we just make sure that u+rwX stays set; only for files and dirs.
-// also, only *actually* set the 0777 subset; others are virtual
-int chmod(const char *path, mode_t mode)
+// the mode rules themselves are in fsfr_chmod_meta
+static int fsfr_chmod_target(struct fsfr_target *t, mode_t mode)
 {
-	struct stat st;
-	if (fsfr_base_stat(path,&st)) {
-		perror("stat error");
+	if (S_ISLNK(t->st.st_mode)) {
+		errno = EOPNOTSUPP;			// same as the real lchmod()
 		return -1;
-	}
-	int oldmask = fsfr_getxattr_int_stat(path,XATTR_MODEMASK,&st);
-	if (oldmask==-1) oldmask = 0;
-	int reqmode = 00600; // "required mode bits"
-	if (S_ISDIR(st.st_mode)) {
-		reqmode = reqmode | 00100;	// dirs require u+x
-	} else if (!S_ISREG(st.st_mode)) {
-		return fsfr_base_chmod(path,mode);	// we only mess with files and dirs
+	} else if (!S_ISREG(t->st.st_mode) && !S_ISDIR(t->st.st_mode)) {
+		return fsfr_target_chmod(t,mode);	// we only mess with files and dirs
 	}
 
-	// which modes go to file, which modes go to xattr
-	int filemode = (mode | reqmode) & 00777;
-	int fakemode = mode;
-	int newmask = filemode ^ fakemode;
-
-	if (oldmask & ~00777) { // preserve old extended mode bits if exist
-		int oldmode = fsfr_getxattr_int_stat(path,XATTR_MODE,&st);
-		if (oldmode==-1) oldmode = 0;
-		// fake non-file
-		fakemode = fakemode | (oldmode & ~00777);
-		newmask = newmask | (oldmask & ~00777);
-	}
-
-	//fprintf(stderr, " chmod 0%o => 0%o + 0%o\n",mode,filemode,fakemode);
-
-	if (fsfr_base_chmod(path,filemode)) {
+	struct fsfr_meta m, old;
+	fsfr_target_getmeta(t,&m);
+	old = m;
+	mode_t filemode = fsfr_chmod_meta(&m,t->st.st_mode,mode);
+	if (fsfr_target_chmod(t,filemode)) {
 		return -1;
 	}
-
-	if (filemode == fakemode) {	// clear mode xattr if no longer used
-		fsfr_unset_attr_stat(path,XATTR_MODE,&st);
-		fsfr_unset_attr_stat(path,XATTR_MODEMASK,&st);
-	} else {
-		fsfr_setxattr_int_stat(path,XATTR_MODE,fakemode,&st);
-		fsfr_setxattr_int_stat(path,XATTR_MODEMASK,newmask,&st);
-	}
+	struct stat st = t->st;
+	st.st_mode = (st.st_mode & S_IFMT) | filemode;
+	if (!fsfr_meta_unchanged(&old,&t->st,&m,&st,&fsfr_cred.imp))
+		fsfr_target_setmeta(t,&m);
 
 	return 0;
 }
-// same as above, but w/ FDs
-// which I could merge them into a single code block... but alas, 'tis C
-int fchmod(int fd, mode_t mode)
-{
-	//fprintf(stderr,"chmod %s: 0%3o\n",path,mode);
-	struct stat st;
-	fsfr_base_fstat(fd,&st);
-	int oldmask = fsfr_fgetxattr_int_stat(fd,XATTR_MODEMASK,&st);
-	if (oldmask==-1) oldmask = 0;
-	int reqmode = 00600;
-	if (S_ISDIR(st.st_mode)) {
-		reqmode = reqmode | 00100;	// dirs require u+x
-	} else if (!S_ISREG(st.st_mode)) {
-		return fsfr_base_fchmod(fd,mode);	// we only mess with files and dirs
-	}
 
-	// which modes go to file, which modes go to xattr
-	int filemode = (mode | reqmode) & 00777;
-	int fakemode = mode;
-	int newmask = filemode ^ fakemode;
-
-	if (oldmask & ~0777) { // preserve old extended mode bits if exist
-		int oldmode = fsfr_fgetxattr_int_stat(fd,XATTR_MODE,&st);
-		if (oldmode==-1) oldmode = 0;
-		// fake non-file
-		fakemode = fakemode | (oldmode & ~0777);
-		newmask = newmask | (oldmask & ~0777);
-	}
-	if (fsfr_base_fchmod(fd,filemode)) {
-		return -1;
-	}
-
-	if (filemode == fakemode) {	// clear mode xattr if no longer used
-		fsfr_funset_attr_stat(fd,XATTR_MODE,&st);
-		fsfr_funset_attr_stat(fd,XATTR_MODEMASK,&st);
-	} else {
-		fsfr_fsetxattr_int_stat(fd,XATTR_MODE,fakemode,&st);
-		fsfr_fsetxattr_int_stat(fd,XATTR_MODEMASK,newmask,&st);
-	}
+static int fsfr_chmodat(int fd, const char *pathname, mode_t mode, int nofollow)
+{
+	struct fsfr_target t;
+	if (fsfr_target_open(&t,fd,pathname,nofollow)) return -1;
+	int rtn = fsfr_chmod_target(&t,mode);
+	fsfr_target_close(&t);
+	return rtn;
+}
 
-	return 0;
+int chmod(const char *path, mode_t mode)
+{
+	FSFR_CALL(chmod,path,-1);
+	return FSFR_RESULT(fsfr_chmodat(AT_FDCWD,path,mode,0));
 }
-// same again, but this time non link dereferencing
 int lchmod(const char *path, mode_t mode)
 {
-	struct stat st;
-	fsfr_base_stat(path,&st);
-	int oldmask = fsfr_lgetxattr_int_stat(path,XATTR_MODEMASK,&st);
-	if (oldmask==-1) oldmask = 0;
-	int reqmode = 00600; // "required mode bits"
-	if (S_ISDIR(st.st_mode)) {
-		reqmode = reqmode | 00100;	// dirs require u+x
-	} else if (!S_ISREG(st.st_mode)) {
-		return fsfr_base_lchmod(path,mode);	// we only mess with files and dirs
-	}
-
-	// which modes go to file, which modes go to xattr
-	int filemode = (mode | reqmode) & 00777;
-	int fakemode = mode;
-	int newmask = filemode ^ fakemode;
-
-	if (oldmask & ~00777) { // preserve old extended mode bits if exist
-		int oldmode = fsfr_lgetxattr_int_stat(path,XATTR_MODE,&st);
-		if (oldmode==-1) oldmode = 0;
-		// fake non-file
-		fakemode = fakemode | (oldmode & ~00777);
-		newmask = newmask | (oldmask & ~00777);
-	}
+	FSFR_CALL(lchmod,path,-1);
+	return FSFR_RESULT(fsfr_chmodat(AT_FDCWD,path,mode,1));
+}
+int fchmod(int fd, mode_t mode)
+{
+	FSFR_CALL(fchmod,NULL,fd);
+	struct fsfr_target t;
+	if (fsfr_target_fd(&t,fd)) return FSFR_RESULT(-1);
+	return FSFR_RESULT(fsfr_chmod_target(&t,mode));
+}
+int fchmodat(int fd, const char*pathname, mode_t mode, int flags)
+{
+	FSFR_CALL(fchmodat,pathname,fd);
+	return FSFR_RESULT(fsfr_chmodat(fd,pathname,mode,flags & AT_SYMLINK_NOFOLLOW));
+}
 
-	if (fsfr_base_lchmod(path,filemode)) {
-		return -1;
-	}
+/****************************************************************
+ *  chown() variations
+ *  	Set new UID/GID in the xattrs
+ ****************************************************************/
+// we don't even attempt to change REAL ownership -- Even as root,
+// this operates on the "visible" owner, leaving the "real" owner intact
+static int fsfr_chown_target(struct fsfr_target *t, uid_t owner, gid_t group)
+{
+	struct fsfr_meta m, old;
+	if ((t->st.st_mode&0600) != 0600 && !S_ISLNK(t->st.st_mode))
+		fsfr_chmod_target(t,t->st.st_mode & 0777);
+	fsfr_target_getmeta(t,&m);
+	old = m;
+	fsfr_chown_meta(&m,owner,group,&t->st,&fsfr_cred.imp);
+	// nothing to write if it already looks that way (or the index says so)
+	if (fsfr_meta_unchanged(&old,&t->st,&m,&t->st,&fsfr_cred.imp)) return 0;
+	return fsfr_target_setmeta(t,&m)?-1:0;
+}
 
-	if (filemode == fakemode) {	// clear mode xattr if no longer used
-		fsfr_lunset_attr_stat(path,XATTR_MODE,&st);
-		fsfr_lunset_attr_stat(path,XATTR_MODEMASK,&st);
-	} else {
-		fsfr_lsetxattr_int_stat(path,XATTR_MODE,fakemode,&st);
-		fsfr_lsetxattr_int_stat(path,XATTR_MODEMASK,newmask,&st);
-	}
+static int fsfr_chownat(int fd, const char *pathname, uid_t owner, gid_t group, int nofollow)
+{
+	struct fsfr_target t;
+	if (fsfr_target_open(&t,fd,pathname,nofollow)) return -1;
+	int rtn = fsfr_chown_target(&t,owner,group);
+	fsfr_target_close(&t);
+	return rtn;
+}
 
-	return 0;
+int chown(const char *path, uid_t owner, gid_t group)
+{
+	FSFR_CALL(chown,path,-1);
+	return FSFR_RESULT(fsfr_chownat(AT_FDCWD,path,owner,group,0));
+}
+int lchown(const char *path, uid_t owner, gid_t group)
+{
+	FSFR_CALL(lchown,path,-1);
+	return FSFR_RESULT(fsfr_chownat(AT_FDCWD,path,owner,group,1));
+}
+int fchown(int fd, uid_t owner, gid_t group)
+{
+	FSFR_CALL(fchown,NULL,fd);
+	struct fsfr_target t;
+	if (fsfr_target_fd(&t,fd)) return FSFR_RESULT(-1);
+	return FSFR_RESULT(fsfr_chown_target(&t,owner,group));
+}
+int fchownat(int fd, const char*pathname, uid_t owner, gid_t group, int flags)
+{
+	FSFR_CALL(fchownat,pathname,fd);
+	if ((flags & AT_EMPTY_PATH) && !pathname[0]) return FSFR_RESULT(fchown(fd,owner,group));
+	return FSFR_RESULT(fsfr_chownat(fd,pathname,owner,group,flags & AT_SYMLINK_NOFOLLOW));
 }
 
 
@@ -277,7 +490,7 @@ int lchmod(const char *path, mode_t mode)
  *  	Filter out xattrs used internally by fsfr. They're 
  *  	tecnically not supposed to be there, right?
  ****************************************************************/
-ssize_t fsfr_filter_xattr(char *list, size_t size)
+static ssize_t fsfr_filter_xattr(char *list, size_t size)
 {
 	if (list==NULL) return size;
 	char *write_p;
@@ -303,21 +516,57 @@ ssize_t fsfr_filter_xattr(char *list, size_t size)
 
 ssize_t listxattr(const char *path, char *list, size_t size) 
 {
+	FSFR_CALL(listxattr,path,-1);
 	int rtn = fsfr_base_listxattr(path,list,size);
-	if (rtn > 0) return fsfr_filter_xattr(list,rtn);
-	return rtn;
+	if (rtn > 0) return FSFR_RESULT(fsfr_filter_xattr(list,rtn));
+	return FSFR_RESULT(rtn);
 }
 ssize_t llistxattr(const char *path, char *list, size_t size) 
 {
+	FSFR_CALL(llistxattr,path,-1);
 	int rtn = fsfr_base_llistxattr(path,list,size);
-	if (rtn > 0) return fsfr_filter_xattr(list,rtn);
-	return rtn;
+	if (rtn > 0) return FSFR_RESULT(fsfr_filter_xattr(list,rtn));
+	return FSFR_RESULT(rtn);
 }
 ssize_t flistxattr(int fd, char *list, size_t size) 
 {
+	FSFR_CALL(flistxattr,NULL,fd);
 	int rtn = fsfr_base_flistxattr(fd,list,size);
-	if (rtn > 0) return fsfr_filter_xattr(list,rtn);
-	return rtn;
+	if (rtn > 0) return FSFR_RESULT(fsfr_filter_xattr(list,rtn));
+	return FSFR_RESULT(rtn);
+}
+
+/****************************************************************
+ *  readdir() variations
+ *  	Hand each entry to the prefetcher (fsfr_prefetch.c) on
+ *  	the way out. That's a no-op unless FSFR_PREFETCH is set.
+ ****************************************************************/
+#define IMPLEMENT_READDIR(NAME,DIRENTTYPE)								\
+DIRENTTYPE *NAME(DIR *d)												\
+{																		\
+	FSFR_CALL(readdir,NULL,dirfd(d));									\
+	DIRENTTYPE *de = fsfr_real.NAME(d);									\
+	if (de) fsfr_prefetch_dirent(d,de->d_name);							\
+	FSFR_RESULT(de!=NULL);												\
+	return de;															\
+}
+IMPLEMENT_READDIR(readdir,		struct dirent)
+IMPLEMENT_READDIR(readdir64,	struct dirent64)
+#undef IMPLEMENT_READDIR
+
+int closedir(DIR *d)
+{
+	FSFR_CALL(closedir,NULL,dirfd(d));
+	fsfr_prefetch_closedir(d);
+	return FSFR_RESULT(fsfr_real.closedir(d));
+}
+
+ssize_t getdents64(int fd, void *buf, size_t nbytes)
+{
+	FSFR_CALL(getdents64,NULL,fd);
+	ssize_t rtn = fsfr_real.getdents64(fd,buf,nbytes);
+	fsfr_prefetch_getdents(fd,buf,rtn);
+	return FSFR_RESULT(rtn);
 }
 
 /****************************************************************
@@ -329,61 +578,171 @@ ssize_t flistxattr(int fd, char *list, size_t size)
  *  	just be writing to the underlying file.
  ****************************************************************/
 
-void frfs_mknod_helper(int fd, mode_t mode, dev_t dev)
+static void frfs_mknod_helper(int fd, mode_t mode, dev_t dev)
 {
 	int mask = 00777;
-	fsfr_fsetxattr_int(fd,XATTR_UID,getuid());
-	fsfr_fsetxattr_int(fd,XATTR_GID,getgid());
-	fsfr_fsetxattr_int(fd,XATTR_RDEV,dev);
-	fsfr_fsetxattr_int(fd,XATTR_MODE,mode & ~mask);
-	fsfr_fsetxattr_int(fd,XATTR_MODEMASK,~mask);
+	struct fsfr_meta m;
+	fsfr_meta_init(&m);
+	fsfr_meta_owner(&m);
+	m.rdev = dev;
+	m.mode = mode & ~mask;
+	m.modemask = ~mask;
+	fsfr_fsetmeta_new(fd,-1,&m);
 }
 
 int __xmknod(int ver, const char *pathname, mode_t mode, dev_t * dev)
 {
+	FSFR_CALL(mknod,pathname,-1);
 	if (!dev) {
 		errno=EINVAL;
-		return  -1;
+		return FSFR_RESULT(-1);
 	}
 	//fprintf(stderr, "0x%x 0%o 0x%x\n",mode,mode,*dev);
 	int mask = 00777;
-	int fd = open(pathname, O_WRONLY|O_CREAT|O_TRUNC, mode & mask);
-	if (fd==-1) return -1;
+	int fd = fsfr_base_open(pathname, O_WRONLY|O_CREAT|O_TRUNC, mode & mask);
+	if (fd==-1) return FSFR_RESULT(-1);
 	frfs_mknod_helper(fd,mode,*dev);
 	close(fd);
-	return 0;
+	return FSFR_RESULT(0);
 }
 
 int __xmknodat(int ver, int fd, const char *pathname, mode_t mode, dev_t * dev)
 {
+	FSFR_CALL(mknodat,pathname,fd);
 	if (!dev) {
 		errno=EINVAL;
-		return  -1;
+		return FSFR_RESULT(-1);
 	}
 	int mask = 00777;
-	int ffd = openat(fd, pathname, O_WRONLY|O_CREAT|O_TRUNC, mode & mask);
-	if (ffd==-1) return -1;
+	int ffd = fsfr_base_openat(fd, pathname, O_WRONLY|O_CREAT|O_TRUNC, mode & mask);
+	if (ffd==-1) return FSFR_RESULT(-1);
 	frfs_mknod_helper(ffd,mode,*dev);
 	close(ffd);
-	return 0;
+	return FSFR_RESULT(0);
+}
+
+// glibc 2.33 and later export these directly
+int mknod(const char *pathname, mode_t mode, dev_t dev)
+{
+	FSFR_CALL(mknod,pathname,-1);
+	return FSFR_RESULT(__xmknod(0,pathname,mode,&dev));
+}
+
+int mknodat(int fd, const char *pathname, mode_t mode, dev_t dev)
+{
+	FSFR_CALL(mknodat,pathname,fd);
+	return FSFR_RESULT(__xmknodat(0,fd,pathname,mode,&dev));
 }
 
 /****************************************************************
  *  symlink()
  *  Change symlink ownership to root.root. This will fail silently
- *  if the FSFR_PROXY_DIR env var is not set. See the note attached
- *  to fsfr_proxygetxattr_int for details.
+ *  if neither FSFR_PROXY_STORE nor FSFR_PROXY_DIR is set.
  ****************************************************************/
-int symlink(const char *oldpath, const char *newpath)
+// a fresh record, not a chown: whatever a previous symlink with
+// this inode left behind doesn't carry over
+static void fsfr_symlink_stamp(int fd, const char *pathname)
 {
-	static int(*fn_orig)(const char*,const char*) = NULL;
-	if (NULL==fn_orig) fn_orig = fsfr_dlnext("symlink");
-	if (!fn_orig) { return -1; }
-	int rtn = fn_orig(oldpath,newpath);
-	if (!rtn) {
-		int discard = lchown(newpath,getuid(),getgid());
+	struct stat st;
+	struct fsfr_meta m;
+	fsfr_meta_init(&m);
+	fsfr_meta_owner(&m);
+	// an empty record still clears out a stale one, if there's a proxy
+	if (fsfr_meta_isempty(&m) && !fsfr_proxy_on()) return;
+	if (fsfr_base_fstatat(fd,pathname,&st,AT_SYMLINK_NOFOLLOW)) return;
+	if (fsfr_index_on() && fsfr_index_stamp(fd,pathname,&st,&m)) {
+		if (!fsfr_daemon_on()) return;
+		fsfr_meta_init(&m);	// the daemon may still know the inode
 	}
-	return rtn;
+	fsfr_lsetmeta_stat(pathname,&m,&st);
+}
+
+int symlink(const char *oldpath, const char *newpath)
+{
+	FSFR_CALL(symlink,newpath,-1);
+	int rtn = fsfr_real.symlink(oldpath,newpath);
+	if (!rtn) fsfr_symlink_stamp(AT_FDCWD,newpath);
+	return FSFR_RESULT(rtn);
+}
+
+
+/****************************************************************
+ *  unlink() and rename() variations
+ *  	A symlink's metadata lives in the proxy, not in the link,
+ *  	so it has to be dropped when the last link to it goes away.
+ *  	Renames keep the inode, so only a symlink being replaced by
+ *  	one matters. Nothing here costs anything without a proxy.
+ *  	With FSFR_DAEMON, the same goes for everything, directories
+ *  	included.
+ ****************************************************************/
+// is pathname the last link to something kept elsewhere? st gets
+// its identity
+static int fsfr_lastlink(int fd, const char *pathname, struct stat *st)
+{
+	if (fsfr_base_fstatat(fd,pathname,st,AT_SYMLINK_NOFOLLOW)) return 0;
+	if (fsfr_daemon_on()) return S_ISDIR(st->st_mode) || st->st_nlink==1;
+	return S_ISLNK(st->st_mode) && st->st_nlink==1;
+}
+
+int unlinkat(int fd, const char *pathname, int flags)
+{
+	FSFR_CALL(unlinkat,pathname,fd);
+	struct stat st;
+	int drop = (!(flags & AT_REMOVEDIR) || fsfr_daemon_on()) && fsfr_proxy_on()
+		&& fsfr_lastlink(fd,pathname,&st);
+	int rtn = fsfr_real.unlinkat(fd,pathname,flags);
+	if (!rtn && drop) fsfr_proxy_drop(st.st_dev,st.st_ino);
+	return FSFR_RESULT(rtn);
+}
+int unlink(const char *pathname)
+{
+	FSFR_CALL(unlink,pathname,-1);
+	return FSFR_RESULT(unlinkat(AT_FDCWD,pathname,0));
+}
+// glibc's remove() calls unlink() internally, out of our reach
+int remove(const char *pathname)
+{
+	FSFR_CALL(unlink,pathname,-1);
+	if (!unlinkat(AT_FDCWD,pathname,0)) return FSFR_RESULT(0);
+	if (errno!=EISDIR) return FSFR_RESULT(-1);
+	return FSFR_RESULT(unlinkat(AT_FDCWD,pathname,AT_REMOVEDIR));
+}
+
+// would this rename replace the last link to a symlink?
+static int fsfr_rename_drops(int olddirfd, const char *oldpath,
+		int newdirfd, const char *newpath, unsigned int flags, struct stat *st)
+{
+	struct stat old;
+	if (flags & (RENAME_EXCHANGE|RENAME_NOREPLACE)) return 0;
+	if (!fsfr_proxy_on() || !fsfr_lastlink(newdirfd,newpath,st)) return 0;
+	// renaming a link onto itself does nothing
+	return fsfr_base_fstatat(olddirfd,oldpath,&old,AT_SYMLINK_NOFOLLOW)
+		|| old.st_dev!=st->st_dev || old.st_ino!=st->st_ino;
+}
+
+int renameat2(int olddirfd, const char *oldpath, int newdirfd, const char *newpath,
+		unsigned int flags)
+{
+	FSFR_CALL(renameat,oldpath,olddirfd);
+	struct stat st;
+	int drop = fsfr_rename_drops(olddirfd,oldpath,newdirfd,newpath,flags,&st);
+	int rtn = fsfr_real.renameat2(olddirfd,oldpath,newdirfd,newpath,flags);
+	if (!rtn && drop) fsfr_proxy_drop(st.st_dev,st.st_ino);
+	return FSFR_RESULT(rtn);
+}
+int renameat(int olddirfd, const char *oldpath, int newdirfd, const char *newpath)
+{
+	FSFR_CALL(renameat,oldpath,olddirfd);
+	struct stat st;
+	int drop = fsfr_rename_drops(olddirfd,oldpath,newdirfd,newpath,0,&st);
+	int rtn = fsfr_real.renameat(olddirfd,oldpath,newdirfd,newpath);
+	if (!rtn && drop) fsfr_proxy_drop(st.st_dev,st.st_ino);
+	return FSFR_RESULT(rtn);
+}
+int rename(const char *oldpath, const char *newpath)
+{
+	FSFR_CALL(rename,oldpath,-1);
+	return FSFR_RESULT(renameat(AT_FDCWD,oldpath,AT_FDCWD,newpath));
 }
 
 
@@ -394,162 +753,423 @@ int symlink(const char *oldpath, const char *newpath)
  ****************************************************************/
 int mkdir(const char *pathname, mode_t mode)
 {
+	FSFR_CALL(mkdir,pathname,-1);
 	int reqmode = 0700;
 	int new_mode = mode | reqmode;
-	static int(*fn_orig)(const char*,mode_t) = NULL;
-	if (NULL==fn_orig) fn_orig = fsfr_dlnext("mkdir");
-	if (!fn_orig) { return -1; }
-	int rtn = fn_orig(pathname,new_mode);
+	int rtn = fsfr_real.mkdir(pathname,new_mode);
 	if (!rtn) {
-		fsfr_setxattr_int(pathname,XATTR_UID,getuid());
-		fsfr_setxattr_int(pathname,XATTR_GID,getgid());
+		struct fsfr_meta m;
+		fsfr_meta_init(&m);
+		fsfr_meta_owner(&m);
 		if (mode != new_mode) {
-			fsfr_setxattr_int(pathname,XATTR_MODE,mode&reqmode);
-			fsfr_setxattr_int(pathname,XATTR_MODEMASK,reqmode);
+			m.mode = mode&reqmode;
+			m.modemask = reqmode;
 		}
+		if (!fsfr_meta_isempty(&m) || fsfr_daemon_on() || fsfr_index_on())
+			fsfr_setmeta_new(pathname,&m);
 	}
-	return rtn;
+	return FSFR_RESULT(rtn);
 }
 
 int mkdirat(int fd, const char *pathname, mode_t mode)
 {
+	FSFR_CALL(mkdirat,pathname,fd);
 	int reqmode = 0700;
 	int new_mode = mode | reqmode;
-	static int(*fn_orig)(int,const char*,mode_t) = NULL;
-	if (NULL==fn_orig) fn_orig = fsfr_dlnext("mkdirat");
-	if (!fn_orig) { return -1; }
-	int rtn = fn_orig(fd,pathname,new_mode);
+	int rtn = fsfr_real.mkdirat(fd,pathname,new_mode);
 	if (!rtn) {
+		struct fsfr_meta m;
+		fsfr_meta_init(&m);
+		fsfr_meta_owner(&m);
+		if (mode != new_mode) {
+			m.mode = mode&reqmode;
+			m.modemask = reqmode;
+		}
+		if (fsfr_meta_isempty(&m) && !fsfr_daemon_on() && !fsfr_index_on())
+			return FSFR_RESULT(rtn);
 		int newfd = fsfr_base_openat(fd,pathname,O_DIRECTORY,0777);
 		if (newfd!=-1) {
-			fsfr_fsetxattr_int(newfd,XATTR_UID,getuid());
-			fsfr_fsetxattr_int(newfd,XATTR_GID,getgid());
-			if (mode != new_mode) {
-				fsfr_fsetxattr_int(newfd,XATTR_MODE,mode&reqmode);
-				fsfr_fsetxattr_int(newfd,XATTR_MODEMASK,reqmode);
-			}
+			fsfr_fsetmeta_new(newfd,-1,&m);
+			close(newfd);
 		}
-		close(newfd);
 	}
-	return rtn;
+	return FSFR_RESULT(rtn);
 }
 
 /****************************************************************
- *  open()
+ *  open() variations
  *  	* Enforce accessiblity (u+rw)
- *  	* Set ownership to root.root
+ *  	* Set ownership to root.root, but only on files we created
+ *
+ *  	Without O_CREAT there's nothing to do but pass it on. With
+ *  	it, the file is first opened O_EXCL to learn whether it's
+ *  	ours; only then is the metadata written, in one go. If there
+ *  	is no metadata to write (FSFR_IMPLICIT covers the owner, and
+ *  	the mode keeps u+rw), it's a single open either way.
  *
- *  So, I can't figure out which base syscall is being used for
- *  open(), so I'm skipping this one. It's not critical, but I'd
- *  like it to be included. If you know what fn to override, drop
- *  me a line at devel@tlarson.com
+ *  	The umask is never touched (doing so isn't thread-safe).
+ *  	We keep track of it instead, and fix up the real mode in the
+ *  	rare case the umask takes away u+rw. Note that glibc's own
+ *  	fopen() opens files internally, out of our reach.
  ****************************************************************/
-/*
-int open(const char *pathname, int flags, mode_t mode)
-{
-	int mask = 0600;
-	int _umask = umask(0);
-	umask(_umask & ~mask);
-	int fd = fsfr_base_open(pathname,flags,mode|mask);
-	umask(_umask);
-	if (fd != -1) {
-		if (((mask&_umask)!=0)||((mask|mode)!=mode)) {
-			fsfr_fsetxattr_int(fd,XATTR_MODE,mode & mask);
-			fsfr_fsetxattr_int(fd,XATTR_MODEMASK,mask);
-		}
-		fsfr_fsetxattr_int(fd,XATTR_UID,0);
-		fsfr_fsetxattr_int(fd,XATTR_GID,0);
-	}
-	return fd;
+#define FSFR_OPEN_NEEDS_MODE(FLAGS) \
+	(((FLAGS) & O_CREAT) || ((FLAGS) & O_TMPFILE)==O_TMPFILE)
+
+static mode_t fsfr_umask_cur;
+static pthread_once_t fsfr_umask_once = PTHREAD_ONCE_INIT;
+
+static void fsfr_umask_load(void)
+{
+	mode_t cur = fsfr_real.umask(0);
+	fsfr_real.umask(cur);
+	__atomic_store_n(&fsfr_umask_cur,cur,__ATOMIC_RELAXED);
+}
+static void __attribute__((constructor)) fsfr_umask_init(void)
+{
+	pthread_once(&fsfr_umask_once,fsfr_umask_load);
 }
 
-int openat(int fd, const char *pathname, int flags, mode_t mode)
+mode_t umask(mode_t mask)
 {
-	int mask = 0600;
-	int _umask = umask(0);
-	umask(_umask & ~mask);
-	int fd = fsfr_base_openat(fd,pathname,flags,mode|mask);
-	umask(_umask);
-	if (fd != -1) {
-		if (((mask&_umask)!=0)||((mask|mode)!=mode)) {
-			fsfr_fsetxattr_int(fd,XATTR_MODE,mode & mask);
-			fsfr_fsetxattr_int(fd,XATTR_MODEMASK,mask);
-		}
-		fsfr_fsetxattr_int(fd,XATTR_UID,0);
-		fsfr_fsetxattr_int(fd,XATTR_GID,0);
+	FSFR_CALL(umask,NULL,-1);
+	fsfr_umask_init();
+	mode_t old = fsfr_real.umask(mask);
+	__atomic_store_n(&fsfr_umask_cur,mask & 0777,__ATOMIC_RELAXED);
+	return FSFR_RESULT(old);
+}
+
+static int fsfr_open_create(int dirfd, const char *pathname, int flags, mode_t mode)
+{
+	int reqmode = 0600;
+	int fd;
+	fsfr_umask_init();
+	mode_t cmask = __atomic_load_n(&fsfr_umask_cur,__ATOMIC_RELAXED);
+	mode_t fakemode = mode & 07777 & ~cmask;
+
+	struct fsfr_meta m;
+	fsfr_meta_init(&m);
+	fsfr_meta_owner(&m);
+	if ((fakemode & reqmode)!=reqmode) {
+		m.mode = fakemode & reqmode;
+		m.modemask = reqmode;
 	}
+	// nothing to write, so it doesn't matter whether it's new
+	if (fsfr_meta_isempty(&m) && !fsfr_daemon_on() && !fsfr_index_on())
+		return fsfr_real.openat(dirfd,pathname,flags,mode);
+
+	if ((flags & O_EXCL) || (flags & O_TMPFILE)==O_TMPFILE) {
+		fd = fsfr_real.openat(dirfd,pathname,flags,mode|reqmode);
+	} else {
+		fd = fsfr_real.openat(dirfd,pathname,flags|O_EXCL,mode|reqmode);
+		// not ours: the caller's own flags, so the kernel's O_CREAT
+		// rules apply (a directory is EISDIR, a dangling symlink is
+		// followed); anything created in between is left unstamped
+		if (fd==-1 && errno==EEXIST) return fsfr_real.openat(dirfd,pathname,flags,mode);
+	}
+	if (fd==-1) return fd;
+	if (cmask & reqmode) fsfr_base_fchmod(fd,fakemode|reqmode);
+	fsfr_fsetmeta_new(fd,fd,&m);
 	return fd;
 }
-*/
 
-/****************************************************************
- *  all the f...at() functions
- *  	Since there is no fgetxattrat function, we need to be
- *  	able to use traditional path semantics to find the file.
- *		First, we check for a proc directory, and if we can use
- *		it, we set the path relative to the corresponding fd
- *		entry. Failing at that, we open the dir by fd, chdir to
- *		to it, get the current working direcotory, then then
- *		chdir back to whence we came. This second option has
- *		the possiblity of causing a race condition in
- *		multithreaded apps, but if you've got a better idea,
- *		I'm all ears.
- *  	
- ****************************************************************/
-#define IMPLEMENT_AT(OUTFN,LOUTFN,...) 							\
-	int discard;												\
-	void *discardp;												\
-	if (pathname[0]=='/' || AT_FDCWD==fd) {						\
-		const char *path = pathname;							\
-		if ((flags & AT_SYMLINK_NOFOLLOW)==AT_SYMLINK_NOFOLLOW)	\
-			return LOUTFN(__VA_ARGS__);							\
-		else													\
-			return OUTFN(__VA_ARGS__);							\
-	} else														\
-	{															\
-		char *path = alloca(PATH_MAX+1);						\
-		if (!access("/proc/self/fd",X_OK)) {					\
-			sprintf(path,"/proc/self/fd/%i/",fd);				\
-		} else {												\
-			DIR* save = opendir(".");							\
-			discard = fchdir(fd);								\
-			discardp = getcwd(path,PATH_MAX);					\
-			discard = fchdir(dirfd(save));						\
-			discard = closedir(save);							\
-			strncat(path,"/",PATH_MAX);							\
-		}														\
-		strncat(path,pathname,PATH_MAX);						\
-		if ((flags & AT_SYMLINK_NOFOLLOW)==AT_SYMLINK_NOFOLLOW)	\
-			return LOUTFN(__VA_ARGS__);							\
-		else													\
-			return OUTFN(__VA_ARGS__);							\
-	}
+int openat(int dirfd, const char *pathname, int flags, ...)
+{
+	if (!FSFR_OPEN_NEEDS_MODE(flags) || (flags & O_PATH))
+		return fsfr_real.openat(dirfd,pathname,flags,0);
+	FSFR_CALL(openat,pathname,dirfd);
+	va_list ap;
+	va_start(ap,flags);
+	mode_t mode = va_arg(ap,int);
+	va_end(ap);
+	return FSFR_RESULT(fsfr_open_create(dirfd,pathname,flags,mode));
+}
 
-int __fxstatat(int ver, int fd, const char *pathname, struct stat *buf, int flags)
+int open(const char *pathname, int flags, ...)
 {
-	IMPLEMENT_AT(__xstat,__lxstat,ver,path,buf)
+	if (!FSFR_OPEN_NEEDS_MODE(flags) || (flags & O_PATH))
+		return fsfr_real.open(pathname,flags,0);
+	FSFR_CALL(open,pathname,-1);
+	va_list ap;
+	va_start(ap,flags);
+	mode_t mode = va_arg(ap,int);
+	va_end(ap);
+	return FSFR_RESULT(fsfr_open_create(AT_FDCWD,pathname,flags,mode));
 }
 
-int __fxstatat64(int ver, int fd, const char *pathname, struct stat64 *buf, int flags)
+// the same thing on 64-bit; elsewhere only the flag differs
+int openat64(int dirfd, const char *pathname, int flags, ...)
 {
-	IMPLEMENT_AT(__xstat64,__lxstat64,ver,path,buf)
+	flags |= O_LARGEFILE;
+	if (!FSFR_OPEN_NEEDS_MODE(flags) || (flags & O_PATH))
+		return fsfr_real.openat(dirfd,pathname,flags,0);
+	FSFR_CALL(openat,pathname,dirfd);
+	va_list ap;
+	va_start(ap,flags);
+	mode_t mode = va_arg(ap,int);
+	va_end(ap);
+	return FSFR_RESULT(fsfr_open_create(dirfd,pathname,flags,mode));
 }
 
-int fchownat(int fd, const char*pathname, uid_t owner, gid_t group, int flags)
+int open64(const char *pathname, int flags, ...)
 {
-	IMPLEMENT_AT(chown,lchown,path,owner,group)
+	flags |= O_LARGEFILE;
+	if (!FSFR_OPEN_NEEDS_MODE(flags) || (flags & O_PATH))
+		return fsfr_real.open(pathname,flags,0);
+	FSFR_CALL(open,pathname,-1);
+	va_list ap;
+	va_start(ap,flags);
+	mode_t mode = va_arg(ap,int);
+	va_end(ap);
+	return FSFR_RESULT(fsfr_open_create(AT_FDCWD,pathname,flags,mode));
 }
 
-int fchmodat(int fd, const char*pathname, mode_t mode, int flags)
+int creat(const char *pathname, mode_t mode)
 {
-	IMPLEMENT_AT(chmod,lchmod,path,mode);
+	FSFR_CALL(open,pathname,-1);
+	return FSFR_RESULT(fsfr_open_create(AT_FDCWD,pathname,O_CREAT|O_WRONLY|O_TRUNC,mode));
 }
 
+int creat64(const char *pathname, mode_t mode)
+{
+	FSFR_CALL(open,pathname,-1);
+	return FSFR_RESULT(fsfr_open_create(AT_FDCWD,pathname,O_CREAT|O_WRONLY|O_TRUNC|O_LARGEFILE,mode));
+}
+
+/****************************************************************
+ *  close(), fsync() and exec() variations
+ *  	Points where changes held back by the write-behind journal
+ *  	(see fsfr_journal.c) have to reach the disk, and those queued
+ *  	for the daemon (see fsfr_daemon.c) have to be sent. Without
+ *  	either there's never anything pending, and these just pass
+ *  	the call on. An exec also writes out the FSFR_STATS counts,
+ *  	which the new program then starts over. glibc's execl*() and
+ *  	system() exec internally, out of our reach; fork() is covered
+ *  	by pthread_atfork() and exit by a destructor.
+ ****************************************************************/
+int close(int fd)
+{
+	FSFR_CALL(close,NULL,fd);
+	fsfr_journal_closefd(fd);
+	return FSFR_RESULT(fsfr_real.close(fd));
+}
+int fsync(int fd)
+{
+	FSFR_CALL(fsync,NULL,fd);
+	fsfr_journal_flushfd(fd);
+	fsfr_daemon_flush();
+	return FSFR_RESULT(fsfr_real.fsync(fd));
+}
+int fdatasync(int fd)
+{
+	FSFR_CALL(fdatasync,NULL,fd);
+	fsfr_journal_flushfd(fd);
+	fsfr_daemon_flush();
+	return FSFR_RESULT(fsfr_real.fdatasync(fd));
+}
+
+// one that works never returns: it fires call_entry, but leaves no
+// trace record and isn't in the counts it writes out
+int execve(const char *path, char *const argv[], char *const envp[])
+{
+	FSFR_CALL(execve,path,-1);
+	fsfr_journal_flush();
+	fsfr_daemon_flush();
+	fsfr_stats_dump("exec",1);
+	return FSFR_RESULT(fsfr_real.execve(path,argv,envp));
+}
+int execv(const char *path, char *const argv[])
+{
+	FSFR_CALL(execv,path,-1);
+	fsfr_journal_flush();
+	fsfr_daemon_flush();
+	fsfr_stats_dump("exec",1);
+	return FSFR_RESULT(fsfr_real.execv(path,argv));
+}
+int execvp(const char *file, char *const argv[])
+{
+	FSFR_CALL(execvp,file,-1);
+	fsfr_journal_flush();
+	fsfr_daemon_flush();
+	fsfr_stats_dump("exec",1);
+	return FSFR_RESULT(fsfr_real.execvp(file,argv));
+}
+int execvpe(const char *file, char *const argv[], char *const envp[])
+{
+	FSFR_CALL(execvpe,file,-1);
+	fsfr_journal_flush();
+	fsfr_daemon_flush();
+	fsfr_stats_dump("exec",1);
+	return FSFR_RESULT(fsfr_real.execvpe(file,argv,envp));
+}
+int fexecve(int fd, char *const argv[], char *const envp[])
+{
+	FSFR_CALL(fexecve,NULL,fd);
+	fsfr_journal_flush();
+	fsfr_daemon_flush();
+	fsfr_stats_dump("exec",1);
+	return FSFR_RESULT(fsfr_real.fexecve(fd,argv,envp));
+}
+int posix_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions,
+		const posix_spawnattr_t *attrp, char *const argv[], char *const envp[])
+{
+	FSFR_CALL(posix_spawn,path,-1);
+	fsfr_journal_flush();
+	fsfr_daemon_flush();
+	return FSFR_RESULT(fsfr_real.posix_spawn(pid,path,file_actions,attrp,argv,envp));
+}
+int posix_spawnp(pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions,
+		const posix_spawnattr_t *attrp, char *const argv[], char *const envp[])
+{
+	FSFR_CALL(posix_spawnp,file,-1);
+	fsfr_journal_flush();
+	fsfr_daemon_flush();
+	return FSFR_RESULT(fsfr_real.posix_spawnp(pid,file,file_actions,attrp,argv,envp));
+}
+
+/****************************************************************
+ *  the remaining f...at() functions
+ *  	The stat itself is a single call relative to the directory
+ *  	fd; the metadata lookup after it goes through the cache and
+ *  	then fsfr_getmeta_at. Where /proc is mounted, that names a
+ *  	relative entry as "/proc/self/fd/<fd>/<name>" for the xattr
+ *  	calls, and the index lookup takes the fd back out of it.
+ ****************************************************************/
+#define IMPLEMENT_FXSTATAT(NAME,STATTYPE,GETMETA_AT,OP)						\
+int NAME(int ver, int fd, const char *pathname, STATTYPE *buf, int flags)	\
+{																			\
+	FSFR_CALL(OP,pathname,fd);												\
+	int rtn = fsfr_real.NAME(ver,fd,pathname,buf,flags);					\
+	if (rtn || !buf) return FSFR_RESULT(rtn);								\
+	struct fsfr_meta m;														\
+	GETMETA_AT(fd,pathname,flags,&m,buf);									\
+	FSFR_APPLY_META(buf,m);													\
+	return FSFR_RESULT(0);													\
+}
+IMPLEMENT_FXSTATAT(__fxstatat,	struct stat,	fsfr_getmeta_at,	fstatat)
+IMPLEMENT_FXSTATAT(__fxstatat64,struct stat64,	fsfr_getmeta_at64,	fstatat)
+#undef IMPLEMENT_FXSTATAT
+
+#define IMPLEMENT_STATAT(NAME,STATTYPE,BASE,GETMETA_AT,OP)					\
+int NAME(int fd, const char *pathname, STATTYPE *buf, int flags)			\
+{																			\
+	FSFR_CALL(OP,pathname,fd);												\
+	int rtn = BASE(fd,pathname,buf,flags);									\
+	if (rtn) return FSFR_RESULT(rtn);										\
+	struct fsfr_meta m;														\
+	GETMETA_AT(fd,pathname,flags,&m,buf);									\
+	FSFR_APPLY_META(buf,m);													\
+	return FSFR_RESULT(0);													\
+}
+IMPLEMENT_STATAT(fstatat,	struct stat,	fsfr_base_fstatat,	fsfr_getmeta_at,	fstatat)
+IMPLEMENT_STATAT(fstatat64,	struct stat64,	fsfr_base_fstatat64,fsfr_getmeta_at64,	fstatat)
+#undef IMPLEMENT_STATAT
+
 int symlinkat(const char *oldpath, int fd, const char *pathname)
 {
-	int flags=0;
-	IMPLEMENT_AT(symlink,symlink,oldpath,path);
+	FSFR_CALL(symlinkat,pathname,fd);
+	int rtn = fsfr_real.symlinkat(oldpath,fd,pathname);
+	if (!rtn) fsfr_symlink_stamp(fd,pathname);
+	return FSFR_RESULT(rtn);
+}
+
+/****************************************************************
+ *  access() variations
+ *  	Judged from the fake owner and mode against the fake
+ *  	credentials, the way the kernel would: root may read and
+ *  	write anything, and execute anything with an x bit set.
+ *  	Costs the one stat; the metadata normally comes from cache.
+ ****************************************************************/
+int faccessat(int fd, const char *pathname, int mode, int flags)
+{
+	FSFR_CALL(faccessat,pathname,fd);
+	struct stat st;
+	struct fsfr_meta m;
+	int at = flags & (AT_SYMLINK_NOFOLLOW|AT_EMPTY_PATH);
+	if (mode & ~(R_OK|W_OK|X_OK)) {
+		errno = EINVAL;
+		return FSFR_RESULT(-1);
+	}
+	if (fsfr_base_fstatat(fd,pathname,&st,at)) return FSFR_RESULT(-1);
+	if (mode==F_OK) return FSFR_RESULT(0);
+	fsfr_getmeta_at(fd,pathname,at,&m,&st);
+	FSFR_APPLY_META(&st,m);
+
+	// AT_EACCESS checks the ids used for file access, not the real ones
+	uid_t uid = (flags & AT_EACCESS) ? FSFR_CRED(fsuid) : FSFR_CRED(ruid);
+	gid_t gid = (flags & AT_EACCESS) ? FSFR_CRED(fsgid) : FSFR_CRED(rgid);
+	int granted;
+	if (uid==0) {
+		granted = R_OK|W_OK;
+		if (S_ISDIR(st.st_mode) || (st.st_mode & 0111)) granted |= X_OK;
+	} else if (uid==st.st_uid) {
+		granted = (st.st_mode >> 6) & 7;
+	} else if (fsfr_ingroup(gid,st.st_gid)) {
+		granted = (st.st_mode >> 3) & 7;
+	} else {
+		granted = st.st_mode & 7;
+	}
+	if (mode & ~granted) {
+		errno = EACCES;
+		return FSFR_RESULT(-1);
+	}
+	// read-only mounts and such are the one thing only the real check knows
+	if (mode & W_OK) return FSFR_RESULT(fsfr_real.faccessat(fd,pathname,W_OK,flags));
+	return FSFR_RESULT(0);
+}
+int access(const char *pathname, int mode)
+{
+	FSFR_CALL(access,pathname,-1);
+	return FSFR_RESULT(faccessat(AT_FDCWD,pathname,mode,0));
+}
+int euidaccess(const char *pathname, int mode)
+{
+	FSFR_CALL(access,pathname,-1);
+	return FSFR_RESULT(faccessat(AT_FDCWD,pathname,mode,AT_EACCESS));
 }
+int eaccess(const char *pathname, int mode)
+{
+	FSFR_CALL(access,pathname,-1);
+	return FSFR_RESULT(faccessat(AT_FDCWD,pathname,mode,AT_EACCESS));
+}
+
+/****************************************************************
+ *  statx()
+ *  	Callers ask only for the fields they want, and plenty
+ *  	(coreutils, Rust, Go) never ask for ownership or mode. Only
+ *  	look up metadata when the mask covers something we fake;
+ *  	otherwise this is a plain pass-through.
+ ****************************************************************/
+#define FSFR_STATX_FAKED (STATX_TYPE|STATX_MODE|STATX_UID|STATX_GID)
 
-#undef IMPLEMENT_AT
+int statx(int fd, const char *pathname, int flags, unsigned int mask, struct statx *buf)
+{
+	FSFR_CALL(statx,pathname,fd);
+	if (!(mask & FSFR_STATX_FAKED)) return FSFR_RESULT(fsfr_base_statx(fd,pathname,flags,mask,buf));
+	// the metadata lookup is keyed on these, so make sure we get them
+	int rtn = fsfr_base_statx(fd,pathname,flags,
+			mask|STATX_TYPE|STATX_MODE|STATX_INO|STATX_CTIME,buf);
+	if (rtn) return FSFR_RESULT(rtn);
+
+	// run it through the same merge as stat()
+	struct stat st;
+	struct fsfr_meta m;
+	memset(&st,0,sizeof(st));
+	st.st_dev = makedev(buf->stx_dev_major,buf->stx_dev_minor);
+	st.st_ino = buf->stx_ino;
+	st.st_mode = buf->stx_mode;
+	st.st_uid = buf->stx_uid;
+	st.st_gid = buf->stx_gid;
+	st.st_rdev = makedev(buf->stx_rdev_major,buf->stx_rdev_minor);
+	st.st_ctim.tv_sec = buf->stx_ctime.tv_sec;
+	st.st_ctim.tv_nsec = buf->stx_ctime.tv_nsec;
+	fsfr_getmeta_at(fd,pathname,flags,&m,&st);
+	FSFR_APPLY_META(&st,m);
+	buf->stx_mode = st.st_mode;
+	buf->stx_uid = st.st_uid;
+	buf->stx_gid = st.st_gid;
+	buf->stx_rdev_major = major(st.st_rdev);
+	buf->stx_rdev_minor = minor(st.st_rdev);
+	return FSFR_RESULT(0);
+}
 
+#pragma GCC visibility pop
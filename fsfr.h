@@ -15,6 +15,7 @@
 #define _ATFILE_SOURCE // for AT_*
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -26,6 +27,8 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <spawn.h>
+#include <limits.h>
 
 
 // xattr names used by this mechanism
@@ -36,7 +39,87 @@
 #define XATTR_GID XATTR_PREFIX "gid"
 #define XATTR_RDEV XATTR_PREFIX "rdev"
 
-void * fsfr_dlnext(const char *sym);
+// packed record holding all of the above in a single xattr. The
+// individual attributes are still read when no record is present.
+#define XATTR_META XATTR_PREFIX "meta"
+#define FSFR_META_VERSION 1
+#define FSFR_META_INDEX -1	// not stored: supplied by the base index
+
+// fields are -1 when unset, same as the fsfr_*getxattr_int helpers
+struct fsfr_meta {
+	int64_t version;
+	int64_t mode;
+	int64_t modemask;
+	int64_t uid;
+	int64_t gid;
+	int64_t rdev;
+};
+
+/****************************************************************
+ *  The real libc functions behind our wrappers, resolved once
+ *  at load time into fsfr_real (see fsfr_real.c). Each entry is
+ *  FSFR_REAL(name, return type, (parameters), (arguments)).
+ ****************************************************************/
+#define FSFR_REAL_SYMBOLS(FSFR_REAL)													\
+	FSFR_REAL(__xstat,		int,	(int v, const char *p, struct stat *b),		(v,p,b))		\
+	FSFR_REAL(__fxstat,		int,	(int v, int fd, struct stat *b),			(v,fd,b))		\
+	FSFR_REAL(__lxstat,		int,	(int v, const char *p, struct stat *b),		(v,p,b))		\
+	FSFR_REAL(__xstat64,	int,	(int v, const char *p, struct stat64 *b),	(v,p,b))		\
+	FSFR_REAL(__fxstat64,	int,	(int v, int fd, struct stat64 *b),			(v,fd,b))		\
+	FSFR_REAL(__lxstat64,	int,	(int v, const char *p, struct stat64 *b),	(v,p,b))		\
+	FSFR_REAL(__fxstatat,	int,	(int v, int d, const char *p, struct stat *b, int f),	(v,d,p,b,f))	\
+	FSFR_REAL(__fxstatat64,	int,	(int v, int d, const char *p, struct stat64 *b, int f),	(v,d,p,b,f))	\
+	FSFR_REAL(fstatat,		int,	(int d, const char *p, struct stat *b, int f),		(d,p,b,f))	\
+	FSFR_REAL(fstatat64,	int,	(int d, const char *p, struct stat64 *b, int f),	(d,p,b,f))	\
+	FSFR_REAL(statx,		int,	(int d, const char *p, int f, unsigned int m, struct statx *b),	(d,p,f,m,b))	\
+	FSFR_REAL(listxattr,	ssize_t,(const char *p, char *l, size_t n),		(p,l,n))		\
+	FSFR_REAL(llistxattr,	ssize_t,(const char *p, char *l, size_t n),		(p,l,n))		\
+	FSFR_REAL(flistxattr,	ssize_t,(int fd, char *l, size_t n),			(fd,l,n))		\
+	FSFR_REAL(readdir,		struct dirent *,	(DIR *d),				(d))			\
+	FSFR_REAL(readdir64,	struct dirent64 *,	(DIR *d),				(d))			\
+	FSFR_REAL(closedir,		int,	(DIR *d),									(d))			\
+	FSFR_REAL(getdents64,	ssize_t,(int fd, void *b, size_t n),			(fd,b,n))		\
+	FSFR_REAL(open,			int,	(const char *p, int f, mode_t m),			(p,f,m))		\
+	FSFR_REAL(openat,		int,	(int d, const char *p, int f, mode_t m),	(d,p,f,m))		\
+	FSFR_REAL(umask,		mode_t,	(mode_t m),									(m))			\
+	FSFR_REAL(chmod,		int,	(const char *p, mode_t m),					(p,m))			\
+	FSFR_REAL(fchmod,		int,	(int fd, mode_t m),							(fd,m))			\
+	FSFR_REAL(lchmod,		int,	(const char *p, mode_t m),					(p,m))			\
+	FSFR_REAL(faccessat,	int,	(int d, const char *p, int m, int f),		(d,p,m,f))		\
+	FSFR_REAL(mkdir,		int,	(const char *p, mode_t m),					(p,m))			\
+	FSFR_REAL(mkdirat,		int,	(int d, const char *p, mode_t m),			(d,p,m))		\
+	FSFR_REAL(symlink,		int,	(const char *o, const char *n),				(o,n))			\
+	FSFR_REAL(symlinkat,	int,	(const char *o, int d, const char *n),		(o,d,n))		\
+	FSFR_REAL(unlinkat,		int,	(int d, const char *p, int f),				(d,p,f))		\
+	FSFR_REAL(renameat,		int,	(int od, const char *o, int nd, const char *n),	(od,o,nd,n))	\
+	FSFR_REAL(renameat2,	int,	(int od, const char *o, int nd, const char *n, unsigned int f),	(od,o,nd,n,f))	\
+	FSFR_REAL(close,		int,	(int fd),									(fd))			\
+	FSFR_REAL(fsync,		int,	(int fd),									(fd))			\
+	FSFR_REAL(fdatasync,	int,	(int fd),									(fd))			\
+	FSFR_REAL(execve,		int,	(const char *p, char *const *a, char *const *e),	(p,a,e))	\
+	FSFR_REAL(execv,		int,	(const char *p, char *const *a),			(p,a))			\
+	FSFR_REAL(execvp,		int,	(const char *p, char *const *a),			(p,a))			\
+	FSFR_REAL(execvpe,		int,	(const char *p, char *const *a, char *const *e),	(p,a,e))	\
+	FSFR_REAL(fexecve,		int,	(int fd, char *const *a, char *const *e),	(fd,a,e))		\
+	FSFR_REAL(posix_spawn,	int,	(pid_t *pid, const char *p, const posix_spawn_file_actions_t *fa,	\
+			const posix_spawnattr_t *at, char *const *a, char *const *e),	(pid,p,fa,at,a,e))		\
+	FSFR_REAL(posix_spawnp,	int,	(pid_t *pid, const char *p, const posix_spawn_file_actions_t *fa,	\
+			const posix_spawnattr_t *at, char *const *a, char *const *e),	(pid,p,fa,at,a,e))
+
+struct fsfr_real_table {
+#define FSFR_REAL_ENTRY(NAME,RTN,PARAMS,ARGS) RTN (*NAME) PARAMS;
+	FSFR_REAL_SYMBOLS(FSFR_REAL_ENTRY)
+#undef FSFR_REAL_ENTRY
+};
+// on a page of its own, so it can be made read-only once filled in
+#define FSFR_REAL_PAGE 4096
+union fsfr_real_page {
+	struct fsfr_real_table table;
+	char pad[FSFR_REAL_PAGE];
+};
+extern union fsfr_real_page fsfr_real_page;
+#define fsfr_real (fsfr_real_page.table)
+void fsfr_real_init(void);
 
 int fsfr_getxattr_int(const char *fpath, const char *name);
 int fsfr_lgetxattr_int(const char *fpath, const char *name);
@@ -48,6 +131,7 @@ int fsfr_unset_attr(const char *fpath, const char* name);
 int fsfr_funset_attr(int fd, const char* name);
 int fsfr_lunset_attr(const char *fpath, const char* name);
 
+int fsfr_proxypath(int64_t inode, char *fpath, size_t len);
 int fsfr_proxygetxattr_int(int64_t inode, const char *name);
 int fsfr_proxysetxattr_int(int64_t inode, const char *name, int64_t val);
 int fsfr_proxyunsetxattr_int(int64_t inode, const char *name);
@@ -61,24 +145,357 @@ int fsfr_lsetxattr_int_stat(const char *fpath, const char* name, int64_t val, co
 int fsfr_unset_attr_stat(const char *fpath, const char* name, const struct stat *st);
 int fsfr_funset_attr_stat(int fd, const char* name, const struct stat *st);
 int fsfr_lunset_attr_stat(const char *fpath, const char* name, const struct stat *st);
+void fsfr_meta_init(struct fsfr_meta *m);
+int fsfr_meta_isempty(const struct fsfr_meta *m);
+// An empty record is removed, unless it has to hide something:
+// individual attributes from an older version, or an index entry
+#define FSFR_META_REMOVABLE(m) (fsfr_meta_isempty(m) && (m)->version!=0	\
+		&& (m)->version!=FSFR_META_INDEX)
+int fsfr_legacy_present(const char *list, ssize_t len);
+int fsfr_getmeta(const char *fpath, struct fsfr_meta *m);
+int fsfr_lgetmeta(const char *fpath, struct fsfr_meta *m);
+int fsfr_fgetmeta(int fd, struct fsfr_meta *m);
+int fsfr_getmeta_legacy(const char *fpath, struct fsfr_meta *m);
+int fsfr_lgetmeta_legacy(const char *fpath, struct fsfr_meta *m);
+int fsfr_fgetmeta_legacy(int fd, struct fsfr_meta *m);
+int fsfr_setmeta(const char *fpath, const struct fsfr_meta *m);
+int fsfr_lsetmeta(const char *fpath, const struct fsfr_meta *m);
+int fsfr_fsetmeta(int fd, const struct fsfr_meta *m);
+int fsfr_proxygetmeta(dev_t dev, ino_t ino, struct fsfr_meta *m);
+int fsfr_proxysetmeta(dev_t dev, ino_t ino, const struct fsfr_meta *m);
+int fsfr_store_on(void);
+int fsfr_store_get(dev_t dev, ino_t ino, struct fsfr_meta *m);
+int fsfr_store_put(dev_t dev, ino_t ino, const struct fsfr_meta *m);
+long fsfr_store_sweep(int (*keep)(uint64_t dev, uint64_t ino, void *arg), void *arg,
+		int dryrun);
+int fsfr_proxy_on(void);
+void fsfr_proxy_drop(dev_t dev, ino_t ino);
+int fsfr_journal_on(void);
+int fsfr_journal_get(dev_t dev, ino_t ino, struct fsfr_meta *m);
+int fsfr_journal_put(int fd, int srcfd, const struct fsfr_meta *m, const struct stat *st);
+void fsfr_journal_flush(void);
+void fsfr_journal_flushfd(int fd);
+void fsfr_journal_closefd(int fd);
+
+// the tools' parallel directory walk, see fsfr_walk.c
+void fsfr_walk_push(char *path);
+void fsfr_walk(int nthreads, void (*scan)(const char *path, void *arg), void **args);
+
+// FSFR_INDEX: read-only base layer written by fsfr-export -f index; the
+// entries follow the header, sorted by path, then the (dev, ino)
+// permutation, then the strings, each path NUL-terminated
+#define FSFR_INDEX_MAGIC 0x3258495246534631ULL	/* "1FSFRIX2" */
+struct fsfr_index_header {
+	uint64_t magic;
+	uint64_t count;
+	uint64_t entries, byino, strings;	// file offsets
+	uint64_t size;
+	char root[PATH_MAX];			// as indexed
+};
+struct fsfr_index_entry {
+	uint64_t dev, ino;
+	uint64_t path;				// offset into strings
+	uint32_t mode, uid, gid, ctime_nsec;
+	uint64_t rdev;
+	int64_t ctime;				// these tell a reused inode number apart
+	int64_t btime;				// 0 if the filesystem doesn't keep it
+	uint32_t btime_nsec, pad;
+};
+// the file's own stat, as far as the index needs it, from either stat type
+struct fsfr_index_key {
+	dev_t dev, rdev;
+	ino_t ino;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	struct timespec ctime;
+};
+#define FSFR_INDEX_KEY(st) ((struct fsfr_index_key){ (st)->st_dev, (st)->st_rdev,	\
+		(st)->st_ino, (st)->st_mode, (st)->st_uid, (st)->st_gid, (st)->st_ctim })
+int fsfr_index_on(void);
+int fsfr_index_get(int dirfd, const char *pathname, const struct fsfr_index_key *k,
+		struct fsfr_meta *m);
+int fsfr_index_stamp(int dirfd, const char *pathname, const struct stat *st,
+		struct fsfr_meta *m);
+
+// FSFR_DAEMON: metadata kept by fsfr-faked instead of in attributes.
+// Fixed-size messages both ways over a Unix stream socket; a GET is
+// answered with the same message, rtn and meta filled in and gen the
+// daemon's generation at the time. A PUT with an empty record is a
+// delete. Right after connecting, the daemon sends a HELLO carrying a
+// memfd (SCM_RIGHTS) whose first 8 bytes are that generation, bumped
+// on every change.
+#define FSFR_DAEMON_HELLO 1
+#define FSFR_DAEMON_GET 2
+#define FSFR_DAEMON_PUT 3
+#define FSFR_DAEMON_SYNC 4	// answered once the snapshot is on disk
+#define FSFR_DAEMON_FENCE 5	// answered once all before it is applied
+struct fsfr_daemon_msg {
+	uint32_t op;
+	int32_t rtn;
+	uint64_t gen;
+	uint64_t dev, ino;
+	struct fsfr_meta meta;
+};
+int fsfr_daemon_on(void);
+int fsfr_daemon_get(dev_t dev, ino_t ino, struct fsfr_meta *m);
+int fsfr_daemon_put(dev_t dev, ino_t ino, const struct fsfr_meta *m);
+void fsfr_daemon_prefetch(const struct stat *st, int n);
+void fsfr_daemon_flush(void);
+int fsfr_daemon_refuse(const char *prog);
+int fsfr_fsetmeta_new(int fd, int srcfd, const struct fsfr_meta *m);
+int fsfr_setmeta_new(const char *path, const struct fsfr_meta *m);
+
+/****************************************************************
+ *  Call hooks
+ *  	Each wrapper opens with FSFR_CALL(op, path, fd) and returns
+ *  	through FSFR_RESULT(), all but open() without O_CREAT, which
+ *  	goes straight through; the xattr helpers make their calls
+ *  	through FSFR_XATTR(). These fire the USDT probes, where
+ *  	<sys/sdt.h> is available, and feed FSFR_STATS (fsfr_stats.c)
+ *  	and FSFR_TRACE (fsfr_trace.c). With neither set, a probe is a
+ *  	nop and the rest a load and a branch.
+ *
+ *  	Probes, all in provider "fsfr":
+ *  	  call_entry(op, path, fd)		call_return(op, result)
+ *  	  xattr_entry(kind, path, fd, attr)
+ *  	  xattr_return(kind, path, fd, attr, result)
+ *  	op and kind are strings, path is NULL for an fd and fd is -1
+ *  	(or AT_FDCWD) for a path.
+ ****************************************************************/
+#define FSFR_OPS(FSFR_OP)												\
+	FSFR_OP(other)	FSFR_OP(stat)		FSFR_OP(lstat)		FSFR_OP(fstat)		\
+	FSFR_OP(fstatat)	FSFR_OP(statx)		FSFR_OP(access)		FSFR_OP(faccessat)	\
+	FSFR_OP(chmod)		FSFR_OP(lchmod)		FSFR_OP(fchmod)		FSFR_OP(fchmodat)	\
+	FSFR_OP(chown)		FSFR_OP(lchown)		FSFR_OP(fchown)		FSFR_OP(fchownat)	\
+	FSFR_OP(mknod)		FSFR_OP(mknodat)	FSFR_OP(mkdir)		FSFR_OP(mkdirat)	\
+	FSFR_OP(symlink)	FSFR_OP(symlinkat)	FSFR_OP(open)		FSFR_OP(openat)		\
+	FSFR_OP(unlink)		FSFR_OP(unlinkat)	FSFR_OP(rename)		FSFR_OP(renameat)	\
+	FSFR_OP(listxattr)	FSFR_OP(llistxattr)	FSFR_OP(flistxattr)						\
+	FSFR_OP(getuid)		FSFR_OP(geteuid)	FSFR_OP(getgid)		FSFR_OP(getegid)	\
+	FSFR_OP(getresuid)	FSFR_OP(getresgid)	FSFR_OP(setresuid)	FSFR_OP(setresgid)	\
+	FSFR_OP(setreuid)	FSFR_OP(setregid)	FSFR_OP(setuid)		FSFR_OP(setgid)		\
+	FSFR_OP(seteuid)	FSFR_OP(setegid)	FSFR_OP(setfsuid)	FSFR_OP(setfsgid)	\
+	FSFR_OP(getgroups)	FSFR_OP(setgroups)	FSFR_OP(umask)		FSFR_OP(readdir)	\
+	FSFR_OP(closedir)	FSFR_OP(getdents64)	FSFR_OP(close)		FSFR_OP(fsync)		\
+	FSFR_OP(fdatasync)	FSFR_OP(execve)		FSFR_OP(execv)		FSFR_OP(execvp)		\
+	FSFR_OP(execvpe)	FSFR_OP(fexecve)	FSFR_OP(posix_spawn)	FSFR_OP(posix_spawnp)
+enum fsfr_op {
+#define FSFR_OP_ENUM(NAME) FSFR_OP_##NAME,
+	FSFR_OPS(FSFR_OP_ENUM)
+#undef FSFR_OP_ENUM
+	FSFR_NOPS
+};
+extern const char *const fsfr_op_names[FSFR_NOPS];
+
+#if __has_include(<sys/sdt.h>) && !defined(FSFR_NO_SDT)
+#include <sys/sdt.h>
+#define FSFR_PROBE2(NAME,A,B)			DTRACE_PROBE2(fsfr,NAME,A,B)
+#define FSFR_PROBE3(NAME,A,B,C)			DTRACE_PROBE3(fsfr,NAME,A,B,C)
+#define FSFR_PROBE4(NAME,A,B,C,D)		DTRACE_PROBE4(fsfr,NAME,A,B,C,D)
+#define FSFR_PROBE5(NAME,A,B,C,D,E)		DTRACE_PROBE5(fsfr,NAME,A,B,C,D,E)
+#else
+#define FSFR_PROBE2(NAME,A,B)			do {} while (0)
+#define FSFR_PROBE3(NAME,A,B,C)			do {} while (0)
+#define FSFR_PROBE4(NAME,A,B,C,D)		do {} while (0)
+#define FSFR_PROBE5(NAME,A,B,C,D,E)		do {} while (0)
+#endif
+
+// which of FSFR_STATS and FSFR_TRACE are on
+#define FSFR_HOOK_STATS 1
+#define FSFR_HOOK_TRACE 2
+extern int fsfr_hooks;
+
+struct fsfr_call {
+	uint64_t t0;		// when it started, if anything is watching
+	int64_t rtn;
+	const char *name;
+	const char *path;
+	int fd;
+	int op;
+	int outer;			// not made from inside another wrapper
+	int counted;		// by FSFR_STATS
+};
+uint64_t fsfr_call_enter(struct fsfr_call *c);
+void fsfr_call_leave(struct fsfr_call *c);
+static inline void fsfr_call_end(struct fsfr_call *c)
+{
+	FSFR_PROBE2(call_return,c->name,c->rtn);
+	if (c->t0) fsfr_call_leave(c);
+}
+#define FSFR_CALL(OP,PATH,FD)											\
+	struct fsfr_call fsfr_call __attribute__((cleanup(fsfr_call_end)))	\
+		= { 0, 0, #OP, (PATH), (FD), FSFR_OP_##OP, 0, 0 };				\
+	FSFR_PROBE3(call_entry,#OP,fsfr_call.path,fsfr_call.fd);			\
+	if (fsfr_hooks) fsfr_call.t0 = fsfr_call_enter(&fsfr_call)
+#define FSFR_RESULT(X) (fsfr_call.rtn = (X))
+// for code that takes either: the path, or the fd
+#define FSFR_PATHOF(F) _Generic((F), int: (const char *)NULL, default: (F))
+#define FSFR_FDOF(F) _Generic((F), int: (F), default: -1)
+
+// the kinds of xattr call FSFR_XATTR makes
+#define FSFR_XATTR_get 1
+#define FSFR_XATTR_set 2
+#define FSFR_XATTR_remove 3
+#define FSFR_XATTR_list 4
+uint64_t fsfr_xattr_enter(void);
+void fsfr_xattr_leave(uint64_t t0, int kind, const char *path, int fd,
+		const char *attr, int64_t rtn);
+#define FSFR_XATTR(KIND,PATH,FD,ATTR,CALL) __extension__ ({				\
+	FSFR_PROBE4(xattr_entry,#KIND,(PATH),(FD),(ATTR));					\
+	uint64_t fsfr_x0 = fsfr_hooks ? fsfr_xattr_enter() : 0;				\
+	__typeof__(CALL) fsfr_xr = (CALL);									\
+	FSFR_PROBE5(xattr_return,#KIND,(PATH),(FD),(ATTR),fsfr_xr);			\
+	if (fsfr_x0) fsfr_xattr_leave(fsfr_x0,FSFR_XATTR_##KIND,(PATH),(FD),(ATTR),fsfr_xr);	\
+	fsfr_xr; })
+
+// FSFR_STATS: what FSFR_STATS_COUNT counts, per op
+#define FSFR_STAT_XATTR 0		// xattr syscalls (each op of a batch)
+#define FSFR_STAT_PROXY 1		// symlink records found in the proxy
+#define FSFR_STAT_HIT 2			// metadata cache hits
+#define FSFR_STAT_MISS 3		// and misses
+#define FSFR_NSTATS 4
+int fsfr_stats_enter(enum fsfr_op op);
+void fsfr_stats_leave(uint64_t ns);
+void fsfr_stats_add(int what, uint64_t n);
+void fsfr_stats_dump(const char *event, int reset);
+#define FSFR_STATS_COUNT(WHAT,N)										\
+	do { if (fsfr_hooks & FSFR_HOOK_STATS) fsfr_stats_add(FSFR_STAT_##WHAT,N); } while (0)
+
+// FSFR_TRACE: one file per thread, a header and then a ring of these
+#define FSFR_TRACE_MAGIC 0x3143525446534631ULL	/* "1FSFTRC1" */
+#define FSFR_TRACE_CALL 0	// a wrapper; otherwise an FSFR_XATTR_* kind
+#define FSFR_TRACE_CUT 1	// flags: the path is only the end of it
+struct fsfr_trace_header {
+	uint64_t magic;
+	uint32_t recsize;
+	uint32_t nrec;			// a power of two
+	uint64_t head;			// records written so far
+	int32_t pid, tid;
+	char comm[16];
+};
+struct fsfr_trace_rec {
+	uint64_t start;			// CLOCK_MONOTONIC, ns
+	uint32_t dur;			// ns
+	uint16_t op;			// FSFR_OP_*: the wrapper, or the one it's inside
+	uint8_t kind;
+	uint8_t flags;
+	int32_t fd;
+	int32_t err;			// errno, where rtn is -1
+	int64_t rtn;
+	char attr[8];			// without "user.fsfr."
+	char path[24];
+};
+
+int fsfr_getmeta_stat(const char *fpath, struct fsfr_meta *m, const struct stat *st);
+int fsfr_lgetmeta_stat(const char *fpath, struct fsfr_meta *m, const struct stat *st);
+int fsfr_fgetmeta_stat(int fd, struct fsfr_meta *m, const struct stat *st);
+int fsfr_setmeta_stat(const char *fpath, const struct fsfr_meta *m, const struct stat *st);
+int fsfr_lsetmeta_stat(const char *fpath, const struct fsfr_meta *m, const struct stat *st);
+int fsfr_fsetmeta_stat(int fd, const struct fsfr_meta *m, const struct stat *st);
+int fsfr_getmeta_stat64(const char *fpath, struct fsfr_meta *m, const struct stat64 *st);
+int fsfr_lgetmeta_stat64(const char *fpath, struct fsfr_meta *m, const struct stat64 *st);
+int fsfr_fgetmeta_stat64(int fd, struct fsfr_meta *m, const struct stat64 *st);
+
 int fsfr_getxattr_int_stat64(const char *fpath, const char *name, const struct stat64 *st);
 int fsfr_lgetxattr_int_stat64(const char *fpath, const char *name, const struct stat64 *st);
 int fsfr_fgetxattr_int_stat64(int fd, const char *name, const struct stat64 *st);
 
+int fsfr_cache_get(dev_t dev, ino_t ino, const struct timespec *ctime,
+		struct fsfr_meta *m, int *rtn);
+void fsfr_cache_put(dev_t dev, ino_t ino, const struct timespec *ctime,
+		const struct fsfr_meta *m, int rtn);
+int fsfr_cache_fdget(int fd, dev_t dev, ino_t ino, const struct timespec *ctime,
+		struct fsfr_meta *m, int *rtn);
+void fsfr_cache_fdput(int fd, dev_t dev, ino_t ino, const struct timespec *ctime,
+		const struct fsfr_meta *m, int rtn);
+int fsfr_shm_get(dev_t dev, ino_t ino, const struct timespec *ctime,
+		struct fsfr_meta *m, int *rtn);
+void fsfr_shm_put(dev_t dev, ino_t ino, const struct timespec *ctime,
+		const struct fsfr_meta *m, int rtn);
+
+// FSFR_IMPLICIT: files really owned by real_uid/real_gid and carrying
+// no owner of their own show up as owned by uid/gid
+struct fsfr_implicit {
+	int on;
+	uid_t uid, real_uid;
+	gid_t gid, real_gid;
+};
+void fsfr_implicit_load(struct fsfr_implicit *imp);
+mode_t fsfr_chmod_meta(struct fsfr_meta *m, mode_t st_mode, mode_t mode);
+void fsfr_chown_meta(struct fsfr_meta *m, uid_t owner, gid_t group,
+		const struct stat *st, const struct fsfr_implicit *imp);
+void fsfr_meta_apply(struct stat *st, const struct fsfr_meta *m,
+		const struct fsfr_implicit *imp);
+int fsfr_meta_unchanged(const struct fsfr_meta *old, const struct stat *oldst,
+		const struct fsfr_meta *m, const struct stat *st,
+		const struct fsfr_implicit *imp);
+
+// a file resolved once; see fsfr_target_open
+struct fsfr_target {
+	int fd;
+	int owned;
+	int byproc;		// path names fd through /proc
+	char path[32];
+	struct stat st;
+};
+
+int fsfr_have_proc(void);
+int fsfr_target_open(struct fsfr_target *t, int dirfd, const char *pathname, int nofollow);
+int fsfr_target_fd(struct fsfr_target *t, int fd);
+void fsfr_target_close(struct fsfr_target *t);
+int fsfr_target_getmeta(struct fsfr_target *t, struct fsfr_meta *m);
+int fsfr_target_setmeta(struct fsfr_target *t, const struct fsfr_meta *m);
+int fsfr_target_chmod(struct fsfr_target *t, mode_t mode);
+int fsfr_getmeta_at(int dirfd, const char *pathname, int flags,
+		struct fsfr_meta *m, const struct stat *st);
+int fsfr_getmeta_at64(int dirfd, const char *pathname, int flags,
+		struct fsfr_meta *m, const struct stat64 *st);
+int fsfr_getmeta_walk(int dirfd, const char *name, const char *path,
+		const struct stat *st, struct fsfr_meta *m);
+
+// one call in a batch; see fsfr_uring.c
+#define FSFR_BATCH_GETXATTR 1
+#define FSFR_BATCH_SETXATTR 2
+#define FSFR_BATCH_CLOSE 3
+struct fsfr_batch_op {
+	int op;
+	int fd;				// used when path is NULL
+	const char *path;
+	const char *name;
+	void *value;
+	size_t size;
+	long res;			// what the call returned, or -errno
+};
+void fsfr_batch(struct fsfr_batch_op *ops, int n);
+
+void fsfr_prefetch_dirent(DIR *d, const char *name);
+void fsfr_prefetch_closedir(DIR *d);
+void fsfr_prefetch_getdents(int fd, const void *buf, ssize_t len);
+
 int fsfr_base_stat(const char *path,struct stat* buf);
 int fsfr_base_lstat(const char *path,struct stat* buf);
 int fsfr_base_fstat(int fd,struct stat* buf);
 int fsfr_base_fstatat(int dirfd, const char *path, struct stat *buf, int flags);
+int fsfr_base_statx(int dirfd, const char *path, int flags, unsigned int mask, struct statx *buf);
+int fsfr_base_stat64(const char *path,struct stat64* buf);
+int fsfr_base_lstat64(const char *path,struct stat64* buf);
+int fsfr_base_fstat64(int fd,struct stat64* buf);
+int fsfr_base_fstatat64(int dirfd, const char *path, struct stat64 *buf, int flags);
 int fsfr_base_openat(int dirfd, const char *pathname, int flags, mode_t mode);
 int fsfr_base_open(const char *pathname, int flags, mode_t mode);
+int fsfr_base_unlinkat(int dirfd, const char *pathname, int flags);
 
 int fsfr_base_chmod(const char *path, mode_t mode);
 int fsfr_base_fchmod(int fd, mode_t mode);
+int fsfr_base_lchmod(const char *path, mode_t mode);
 
 ssize_t fsfr_base_listxattr(const char *path, char *list, size_t size);
 ssize_t fsfr_base_llistxattr(const char *path, char *list, size_t size);
 ssize_t fsfr_base_flistxattr(int filedes, char *list, size_t size);
-
-extern __thread void *fsfr_statignore;
+ssize_t fsfr_base_lgetxattrat(int dirfd, const char *name, const char *attr,
+		void *value, size_t size);
+int fsfr_base_lsetxattrat(int dirfd, const char *name, const char *attr,
+		const void *value, size_t size, int flags);
 
 #endif /* FSFR_H_ */
@@ -11,56 +11,129 @@
 #include "fsfr.h"
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <sys/syscall.h>
 
 /****************************************************************
  *  stat
- *  	Note that we've replaced __xstat() not stat(), which means
- *  	internal calls must use the *system* stat, which in turn calls
- *  	that function. We fsfr_statignore to tell us when to NOT apply
- *  	custom stat values
+ *  	Straight to the kernel. Both the old __xstat() entry points
+ *  	and the stat() family exported by newer glibc are overridden,
+ *  	so going through libc here would land right back in our own
+ *  	wrappers. Where the kernel's struct stat isn't the one libc
+ *  	hands out, fall back to the next fstatat() in line instead,
+ *  	or to __fxstatat() with a glibc older than 2.33, which has
+ *  	no fstatat() of its own to call.
  ****************************************************************/
-#define IMPLEMENT_STAT(NAME,FILETYPE,STATTYPE)                  \
-int fsfr_base_##NAME(FILETYPE file, STATTYPE *buf)              \
-{                                                               \
-	fsfr_statignore = buf;                                      \
-	int rtn = NAME(file,buf);                                   \
-	fsfr_statignore = 0;                                        \
-	return rtn;                                                 \
-}                                                               
-IMPLEMENT_STAT(stat,		const char*,	struct stat)
-IMPLEMENT_STAT(fstat,		int,			struct stat)
-IMPLEMENT_STAT(lstat,		const char*,	struct stat)
-// These aren't currently used
-//IMPLEMENT_STAT(stat64,		const char*,	struct stat64)
-//IMPLEMENT_STAT(fstat64,		int,			struct stat64)
-//IMPLEMENT_STAT(lstat64,		const char*,	struct stat64)
-#undef IMPLEMENT_STAT
+#if defined(SYS_newfstatat) && __WORDSIZE == 64
+#define FSFR_RAW_STAT
+#endif
 
 int fsfr_base_fstatat(int dirfd, const char *path, struct stat *buf, int flags)
 {
-	fsfr_statignore = buf;
-	int rtn = fstatat(dirfd,path,buf,flags);
-	fsfr_statignore = 0;
-	return rtn;
+#ifdef FSFR_RAW_STAT
+	return syscall(SYS_newfstatat,dirfd,path,buf,flags);
+#elif defined(_STAT_VER)
+	return fsfr_real.__fxstatat(_STAT_VER,dirfd,path,buf,flags);
+#else
+	return fsfr_real.fstatat(dirfd,path,buf,flags);
+#endif
+}
+
+int fsfr_base_fstatat64(int dirfd, const char *path, struct stat64 *buf, int flags)
+{
+#ifdef FSFR_RAW_STAT
+	// identical layouts on 64-bit
+	return syscall(SYS_newfstatat,dirfd,path,buf,flags);
+#elif defined(_STAT_VER)
+	return fsfr_real.__fxstatat64(_STAT_VER,dirfd,path,buf,flags);
+#else
+	return fsfr_real.fstatat64(dirfd,path,buf,flags);
+#endif
+}
+
+int fsfr_base_stat(const char *path, struct stat *buf)
+{
+	return fsfr_base_fstatat(AT_FDCWD,path,buf,0);
+}
+int fsfr_base_lstat(const char *path, struct stat *buf)
+{
+	return fsfr_base_fstatat(AT_FDCWD,path,buf,AT_SYMLINK_NOFOLLOW);
+}
+int fsfr_base_fstat(int fd, struct stat *buf)
+{
+	return fsfr_base_fstatat(fd,"",buf,AT_EMPTY_PATH);
+}
+int fsfr_base_stat64(const char *path, struct stat64 *buf)
+{
+	return fsfr_base_fstatat64(AT_FDCWD,path,buf,0);
+}
+int fsfr_base_lstat64(const char *path, struct stat64 *buf)
+{
+	return fsfr_base_fstatat64(AT_FDCWD,path,buf,AT_SYMLINK_NOFOLLOW);
+}
+int fsfr_base_fstat64(int fd, struct stat64 *buf)
+{
+	return fsfr_base_fstatat64(fd,"",buf,AT_EMPTY_PATH);
+}
+
+int fsfr_base_statx(int dirfd, const char *path, int flags, unsigned int mask, struct statx *buf)
+{
+#ifdef SYS_statx
+	return syscall(SYS_statx,dirfd,path,flags,mask,buf);
+#else
+	return fsfr_real.statx(dirfd,path,flags,mask,buf);
+#endif
 }
 
 ssize_t fsfr_base_listxattr(const char *path, char *list, size_t size) {
-	static int(*fn_orig)(const char *, char *, size_t) = NULL;
-	if (fn_orig==NULL) fn_orig = fsfr_dlnext("listxattr");
-	if (!fn_orig) { return -1; }
-	return fn_orig(path,list,size);
+	return FSFR_XATTR(list,path,-1,NULL,fsfr_real.listxattr(path,list,size));
 }
 ssize_t fsfr_base_llistxattr(const char *path, char *list, size_t size) {
-	static int(*fn_orig)(const char *, char *, size_t) = NULL;
-	if (fn_orig==NULL) fn_orig = fsfr_dlnext("llistxattr");
-	if (!fn_orig) { return -1; }
-	return fn_orig(path,list,size);
+	return FSFR_XATTR(list,path,-1,NULL,fsfr_real.llistxattr(path,list,size));
 }
 ssize_t fsfr_base_flistxattr(int filedes, char *list, size_t size) {
-	static int(*fn_orig)(int, char *, size_t) = NULL;
-	if (fn_orig==NULL) fn_orig = fsfr_dlnext("flistxattr");
-	if (!fn_orig) { return -1; }
-	return fn_orig(filedes,list,size);
+	return FSFR_XATTR(list,NULL,filedes,NULL,fsfr_real.flistxattr(filedes,list,size));
+}
+
+// Attributes of name in dirfd, not following symlinks. Linux 6.13
+// and later only; elsewhere these fail with ENOSYS, and the caller
+// has to build a path instead.
+#ifndef SYS_getxattrat
+#define SYS_getxattrat 464	// the same on every architecture
+#define SYS_setxattrat 463
+#endif
+struct fsfr_xattr_args {
+	uint64_t value;
+	uint32_t size;
+	uint32_t flags;
+};
+static int have_xattrat = 1;
+
+ssize_t fsfr_base_lgetxattrat(int dirfd, const char *name, const char *attr,
+		void *value, size_t size)
+{
+	if (!__atomic_load_n(&have_xattrat,__ATOMIC_RELAXED)) {
+		errno = ENOSYS;
+		return -1;
+	}
+	struct fsfr_xattr_args args = { (uintptr_t)value, size, 0 };
+	ssize_t rtn = FSFR_XATTR(get,name,dirfd,attr,
+			syscall(SYS_getxattrat,dirfd,name,AT_SYMLINK_NOFOLLOW,attr,&args,sizeof(args)));
+	if (rtn==-1 && errno==ENOSYS) __atomic_store_n(&have_xattrat,0,__ATOMIC_RELAXED);
+	return rtn;
+}
+
+int fsfr_base_lsetxattrat(int dirfd, const char *name, const char *attr,
+		const void *value, size_t size, int flags)
+{
+	if (!__atomic_load_n(&have_xattrat,__ATOMIC_RELAXED)) {
+		errno = ENOSYS;
+		return -1;
+	}
+	struct fsfr_xattr_args args = { (uintptr_t)value, size, flags };
+	int rtn = FSFR_XATTR(set,name,dirfd,attr,
+			syscall(SYS_setxattrat,dirfd,name,AT_SYMLINK_NOFOLLOW,attr,&args,sizeof(args)));
+	if (rtn==-1 && errno==ENOSYS) __atomic_store_n(&have_xattrat,0,__ATOMIC_RELAXED);
+	return rtn;
 }
 
 /****************************************************************
@@ -68,18 +141,17 @@ ssize_t fsfr_base_flistxattr(int filedes, char *list, size_t size) {
  ****************************************************************/
 int fsfr_base_openat(int dirfd, const char *pathname, int flags, mode_t mode)
 {
-	static int(*fn_orig)(int,const char *,int,mode_t) = NULL;
-	if (fn_orig==NULL) fn_orig = fsfr_dlnext("openat");
-	if (!fn_orig) { return -1; }
-	return fn_orig(dirfd,pathname,flags,mode);
+	return fsfr_real.openat(dirfd,pathname,flags,mode);
 }
 
 int fsfr_base_open(const char *pathname, int flags, mode_t mode)
 {
-	static int(*fn_orig)(const char *, int, mode_t) = NULL;
-	if (fn_orig==NULL) fn_orig = fsfr_dlnext("open");
-	if (!fn_orig) { return -1; }
-	return fn_orig(pathname,flags,mode);
+	return fsfr_real.open(pathname,flags,mode);
+}
+
+int fsfr_base_unlinkat(int dirfd, const char *pathname, int flags)
+{
+	return fsfr_real.unlinkat(dirfd,pathname,flags);
 }
 
 
@@ -88,25 +160,16 @@ int fsfr_base_open(const char *pathname, int flags, mode_t mode)
  ****************************************************************/
 int fsfr_base_chmod(const char *path, mode_t mode)
 {
-	static int(*fn_orig)(const char *, mode_t) = NULL;
-	if (fn_orig==NULL) fn_orig = fsfr_dlnext("chmod");
-	if (!fn_orig) { return -1; }
-	return fn_orig(path,mode);
+	return fsfr_real.chmod(path,mode);
 }
 
 int fsfr_base_fchmod(int fd, mode_t mode)
 {
-	static int(*fn_orig)(int, mode_t) = NULL;
-	if (fn_orig==NULL) fn_orig = fsfr_dlnext("fchmod");
-	if (!fn_orig) { return -1; }
-	return fn_orig(fd,mode);
+	return fsfr_real.fchmod(fd,mode);
 }
 
 int fsfr_base_lchmod(const char *path, mode_t mode)
 {
-	static int(*fn_orig)(const char *, mode_t) = NULL;
-	if (fn_orig==NULL) fn_orig = fsfr_dlnext("lchmod");
-	if (!fn_orig) { return -1; }
-	return fn_orig(path,mode);
+	return fsfr_real.lchmod(path,mode);
 }
 
@@ -0,0 +1,182 @@
+/*
+ * fsfr_cache.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+#include "fsfr.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+/****************************************************************
+ *  Metadata cache
+ *  	Remembers the result of the last xattr lookup per inode,
+ *  	keyed by the (st_dev, st_ino) pair the real stat already
+ *  	returned. Any metadata change touches the inode's ctime,
+ *  	so an entry is only trusted while ctime is unchanged; a hit
+ *  	costs no syscalls at all.
+ *
+ *  	Our own updates change ctime too, and we don't know the new
+ *  	value without another stat, so those entries are stored
+ *  	with ctime "pending" and adopt whatever the next stat sees.
+ *
+ *  	Misses fall through to the shared cache in fsfr_shmcache.c,
+ *  	if one is configured. Symlinks, whose records don't live on
+ *  	the inode, are never published there. Set FSFR_CACHE=0 to disable both.
+ ****************************************************************/
+
+#define CACHE_SLOTS 8192	// default; FSFR_CACHE_SIZE overrides
+#define CACHE_PREFETCH_SLOTS (1<<17)	// enough to cover a big directory
+#define CACHE_LOCKS 64		// power of 2
+#define CACHE_FDS 1024
+#define CTIME_PENDING -1
+
+struct fsfr_cache_entry {
+	dev_t dev;
+	ino_t ino;
+	struct timespec ctime;
+	struct fsfr_meta meta;
+	int rtn;	// what fsfr_*getmeta returned
+	int valid;
+};
+
+static struct fsfr_cache_entry *cache = NULL;
+static unsigned int cache_mask = 0;
+// per-fd shortcut for fstat, which doesn't need to hash at all
+static struct fsfr_cache_entry cache_fd[CACHE_FDS];
+static pthread_mutex_t cache_lock[CACHE_LOCKS];
+static int cache_enabled = -1;
+
+static void fsfr_cache_reset_locks(void)
+{
+	int i;
+	for (i=0; i<CACHE_LOCKS; i++) pthread_mutex_init(&cache_lock[i],NULL);
+}
+
+static void fsfr_cache_init(void)
+{
+	char *env = getenv("FSFR_CACHE");
+	char *size = getenv("FSFR_CACHE_SIZE");
+	char *prefetch = getenv("FSFR_PREFETCH");
+	unsigned long want = CACHE_SLOTS, slots = 1;
+	fsfr_cache_reset_locks();
+	// a lock held by another thread at fork() would never be released
+	pthread_atfork(NULL,NULL,fsfr_cache_reset_locks);
+	if (env && !strcmp(env,"0")) {
+		cache_enabled = 0;
+		return;
+	}
+	// prefetched entries have to survive until the caller gets there
+	if (prefetch && atoi(prefetch) > 0) want = CACHE_PREFETCH_SLOTS;
+	if (size && atol(size) > 0) want = atol(size);
+	while (slots < want && slots < (1UL<<30)) slots <<= 1;
+	cache = calloc(slots,sizeof(*cache));
+	cache_mask = slots-1;
+	cache_enabled = cache!=NULL;
+}
+
+static inline int fsfr_cache_on(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	if (cache_enabled==-1) pthread_once(&once,fsfr_cache_init);
+	return cache_enabled;
+}
+
+static inline unsigned int fsfr_cache_hash(dev_t dev, ino_t ino)
+{
+	uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+	h *= 0xff51afd7ed558ccdULL;
+	return (unsigned int)(h >> 32);
+}
+
+// copy out e if it matches; a pending ctime is adopted on the spot
+static int fsfr_cache_match(struct fsfr_cache_entry *e, dev_t dev, ino_t ino,
+		const struct timespec *ctime, struct fsfr_meta *m, int *rtn)
+{
+	if (!e->valid || e->dev!=dev || e->ino!=ino) return 0;
+	if (e->ctime.tv_nsec==CTIME_PENDING) {
+		e->ctime = *ctime;
+	} else if (e->ctime.tv_sec!=ctime->tv_sec || e->ctime.tv_nsec!=ctime->tv_nsec) {
+		e->valid = 0;
+		return 0;
+	}
+	*m = e->meta;
+	*rtn = e->rtn;
+	return 1;
+}
+
+static void fsfr_cache_fill(struct fsfr_cache_entry *e, dev_t dev, ino_t ino,
+		const struct timespec *ctime, const struct fsfr_meta *m, int rtn)
+{
+	e->dev = dev;
+	e->ino = ino;
+	if (ctime) {
+		e->ctime = *ctime;
+	} else {
+		e->ctime.tv_sec = 0;
+		e->ctime.tv_nsec = CTIME_PENDING;
+	}
+	e->meta = *m;
+	e->rtn = rtn;
+	e->valid = 1;
+}
+
+// Returns 1 and fills m/rtn on a hit
+int fsfr_cache_get(dev_t dev, ino_t ino, const struct timespec *ctime,
+		struct fsfr_meta *m, int *rtn)
+{
+	if (!fsfr_cache_on()) return 0;
+	unsigned int h = fsfr_cache_hash(dev,ino);
+	pthread_mutex_t *lock = &cache_lock[h & (CACHE_LOCKS-1)];
+	pthread_mutex_lock(lock);
+	int hit = fsfr_cache_match(&cache[h & cache_mask],dev,ino,ctime,m,rtn);
+	if (!hit && fsfr_shm_get(dev,ino,ctime,m,rtn)) {
+		fsfr_cache_fill(&cache[h & cache_mask],dev,ino,ctime,m,*rtn);
+		hit = 1;
+	}
+	pthread_mutex_unlock(lock);
+	return hit;
+}
+
+// ctime NULL means "changed by us just now", or "not something other
+// processes can validate" (symlinks, see FSFR_CACHE_CTIME)
+void fsfr_cache_put(dev_t dev, ino_t ino, const struct timespec *ctime,
+		const struct fsfr_meta *m, int rtn)
+{
+	if (!fsfr_cache_on()) return;
+	unsigned int h = fsfr_cache_hash(dev,ino);
+	pthread_mutex_t *lock = &cache_lock[h & (CACHE_LOCKS-1)];
+	pthread_mutex_lock(lock);
+	fsfr_cache_fill(&cache[h & cache_mask],dev,ino,ctime,m,rtn);
+	pthread_mutex_unlock(lock);
+	// only publish what other processes can validate
+	if (ctime) fsfr_shm_put(dev,ino,ctime,m,rtn);
+}
+
+int fsfr_cache_fdget(int fd, dev_t dev, ino_t ino, const struct timespec *ctime,
+		struct fsfr_meta *m, int *rtn)
+{
+	if (fd<0 || fd>=CACHE_FDS) return fsfr_cache_get(dev,ino,ctime,m,rtn);
+	if (!fsfr_cache_on()) return 0;
+	pthread_mutex_t *lock = &cache_lock[fd & (CACHE_LOCKS-1)];
+	pthread_mutex_lock(lock);
+	int hit = fsfr_cache_match(&cache_fd[fd],dev,ino,ctime,m,rtn);
+	pthread_mutex_unlock(lock);
+	return hit || fsfr_cache_get(dev,ino,ctime,m,rtn);
+}
+
+void fsfr_cache_fdput(int fd, dev_t dev, ino_t ino, const struct timespec *ctime,
+		const struct fsfr_meta *m, int rtn)
+{
+	fsfr_cache_put(dev,ino,ctime,m,rtn);
+	if (fd<0 || fd>=CACHE_FDS || !fsfr_cache_on()) return;
+	pthread_mutex_t *lock = &cache_lock[fd & (CACHE_LOCKS-1)];
+	pthread_mutex_lock(lock);
+	fsfr_cache_fill(&cache_fd[fd],dev,ino,ctime,m,rtn);
+	pthread_mutex_unlock(lock);
+}
@@ -0,0 +1,407 @@
+/*
+ * fsfr_chown.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+/****************************************************************
+ *  fsfr-chown, fsfr-chmod
+ *  	chown -R and chmod -R for a fake root, without the preload:
+ *  	the fake owner and mode are worked out with the same rules
+ *  	the wrappers use (fsfr_chown_meta, fsfr_chmod_meta) and
+ *  	written straight to the metadata record. A file without one
+ *  	starts from what the base index has for it, as it would
+ *  	under the preload. Built twice from this file;
+ *  	FSFR_TOOL_CHMOD picks which one.
+ *
+ *  	Directories are read by several threads at once, with the
+ *  	walk in fsfr_walk.c. Entries are handled relative to their
+ *  	directory's fd, and only records that actually change are
+ *  	written back.
+ *  	Symlinks are never followed below the named files; their
+ *  	owner goes to the proxy, same as lchown().
+ ****************************************************************/
+
+#include "fsfr.h"
+#include <stdlib.h>
+#include <pwd.h>
+#include <grp.h>
+#include <time.h>
+
+#define WALK_MAXTHREADS 64
+
+static int nthreads = 0;
+static int recurse = 0;
+static int nofollow = 0;
+static int verbose = 0;
+static int summary = 0;
+static long nseen = 0, nchanged = 0, failed = 0;
+
+#ifdef FSFR_TOOL_CHMOD
+#define TOOL "fsfr-chmod"
+// one clause of a symbolic mode, or the whole of an octal one
+struct mode_clause {
+	char op;		// '+', '-' or '='
+	mode_t who;
+	mode_t perm;
+	int dirx;		// X: execute only for dirs or if anyone has it
+};
+static struct mode_clause clauses[32];
+static int nclauses = 0;
+#else
+#define TOOL "fsfr-chown"
+static uid_t new_uid = -1;
+static gid_t new_gid = -1;
+#endif
+static struct fsfr_implicit imp;
+
+static void walk_fail(const char *path)
+{
+	fprintf(stderr,TOOL ": %s: %s\n",path,strerror(errno));
+	__atomic_add_fetch(&failed,1,__ATOMIC_RELAXED);
+}
+
+static void *walk_alloc(size_t size)
+{
+	void *p = malloc(size);
+	if (!p) {
+		perror(TOOL);
+		exit(1);
+	}
+	return p;
+}
+
+/****************************************************************
+ *  The change itself
+ ****************************************************************/
+#ifdef FSFR_TOOL_CHMOD
+// the fake mode, as the wrappers would report it
+static mode_t fake_mode(const struct stat *st, const struct fsfr_meta *m)
+{
+	if (m->modemask==-1) return st->st_mode;
+	return (st->st_mode & ~m->modemask) | (m->mode & m->modemask);
+}
+
+static mode_t new_mode(mode_t cur)
+{
+	mode_t mode = cur & 07777;
+	int i;
+	for (i=0; i<nclauses; i++) {
+		struct mode_clause *c = &clauses[i];
+		mode_t perm = c->perm;
+		if (c->dirx && (S_ISDIR(cur) || (cur & 0111))) perm |= 0111 & c->who;
+		if (c->op=='+') mode |= perm;
+		else if (c->op=='-') mode &= ~perm;
+		else mode = (mode & ~c->who) | perm;
+	}
+	return mode;
+}
+#endif
+
+// Work out what changes for one entry. Returns 1 if m needs writing;
+// a real chmod, if any, is done here. dirfd/name reach the entry.
+static int walk_change(int dirfd, const char *name, const char *path,
+		const struct stat *st, struct fsfr_meta *m)
+{
+	struct fsfr_meta old = *m;
+	mode_t filemode = st->st_mode & 07777;
+#ifdef FSFR_TOOL_CHMOD
+	if (S_ISLNK(st->st_mode)) return 0;
+	mode_t mode = new_mode(fake_mode(st,m));
+	filemode = fsfr_chmod_meta(m,st->st_mode,mode);
+#else
+	if ((st->st_mode&0600)!=0600 && !S_ISLNK(st->st_mode))
+		filemode = fsfr_chmod_meta(m,st->st_mode,st->st_mode & 0777);
+	fsfr_chown_meta(m,new_uid,new_gid,st,&imp);
+#endif
+	if (filemode!=(st->st_mode & 07777) && fchmodat(dirfd,name,filemode,0)) {
+		walk_fail(path);
+		return 0;
+	}
+	struct stat now = *st;
+	now.st_mode = (st->st_mode & S_IFMT) | filemode;
+	// as the wrappers decide it, the base index included
+	if (fsfr_meta_unchanged(&old,st,m,&now,&imp)) {
+		if (filemode!=(st->st_mode & 07777)) __atomic_add_fetch(&nchanged,1,__ATOMIC_RELAXED);
+		return 0;
+	}
+	if (verbose) printf("%s\n",path);
+	__atomic_add_fetch(&nchanged,1,__ATOMIC_RELAXED);
+	return 1;
+}
+
+// relative to the directory where the kernel can (Linux 6.13),
+// otherwise by the path from the cwd
+static int walk_setxattr(int dirfd, const char *name, const char *path,
+		const void *value, size_t size)
+{
+	if (dirfd!=AT_FDCWD) {
+		int rtn = fsfr_base_lsetxattrat(dirfd,name,XATTR_META,value,size,0);
+		if (rtn!=-1 || errno!=ENOSYS) return rtn;
+	}
+	return lsetxattr(path,XATTR_META,value,size,0);
+}
+
+// one entry of a directory, or a file named on the command line
+static void walk_entry(int dirfd, const char *name, const char *path, const struct stat *st)
+{
+	struct fsfr_meta m;
+	int rtn;
+	fsfr_getmeta_walk(dirfd,name,path,st,&m);
+	if (!walk_change(dirfd,name,path,st,&m)) return;
+	if (S_ISLNK(st->st_mode)) {
+		// the proxy, keyed by (dev, ino), same as lchown()
+		rtn = fsfr_proxysetmeta(st->st_dev,st->st_ino,&m);
+		if (rtn) errno = rtn<0 ? -rtn : EIO;
+	} else if (FSFR_META_REMOVABLE(&m)) {
+		// nothing left to fake: the record goes (fsfr_lsetmeta knows how)
+		rtn = fsfr_lsetmeta(path,&m);
+		if (rtn) errno = -rtn;
+	} else {
+		m.version = FSFR_META_VERSION;
+		rtn = walk_setxattr(dirfd,name,path,&m,sizeof(m));
+	}
+	if (rtn) walk_fail(path);
+}
+
+/****************************************************************
+ *  Parallel walk
+ ****************************************************************/
+static char *walk_join(const char *dir, const char *name, char **base)
+{
+	size_t dlen = strlen(dir);
+	char *path = walk_alloc(dlen + strlen(name) + 2);
+	memcpy(path,dir,dlen);
+	if (dlen && dir[dlen-1]!='/') path[dlen++] = '/';
+	strcpy(path+dlen,name);
+	*base = path+dlen;
+	return path;
+}
+
+// read one directory: change every entry in it, queue the subdirectories
+static void walk_dir(const char *dirpath, void *arg)
+{
+	int fd = open(dirpath,O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd==-1) {
+		walk_fail(dirpath);
+		return;
+	}
+	char buf[32768];
+	ssize_t len;
+	while ((len = getdents64(fd,buf,sizeof(buf))) > 0) {
+		char *p = buf;
+		while (p < buf+len) {
+			struct dirent64 *de = (struct dirent64 *)p;
+			const char *name = de->d_name;
+			struct stat st;
+			p += de->d_reclen;
+			if (name[0]=='.' && (!name[1] || (name[1]=='.' && !name[2]))) continue;
+			char *base;
+			char *path = walk_join(dirpath,name,&base);
+			if (fstatat(fd,name,&st,AT_SYMLINK_NOFOLLOW)) {
+				walk_fail(path);
+				free(path);
+				continue;
+			}
+			__atomic_add_fetch(&nseen,1,__ATOMIC_RELAXED);
+			walk_entry(fd,base,path,&st);
+			if (S_ISDIR(st.st_mode)) fsfr_walk_push(path);
+			else free(path);
+		}
+	}
+	if (len<0) walk_fail(dirpath);
+	close(fd);
+}
+
+// one of the files named on the command line
+static void walk_root(const char *path)
+{
+	struct stat st;
+	struct fsfr_meta m;
+	int follow = !recurse && !nofollow;
+	if ((follow ? stat(path,&st) : lstat(path,&st))) {
+		walk_fail(path);
+		return;
+	}
+	__atomic_add_fetch(&nseen,1,__ATOMIC_RELAXED);
+	if (!follow || S_ISLNK(st.st_mode)) {
+		walk_entry(AT_FDCWD,path,path,&st);
+	} else {
+		// through a symlink, if it is one
+		if (fsfr_getmeta(path,&m)==-1 && fsfr_index_on())
+			fsfr_index_get(AT_FDCWD,path,&FSFR_INDEX_KEY(&st),&m);
+		if (walk_change(AT_FDCWD,path,path,&st,&m)) {
+			int rtn = fsfr_setmeta(path,&m);
+			if (rtn) {
+				errno = -rtn;
+				walk_fail(path);
+			}
+		}
+	}
+	if (recurse && S_ISDIR(st.st_mode)) {
+		char *copy = walk_alloc(strlen(path)+1);
+		strcpy(copy,path);
+		fsfr_walk_push(copy);
+	}
+}
+
+/****************************************************************
+ *  Command line
+ ****************************************************************/
+#ifdef FSFR_TOOL_CHMOD
+static int parse_mode(const char *spec)
+{
+	char *end;
+	if (*spec>='0' && *spec<='7') {
+		long mode = strtol(spec,&end,8);
+		if (*end || mode<0 || mode>07777) return -1;
+		clauses[0].op = '=';
+		clauses[0].who = 07777;
+		clauses[0].perm = mode;
+		clauses[0].dirx = 0;
+		nclauses = 1;
+		return 0;
+	}
+	mode_t cmask = umask(0);
+	umask(cmask);
+	const char *p = spec;
+	for (;;) {
+		mode_t who = 0;
+		for (; *p && strchr("ugoa",*p); p++) {
+			if (*p=='u') who |= 04700;
+			else if (*p=='g') who |= 02070;
+			else if (*p=='o') who |= 00007;
+			else who |= 07777;
+		}
+		int masked = !who;
+		if (!who) who = 07777;
+		if (!*p || !strchr("+-=",*p)) return -1;
+		while (*p && strchr("+-=",*p)) {
+			if (nclauses==sizeof(clauses)/sizeof(clauses[0])) return -1;
+			struct mode_clause *c = &clauses[nclauses++];
+			c->op = *p++;
+			c->who = who & ~(masked ? cmask : 0);
+			c->perm = 0;
+			c->dirx = 0;
+			for (; *p && strchr("rwxXst",*p); p++) {
+				if (*p=='r') c->perm |= 0444;
+				else if (*p=='w') c->perm |= 0222;
+				else if (*p=='x') c->perm |= 0111;
+				else if (*p=='X') c->dirx = 1;
+				else if (*p=='s') c->perm |= 06000;
+				else c->perm |= 01000;
+			}
+			c->perm &= c->who;
+			if (c->op=='=') c->who = who;	// = clears what the umask protects too
+		}
+		if (!*p) return 0;
+		if (*p++!=',') return -1;
+	}
+}
+#else
+static int parse_id(const char *s, int group, unsigned int *id)
+{
+	char *end;
+	unsigned long n = strtoul(s,&end,10);
+	if (*s && !*end) {
+		*id = n;
+		return 0;
+	}
+	if (group) {
+		struct group *gr = getgrnam(s);
+		if (!gr) return -1;
+		*id = gr->gr_gid;
+	} else {
+		struct passwd *pw = getpwnam(s);
+		if (!pw) return -1;
+		*id = pw->pw_uid;
+	}
+	return 0;
+}
+
+// user, user:group, :group, or user: for the user's login group
+static int parse_owner(const char *spec)
+{
+	char *copy = strdup(spec), *colon = strchr(copy,':');
+	unsigned int id;
+	int rtn = 0;
+	if (colon) *colon = '\0';
+	if (*copy) {
+		if (parse_id(copy,0,&id)) rtn = -1;
+		else new_uid = id;
+	}
+	if (!rtn && colon && colon[1]) {
+		if (parse_id(colon+1,1,&id)) rtn = -1;
+		else new_gid = id;
+	} else if (!rtn && colon && *copy) {
+		struct passwd *pw = getpwuid(new_uid);
+		if (!pw) rtn = -1;
+		else new_gid = pw->pw_gid;
+	}
+	free(copy);
+	return rtn;
+}
+#endif
+
+static void usage(const char *name)
+{
+#ifdef FSFR_TOOL_CHMOD
+	fprintf(stderr,"usage: %s [-Rhsv] [-j threads] MODE <file>...\n",name);
+	fprintf(stderr,"  Sets the fake mode of each <file>, as chmod would under fsfakeroot.\n");
+	fprintf(stderr,"  MODE is octal, or symbolic ([ugoa][+-=][rwxXst], comma-separated).\n");
+#else
+	fprintf(stderr,"usage: %s [-Rhsv] [-j threads] OWNER[:[GROUP]] <file>...\n",name);
+	fprintf(stderr,"  Sets the fake owner of each <file>, as chown would under fsfakeroot.\n");
+#endif
+	fprintf(stderr,"  -R: recurse into directories, never following symlinks\n");
+	fprintf(stderr,"  -h: change the symlinks named rather than what they point to\n");
+	fprintf(stderr,"  -s: print a summary with the time taken\n");
+	fprintf(stderr,"  -v: list what was changed\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, i;
+	nthreads = ncpu < 1 ? 1 : ncpu > WALK_MAXTHREADS ? WALK_MAXTHREADS : ncpu;
+	while ((opt = getopt(argc,argv,"+Rhsvj:")) != -1) {
+		switch (opt) {
+		case 'R': recurse = 1; break;
+		case 'h': nofollow = 1; break;
+		case 's': summary = 1; break;
+		case 'v': verbose = 1; break;
+		case 'j': nthreads = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind+1 >= argc || nthreads < 1 || nthreads > WALK_MAXTHREADS) usage(argv[0]);
+	if (fsfr_daemon_refuse(TOOL)) return 2;
+#ifdef FSFR_TOOL_CHMOD
+	if (parse_mode(argv[optind])) {
+		fprintf(stderr,TOOL ": invalid mode: %s\n",argv[optind]);
+		return 2;
+	}
+#else
+	if (parse_owner(argv[optind])) {
+		fprintf(stderr,TOOL ": invalid owner: %s\n",argv[optind]);
+		return 2;
+	}
+#endif
+	fsfr_implicit_load(&imp);
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	for (i=optind+1; i<argc; i++) walk_root(argv[i]);
+	if (recurse) fsfr_walk(nthreads,walk_dir,NULL);
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	if (summary) {
+		double ms = (t1.tv_sec-t0.tv_sec)*1e3 + (t1.tv_nsec-t0.tv_nsec)/1e6;
+		fprintf(stderr,"%li entries, %li changed, %.1f ms (%d threads)\n",
+				nseen,nchanged,ms,nthreads);
+	}
+	return failed?1:0;
+}
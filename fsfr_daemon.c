@@ -0,0 +1,392 @@
+/*
+ * fsfr_daemon.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+#include "fsfr.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/****************************************************************
+ *  Daemon client
+ *  	With FSFR_DAEMON naming the socket of a running fsfr-faked,
+ *  	metadata is kept there, keyed by (st_dev, st_ino), instead
+ *  	of in extended attributes. This is for filesystems without
+ *  	user attributes (tmpfs before 6.6, overlayfs, NFS), or where
+ *  	they're slow.
+ *
+ *  	Changes are not answered; they queue up and go out in one
+ *  	write, ahead of the next lookup that misses, once DMN_BATCH
+ *  	are pending, and before fork(), exec(), fsync() and exit.
+ *  	Those last go out with a FENCE behind them, and wait for its
+ *  	answer: the daemon takes each connection in order, but not
+ *  	one against another, and whoever runs next has a connection
+ *  	of its own.
+ *
+ *  	Lookups are remembered in a small cache of our own (the
+ *  	ctime-based one is no use here: nothing about the inode
+ *  	changes), and trusted while the daemon's change counter,
+ *  	which it shares with us through a memfd, stays where it was.
+ *  	Our own pending changes always win.
+ *
+ *  	If the daemon can't be reached, nothing has metadata and
+ *  	changes fail with the error connect() gave; it is tried again
+ *  	each time.
+ *  	Nothing falls back to extended attributes.
+ ****************************************************************/
+
+#define DMN_BATCH 64		// messages per write
+#define DMN_CACHE 4096		// power of 2
+#define DMN_PENDING (~0ULL)	// cache gen: changed here, not sent yet
+
+struct fsfr_dmn_entry {
+	uint64_t dev, ino;
+	uint64_t gen;		// 0: unused
+	int rtn;
+	struct fsfr_meta meta;
+};
+
+static const char *dmn_path = NULL;
+static int dmn_fd = -1;
+static const volatile uint64_t *dmn_gen = NULL;
+static struct fsfr_daemon_msg dmn_out[DMN_BATCH];
+static int dmn_nout = 0;
+static int dmn_unfenced = 0;	// sent since the last answer came back
+static struct fsfr_dmn_entry dmn_cache[DMN_CACHE];
+static pthread_mutex_t dmn_lock = PTHREAD_MUTEX_INITIALIZER;
+static int dmn_warned = 0;
+
+static void fsfr_dmn_atfork_prepare(void);
+static void fsfr_dmn_atfork_parent(void);
+static void fsfr_dmn_atfork_child(void);
+
+static void fsfr_dmn_attach(void)
+{
+	char *path = getenv("FSFR_DAEMON");
+	if (!path || !*path) return;
+	dmn_path = path;
+	pthread_atfork(fsfr_dmn_atfork_prepare,fsfr_dmn_atfork_parent,fsfr_dmn_atfork_child);
+}
+
+int fsfr_daemon_on(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once,fsfr_dmn_attach);
+	return dmn_path!=NULL;
+}
+
+static inline struct fsfr_dmn_entry *fsfr_dmn_slot(uint64_t dev, uint64_t ino)
+{
+	uint64_t h = (dev * 0x9e3779b97f4a7c15ULL) ^ ino;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	return &dmn_cache[(h ^ (h >> 31)) & (DMN_CACHE-1)];
+}
+
+/****************************************************************
+ *  Connection
+ *  	All of these are called with dmn_lock held.
+ ****************************************************************/
+static void fsfr_dmn_drop(void)
+{
+	if (dmn_fd!=-1) fsfr_real.close(dmn_fd);
+	dmn_fd = -1;
+	dmn_unfenced = 0;
+}
+
+static void fsfr_dmn_fail(void)
+{
+	if (!dmn_warned++)
+		fprintf(stderr,"fsfakeroot: %s: %s\n",dmn_path,strerror(errno));
+	fsfr_dmn_drop();
+}
+
+static int fsfr_dmn_connect(void)
+{
+	struct sockaddr_un sa;
+	if (dmn_fd!=-1) return 0;
+	if (strlen(dmn_path) >= sizeof(sa.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&sa,0,sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path,dmn_path);
+	dmn_fd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+	if (dmn_fd==-1) return -1;
+	if (connect(dmn_fd,(struct sockaddr *)&sa,sizeof(sa))) {
+		fsfr_dmn_drop();
+		return -1;
+	}
+
+	// the hello brings the change counter along
+	struct fsfr_daemon_msg hello;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { &hello, sizeof(hello) };
+	struct msghdr mh;
+	memset(&mh,0,sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	ssize_t n;
+	do n = recvmsg(dmn_fd,&mh,MSG_WAITALL|MSG_CMSG_CLOEXEC);
+	while (n==-1 && errno==EINTR);
+	struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+	if (n!=sizeof(hello) || hello.op!=FSFR_DAEMON_HELLO || !c
+			|| c->cmsg_level!=SOL_SOCKET || c->cmsg_type!=SCM_RIGHTS) {
+		if (n>=0) errno = EPROTO;
+		fsfr_dmn_drop();
+		return -1;
+	}
+	int genfd;
+	memcpy(&genfd,CMSG_DATA(c),sizeof(int));
+	if (!dmn_gen) {
+		void *map = mmap(NULL,sizeof(uint64_t),PROT_READ,MAP_SHARED,genfd,0);
+		if (map!=MAP_FAILED) dmn_gen = map;
+	}
+	fsfr_real.close(genfd);
+	if (!dmn_gen) {
+		fsfr_dmn_drop();
+		return -1;
+	}
+	return 0;
+}
+
+static int fsfr_dmn_send(const void *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = send(dmn_fd,buf,len,MSG_NOSIGNAL);
+		if (n==-1 && errno==EINTR) continue;
+		if (n<=0) return -1;
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int fsfr_dmn_recv(void *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = recv(dmn_fd,buf,len,MSG_WAITALL);
+		if (n==-1 && errno==EINTR) continue;
+		if (n<=0) {
+			if (!n) errno = ECONNRESET;
+			return -1;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Sends whatever is queued. What we changed is no longer ours to
+// vouch for once the daemon has it, so those cache entries go back
+// to being checked against its counter.
+static int fsfr_dmn_flush_locked(void)
+{
+	int i, rtn = 0;
+	if (!dmn_nout) return 0;
+	if (fsfr_dmn_connect() || fsfr_dmn_send(dmn_out,dmn_nout*sizeof(*dmn_out))) {
+		fsfr_dmn_fail();
+		rtn = -1;
+	} else dmn_unfenced = 1;
+	for (i=0; i<dmn_nout; i++) {
+		struct fsfr_dmn_entry *e = fsfr_dmn_slot(dmn_out[i].dev,dmn_out[i].ino);
+		if (e->gen==DMN_PENDING && e->dev==dmn_out[i].dev && e->ino==dmn_out[i].ino)
+			e->gen = 0;
+	}
+	dmn_nout = 0;
+	return rtn;
+}
+
+// Sends whatever is queued, and waits until the daemon has applied
+// it and everything sent before, so that other connections see it.
+// An answer to anything does as well as one to a FENCE.
+static int fsfr_dmn_sync_locked(void)
+{
+	struct fsfr_daemon_msg req;
+	if (!dmn_nout && !dmn_unfenced) return 0;
+	if (dmn_nout==DMN_BATCH && fsfr_dmn_flush_locked()) return -1;
+	memset(&req,0,sizeof(req));
+	req.op = FSFR_DAEMON_FENCE;
+	dmn_out[dmn_nout++] = req;
+	if (fsfr_dmn_flush_locked()) return -1;
+	if (fsfr_dmn_recv(&req,sizeof(req)) || req.op!=FSFR_DAEMON_FENCE) {
+		fsfr_dmn_fail();
+		return -1;
+	}
+	dmn_unfenced = 0;
+	return 0;
+}
+
+static int fsfr_dmn_cached(uint64_t dev, uint64_t ino, struct fsfr_meta *m)
+{
+	struct fsfr_dmn_entry *e = fsfr_dmn_slot(dev,ino);
+	if (!e->gen || e->dev!=dev || e->ino!=ino) return 0;
+	if (e->gen!=DMN_PENDING && (!dmn_gen || e->gen!=*dmn_gen)) return 0;
+	*m = e->meta;
+	return 1;
+}
+
+static void fsfr_dmn_remember(const struct fsfr_daemon_msg *r)
+{
+	struct fsfr_dmn_entry *e = fsfr_dmn_slot(r->dev,r->ino);
+	// don't let an answer evict something not sent yet
+	if (e->gen==DMN_PENDING) return;
+	e->dev = r->dev;
+	e->ino = r->ino;
+	e->gen = r->gen;
+	e->rtn = r->rtn;
+	e->meta = r->meta;
+	if (r->rtn) fsfr_meta_init(&e->meta);
+}
+
+/****************************************************************
+ *  Lookup and update
+ ****************************************************************/
+int fsfr_daemon_get(dev_t dev, ino_t ino, struct fsfr_meta *m)
+{
+	struct fsfr_daemon_msg req;
+	int rtn = -1;
+	pthread_mutex_lock(&dmn_lock);
+	if (fsfr_dmn_cached(dev,ino,m)) {
+		rtn = fsfr_meta_isempty(m)?-1:0;
+		pthread_mutex_unlock(&dmn_lock);
+		FSFR_STATS_COUNT(HIT,1);
+		return rtn;
+	}
+	FSFR_STATS_COUNT(MISS,1);
+	fsfr_meta_init(m);
+	memset(&req,0,sizeof(req));
+	req.op = FSFR_DAEMON_GET;
+	req.dev = dev;
+	req.ino = ino;
+	// whatever is queued goes out ahead of the question
+	if (dmn_nout==DMN_BATCH) fsfr_dmn_flush_locked();
+	dmn_out[dmn_nout++] = req;
+	if (fsfr_dmn_flush_locked()==0) {
+		if (fsfr_dmn_recv(&req,sizeof(req)) || req.op!=FSFR_DAEMON_GET) {
+			fsfr_dmn_fail();
+		} else {
+			dmn_unfenced = 0;
+			fsfr_dmn_remember(&req);
+			if (!req.rtn) {
+				*m = req.meta;
+				rtn = fsfr_meta_isempty(m)?-1:0;
+			}
+		}
+	}
+	pthread_mutex_unlock(&dmn_lock);
+	return rtn;
+}
+
+int fsfr_daemon_put(dev_t dev, ino_t ino, const struct fsfr_meta *m)
+{
+	int rtn = 0;
+	pthread_mutex_lock(&dmn_lock);
+	if (dmn_fd==-1 && fsfr_dmn_connect()) {
+		rtn = -errno;
+		fsfr_dmn_fail();
+		pthread_mutex_unlock(&dmn_lock);
+		return rtn;
+	}
+	struct fsfr_dmn_entry *e = fsfr_dmn_slot(dev,ino);
+	// an unsent change being evicted has to go out first, and without
+	// this one, which stays pending until the flush that sends it
+	if (e->gen==DMN_PENDING && (e->dev!=dev || e->ino!=ino)) {
+		if (fsfr_dmn_flush_locked()) rtn = -errno;
+	}
+
+	struct fsfr_daemon_msg *req = &dmn_out[dmn_nout++];
+	memset(req,0,sizeof(*req));
+	req->op = FSFR_DAEMON_PUT;
+	req->dev = dev;
+	req->ino = ino;
+	req->meta = *m;
+	req->meta.version = FSFR_META_VERSION;
+	e->dev = dev;
+	e->ino = ino;
+	e->gen = DMN_PENDING;
+	e->meta = *m;
+	e->rtn = fsfr_meta_isempty(m)?-1:0;
+	if (dmn_nout==DMN_BATCH && fsfr_dmn_flush_locked()) rtn = -errno;
+	pthread_mutex_unlock(&dmn_lock);
+	return rtn;
+}
+
+// Looks up every entry the cache doesn't already have, with all the
+// questions in one write and the answers read back after.
+void fsfr_daemon_prefetch(const struct stat *st, int n)
+{
+	struct fsfr_daemon_msg req[DMN_BATCH];
+	struct fsfr_meta m;
+	int i, k = 0;
+	pthread_mutex_lock(&dmn_lock);
+	if (fsfr_dmn_flush_locked()) goto out;
+	for (i=0; i<n && k<DMN_BATCH; i++) {
+		if (fsfr_dmn_cached(st[i].st_dev,st[i].st_ino,&m)) continue;
+		memset(&req[k],0,sizeof(req[k]));
+		req[k].op = FSFR_DAEMON_GET;
+		req[k].dev = st[i].st_dev;
+		req[k].ino = st[i].st_ino;
+		k++;
+	}
+	if (!k) goto out;
+	if (fsfr_dmn_connect() || fsfr_dmn_send(req,k*sizeof(*req))
+			|| fsfr_dmn_recv(req,k*sizeof(*req))) {
+		fsfr_dmn_fail();
+		goto out;
+	}
+	dmn_unfenced = 0;
+	for (i=0; i<k; i++) fsfr_dmn_remember(&req[i]);
+out:
+	pthread_mutex_unlock(&dmn_lock);
+}
+
+void fsfr_daemon_flush(void)
+{
+	if (!dmn_path) return;
+	pthread_mutex_lock(&dmn_lock);
+	fsfr_dmn_sync_locked();
+	pthread_mutex_unlock(&dmn_lock);
+}
+
+// The tools work on extended attributes. Through the library they'd
+// reach the daemon for symlinks alone, so they don't run with it set.
+int fsfr_daemon_refuse(const char *prog)
+{
+	if (!fsfr_daemon_on()) return 0;
+	fprintf(stderr,"%s: FSFR_DAEMON is set; this works on extended attributes only\n",prog);
+	return -1;
+}
+
+static void __attribute__((destructor)) fsfr_dmn_fini(void)
+{
+	fsfr_daemon_flush();
+}
+
+// nothing is queued across fork(), and the child gets its own
+// connection, or the answers would go to whoever reads first
+static void fsfr_dmn_atfork_prepare(void)
+{
+	pthread_mutex_lock(&dmn_lock);
+	fsfr_dmn_sync_locked();
+}
+static void fsfr_dmn_atfork_parent(void)
+{
+	pthread_mutex_unlock(&dmn_lock);
+}
+static void fsfr_dmn_atfork_child(void)
+{
+	fsfr_dmn_drop();
+	pthread_mutex_init(&dmn_lock,NULL);
+}
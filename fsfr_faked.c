@@ -0,0 +1,484 @@
+/*
+ * fsfr_faked.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+/****************************************************************
+ *  fsfr-faked
+ *  	Keeps fake metadata in memory for processes running with
+ *  	FSFR_DAEMON pointing at its socket (see fsfr_daemon.c), for
+ *  	filesystems that can't hold it in extended attributes. A
+ *  	single thread serves every client with poll(); requests are
+ *  	handled in the order they arrive on each connection, so a
+ *  	client may send any number of them before reading answers,
+ *  	but in no particular order across connections; a client that
+ *  	needs its changes seen elsewhere sends a FENCE and waits.
+ *
+ *  	The table is an open-addressing hash on (dev, ino), grown as
+ *  	needed. With -s it is loaded from a snapshot at startup and
+ *  	written back (to a temporary file, then renamed over it)
+ *  	every -t seconds if anything changed, on SIGHUP, on a SYNC
+ *  	request and on the way out (SIGINT, SIGTERM).
+ ****************************************************************/
+
+#include "fsfr.h"
+#include <stdlib.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define FAKED_MAXCLIENTS 1024
+#define FAKED_INTERVAL 30	// seconds between snapshots
+#define FAKED_IN 8192		// per client, bytes read at a time
+#define SNAP_MAGIC 0x314e535246534631ULL	// "1FSFRSN1"
+
+struct faked_slot {
+	uint64_t dev, ino;
+	struct fsfr_meta meta;
+	int used;
+};
+
+struct faked_client {
+	int fd;
+	char in[FAKED_IN];
+	size_t inlen;
+	char *out;
+	size_t outlen, outcap;
+};
+
+struct snap_header {
+	uint64_t magic;
+	uint64_t count;
+};
+
+struct snap_entry {
+	uint64_t dev, ino;
+	struct fsfr_meta meta;
+};
+
+static struct faked_slot *table = NULL;
+static size_t table_size = 0, table_used = 0;
+static volatile uint64_t *gen = NULL;
+static const char *snap_path = NULL;
+static int dirty = 0;
+static volatile sig_atomic_t got_signal = 0;
+
+static void *faked_alloc(size_t size)
+{
+	void *p = calloc(1,size);
+	if (!p) {
+		perror("fsfr-faked");
+		exit(1);
+	}
+	return p;
+}
+
+/****************************************************************
+ *  Table
+ ****************************************************************/
+static inline size_t faked_hash(uint64_t dev, uint64_t ino)
+{
+	uint64_t h = (dev * 0x9e3779b97f4a7c15ULL) ^ ino;
+	h *= 0xff51afd7ed558ccdULL;
+	return (size_t)(h ^ (h >> 32));
+}
+
+static struct faked_slot *faked_find(uint64_t dev, uint64_t ino)
+{
+	size_t i = faked_hash(dev,ino) & (table_size-1);
+	while (table[i].used && (table[i].dev!=dev || table[i].ino!=ino))
+		i = (i+1) & (table_size-1);
+	return &table[i];
+}
+
+static void faked_grow(void)
+{
+	struct faked_slot *old = table;
+	size_t i, oldsize = table_size;
+	table_size = table_size ? 2*table_size : 65536;
+	table = faked_alloc(table_size*sizeof(*table));
+	for (i=0; i<oldsize; i++)
+		if (old[i].used) *faked_find(old[i].dev,old[i].ino) = old[i];
+	free(old);
+}
+
+// an empty record removes the entry; later ones in its probe chain
+// move up so that nothing needs a tombstone
+static void faked_put(uint64_t dev, uint64_t ino, const struct fsfr_meta *m)
+{
+	struct faked_slot *s = faked_find(dev,ino);
+	if (!fsfr_meta_isempty(m)) {
+		if (!s->used) {
+			if (2*(table_used+1) > table_size) {
+				faked_grow();
+				s = faked_find(dev,ino);
+			}
+			s->used = 1;
+			s->dev = dev;
+			s->ino = ino;
+			table_used++;
+		}
+		s->meta = *m;
+	} else if (s->used) {
+		size_t i = s-table, j = i;
+		for (;;) {
+			j = (j+1) & (table_size-1);
+			if (!table[j].used) break;
+			size_t k = faked_hash(table[j].dev,table[j].ino) & (table_size-1);
+			// can j's entry live at i? only if i lies between k and j
+			if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+				table[i] = table[j];
+				i = j;
+			}
+		}
+		table[i].used = 0;
+		table_used--;
+	} else {
+		return;
+	}
+	dirty = 1;
+	__atomic_add_fetch(gen,1,__ATOMIC_RELEASE);
+}
+
+/****************************************************************
+ *  Snapshots
+ ****************************************************************/
+static int snap_load(void)
+{
+	struct snap_header h;
+	struct snap_entry e;
+	uint64_t i;
+	FILE *f = fopen(snap_path,"r");
+	if (!f) return errno==ENOENT ? 0 : -1;
+	if (fread(&h,sizeof(h),1,f)!=1 || h.magic!=SNAP_MAGIC) {
+		fprintf(stderr,"fsfr-faked: %s is not a snapshot\n",snap_path);
+		fclose(f);
+		return -1;
+	}
+	for (i=0; i<h.count; i++) {
+		if (fread(&e,sizeof(e),1,f)!=1) {
+			fprintf(stderr,"fsfr-faked: %s: truncated\n",snap_path);
+			fclose(f);
+			return -1;
+		}
+		faked_put(e.dev,e.ino,&e.meta);
+	}
+	fclose(f);
+	dirty = 0;
+	return 0;
+}
+
+static int snap_write(void)
+{
+	struct snap_header h = { SNAP_MAGIC, table_used };
+	struct snap_entry e;
+	size_t i;
+	if (!snap_path || !dirty) return 0;
+	size_t len = strlen(snap_path);
+	char *tmp = faked_alloc(len+5);
+	memcpy(tmp,snap_path,len);
+	strcpy(tmp+len,".tmp");
+	FILE *f = fopen(tmp,"w");
+	if (!f) goto fail;
+	fwrite(&h,sizeof(h),1,f);
+	for (i=0; i<table_size; i++) {
+		if (!table[i].used) continue;
+		e.dev = table[i].dev;
+		e.ino = table[i].ino;
+		e.meta = table[i].meta;
+		fwrite(&e,sizeof(e),1,f);
+	}
+	if (fflush(f) || fsync(fileno(f))) {
+		fclose(f);
+		goto fail;
+	}
+	if (fclose(f) || rename(tmp,snap_path)) goto fail;
+	free(tmp);
+	dirty = 0;
+	return 0;
+fail:
+	perror(tmp);
+	unlink(tmp);
+	free(tmp);
+	return -1;
+}
+
+/****************************************************************
+ *  Clients
+ ****************************************************************/
+static void client_reply(struct faked_client *c, const struct fsfr_daemon_msg *msg)
+{
+	if (c->outlen + sizeof(*msg) > c->outcap) {
+		c->outcap = c->outcap ? 2*c->outcap : 16*sizeof(*msg);
+		c->out = realloc(c->out,c->outcap);
+		if (!c->out) {
+			perror("fsfr-faked");
+			exit(1);
+		}
+	}
+	memcpy(c->out+c->outlen,msg,sizeof(*msg));
+	c->outlen += sizeof(*msg);
+}
+
+static void client_handle(struct faked_client *c, struct fsfr_daemon_msg *msg)
+{
+	struct faked_slot *s;
+	switch (msg->op) {
+	case FSFR_DAEMON_GET:
+		s = faked_find(msg->dev,msg->ino);
+		if (s->used) {
+			msg->meta = s->meta;
+			msg->rtn = 0;
+		} else {
+			fsfr_meta_init(&msg->meta);
+			msg->rtn = -1;
+		}
+		msg->gen = __atomic_load_n(gen,__ATOMIC_ACQUIRE);
+		client_reply(c,msg);
+		break;
+	case FSFR_DAEMON_PUT:
+		faked_put(msg->dev,msg->ino,&msg->meta);
+		break;
+	case FSFR_DAEMON_SYNC:
+		msg->rtn = snap_write() ? -EIO : 0;
+		msg->gen = __atomic_load_n(gen,__ATOMIC_ACQUIRE);
+		client_reply(c,msg);
+		break;
+	case FSFR_DAEMON_FENCE:
+		msg->rtn = 0;
+		msg->gen = __atomic_load_n(gen,__ATOMIC_ACQUIRE);
+		client_reply(c,msg);
+		break;
+	}
+}
+
+// 0 while the connection is worth keeping
+static int client_read(struct faked_client *c)
+{
+	ssize_t n = recv(c->fd,c->in+c->inlen,sizeof(c->in)-c->inlen,MSG_DONTWAIT);
+	if (n==-1) return errno==EINTR || errno==EAGAIN ? 0 : -1;
+	if (!n) return -1;
+	c->inlen += n;
+	size_t off = 0;
+	while (c->inlen-off >= sizeof(struct fsfr_daemon_msg)) {
+		struct fsfr_daemon_msg msg;
+		memcpy(&msg,c->in+off,sizeof(msg));
+		client_handle(c,&msg);
+		off += sizeof(msg);
+	}
+	memmove(c->in,c->in+off,c->inlen-off);
+	c->inlen -= off;
+	return 0;
+}
+
+static int client_write(struct faked_client *c)
+{
+	ssize_t n = send(c->fd,c->out,c->outlen,MSG_DONTWAIT|MSG_NOSIGNAL);
+	if (n==-1) return errno==EINTR || errno==EAGAIN ? 0 : -1;
+	memmove(c->out,c->out+n,c->outlen-n);
+	c->outlen -= n;
+	return 0;
+}
+
+// greets a new client with the change counter
+static int client_hello(int fd, int genfd)
+{
+	struct fsfr_daemon_msg hello;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { &hello, sizeof(hello) };
+	struct msghdr mh;
+	memset(&hello,0,sizeof(hello));
+	hello.op = FSFR_DAEMON_HELLO;
+	hello.gen = *gen;
+	memset(&mh,0,sizeof(mh));
+	memset(cbuf,0,sizeof(cbuf));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm),&genfd,sizeof(int));
+	return sendmsg(fd,&mh,MSG_NOSIGNAL)==sizeof(hello) ? 0 : -1;
+}
+
+/****************************************************************
+ *  Setup
+ ****************************************************************/
+static void on_signal(int sig)
+{
+	got_signal = sig;
+}
+
+// a socket file left behind by a daemon that's gone is reused
+static int faked_listen(const char *path)
+{
+	struct sockaddr_un sa;
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&sa,0,sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path,path);
+	int fd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+	if (fd==-1) return -1;
+	if (bind(fd,(struct sockaddr *)&sa,sizeof(sa)) && errno==EADDRINUSE) {
+		int probe = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+		if (probe!=-1 && connect(probe,(struct sockaddr *)&sa,sizeof(sa)) && errno==ECONNREFUSED)
+			unlink(path);
+		if (probe!=-1) close(probe);
+		if (bind(fd,(struct sockaddr *)&sa,sizeof(sa))) {
+			close(fd);
+			errno = EADDRINUSE;
+			return -1;
+		}
+	}
+	if (listen(fd,128)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,"usage: %s [-f] [-s snapshot] [-t seconds] <socket>\n",name);
+	fprintf(stderr,"  Serves fake metadata to processes started with FSFR_DAEMON=<socket>.\n");
+	fprintf(stderr,"  -f: stay in the foreground\n");
+	fprintf(stderr,"  -s: load from and save to this file\n");
+	fprintf(stderr,"  -t: seconds between saves, if anything changed (default %i)\n",FAKED_INTERVAL);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static struct faked_client *clients[FAKED_MAXCLIENTS];
+	static struct pollfd pfd[FAKED_MAXCLIENTS+1];
+	int foreground = 0, interval = FAKED_INTERVAL;
+	int opt, i, nclients = 0;
+	while ((opt = getopt(argc,argv,"fs:t:")) != -1) {
+		switch (opt) {
+		case 'f': foreground = 1; break;
+		case 's': snap_path = optarg; break;
+		case 't': interval = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind+1 != argc || interval < 1) usage(argv[0]);
+	const char *sock = argv[optind];
+
+	int genfd = memfd_create("fsfr-faked",MFD_CLOEXEC);
+	if (genfd==-1 || ftruncate(genfd,sizeof(uint64_t))) {
+		perror("memfd_create");
+		return 1;
+	}
+	gen = mmap(NULL,sizeof(uint64_t),PROT_READ|PROT_WRITE,MAP_SHARED,genfd,0);
+	if (gen==MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	*gen = 1;	// clients take 0 for "never"
+	faked_grow();
+	if (snap_path && snap_load()) {
+		if (errno) perror(snap_path);
+		return 1;
+	}
+	int lfd = faked_listen(sock);
+	if (lfd==-1) {
+		perror(sock);
+		return 1;
+	}
+
+	// only block the signals we handle; ppoll() lets them in
+	sigset_t block, none;
+	struct sigaction sa;
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigemptyset(&block);
+	sigaddset(&block,SIGINT);
+	sigaddset(&block,SIGTERM);
+	sigaddset(&block,SIGHUP);
+	sigprocmask(SIG_BLOCK,&block,&none);
+	sigaction(SIGINT,&sa,NULL);
+	sigaction(SIGTERM,&sa,NULL);
+	sigaction(SIGHUP,&sa,NULL);
+	signal(SIGPIPE,SIG_IGN);
+
+	// the socket is ready before whoever started us goes on
+	if (!foreground) {
+		pid_t pid = fork();
+		if (pid==-1) {
+			perror("fork");
+			return 1;
+		}
+		if (pid) return 0;
+		setsid();
+		int null = open("/dev/null",O_RDWR);
+		if (null!=-1) {
+			dup2(null,0);
+			dup2(null,1);
+			if (null>2) close(null);
+		}
+	}
+
+	for (;;) {
+		struct timespec ts = { interval, 0 };
+		pfd[0].fd = lfd;
+		pfd[0].events = nclients < FAKED_MAXCLIENTS ? POLLIN : 0;
+		for (i=0; i<nclients; i++) {
+			pfd[i+1].fd = clients[i]->fd;
+			pfd[i+1].events = POLLIN | (clients[i]->outlen ? POLLOUT : 0);
+		}
+		int n = ppoll(pfd,nclients+1,dirty && snap_path ? &ts : NULL,&none);
+		if (got_signal) {
+			if (got_signal!=SIGHUP) break;
+			got_signal = 0;
+			snap_write();
+			continue;
+		}
+		if (n==-1) {
+			if (errno==EINTR) continue;
+			perror("poll");
+			break;
+		}
+		if (!n) {
+			snap_write();
+			continue;
+		}
+		for (i=nclients-1; i>=0; i--) {
+			struct faked_client *c = clients[i];
+			int bad = pfd[i+1].revents & (POLLERR|POLLNVAL);
+			if (!bad && (pfd[i+1].revents & (POLLIN|POLLHUP))) bad = client_read(c);
+			if (!bad && c->outlen) bad = client_write(c);
+			if (bad) {
+				close(c->fd);
+				free(c->out);
+				free(c);
+				clients[i] = clients[--nclients];
+			}
+		}
+		if (pfd[0].revents & POLLIN) {
+			int fd = accept4(lfd,NULL,NULL,SOCK_CLOEXEC);
+			if (fd==-1) continue;
+			if (client_hello(fd,genfd)) {
+				close(fd);
+				continue;
+			}
+			struct faked_client *c = faked_alloc(sizeof(*c));
+			c->fd = fd;
+			clients[nclients++] = c;
+		}
+	}
+	unlink(sock);
+	return snap_write() ? 1 : 0;
+}
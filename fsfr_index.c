@@ -0,0 +1,289 @@
+/*
+ * fsfr_index.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+#include "fsfr.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/****************************************************************
+ *  Base index
+ *  	A read-only layer under the attributes: FSFR_INDEX names a
+ *  	file written by fsfr-export -f index, holding the fake mode,
+ *  	owner and device number of every path in a tree. A file with
+ *  	no metadata of its own takes what the index has for it; any
+ *  	change is written to the file's attributes as usual and
+ *  	hides the index entry from then on.
+ *
+ *  	Entries are sorted by path, relative to the indexed root,
+ *  	and a second table orders them by (dev, ino). Inode lookups
+ *  	cost nothing and are used while the indexed tree is the
+ *  	one in use; an inode number can be reused once its file is
+ *  	gone, so a hit also needs the ctime the file was indexed
+ *  	with, or failing that its birth time. FSFR_INDEX_ROOT moves
+ *  	the index onto another root (a fresh extraction of the same
+ *  	image, say), and then only paths count, which costs a
+ *  	readlink() or getcwd().
+ *
+ *  	A path is only a name, so an entry found by path is only
+ *  	taken by a file that already is what it says, short of the
+ *  	u+rw that the real file needs: the same type, permissions
+ *  	and owner (FSFR_IMPLICIT counted). Something renamed or
+ *  	created there that isn't gets nothing from the entry. A new
+ *  	file the entry does fit is left unstamped, and a chown() or
+ *  	chmod() to what the index says already writes nothing, so
+ *  	unpacking the image the index was made from under
+ *  	FSFR_IMPLICIT writes hardly any metadata at all.
+ ****************************************************************/
+
+static const struct fsfr_index_header *index_hdr = NULL;
+static const struct fsfr_index_entry *index_ents = NULL;
+static const uint32_t *index_byino = NULL;
+static const char *index_strings = NULL;
+static char index_root[PATH_MAX];
+static size_t index_rootlen = 0;
+static int index_useino = 0;
+static struct fsfr_implicit index_imp;
+
+static void fsfr_index_attach(void)
+{
+	char *path = getenv("FSFR_INDEX");
+	char *root = getenv("FSFR_INDEX_ROOT");
+	struct stat st;
+	if (!path || !*path) return;
+	int fd = fsfr_base_open(path,O_RDONLY|O_CLOEXEC,0);
+	if (fd==-1) return;
+	if (fsfr_base_fstat(fd,&st) || st.st_size < sizeof(struct fsfr_index_header)) {
+		fsfr_real.close(fd);
+		return;
+	}
+	void *map = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	fsfr_real.close(fd);
+	if (map==MAP_FAILED) return;
+	const struct fsfr_index_header *h = map;
+	uint64_t count = h->count;
+	// a file that isn't what it says is ignored, not trusted
+	if (h->magic!=FSFR_INDEX_MAGIC || h->size!=st.st_size
+			|| h->entries + count*sizeof(struct fsfr_index_entry) > st.st_size
+			|| h->byino + count*sizeof(uint32_t) > st.st_size
+			|| h->strings > st.st_size || !memchr(h->root,'\0',sizeof(h->root))
+			|| ((const char *)map)[st.st_size-1]!='\0') {
+		munmap(map,st.st_size);
+		return;
+	}
+	index_useino = !root || !*root || !strcmp(root,h->root);
+	if (!root || !*root) root = (char *)h->root;
+	index_rootlen = strlen(root);
+	while (index_rootlen > 1 && root[index_rootlen-1]=='/') index_rootlen--;
+	if (index_rootlen >= sizeof(index_root)) {
+		munmap(map,st.st_size);
+		return;
+	}
+	memcpy(index_root,root,index_rootlen);
+	index_root[index_rootlen] = '\0';
+	if (index_rootlen==1) index_rootlen = 0;	// "/": every absolute path
+	index_ents = (const void *)((const char *)map + h->entries);
+	index_byino = (const void *)((const char *)map + h->byino);
+	index_strings = (const char *)map + h->strings;
+	fsfr_implicit_load(&index_imp);
+	index_hdr = h;
+}
+
+int fsfr_index_on(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once,fsfr_index_attach);
+	return index_hdr!=NULL;
+}
+
+static const struct fsfr_index_entry *fsfr_index_byino(dev_t dev, ino_t ino)
+{
+	size_t lo = 0, hi = index_hdr->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi-lo)/2;
+		const struct fsfr_index_entry *e = &index_ents[index_byino[mid]];
+		if (e->dev==dev && e->ino==ino) return e;
+		if (e->dev < dev || (e->dev==dev && e->ino < ino)) lo = mid+1;
+		else hi = mid;
+	}
+	return NULL;
+}
+
+static const struct fsfr_index_entry *fsfr_index_bypath(const char *rel)
+{
+	size_t lo = 0, hi = index_hdr->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi-lo)/2;
+		const struct fsfr_index_entry *e = &index_ents[mid];
+		int cmp = strcmp(index_strings+e->path,rel);
+		if (!cmp) return e;
+		if (cmp < 0) lo = mid+1;
+		else hi = mid;
+	}
+	return NULL;
+}
+
+// Absolute path of pathname in dirfd (or of dirfd itself, if pathname
+// is NULL), with "." and ".." taken out the way the shell would; the
+// "/proc/self/fd/N/..." paths made for the *at() calls count as N.
+// Returns the path relative to the index root, or NULL if it's not
+// under it.
+static const char *fsfr_index_relpath(int dirfd, const char *pathname, char *buf)
+{
+	char raw[2*PATH_MAX];
+	size_t len = 0;
+	if (pathname && !strncmp(pathname,"/proc/self/fd/",14)) {
+		char *end;
+		dirfd = strtol(pathname+14,&end,10);
+		pathname = *end=='/' ? end+1 : *end ? NULL : "";
+		if (!pathname) return NULL;
+	}
+	if (!pathname || pathname[0]!='/') {
+		if (dirfd==AT_FDCWD) {
+			if (syscall(SYS_getcwd,raw,PATH_MAX)<0) return NULL;
+			len = strlen(raw);
+		} else {
+			char link[32];
+			snprintf(link,sizeof(link),"/proc/self/fd/%i",dirfd);
+			ssize_t n = readlink(link,raw,PATH_MAX-1);
+			if (n<=0 || raw[0]!='/') return NULL;
+			len = n;
+		}
+		raw[len++] = '/';
+	}
+	if (pathname) {
+		size_t plen = strlen(pathname);
+		if (len + plen >= sizeof(raw)) return NULL;
+		memcpy(raw+len,pathname,plen);
+		len += plen;
+	}
+	raw[len] = '\0';
+
+	// lexical clean-up, component by component, into buf
+	size_t out = 0;
+	char *p = raw;
+	while (*p) {
+		while (*p=='/') p++;
+		char *comp = p;
+		while (*p && *p!='/') p++;
+		size_t clen = p-comp;
+		if (!clen || (clen==1 && comp[0]=='.')) continue;
+		if (clen==2 && comp[0]=='.' && comp[1]=='.') {
+			while (out && buf[out-1]!='/') out--;
+			if (out) out--;
+			continue;
+		}
+		if (out + clen + 2 > PATH_MAX) return NULL;
+		buf[out++] = '/';
+		memcpy(buf+out,comp,clen);
+		out += clen;
+	}
+	if (!out) buf[out++] = '/';
+	buf[out] = '\0';
+
+	if (strncmp(buf,index_root,index_rootlen)) return NULL;
+	if (!buf[index_rootlen]) return "";
+	if (buf[index_rootlen]!='/') return NULL;
+	return buf+index_rootlen+1;
+}
+
+// Is e, found by inode number, still the file it was indexed as?
+static int fsfr_index_samefile(const struct fsfr_index_entry *e, int dirfd,
+		const char *pathname, const struct fsfr_index_key *k)
+{
+	struct statx stx;
+	if (e->ctime==k->ctime.tv_sec && e->ctime_nsec==k->ctime.tv_nsec) return 1;
+	// changed since, which the birth time survives; costs a statx()
+	if (!e->btime && !e->btime_nsec) return 0;
+	int flags = S_ISLNK(k->mode) ? AT_SYMLINK_NOFOLLOW : 0;
+	if (!pathname || !*pathname) {
+		pathname = "";
+		flags |= AT_EMPTY_PATH;
+	}
+	if (fsfr_base_statx(dirfd,pathname,flags,STATX_BTIME,&stx) || !(stx.stx_mask & STATX_BTIME)
+			|| stx.stx_ino!=k->ino)
+		return 0;
+	return e->btime==stx.stx_btime.tv_sec && e->btime_nsec==stx.stx_btime.tv_nsec;
+}
+
+// Does e, found by path, fit the file there as it is without it?
+static int fsfr_index_fits(const struct fsfr_index_entry *e, const struct fsfr_index_key *k)
+{
+	uid_t uid = k->uid;
+	gid_t gid = k->gid;
+	if (index_imp.on && uid==index_imp.real_uid) uid = index_imp.uid;
+	if (index_imp.on && gid==index_imp.real_gid) gid = index_imp.gid;
+	// a plain file may stand in for a node
+	if ((e->mode & S_IFMT)!=(k->mode & S_IFMT) && !(S_ISREG(k->mode)
+			&& !S_ISREG(e->mode) && !S_ISDIR(e->mode) && !S_ISLNK(e->mode)))
+		return 0;
+	// what the real file needs to be usable, see fsfr_chmod_meta
+	mode_t req = S_ISDIR(k->mode) ? 0700 : S_ISREG(k->mode) ? 0600 : 0;
+	return (k->mode & 07777)==((e->mode & 07777) | (k->mode & req))
+		&& e->uid==uid && e->gid==gid;
+}
+
+// Fills m with what the index has for the file (the record it would
+// need to look that way) and returns 0, or returns -1 if it has
+// nothing that is this file's.
+int fsfr_index_get(int dirfd, const char *pathname, const struct fsfr_index_key *k,
+		struct fsfr_meta *m)
+{
+	const struct fsfr_index_entry *e = NULL;
+	char buf[PATH_MAX];
+	fsfr_meta_init(m);
+	if (!fsfr_index_on()) return -1;
+	if (index_useino) {
+		e = fsfr_index_byino(k->dev,k->ino);
+		if (e && !fsfr_index_samefile(e,dirfd,pathname,k)) e = NULL;
+	}
+	if (!e) {
+		const char *rel = fsfr_index_relpath(dirfd,pathname,buf);
+		if (rel) e = fsfr_index_bypath(rel);
+		if (e && !fsfr_index_fits(e,k)) e = NULL;
+	}
+	// a path that led through a symlink to something else
+	if (!e || S_ISLNK(e->mode)!=S_ISLNK(k->mode) || S_ISDIR(e->mode)!=S_ISDIR(k->mode))
+		return -1;
+
+	// only the bits that differ; a plain file may stand in for a node
+	mode_t diff = (k->mode ^ e->mode) & (S_IFMT|07777);
+	if (!S_ISREG(k->mode)) diff &= ~S_IFMT;
+	if (diff) {
+		m->mode = e->mode;
+		m->modemask = diff;
+	}
+	m->uid = e->uid;
+	m->gid = e->gid;
+	m->version = FSFR_META_INDEX;
+	if ((S_ISCHR(e->mode) || S_ISBLK(e->mode)) && (e->rdev!=k->rdev || (diff & S_IFMT)))
+		m->rdev = e->rdev;
+	return 0;
+}
+
+// For something just created (st) that is about to be stamped with
+// m: returns 1 if the index already shows it that way, so there's
+// nothing to write. If the index would show it some other way, an
+// empty m gets its owner filled in, so that writing it hides the
+// entry.
+int fsfr_index_stamp(int dirfd, const char *pathname, const struct stat *st,
+		struct fsfr_meta *m)
+{
+	struct fsfr_meta idx;
+	if (fsfr_index_get(dirfd,pathname,&FSFR_INDEX_KEY(st),&idx)) return 0;
+	if (fsfr_meta_unchanged(&idx,st,m,st,&index_imp)) return 1;
+	if (fsfr_meta_isempty(m)) {
+		m->uid = index_imp.on && st->st_uid==index_imp.real_uid ? index_imp.uid : st->st_uid;
+		m->gid = index_imp.on && st->st_gid==index_imp.real_gid ? index_imp.gid : st->st_gid;
+	}
+	return 0;
+}
@@ -10,67 +10,47 @@
 
 #include "fsfr.h"
 
-#include <dlfcn.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
 
 /****************************************************************
  *  Internal helper functions
  ****************************************************************/
 
-// fetch the "real" syscall for the provided function
-void * fsfr_dlnext(const char *sym) {
-	//fprintf(stderr,"LOADING %s\n",sym);
-	void * rtn = dlsym(RTLD_NEXT,sym);
-	//fprintf(stderr,"SYM %s: %llu\n",sym,(long long unsigned int)rtn);
-	if (NULL==rtn) {
-		const char *err = dlerror();
-		if (err) {
-			fprintf(stderr,"Failed loading %s: %s\n",sym,dlerror());
-		} else {
-			//retry, but with "default" symbol instead
-			rtn = dlsym(RTLD_DEFAULT,sym);
-			if (NULL==rtn) fprintf(stderr,"Failed loading %s: (unknown error)\n",sym);
-		}
-		// not sure what would be a good generic error, since dlsym doesn't set errno
-		if (NULL==rtn) {
-			//fprintf(stderr,"Failed to load %s.",sym);
-			errno = EINVAL;
-		}
-	}
-	return rtn;
+// path of the proxy file standing in for the given symlink inode
+int fsfr_proxypath(int64_t inode, char *fpath, size_t len)
+{
+	static char *proxy_dir = (char *)-1;
+	if (proxy_dir==(char *)-1) proxy_dir = getenv("FSFR_PROXY_DIR");
+	if (!proxy_dir) return -1;
+	snprintf(fpath,len,"%s/%lli.fsfr",proxy_dir,(long long int) inode);
+	return 0;
 }
-
-
 int fsfr_proxygetxattr_int(int64_t inode, const char *name)
 {
-	char *proxy_dir = getenv("FSFR_PROXY_DIR");
-	if (!proxy_dir) return -1;
 	char fpath[PATH_MAX];
-	snprintf(fpath,PATH_MAX,"%s/%lli.fsfr",proxy_dir,(long long int) inode);
+	if (fsfr_proxypath(inode,fpath,PATH_MAX)) return -1;
 	return fsfr_getxattr_int(fpath,name);
 }
 int fsfr_proxysetxattr_int(int64_t inode, const char *name, int64_t val)
 {
-	char *proxy_dir = getenv("FSFR_PROXY_DIR");
-	if (!proxy_dir) return 0;
+	char fpath[PATH_MAX];
+	if (fsfr_proxypath(inode,fpath,PATH_MAX)) return 0;
 	// fails silently if FSFR_PROXY_DIR is unset, as this extension
 	// is optional. This is a judgement call; if you don't like it, change
 	// 0 to -1 above.
-	char fpath[PATH_MAX];
-	snprintf(fpath,PATH_MAX,"%s/%lli.fsfr",proxy_dir,(long long int) inode);
 	struct stat st;
 	if (fsfr_base_stat(fpath,&st)) {
-		fsfr_base_open(fpath,O_WRONLY|O_CREAT|O_TRUNC,0644);
+		int fd = fsfr_base_open(fpath,O_WRONLY|O_CREAT|O_TRUNC,0644);
+		if (fd!=-1) close(fd);
 	}
 	return fsfr_setxattr_int(fpath,name,val);
 }
 int fsfr_proxyunsetxattr_int(int64_t inode, const char *name)
 {
-	char *proxy_dir = getenv("FSFR_PROXY_DIR");
-	if (!proxy_dir) return 0;
-	// Also fails silently. See note in fsfr_proxysetxattr_int
 	char fpath[PATH_MAX];
-	snprintf(fpath,PATH_MAX,"%s/%lli.fsfr",proxy_dir,(long long int) inode);
+	if (fsfr_proxypath(inode,fpath,PATH_MAX)) return 0;
+	// Also fails silently. See note in fsfr_proxysetxattr_int
 	return fsfr_unset_attr(fpath,name);
 }
 
@@ -79,46 +59,46 @@ int fsfr_proxyunsetxattr_int(int64_t inode, const char *name)
 int fsfr_getxattr_int(const char *fpath, const char *name)
 {
 	int64_t rtn = -1;
-	if (getxattr(fpath,name,&rtn,sizeof(rtn))>0) return (int) rtn;
+	if (FSFR_XATTR(get,fpath,-1,name,getxattr(fpath,name,&rtn,sizeof(rtn)))>0) return (int) rtn;
 	return -1;
 }
 int fsfr_lgetxattr_int(const char *fpath, const char *name)
 {
 	int64_t rtn = -1;
-	if (lgetxattr(fpath,name,&rtn,sizeof(rtn))>0) return (int) rtn;
+	if (FSFR_XATTR(get,fpath,-1,name,lgetxattr(fpath,name,&rtn,sizeof(rtn)))>0) return (int) rtn;
 	return -1;
 }
 int fsfr_fgetxattr_int(int fd, const char *name)
 {
 	int64_t rtn = -1;
-	if (fgetxattr(fd,name,&rtn,sizeof(rtn))>0) return (int) rtn;
+	if (FSFR_XATTR(get,NULL,fd,name,fgetxattr(fd,name,&rtn,sizeof(rtn)))>0) return (int) rtn;
 	return -1;
 }
 int fsfr_setxattr_int(const char *fpath, const char* name, int64_t val)
 {
 	//fprintf(stderr,"%s: 0x%llx 0%llo\n",name,val,val);
-	return setxattr(fpath,name,&val,sizeof(val),0)?-errno:0;
+	return FSFR_XATTR(set,fpath,-1,name,setxattr(fpath,name,&val,sizeof(val),0))?-errno:0;
 }
 int fsfr_fsetxattr_int(int fd, const char* name, int64_t val)
 {
 	//fprintf(stderr,"%s: 0x%llx 0%llo\n",name,val,val);
-	return fsetxattr(fd,name,&val,sizeof(val),0)?-errno:0;
+	return FSFR_XATTR(set,NULL,fd,name,fsetxattr(fd,name,&val,sizeof(val),0))?-errno:0;
 }
 int fsfr_lsetxattr_int(const char *fpath, const char* name, int64_t val)
 {
-	return lsetxattr(fpath,name,&val,sizeof(val),0)?-errno:0;
+	return FSFR_XATTR(set,fpath,-1,name,lsetxattr(fpath,name,&val,sizeof(val),0))?-errno:0;
 }
 int fsfr_unset_attr(const char *fpath, const char* name)
 {
-	return removexattr(fpath,name)?-errno:0;
+	return FSFR_XATTR(remove,fpath,-1,name,removexattr(fpath,name))?-errno:0;
 }
 int fsfr_funset_attr(int fd, const char* name)
 {
-	return fremovexattr(fd,name)?-errno:0;
+	return FSFR_XATTR(remove,NULL,fd,name,fremovexattr(fd,name))?-errno:0;
 }
 int fsfr_lunset_attr(const char *fpath, const char* name)
 {
-	return lremovexattr(fpath,name)?-errno:0;
+	return FSFR_XATTR(remove,fpath,-1,name,lremovexattr(fpath,name))?-errno:0;
 }
 
 
@@ -182,3 +162,532 @@ int fsfr_fgetxattr_int_stat64(int fd, const char *name, const struct stat64 *st)
 	if (S_ISLNK(st->st_mode)) return fsfr_proxygetxattr_int(st->st_ino,name);
 	return fsfr_fgetxattr_int(fd,name);
 }
+
+/****************************************************************
+ *  packed metadata record
+ *  	A single getxattr/setxattr per lookup/update rather than
+ *  	one per field. Trees written by older versions only carry
+ *  	the individual attributes; those are still honored (and
+ *  	shadowed once a record is written) until fsfr-migrate
+ *  	converts them. Set FSFR_LEGACY=0 to skip that fallback.
+ ****************************************************************/
+void fsfr_meta_init(struct fsfr_meta *m)
+{
+	m->version = FSFR_META_VERSION;
+	m->mode = m->modemask = m->uid = m->gid = m->rdev = -1;
+}
+int fsfr_meta_isempty(const struct fsfr_meta *m)
+{
+	return m->modemask==-1 && m->uid==-1 && m->gid==-1 && m->rdev==-1;
+}
+// True if writing m (for a file that will look like st) changes
+// nothing stat() shows, compared with old (read while it looked like
+// oldst). What the index supplies is relative to the real mode at the
+// time, so for that only the end result counts.
+int fsfr_meta_unchanged(const struct fsfr_meta *old, const struct stat *oldst,
+		const struct fsfr_meta *m, const struct stat *st,
+		const struct fsfr_implicit *imp)
+{
+	if (old->version!=FSFR_META_INDEX) {
+		return old->modemask==m->modemask && (m->modemask==-1 || old->mode==m->mode)
+			&& old->uid==m->uid && old->gid==m->gid && old->rdev==m->rdev;
+	}
+	struct stat a = *oldst, b = *st;
+	fsfr_meta_apply(&a,old,imp);
+	fsfr_meta_apply(&b,m,imp);
+	return a.st_mode==b.st_mode && a.st_uid==b.st_uid && a.st_gid==b.st_gid
+		&& ((!S_ISCHR(a.st_mode) && !S_ISBLK(a.st_mode)) || a.st_rdev==b.st_rdev);
+}
+
+// true if an xattr name list holds any of the individual attributes
+int fsfr_legacy_present(const char *list, ssize_t len)
+{
+	const char *end = list + len;
+	int prefix_len = strlen(XATTR_PREFIX);
+	while (list < end) {
+		if (!strncmp(list,XATTR_PREFIX,prefix_len) && strcmp(list,XATTR_META))
+			return 1;
+		list += strlen(list) + 1;
+	}
+	return 0;
+}
+
+static int fsfr_legacy_enabled(void)
+{
+	static int enabled = -1;
+	if (enabled==-1) {
+		char *env = getenv("FSFR_LEGACY");
+		enabled = !(env && !strcmp(env,"0"));
+	}
+	return enabled;
+}
+
+// What's left when there's no record: the individual attributes.
+// The listxattr probe keeps a miss at two syscalls instead of six.
+#define IMPLEMENT_GETMETA_LEGACY(NAME,FILETYPE,LISTXATTR,GETINT)		\
+int NAME(FILETYPE file, struct fsfr_meta *m)							\
+{																		\
+	fsfr_meta_init(m);													\
+	if (!fsfr_legacy_enabled()) return -1;								\
+	char list[1024];													\
+	ssize_t len = LISTXATTR(file,list,sizeof(list));					\
+	if (len==0 || (len<0 && errno!=ERANGE)) return -1;					\
+	if (len>0 && !fsfr_legacy_present(list,len)) return -1;				\
+	m->modemask = GETINT(file,XATTR_MODEMASK);							\
+	m->uid = GETINT(file,XATTR_UID);									\
+	m->gid = GETINT(file,XATTR_GID);									\
+	m->rdev = GETINT(file,XATTR_RDEV);									\
+	if (m->modemask!=-1) m->mode = GETINT(file,XATTR_MODE);				\
+	if (fsfr_meta_isempty(m)) return -1;								\
+	m->version = 0;														\
+	return 0;															\
+}
+IMPLEMENT_GETMETA_LEGACY(fsfr_getmeta_legacy,	const char*,fsfr_base_listxattr,	fsfr_getxattr_int)
+IMPLEMENT_GETMETA_LEGACY(fsfr_lgetmeta_legacy,	const char*,fsfr_base_llistxattr,	fsfr_lgetxattr_int)
+IMPLEMENT_GETMETA_LEGACY(fsfr_fgetmeta_legacy,	int,		fsfr_base_flistxattr,	fsfr_fgetxattr_int)
+#undef IMPLEMENT_GETMETA_LEGACY
+
+// Returns 0 if any metadata was found, -1 if not (m is then empty).
+// m->version is 0 if the values came from the individual attributes.
+#define IMPLEMENT_GETMETA(NAME,FILETYPE,GETXATTR,LEGACY)				\
+int NAME(FILETYPE file, struct fsfr_meta *m)							\
+{																		\
+	struct fsfr_meta rec;												\
+	ssize_t len = FSFR_XATTR(get,FSFR_PATHOF(file),FSFR_FDOF(file),XATTR_META,	\
+			GETXATTR(file,XATTR_META,&rec,sizeof(rec)));				\
+	if (len==sizeof(rec) && rec.version==FSFR_META_VERSION) {			\
+		*m = rec;														\
+		return 0;														\
+	}																	\
+	return LEGACY(file,m);												\
+}
+IMPLEMENT_GETMETA(fsfr_getmeta,	const char*,getxattr,	fsfr_getmeta_legacy)
+IMPLEMENT_GETMETA(fsfr_lgetmeta,const char*,lgetxattr,	fsfr_lgetmeta_legacy)
+IMPLEMENT_GETMETA(fsfr_fgetmeta,int,		fgetxattr,	fsfr_fgetmeta_legacy)
+#undef IMPLEMENT_GETMETA
+
+// An empty record is removed, unless it still has to shadow
+// individual attributes left behind by an older version, or an
+// index entry (see FSFR_META_REMOVABLE).
+#define IMPLEMENT_SETMETA(NAME,FILETYPE,SETXATTR,REMOVEXATTR)			\
+int NAME(FILETYPE file, const struct fsfr_meta *m)						\
+{																		\
+	if (FSFR_META_REMOVABLE(m)) {										\
+		if (FSFR_XATTR(remove,FSFR_PATHOF(file),FSFR_FDOF(file),XATTR_META,	\
+				REMOVEXATTR(file,XATTR_META)) && errno!=ENODATA) return -errno;	\
+		return 0;														\
+	}																	\
+	struct fsfr_meta rec = *m;											\
+	rec.version = FSFR_META_VERSION;									\
+	return FSFR_XATTR(set,FSFR_PATHOF(file),FSFR_FDOF(file),XATTR_META,	\
+			SETXATTR(file,XATTR_META,&rec,sizeof(rec),0))?-errno:0;		\
+}
+IMPLEMENT_SETMETA(fsfr_setmeta,	const char*,setxattr,	removexattr)
+IMPLEMENT_SETMETA(fsfr_lsetmeta,const char*,lsetxattr,	lremovexattr)
+IMPLEMENT_SETMETA(fsfr_fsetmeta,int,		fsetxattr,	fremovexattr)
+#undef IMPLEMENT_SETMETA
+
+// FSFR_PROXY_STORE (see fsfr_proxystore.c) wins over FSFR_PROXY_DIR,
+// and FSFR_DAEMON over both
+int fsfr_proxygetmeta(dev_t dev, ino_t ino, struct fsfr_meta *m)
+{
+	char fpath[PATH_MAX];
+	int rtn;
+	if (fsfr_daemon_on()) rtn = fsfr_daemon_get(dev,ino,m);
+	else if (fsfr_store_on()) rtn = fsfr_store_get(dev,ino,m);
+	else if (fsfr_proxypath(ino,fpath,PATH_MAX)) {
+		fsfr_meta_init(m);
+		return -1;
+	} else rtn = fsfr_getmeta(fpath,m);
+	if (!rtn) FSFR_STATS_COUNT(PROXY,1);
+	return rtn;
+}
+int fsfr_proxysetmeta(dev_t dev, ino_t ino, const struct fsfr_meta *m)
+{
+	char fpath[PATH_MAX];
+	if (fsfr_daemon_on()) return fsfr_daemon_put(dev,ino,m);
+	if (fsfr_store_on()) return fsfr_store_put(dev,ino,m);
+	if (fsfr_proxypath(ino,fpath,PATH_MAX)) return 0;
+	// Fails silently, as in fsfr_proxysetxattr_int
+	struct stat st;
+	if (fsfr_base_stat(fpath,&st)) {
+		if (fsfr_meta_isempty(m)) return 0;
+		int fd = fsfr_base_open(fpath,O_WRONLY|O_CREAT|O_TRUNC,0644);
+		if (fd!=-1) close(fd);
+	}
+	return fsfr_setmeta(fpath,m);
+}
+
+// is there anywhere to keep symlink metadata at all?
+int fsfr_proxy_on(void)
+{
+	char fpath[PATH_MAX];
+	return fsfr_daemon_on() || fsfr_store_on() || !fsfr_proxypath(0,fpath,PATH_MAX);
+}
+
+// forget the metadata of a symlink that no longer exists
+void fsfr_proxy_drop(dev_t dev, ino_t ino)
+{
+	char fpath[PATH_MAX];
+	struct fsfr_meta m;
+	fsfr_meta_init(&m);
+	if (fsfr_daemon_on()) fsfr_daemon_put(dev,ino,&m);
+	else if (fsfr_store_on()) fsfr_store_put(dev,ino,&m);
+	else if (!fsfr_proxypath(ino,fpath,PATH_MAX)) fsfr_base_unlinkat(AT_FDCWD,fpath,0);
+}
+
+// A symlink's record is kept elsewhere and writing it leaves the
+// symlink's ctime alone, so other processes couldn't tell a stale
+// copy from a good one: it's only cached here, as if we'd just
+// written it, and never published to the shared cache.
+#define FSFR_CACHE_CTIME(st) (S_ISLNK((st)->st_mode)?NULL:&(st)->st_ctim)
+
+// The *_stat variants consult the write-behind journal and then the
+// metadata cache first; see fsfr_journal.c and fsfr_cache.c. Files
+// with no metadata of their own fall back to the base index, see
+// fsfr_index.c. With FSFR_DAEMON, the daemon (which has a cache of
+// its own) takes the place of all but the index; see fsfr_daemon.c
+#define IMPLEMENT_GETMETA_STAT(NAME,FILETYPE,STATTYPE,GETMETA)			\
+int NAME(FILETYPE file, struct fsfr_meta *m, const STATTYPE *st)		\
+{																		\
+	int rtn;															\
+	if (fsfr_daemon_on()) {												\
+		rtn = fsfr_daemon_get(st->st_dev,st->st_ino,m);					\
+		if (rtn==-1 && fsfr_index_on())									\
+			rtn = fsfr_index_get(AT_FDCWD,file,&FSFR_INDEX_KEY(st),m);	\
+		return rtn;														\
+	}																	\
+	if (fsfr_journal_get(st->st_dev,st->st_ino,m))						\
+		return fsfr_meta_isempty(m)?-1:0;								\
+	if (fsfr_cache_get(st->st_dev,st->st_ino,&st->st_ctim,m,&rtn)) {	\
+		FSFR_STATS_COUNT(HIT,1);										\
+		return rtn;														\
+	}																	\
+	FSFR_STATS_COUNT(MISS,1);											\
+	if (S_ISLNK(st->st_mode)) rtn = fsfr_proxygetmeta(st->st_dev,st->st_ino,m);	\
+	else rtn = GETMETA(file,m);											\
+	if (rtn==-1 && fsfr_index_on())										\
+		rtn = fsfr_index_get(AT_FDCWD,file,&FSFR_INDEX_KEY(st),m);		\
+	fsfr_cache_put(st->st_dev,st->st_ino,FSFR_CACHE_CTIME(st),m,rtn);	\
+	return rtn;															\
+}
+IMPLEMENT_GETMETA_STAT(fsfr_getmeta_stat,	const char*,struct stat,	fsfr_getmeta)
+IMPLEMENT_GETMETA_STAT(fsfr_lgetmeta_stat,	const char*,struct stat,	fsfr_lgetmeta)
+IMPLEMENT_GETMETA_STAT(fsfr_getmeta_stat64,	const char*,struct stat64,	fsfr_getmeta)
+IMPLEMENT_GETMETA_STAT(fsfr_lgetmeta_stat64,const char*,struct stat64,	fsfr_lgetmeta)
+#undef IMPLEMENT_GETMETA_STAT
+
+#define IMPLEMENT_FGETMETA_STAT(NAME,STATTYPE)							\
+int NAME(int fd, struct fsfr_meta *m, const STATTYPE *st)				\
+{																		\
+	int rtn;															\
+	if (fsfr_daemon_on()) {												\
+		rtn = fsfr_daemon_get(st->st_dev,st->st_ino,m);					\
+		if (rtn==-1 && fsfr_index_on())									\
+			rtn = fsfr_index_get(fd,NULL,&FSFR_INDEX_KEY(st),m);		\
+		return rtn;														\
+	}																	\
+	if (fsfr_journal_get(st->st_dev,st->st_ino,m))						\
+		return fsfr_meta_isempty(m)?-1:0;								\
+	if (fsfr_cache_fdget(fd,st->st_dev,st->st_ino,&st->st_ctim,m,&rtn)) {	\
+		FSFR_STATS_COUNT(HIT,1);										\
+		return rtn;														\
+	}																	\
+	FSFR_STATS_COUNT(MISS,1);											\
+	if (S_ISLNK(st->st_mode)) rtn = fsfr_proxygetmeta(st->st_dev,st->st_ino,m);	\
+	else rtn = fsfr_fgetmeta(fd,m);										\
+	if (rtn==-1 && fsfr_index_on())										\
+		rtn = fsfr_index_get(fd,NULL,&FSFR_INDEX_KEY(st),m);			\
+	fsfr_cache_fdput(fd,st->st_dev,st->st_ino,FSFR_CACHE_CTIME(st),m,rtn);	\
+	return rtn;															\
+}
+IMPLEMENT_FGETMETA_STAT(fsfr_fgetmeta_stat,		struct stat)
+IMPLEMENT_FGETMETA_STAT(fsfr_fgetmeta_stat64,	struct stat64)
+#undef IMPLEMENT_FGETMETA_STAT
+
+// the write changes ctime, so the cached copy waits for the next stat
+#define IMPLEMENT_SETMETA_STAT(NAME,FILETYPE,SETMETA)					\
+int NAME(FILETYPE file, const struct fsfr_meta *m, const struct stat *st)	\
+{																		\
+	int rtn;															\
+	if (fsfr_daemon_on()) return fsfr_daemon_put(st->st_dev,st->st_ino,m);	\
+	if (S_ISLNK(st->st_mode)) rtn = fsfr_proxysetmeta(st->st_dev,st->st_ino,m);	\
+	else rtn = SETMETA(file,m);											\
+	if (!rtn) fsfr_cache_put(st->st_dev,st->st_ino,NULL,m,				\
+			fsfr_meta_isempty(m)?-1:0);									\
+	return rtn;															\
+}
+IMPLEMENT_SETMETA_STAT(fsfr_setmeta_stat,	const char*,fsfr_setmeta)
+IMPLEMENT_SETMETA_STAT(fsfr_lsetmeta_stat,	const char*,fsfr_lsetmeta)
+IMPLEMENT_SETMETA_STAT(fsfr_fsetmeta_stat,	int,		fsfr_fsetmeta)
+#undef IMPLEMENT_SETMETA_STAT
+
+// Metadata for something we just created through fd; srcfd is the
+// caller's copy of it, if they have one (see fsfr_journal_put). The
+// daemon still has whatever an earlier file with the same inode left
+// behind, so there even an empty record is written. With the index,
+// this is called with an empty record too, see fsfr_index_stamp.
+int fsfr_fsetmeta_new(int fd, int srcfd, const struct fsfr_meta *m)
+{
+	struct stat st;
+	struct fsfr_meta own = *m;
+	int have_st = 0;
+	if (fsfr_index_on()) {
+		if (fsfr_base_fstat(fd,&st)) return -errno;
+		have_st = 1;
+		// the index already has it, if it's part of the base image
+		if (fsfr_index_stamp(fd,NULL,&st,&own)) {
+			if (!fsfr_daemon_on()) return 0;
+			fsfr_meta_init(&own);
+		}
+	}
+	if (fsfr_daemon_on()) {
+		if (!have_st && fsfr_base_fstat(fd,&st)) return -errno;
+		return fsfr_daemon_put(st.st_dev,st.st_ino,&own);
+	}
+	if (fsfr_meta_isempty(&own)) return 0;
+	if (fsfr_journal_on() && (have_st || !fsfr_base_fstat(fd,&st))
+			&& !fsfr_journal_put(fd,srcfd,&own,&st)) return 0;
+	return fsfr_fsetmeta(fd,&own);
+}
+
+// the same, for something we only have the path of
+int fsfr_setmeta_new(const char *path, const struct fsfr_meta *m)
+{
+	struct stat st;
+	struct fsfr_meta own = *m;
+	int have_st = 0;
+	if (fsfr_index_on()) {
+		if (fsfr_base_lstat(path,&st)) return -errno;
+		have_st = 1;
+		if (fsfr_index_stamp(AT_FDCWD,path,&st,&own)) {
+			if (!fsfr_daemon_on()) return 0;
+			fsfr_meta_init(&own);
+		}
+	}
+	if (fsfr_daemon_on()) {
+		if (!have_st && fsfr_base_lstat(path,&st)) return -errno;
+		return fsfr_daemon_put(st.st_dev,st.st_ino,&own);
+	}
+	if (fsfr_meta_isempty(&own)) return 0;
+	return fsfr_setmeta(path,&own);
+}
+
+/****************************************************************
+ *  chmod() and chown() rules
+ *  	Shared by the wrappers and the fsfr-chown/fsfr-chmod tools.
+ *  	Both only work out the new record (and the real mode); the
+ *  	caller reads and writes it.
+ ****************************************************************/
+void fsfr_implicit_load(struct fsfr_implicit *imp)
+{
+	char *implicit = getenv("FSFR_IMPLICIT");
+	memset(imp,0,sizeof(*imp));
+	if (!implicit || !*implicit || !strcmp(implicit,"0")) return;
+	unsigned int u = 0, g = 0;
+	if (sscanf(implicit,"%u:%u",&u,&g)!=2) u = g = 0;
+	imp->on = 1;
+	imp->uid = u;
+	imp->gid = g;
+	// geteuid() may be ours; ask the kernel who really creates files
+	imp->real_uid = syscall(SYS_geteuid);
+	imp->real_gid = syscall(SYS_getegid);
+}
+
+// Root wouldn't be able to lock himself out of a directory or file,
+// so we just make sure that u+rwX stays set; only for files and dirs.
+// also, only *actually* set the 0777 subset; others are virtual.
+// Returns the mode to really set on the file.
+mode_t fsfr_chmod_meta(struct fsfr_meta *m, mode_t st_mode, mode_t mode)
+{
+	int reqmode = 00600; // "required mode bits"
+	if (S_ISDIR(st_mode)) {
+		reqmode = reqmode | 00100;	// dirs require u+x
+	} else if (!S_ISREG(st_mode)) {
+		return mode;	// we only mess with files and dirs
+	}
+
+	int oldmask = m->modemask;
+	if (oldmask==-1) oldmask = 0;
+
+	// which modes go to file, which modes go to xattr
+	int filemode = (mode | reqmode) & 00777;
+	int fakemode = mode;
+	int newmask = filemode ^ fakemode;
+
+	if (oldmask & ~00777) { // preserve old extended mode bits if exist
+		int oldmode = m->mode;
+		if (oldmode==-1) oldmode = 0;
+		// fake non-file
+		fakemode = fakemode | (oldmode & ~00777);
+		newmask = newmask | (oldmask & ~00777);
+	}
+
+	if (filemode == fakemode) {	// clear mode xattr if no longer used
+		m->mode = m->modemask = -1;
+	} else {
+		m->mode = fakemode;
+		m->modemask = newmask;
+	}
+	return filemode;
+}
+
+void fsfr_chown_meta(struct fsfr_meta *m, uid_t owner, gid_t group,
+		const struct stat *st, const struct fsfr_implicit *imp)
+{
+	if (owner!=-1) m->uid = owner;
+	if (group!=-1) m->gid = group;
+	if (imp->on) {	// no need to spell out the default
+		if (m->uid==imp->uid && st->st_uid==imp->real_uid) m->uid = -1;
+		if (m->gid==imp->gid && st->st_gid==imp->real_gid) m->gid = -1;
+	}
+}
+
+// the stat() the wrappers would report, for tools that run without them
+// (FSFR_APPLY_META in fsfakeroot.c is the same, for both stat types)
+void fsfr_meta_apply(struct stat *st, const struct fsfr_meta *m,
+		const struct fsfr_implicit *imp)
+{
+	if (m->modemask!=-1) st->st_mode = (st->st_mode & ~m->modemask) | (m->mode & m->modemask);
+	if (m->uid!=-1) st->st_uid = m->uid;
+	else if (imp->on && st->st_uid==imp->real_uid) st->st_uid = imp->uid;
+	if (m->gid!=-1) st->st_gid = m->gid;
+	else if (imp->on && st->st_gid==imp->real_gid) st->st_gid = imp->gid;
+	if (m->rdev!=-1) st->st_rdev = m->rdev;
+}
+
+/****************************************************************
+ *  Resolve-once targets
+ *  	chmod(), chown() and the *at() calls need the file's stat,
+ *  	its metadata, and sometimes a real chmod, all on the same
+ *  	file. Rather than walk the path for each of those (and, for
+ *  	the *at() calls, rebuild a path relative to the directory
+ *  	fd first), open it once with O_PATH and do everything else
+ *  	through /proc/self/fd/N.
+ *
+ *  	Without /proc, open it for reading instead and use the f*()
+ *  	calls. Symlinks can't be opened that way, but all they need
+ *  	is the stat, since their metadata lives in the proxy.
+ ****************************************************************/
+int fsfr_have_proc(void)
+{
+	static int have_proc = -1;
+	struct stat st;
+	// not access(), which is ours and needs this
+	if (have_proc==-1) have_proc = !fsfr_base_stat("/proc/self/fd",&st) && S_ISDIR(st.st_mode);
+	return have_proc;
+}
+
+int fsfr_target_open(struct fsfr_target *t, int dirfd, const char *pathname, int nofollow)
+{
+	int flags = O_CLOEXEC | (nofollow?O_NOFOLLOW:0);
+	int rtn;
+	t->owned = 1;
+	t->byproc = fsfr_have_proc();
+	if (t->byproc) {
+		t->fd = fsfr_base_openat(dirfd,pathname,flags|O_PATH,0);
+		if (t->fd==-1) return -1;
+		snprintf(t->path,sizeof(t->path),"/proc/self/fd/%i",t->fd);
+		rtn = fsfr_base_fstat(t->fd,&t->st);
+	} else {
+		t->fd = fsfr_base_openat(dirfd,pathname,flags|O_RDONLY|O_NONBLOCK|O_NOCTTY,0);
+		if (t->fd==-1 && !(nofollow && errno==ELOOP)) return -1;
+		if (t->fd==-1) rtn = fsfr_base_fstatat(dirfd,pathname,&t->st,AT_SYMLINK_NOFOLLOW);
+		else rtn = fsfr_base_fstat(t->fd,&t->st);
+	}
+	if (rtn) {
+		int err = errno;
+		fsfr_target_close(t);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+// wrap an fd the caller already has; it stays theirs
+int fsfr_target_fd(struct fsfr_target *t, int fd)
+{
+	t->fd = fd;
+	t->owned = 0;
+	t->byproc = 0;
+	return fsfr_base_fstat(fd,&t->st);
+}
+
+void fsfr_target_close(struct fsfr_target *t)
+{
+	if (t->owned && t->fd!=-1) close(t->fd);
+	t->fd = -1;
+}
+
+int fsfr_target_getmeta(struct fsfr_target *t, struct fsfr_meta *m)
+{
+	if (t->byproc) return fsfr_getmeta_stat(t->path,m,&t->st);
+	return fsfr_fgetmeta_stat(t->fd,m,&t->st);
+}
+
+int fsfr_target_setmeta(struct fsfr_target *t, const struct fsfr_meta *m)
+{
+	if (!fsfr_journal_put(t->fd,t->owned?-1:t->fd,m,&t->st)) return 0;
+	if (t->byproc) return fsfr_setmeta_stat(t->path,m,&t->st);
+	return fsfr_fsetmeta_stat(t->fd,m,&t->st);
+}
+
+int fsfr_target_chmod(struct fsfr_target *t, mode_t mode)
+{
+	if (t->byproc) return fsfr_base_chmod(t->path,mode);
+	return fsfr_base_fchmod(t->fd,mode);
+}
+
+// Metadata for something the caller just stat'ed relative to dirfd.
+// Relative paths are reached through the directory's /proc entry,
+// which costs one short walk instead of the old getcwd() dance.
+// (Symlinks only need the stat, unless the index has to find them.)
+#define IMPLEMENT_GETMETA_AT(NAME,STATTYPE,GETMETA,LGETMETA,FGETMETA)	\
+int NAME(int dirfd, const char *pathname, int flags,					\
+		struct fsfr_meta *m, const STATTYPE *st)						\
+{																		\
+	int nofollow = flags & AT_SYMLINK_NOFOLLOW;							\
+	if ((flags & AT_EMPTY_PATH) && !pathname[0])						\
+		return FGETMETA(dirfd,m,st);									\
+	if (pathname[0]=='/' || dirfd==AT_FDCWD							\
+			|| (S_ISLNK(st->st_mode) && !fsfr_index_on()))				\
+		return nofollow ? LGETMETA(pathname,m,st) : GETMETA(pathname,m,st);	\
+	if (fsfr_have_proc()) {												\
+		char path[PATH_MAX];											\
+		snprintf(path,PATH_MAX,"/proc/self/fd/%i/%s",dirfd,pathname);	\
+		return nofollow ? LGETMETA(path,m,st) : GETMETA(path,m,st);		\
+	}																	\
+	struct fsfr_target t;												\
+	if (fsfr_target_open(&t,dirfd,pathname,nofollow)) {				\
+		fsfr_meta_init(m);												\
+		return -1;														\
+	}																	\
+	int rtn = FGETMETA(t.fd,m,st);										\
+	fsfr_target_close(&t);												\
+	return rtn;															\
+}
+IMPLEMENT_GETMETA_AT(fsfr_getmeta_at,	struct stat,	fsfr_getmeta_stat,	fsfr_lgetmeta_stat,	fsfr_fgetmeta_stat)
+IMPLEMENT_GETMETA_AT(fsfr_getmeta_at64,	struct stat64,	fsfr_getmeta_stat64,fsfr_lgetmeta_stat64,fsfr_fgetmeta_stat64)
+#undef IMPLEMENT_GETMETA_AT
+
+// For the tools' tree walks: the metadata of name in dirfd (path is
+// the same thing from the cwd), found the way the wrappers find it,
+// the record and then the base index, but without their caches
+int fsfr_getmeta_walk(int dirfd, const char *name, const char *path,
+		const struct stat *st, struct fsfr_meta *m)
+{
+	int rtn;
+	if (S_ISLNK(st->st_mode)) {
+		rtn = fsfr_proxygetmeta(st->st_dev,st->st_ino,m);
+	} else {
+		ssize_t len = -1;
+		if (dirfd!=AT_FDCWD) len = fsfr_base_lgetxattrat(dirfd,name,XATTR_META,m,sizeof(*m));
+		if (dirfd==AT_FDCWD || (len==-1 && errno==ENOSYS))
+			len = lgetxattr(path,XATTR_META,m,sizeof(*m));
+		if (len==sizeof(*m) && m->version==FSFR_META_VERSION) rtn = 0;
+		else rtn = fsfr_lgetmeta_legacy(path,m);
+	}
+	if (rtn==-1 && fsfr_index_on())
+		rtn = fsfr_index_get(dirfd,name,&FSFR_INDEX_KEY(st),m);
+	return rtn;
+}
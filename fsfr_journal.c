@@ -0,0 +1,477 @@
+/*
+ * fsfr_journal.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+#include "fsfr.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+/****************************************************************
+ *  Write-behind journal
+ *  	With FSFR_JOURNAL set to a directory, metadata changes to
+ *  	files and directories aren't written to the xattr right
+ *  	away. They're kept in memory by (dev, ino), so a chown and
+ *  	a chmod of a freshly extracted file end up as one setxattr,
+ *  	and our own stat calls answer from there in the meantime.
+ *
+ *  	Pending changes are written out in batches: once
+ *  	JOURNAL_BATCH of the fds they came in on have been closed,
+ *  	when the journal fills up, and before fork(), exec() and
+ *  	exit. An fsync() writes out its file right away. Until then,
+ *  	other processes don't see them. Each entry holds a descriptor
+ *  	of its own (so there are never more than FSFR_JOURNAL_SIZE
+ *  	of them, 256 by default), and a rename in the meantime
+ *  	doesn't matter.
+ *
+ *  	Every pending change is also kept in <dir>/<pid>.fsfrj, a
+ *  	file mapped into memory, which costs no syscalls to update.
+ *  	A process that dies without flushing leaves it behind, and
+ *  	the next one to start replays it onto whatever is still at
+ *  	the recorded path with the recorded (dev, ino). Symlinks
+ *  	never go through here; the proxy already covers them.
+ ****************************************************************/
+
+#define JOURNAL_MAGIC 0x314c4e524a524653ULL	// "FSRJRNL1"
+#define JOURNAL_SLOTS 256					// default; FSFR_JOURNAL_SIZE overrides
+#define JOURNAL_BATCH 64					// closed files written out at a time
+#define JOURNAL_FDS 1024
+
+#define SLOT_EMPTY 0
+#define SLOT_USED 1
+
+// on disk, one per pending change
+struct fsfr_journal_slot {
+	uint32_t state;
+	uint32_t gen;		// low bit picks the live copy of meta
+	uint64_t dev;
+	uint64_t ino;
+	struct fsfr_meta meta[2];
+	char path[PATH_MAX];
+};
+
+struct fsfr_journal_header {
+	uint64_t magic;
+	uint64_t nslots;
+	char pad[48];
+};
+
+// in memory; open addressing over twice as many entries as slots
+struct fsfr_journal_entry {
+	dev_t dev;
+	ino_t ino;
+	int state;		// SLOT_EMPTY, SLOT_USED or JOURNAL_GONE
+	int fd;			// ours, O_PATH; used through /proc/self/fd
+	int srcfd;		// the caller's, or -1
+	int ready;		// the caller has closed srcfd
+	uint32_t slot;
+	struct fsfr_meta meta;
+};
+#define JOURNAL_GONE 2	// keeps probe chains intact
+
+static const char *journal_dir = NULL;
+static int journal_enabled = 0;
+static uint32_t journal_nslots = 0;
+static int journal_pending = 0;
+static struct fsfr_journal_entry *journal = NULL;
+static uint32_t journal_mask = 0;
+static uint32_t journal_tomb = 0;
+static uint32_t *journal_free = NULL;	// stack of unused log slots
+static uint32_t journal_nfree = 0;
+static uint32_t journal_ready = 0;
+static int journal_byfd[JOURNAL_FDS];	// caller's fd -> entry+1
+// room for flushing every slot in one batch
+static struct fsfr_batch_op *flush_ops = NULL;
+static struct fsfr_meta *flush_recs = NULL;
+static struct fsfr_journal_entry **flush_entries = NULL;
+static char (*flush_paths)[32] = NULL;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the log; opened on first use
+static struct fsfr_journal_header *log_hdr = NULL;
+static struct fsfr_journal_slot *log_slots = NULL;
+static size_t log_size = 0;
+static int log_fd = -1;
+static char log_path[PATH_MAX];
+
+static inline uint32_t fsfr_journal_hash(dev_t dev, ino_t ino)
+{
+	uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	return (uint32_t)(h >> 32);
+}
+
+static struct fsfr_journal_entry *fsfr_journal_find(dev_t dev, ino_t ino)
+{
+	uint32_t h = fsfr_journal_hash(dev,ino), i;
+	for (i=0; i<=journal_mask; i++) {
+		struct fsfr_journal_entry *e = &journal[(h+i) & journal_mask];
+		if (e->state==SLOT_EMPTY) return NULL;
+		if (e->state==SLOT_USED && e->dev==dev && e->ino==ino) return e;
+	}
+	return NULL;
+}
+
+/****************************************************************
+ *  Replay
+ *  	A log whose flock() we can take belongs to nobody alive.
+ *  	An entry only applies if the path still leads to the inode
+ *  	it was recorded for.
+ ****************************************************************/
+static void fsfr_journal_replay(int dirfd, const char *name)
+{
+	int fd = fsfr_base_openat(dirfd,name,O_RDWR|O_CLOEXEC,0);
+	if (fd==-1) return;
+	struct fsfr_journal_header hdr;
+	struct stat st;
+	if (flock(fd,LOCK_EX|LOCK_NB) || fsfr_base_fstat(fd,&st)
+			|| pread(fd,&hdr,sizeof(hdr),0)!=sizeof(hdr) || hdr.magic!=JOURNAL_MAGIC
+			|| st.st_size < sizeof(hdr) + hdr.nslots*sizeof(struct fsfr_journal_slot)) {
+		fsfr_real.close(fd);
+		return;
+	}
+	size_t size = sizeof(hdr) + hdr.nslots*sizeof(struct fsfr_journal_slot);
+	void *map = mmap(NULL,size,PROT_READ,MAP_SHARED,fd,0);
+	if (map!=MAP_FAILED) {
+		struct fsfr_journal_slot *slots = (struct fsfr_journal_slot *)((struct fsfr_journal_header *)map+1);
+		uint64_t i;
+		for (i=0; i<hdr.nslots; i++) {
+			struct fsfr_journal_slot *s = &slots[i];
+			if (s->state!=SLOT_USED || !memchr(s->path,'\0',PATH_MAX)) continue;
+			if (fsfr_base_lstat(s->path,&st) || S_ISLNK(st.st_mode)
+					|| st.st_dev!=s->dev || st.st_ino!=s->ino) continue;
+			fsfr_lsetmeta(s->path,&s->meta[s->gen & 1]);
+		}
+		munmap(map,size);
+		fsfr_base_unlinkat(dirfd,name,0);
+	}
+	fsfr_real.close(fd);
+}
+
+static void fsfr_journal_recover(void)
+{
+	int dirfd = fsfr_base_open(journal_dir,O_RDONLY|O_DIRECTORY|O_CLOEXEC,0);
+	DIR *d = dirfd==-1 ? NULL : fdopendir(dirfd);
+	if (!d) {
+		if (dirfd!=-1) fsfr_real.close(dirfd);
+		return;
+	}
+	struct dirent *de;
+	while ((de = fsfr_real.readdir(d))) {
+		long pid;
+		char suffix[8];
+		if (sscanf(de->d_name,"%ld.%7s",&pid,suffix)!=2 || strcmp(suffix,"fsfrj")) continue;
+		fsfr_journal_replay(dirfd,de->d_name);
+	}
+	fsfr_real.closedir(d);
+}
+
+/****************************************************************
+ *  Setup
+ ****************************************************************/
+static void fsfr_journal_atfork_prepare(void);
+static void fsfr_journal_atfork_parent(void);
+static void fsfr_journal_atfork_child(void);
+
+static void __attribute__((constructor)) fsfr_journal_init(void)
+{
+	static int done = 0;
+	if (done++) return;
+	char *dir = getenv("FSFR_JOURNAL");
+	char *env = getenv("FSFR_JOURNAL_SIZE");
+	if (!dir || !*dir || dir[0]!='/' || !fsfr_have_proc()) return;
+	// the daemon's queue does the same job; see fsfr_daemon.c
+	if (fsfr_daemon_on()) return;
+	uint32_t want = env && atol(env) > 0 ? atol(env) : JOURNAL_SLOTS;
+	journal_nslots = want < (1U<<20) ? want : (1U<<20);
+	uint32_t size = 2;
+	while (size < 2*journal_nslots) size <<= 1;
+	journal = calloc(size,sizeof(*journal));
+	journal_free = calloc(journal_nslots,sizeof(*journal_free));
+	flush_ops = calloc(journal_nslots,sizeof(*flush_ops));
+	flush_recs = calloc(journal_nslots,sizeof(*flush_recs));
+	flush_entries = calloc(journal_nslots,sizeof(*flush_entries));
+	flush_paths = calloc(journal_nslots,sizeof(*flush_paths));
+	if (!journal || !journal_free || !flush_ops || !flush_recs
+			|| !flush_entries || !flush_paths) {
+		free(journal);
+		free(journal_free);
+		free(flush_ops);
+		free(flush_recs);
+		free(flush_entries);
+		free(flush_paths);
+		journal = NULL;
+		return;
+	}
+	journal_mask = size-1;
+	journal_dir = dir;
+	fsfr_journal_recover();
+	pthread_atfork(fsfr_journal_atfork_prepare,fsfr_journal_atfork_parent,
+			fsfr_journal_atfork_child);
+	journal_enabled = 1;
+}
+
+// the log for this process; called with journal_lock held
+static int fsfr_journal_open_log(void)
+{
+	if (log_slots) return 0;
+	snprintf(log_path,sizeof(log_path),"%s/%ld.fsfrj",journal_dir,(long)getpid());
+	int fd = fsfr_base_open(log_path,O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC,0600);
+	if (fd==-1) return -1;
+	struct fsfr_journal_header hdr;
+	memset(&hdr,0,sizeof(hdr));
+	hdr.magic = JOURNAL_MAGIC;
+	hdr.nslots = journal_nslots;
+	size_t size = sizeof(hdr) + journal_nslots*sizeof(struct fsfr_journal_slot);
+	void *map = MAP_FAILED;
+	// held for as long as we live; see fsfr_journal_replay
+	if (!flock(fd,LOCK_EX|LOCK_NB) && !ftruncate(fd,size)
+			&& pwrite(fd,&hdr,sizeof(hdr),0)==sizeof(hdr))
+		map = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	if (map==MAP_FAILED) {
+		fsfr_base_unlinkat(AT_FDCWD,log_path,0);
+		fsfr_real.close(fd);
+		return -1;
+	}
+	uint32_t i;
+	for (i=0; i<journal_nslots; i++) journal_free[i] = journal_nslots-1-i;
+	journal_nfree = journal_nslots;
+	log_hdr = map;
+	log_slots = (struct fsfr_journal_slot *)(log_hdr+1);
+	log_size = size;
+	log_fd = fd;
+	return 0;
+}
+
+/****************************************************************
+ *  Flushing
+ ****************************************************************/
+// drop e once it's on disk; called with journal_lock held
+static void fsfr_journal_forget(struct fsfr_journal_entry *e)
+{
+	__atomic_store_n(&log_slots[e->slot].state,SLOT_EMPTY,__ATOMIC_RELEASE);
+	journal_free[journal_nfree++] = e->slot;
+	if (e->srcfd>=0 && e->srcfd<JOURNAL_FDS
+			&& journal_byfd[e->srcfd]==e-journal+1) journal_byfd[e->srcfd] = 0;
+	if (e->ready) journal_ready--;
+	e->state = JOURNAL_GONE;
+	journal_tomb++;
+	__atomic_sub_fetch(&journal_pending,1,__ATOMIC_RELAXED);
+}
+
+// write e out and forget it; called with journal_lock held
+static void fsfr_journal_write(struct fsfr_journal_entry *e)
+{
+	char path[32];
+	snprintf(path,sizeof(path),"/proc/self/fd/%i",e->fd);
+	if (!fsfr_setmeta(path,&e->meta))
+		fsfr_cache_put(e->dev,e->ino,NULL,&e->meta,fsfr_meta_isempty(&e->meta)?-1:0);
+	fsfr_real.close(e->fd);
+	fsfr_journal_forget(e);
+}
+
+// Everything at once, or everything whose fd has been closed: one
+// batch of setxattr calls (see fsfr_uring.c), then one of closes.
+// Removals have no batched form and go singly.
+static void fsfr_journal_flush_locked(int all)
+{
+	uint32_t i, n = 0;
+	for (i=0; i<=journal_mask && journal_pending > n; i++) {
+		struct fsfr_journal_entry *e = &journal[i];
+		if (e->state!=SLOT_USED || !(all || e->ready)) continue;
+		if (FSFR_META_REMOVABLE(&e->meta)) {
+			fsfr_journal_write(e);
+			continue;
+		}
+		struct fsfr_batch_op *op = &flush_ops[n];
+		snprintf(flush_paths[n],sizeof(flush_paths[n]),"/proc/self/fd/%i",e->fd);
+		flush_recs[n] = e->meta;
+		flush_recs[n].version = FSFR_META_VERSION;
+		op->op = FSFR_BATCH_SETXATTR;
+		op->path = flush_paths[n];
+		op->name = XATTR_META;
+		op->value = &flush_recs[n];
+		op->size = sizeof(flush_recs[n]);
+		flush_entries[n++] = e;
+	}
+	fsfr_batch(flush_ops,n);
+	for (i=0; i<n; i++) {
+		struct fsfr_journal_entry *e = flush_entries[i];
+		if (!flush_ops[i].res)
+			fsfr_cache_put(e->dev,e->ino,NULL,&e->meta,fsfr_meta_isempty(&e->meta)?-1:0);
+		flush_ops[i].op = FSFR_BATCH_CLOSE;
+		flush_ops[i].fd = e->fd;
+		flush_ops[i].path = NULL;
+	}
+	fsfr_batch(flush_ops,n);
+	for (i=0; i<n; i++) fsfr_journal_forget(flush_entries[i]);
+	if (!all) return;
+	// everything is gone, tombstones included
+	memset(journal,0,(journal_mask+1)*sizeof(*journal));
+	memset(journal_byfd,0,sizeof(journal_byfd));
+	journal_tomb = 0;
+}
+
+void fsfr_journal_flush(void)
+{
+	if (!__atomic_load_n(&journal_pending,__ATOMIC_RELAXED)) return;
+	pthread_mutex_lock(&journal_lock);
+	fsfr_journal_flush_locked(1);
+	pthread_mutex_unlock(&journal_lock);
+}
+
+// the caller's fsync(): write out fd's entry now
+void fsfr_journal_flushfd(int fd)
+{
+	if (!__atomic_load_n(&journal_pending,__ATOMIC_RELAXED)) return;
+	if (fd<0 || fd>=JOURNAL_FDS) return;
+	pthread_mutex_lock(&journal_lock);
+	int idx = journal_byfd[fd];
+	if (idx && journal[idx-1].state==SLOT_USED && journal[idx-1].srcfd==fd)
+		fsfr_journal_write(&journal[idx-1]);
+	journal_byfd[fd] = 0;
+	pthread_mutex_unlock(&journal_lock);
+}
+
+// the caller's close(): fd's entry can go with the next batch
+void fsfr_journal_closefd(int fd)
+{
+	if (!__atomic_load_n(&journal_pending,__ATOMIC_RELAXED)) return;
+	if (fd<0 || fd>=JOURNAL_FDS) return;
+	pthread_mutex_lock(&journal_lock);
+	int idx = journal_byfd[fd];
+	if (idx && journal[idx-1].state==SLOT_USED && journal[idx-1].srcfd==fd
+			&& !journal[idx-1].ready) {
+		journal[idx-1].ready = 1;
+		if (++journal_ready >= JOURNAL_BATCH) fsfr_journal_flush_locked(0);
+	}
+	journal_byfd[fd] = 0;
+	pthread_mutex_unlock(&journal_lock);
+}
+
+static void __attribute__((destructor)) fsfr_journal_fini(void)
+{
+	if (!journal_enabled) return;
+	pthread_mutex_lock(&journal_lock);
+	fsfr_journal_flush_locked(1);
+	if (log_slots) {
+		munmap(log_hdr,log_size);
+		fsfr_base_unlinkat(AT_FDCWD,log_path,0);
+		fsfr_real.close(log_fd);
+		log_hdr = NULL;
+		log_slots = NULL;
+	}
+	pthread_mutex_unlock(&journal_lock);
+}
+
+// nothing is pending across fork(), so the child starts clean
+static void fsfr_journal_atfork_prepare(void)
+{
+	pthread_mutex_lock(&journal_lock);
+	fsfr_journal_flush_locked(1);
+}
+static void fsfr_journal_atfork_parent(void)
+{
+	pthread_mutex_unlock(&journal_lock);
+}
+static void fsfr_journal_atfork_child(void)
+{
+	// the parent's log is still mapped and locked; leave it be
+	if (log_slots) {
+		munmap(log_hdr,log_size);
+		fsfr_real.close(log_fd);
+		log_hdr = NULL;
+		log_slots = NULL;
+	}
+	pthread_mutex_init(&journal_lock,NULL);
+}
+
+/****************************************************************
+ *  Lookup and update
+ ****************************************************************/
+int fsfr_journal_on(void)
+{
+	return journal_enabled;
+}
+
+// Returns 1 and fills m if a change to (dev, ino) is pending
+int fsfr_journal_get(dev_t dev, ino_t ino, struct fsfr_meta *m)
+{
+	if (!__atomic_load_n(&journal_pending,__ATOMIC_RELAXED)) return 0;
+	pthread_mutex_lock(&journal_lock);
+	struct fsfr_journal_entry *e = fsfr_journal_find(dev,ino);
+	if (e) *m = e->meta;
+	pthread_mutex_unlock(&journal_lock);
+	return e!=NULL;
+}
+
+// Record m for the file open on fd (the caller's, or an O_PATH one
+// of ours if srcfd is -1). Returns 0 if it's journaled, -1 if the
+// caller has to write it out itself.
+int fsfr_journal_put(int fd, int srcfd, const struct fsfr_meta *m, const struct stat *st)
+{
+	if (!journal_enabled || fd<0 || S_ISLNK(st->st_mode)) return -1;
+	pthread_mutex_lock(&journal_lock);
+	struct fsfr_journal_entry *e = fsfr_journal_find(st->st_dev,st->st_ino);
+	if (e) {
+		struct fsfr_journal_slot *s = &log_slots[e->slot];
+		uint32_t gen = s->gen;
+		s->meta[(gen+1) & 1] = *m;
+		__atomic_store_n(&s->gen,gen+1,__ATOMIC_RELEASE);
+		e->meta = *m;
+		pthread_mutex_unlock(&journal_lock);
+		return 0;
+	}
+	if (fsfr_journal_open_log()) {
+		pthread_mutex_unlock(&journal_lock);
+		return -1;
+	}
+	if (!journal_nfree || journal_tomb > journal_nslots) fsfr_journal_flush_locked(1);
+
+	// Not a dup: an O_PATH descriptor doesn't keep the file open for
+	// writing (which would make exec() of it fail with ETXTBSY), and
+	// closing it doesn't drop the caller's fcntl() locks on it.
+	char proc[32];
+	snprintf(proc,sizeof(proc),"/proc/self/fd/%i",fd);
+	int ours = fsfr_base_open(proc,O_PATH|O_CLOEXEC,0);
+	if (ours==-1) {
+		pthread_mutex_unlock(&journal_lock);
+		return -1;
+	}
+	uint32_t slot = journal_free[--journal_nfree];
+	struct fsfr_journal_slot *s = &log_slots[slot];
+	snprintf(proc,sizeof(proc),"/proc/self/fd/%i",ours);
+	ssize_t len = readlink(proc,s->path,sizeof(s->path)-1);
+	s->path[len>0 ? len : 0] = '\0';
+	uint32_t gen = s->gen;
+	s->meta[(gen+1) & 1] = *m;
+	s->dev = st->st_dev;
+	s->ino = st->st_ino;
+	__atomic_store_n(&s->gen,gen+1,__ATOMIC_RELEASE);
+	__atomic_store_n(&s->state,SLOT_USED,__ATOMIC_RELEASE);
+
+	uint32_t h = fsfr_journal_hash(st->st_dev,st->st_ino);
+	while (journal[h & journal_mask].state==SLOT_USED) h++;
+	e = &journal[h & journal_mask];
+	if (e->state==JOURNAL_GONE) journal_tomb--;
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->state = SLOT_USED;
+	e->fd = ours;
+	e->srcfd = srcfd;
+	e->ready = 0;
+	e->slot = slot;
+	e->meta = *m;
+	if (srcfd>=0 && srcfd<JOURNAL_FDS) journal_byfd[srcfd] = e-journal+1;
+	__atomic_add_fetch(&journal_pending,1,__ATOMIC_RELAXED);
+	pthread_mutex_unlock(&journal_lock);
+	return 0;
+}
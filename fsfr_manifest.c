@@ -0,0 +1,891 @@
+/*
+ * fsfr_manifest.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+/****************************************************************
+ *  fsfr-export, fsfr-import
+ *  	Write the fake metadata of a tree out as a manifest, and put
+ *  	it back onto a tree (say, after copying it with a tool that
+ *  	drops extended attributes). What is written is what stat()
+ *  	shows under the preload: the real stat with the record
+ *  	applied. Built twice from this file; FSFR_TOOL_IMPORT picks
+ *  	which one.
+ *
+ *  	Two formats: an mtree(5) manifest, one line per entry with
+ *  	its path relative to the root, and the save file of the
+ *  	original fakeroot (fakeroot -s / -i), which is keyed by
+ *  	device and inode and so only fits the same filesystem. An
+ *  	export can also be written as the index that FSFR_INDEX
+ *  	reads (-f index), which has to be sorted and so is held in
+ *  	memory until the walk is done.
+ *
+ *  	Trees are walked by several threads; an export streams out
+ *  	each directory as it is read, in no particular order. An
+ *  	mtree import is read a batch of lines at a time and handed
+ *  	to the threads. Only a fakeroot import holds its whole input
+ *  	in memory, since the tree has to be walked to find the inodes.
+ ****************************************************************/
+
+#include "fsfr.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/sysmacros.h>
+
+#define MAN_MAXTHREADS 64
+#define MAN_OUTBUF 65536	// per thread, written out whole lines at a time
+#define MAN_BATCH 256		// manifest lines per batch of work
+#define MAN_QUEUE 16		// batches read ahead of the threads
+
+#define MAN_MTREE 0
+#define MAN_FAKEROOT 1
+#define MAN_INDEX 2		// export only: the base index, see fsfr_index.c
+
+#ifdef FSFR_TOOL_IMPORT
+#define TOOL "fsfr-import"
+#else
+#define TOOL "fsfr-export"
+#endif
+
+// what an entry should look like; type 0 and -1 for anything else
+// mean "leave as it is"
+struct man_want {
+	mode_t type;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	dev_t rdev;
+	int has_rdev;
+};
+
+static int format = MAN_MTREE;
+static int nthreads = 1;
+static size_t rootlen = 0;		// paths are shown relative to this much
+static struct fsfr_implicit imp;
+static long nseen = 0, failed = 0;
+#ifdef FSFR_TOOL_IMPORT
+static int verbose = 0;
+static long nchanged = 0;
+#endif
+
+static void man_fail(const char *path)
+{
+	fprintf(stderr,TOOL ": %s: %s\n",path,strerror(errno));
+	__atomic_add_fetch(&failed,1,__ATOMIC_RELAXED);
+}
+
+static void *man_alloc(size_t size)
+{
+	void *p = malloc(size);
+	if (!p) {
+		perror(TOOL);
+		exit(1);
+	}
+	return p;
+}
+
+static char *man_join(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir);
+	char *path = man_alloc(dlen + strlen(name) + 2);
+	memcpy(path,dir,dlen);
+	if (!dlen || dir[dlen-1]!='/') path[dlen++] = '/';
+	strcpy(path+dlen,name);
+	return path;
+}
+
+static const char *man_typename(mode_t mode)
+{
+	switch (mode & S_IFMT) {
+	case S_IFREG: return "file";
+	case S_IFDIR: return "dir";
+	case S_IFLNK: return "link";
+	case S_IFBLK: return "block";
+	case S_IFCHR: return "char";
+	case S_IFIFO: return "fifo";
+	case S_IFSOCK: return "socket";
+	}
+	return NULL;
+}
+
+/****************************************************************
+ *  Parallel walk
+ *  	With the walk in fsfr_walk.c; man_visit is called for every
+ *  	entry, with the arg of the thread that found it.
+ ****************************************************************/
+static void (*man_visit)(int dirfd, const char *name, const char *path,
+		const struct stat *st, void *arg);
+
+static void walk_dir(const char *path, void *arg)
+{
+	int fd = open(path,O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	DIR *d = fd==-1 ? NULL : fdopendir(fd);
+	if (!d) {
+		man_fail(path);
+		if (fd!=-1) close(fd);
+		return;
+	}
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		const char *name = de->d_name;
+		struct stat st;
+		if (name[0]=='.' && (!name[1] || (name[1]=='.' && !name[2]))) continue;
+		char *sub = man_join(path,name);
+		if (fstatat(fd,name,&st,AT_SYMLINK_NOFOLLOW)) {
+			man_fail(sub);
+			free(sub);
+			continue;
+		}
+		__atomic_add_fetch(&nseen,1,__ATOMIC_RELAXED);
+		man_visit(fd,name,sub,&st,arg);
+		if (S_ISDIR(st.st_mode)) fsfr_walk_push(sub);
+		else free(sub);
+	}
+	closedir(d);
+}
+
+// the root itself, then everything under it; args holds each
+// thread's own arg, for whatever man_visit needs
+static void walk_tree(const char *root, void **args)
+{
+	struct stat st;
+	if (lstat(root,&st)) {
+		man_fail(root);
+		return;
+	}
+	__atomic_add_fetch(&nseen,1,__ATOMIC_RELAXED);
+	man_visit(AT_FDCWD,root,root,&st,args[0]);
+	if (!S_ISDIR(st.st_mode)) return;
+	fsfr_walk_push(strdup(root));
+	fsfr_walk(nthreads,walk_dir,args);
+}
+
+#ifndef FSFR_TOOL_IMPORT
+/****************************************************************
+ *  Export
+ ****************************************************************/
+static FILE *out;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct man_outbuf {
+	char buf[MAN_OUTBUF];
+	size_t len;
+};
+
+static void out_flush(struct man_outbuf *o)
+{
+	pthread_mutex_lock(&out_lock);
+	fwrite(o->buf,1,o->len,out);
+	pthread_mutex_unlock(&out_lock);
+	o->len = 0;
+}
+
+// lines go into the buffer whole, so that threads never interleave
+static void out_line(struct man_outbuf *o, const char *line, size_t len)
+{
+	if (len > MAN_OUTBUF-o->len) out_flush(o);
+	memcpy(o->buf+o->len,line,len);
+	o->len += len;
+}
+
+// mtree(5) escapes: whitespace, '#', '=', '\' and anything unprintable
+static void mtree_quote(char *dst, const char *src)
+{
+	for (; *src; src++) {
+		unsigned char c = *src;
+		if (c<=' ' || c>=0x7f || c=='#' || c=='=' || c=='\\') {
+			*dst++ = '\\';
+			*dst++ = '0' + ((c>>6)&7);
+			*dst++ = '0' + ((c>>3)&7);
+			*dst++ = '0' + (c&7);
+		} else {
+			*dst++ = c;
+		}
+	}
+	*dst = '\0';
+}
+
+static void export_visit(int dirfd, const char *name, const char *path,
+		const struct stat *real, void *arg)
+{
+	struct man_outbuf *o = arg;
+	struct fsfr_meta m;
+	struct stat st = *real;
+	fsfr_getmeta_walk(dirfd,name,path,real,&m);
+	fsfr_meta_apply(&st,&m,&imp);
+
+	char line[10*PATH_MAX];
+	int len;
+	if (format==MAN_FAKEROOT) {
+		len = snprintf(line,sizeof(line),
+				"dev=%llx,ino=%llu,mode=%llo,uid=%llu,gid=%llu,nlink=%llu,rdev=%llu\n",
+				(unsigned long long)st.st_dev,(unsigned long long)st.st_ino,
+				(unsigned long long)st.st_mode,(unsigned long long)st.st_uid,
+				(unsigned long long)st.st_gid,(unsigned long long)st.st_nlink,
+				(unsigned long long)st.st_rdev);
+	} else {
+		const char *type = man_typename(st.st_mode);
+		if (!type) return;
+		line[0] = '.';
+		mtree_quote(line+1,path+rootlen);
+		len = strlen(line);
+		len += sprintf(line+len," type=%s uid=%u gid=%u mode=%04o",type,
+				(unsigned int)st.st_uid,(unsigned int)st.st_gid,
+				(unsigned int)(st.st_mode & 07777));
+		if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode))
+			len += sprintf(line+len," device=native,%u,%u",major(st.st_rdev),minor(st.st_rdev));
+		if (S_ISLNK(st.st_mode)) {
+			char target[PATH_MAX];
+			ssize_t tlen = readlinkat(dirfd,name,target,sizeof(target)-1);
+			if (tlen>=0) {
+				target[tlen] = '\0';
+				len += sprintf(line+len," link=");
+				mtree_quote(line+len,target);
+				len += strlen(line+len);
+			}
+		}
+		line[len++] = '\n';
+	}
+	out_line(o,line,len);
+	if (o->len > MAN_OUTBUF/2) out_flush(o);
+}
+
+// the index is collected whole, then sorted and written at the end
+static struct fsfr_index_entry *ix_ents = NULL;
+static char **ix_paths = NULL;
+static size_t ix_used = 0, ix_size = 0;
+
+static void index_visit(int dirfd, const char *name, const char *path,
+		const struct stat *real, void *arg)
+{
+	struct fsfr_meta m;
+	struct stat st = *real;
+	struct statx stx;
+	fsfr_getmeta_walk(dirfd,name,path,real,&m);
+	fsfr_meta_apply(&st,&m,&imp);
+	// the birth time, where there is one, outlasts the ctime
+	if (fsfr_base_statx(dirfd,name,AT_SYMLINK_NOFOLLOW,STATX_BTIME,&stx)
+			|| stx.stx_ino!=real->st_ino)
+		stx.stx_mask = 0;
+	const char *rel = path+rootlen;
+	while (*rel=='/') rel++;
+	char *copy = strdup(rel);
+	if (!copy) {
+		perror(TOOL);
+		exit(1);
+	}
+
+	pthread_mutex_lock(&out_lock);
+	if (ix_used==ix_size) {
+		ix_size = ix_size ? 2*ix_size : 4096;
+		ix_ents = realloc(ix_ents,ix_size*sizeof(*ix_ents));
+		ix_paths = realloc(ix_paths,ix_size*sizeof(*ix_paths));
+		if (!ix_ents || !ix_paths) {
+			perror(TOOL);
+			exit(1);
+		}
+	}
+	struct fsfr_index_entry *e = &ix_ents[ix_used];
+	memset(e,0,sizeof(*e));
+	e->dev = real->st_dev;
+	e->ino = real->st_ino;
+	e->mode = st.st_mode;
+	e->uid = st.st_uid;
+	e->gid = st.st_gid;
+	e->rdev = st.st_rdev;
+	e->ctime = real->st_ctim.tv_sec;
+	e->ctime_nsec = real->st_ctim.tv_nsec;
+	if (stx.stx_mask & STATX_BTIME) {
+		e->btime = stx.stx_btime.tv_sec;
+		e->btime_nsec = stx.stx_btime.tv_nsec;
+	}
+	ix_paths[ix_used++] = copy;
+	pthread_mutex_unlock(&out_lock);
+}
+
+static uint32_t *ix_order = NULL;
+
+static int index_bypath(const void *a, const void *b)
+{
+	return strcmp(ix_paths[*(const uint32_t *)a],ix_paths[*(const uint32_t *)b]);
+}
+
+static int index_byino(const void *a, const void *b)
+{
+	const struct fsfr_index_entry *x = &ix_ents[ix_order[*(const uint32_t *)a]];
+	const struct fsfr_index_entry *y = &ix_ents[ix_order[*(const uint32_t *)b]];
+	if (x->dev!=y->dev) return x->dev < y->dev ? -1 : 1;
+	if (x->ino!=y->ino) return x->ino < y->ino ? -1 : 1;
+	return 0;
+}
+
+// header, entries by path, their (dev, ino) order, then the paths
+static int index_write(const char *root)
+{
+	struct fsfr_index_header h;
+	size_t i, strsize = 0;
+	memset(&h,0,sizeof(h));
+	if (!realpath(root,h.root)) return -1;
+	if (ix_used > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	uint32_t *byino = man_alloc((ix_used+1)*sizeof(uint32_t));
+	ix_order = man_alloc((ix_used+1)*sizeof(uint32_t));
+	for (i=0; i<ix_used; i++) ix_order[i] = i;
+	qsort(ix_order,ix_used,sizeof(uint32_t),index_bypath);
+	for (i=0; i<ix_used; i++) {
+		ix_ents[ix_order[i]].path = strsize;
+		strsize += strlen(ix_paths[ix_order[i]]) + 1;
+		byino[i] = i;
+	}
+	qsort(byino,ix_used,sizeof(uint32_t),index_byino);
+
+	h.magic = FSFR_INDEX_MAGIC;
+	h.count = ix_used;
+	h.entries = sizeof(h);
+	h.byino = h.entries + ix_used*sizeof(struct fsfr_index_entry);
+	h.strings = h.byino + ((ix_used*sizeof(uint32_t) + 7) & ~7);
+	h.size = h.strings + strsize;
+	fwrite(&h,sizeof(h),1,out);
+	for (i=0; i<ix_used; i++) fwrite(&ix_ents[ix_order[i]],sizeof(*ix_ents),1,out);
+	fwrite(byino,sizeof(uint32_t),ix_used,out);
+	if (ix_used & 1) fwrite("\0\0\0\0",4,1,out);
+	for (i=0; i<ix_used; i++) fwrite(ix_paths[ix_order[i]],strlen(ix_paths[ix_order[i]])+1,1,out);
+	free(byino);
+	return 0;
+}
+
+#else
+/****************************************************************
+ *  Import
+ ****************************************************************/
+static int dryrun = 0;
+
+// make path (whose real stat is st) look like w
+static void import_apply(const char *path, const struct stat *st, const struct man_want *w)
+{
+	struct fsfr_meta m, old;
+	mode_t type = st->st_mode & S_IFMT;
+	if (S_ISLNK(st->st_mode) && w->type && w->type!=S_IFLNK) goto mismatch;
+	fsfr_getmeta_walk(AT_FDCWD,path,path,st,&m);
+	old = m;
+
+	mode_t filemode = st->st_mode & 07777;
+	if (w->type && w->type!=type) {
+		// only a plain file can stand in for a node, as mknod() leaves it
+		if (!S_ISREG(st->st_mode) || w->type==S_IFDIR || w->type==S_IFLNK) goto mismatch;
+		m.mode = w->type;
+		m.modemask = S_IFMT;
+		filemode = fsfr_chmod_meta(&m,st->st_mode,w->mode!=-1 ? w->mode : filemode);
+	} else if (!S_ISLNK(st->st_mode)) {
+		if (w->type && m.modemask!=-1 && (m.modemask & S_IFMT)) {
+			// was standing in for a node, and isn't any more
+			m.modemask &= ~S_IFMT;
+			if (!m.modemask) m.mode = m.modemask = -1;
+			if (!w->has_rdev) m.rdev = -1;
+		}
+		if (w->mode!=-1) {
+			// fsfr_chmod_meta keeps faked set-id and sticky bits; a
+			// manifest's mode is the whole mode
+			if (m.modemask!=-1 && (m.modemask &= ~07777)==0) m.mode = m.modemask = -1;
+			filemode = fsfr_chmod_meta(&m,st->st_mode,w->mode);
+		}
+	}
+	if (w->has_rdev) {
+		// a real node with the right number needs nothing faked
+		if (w->type==type && w->rdev==st->st_rdev) m.rdev = -1;
+		else m.rdev = w->rdev;
+	}
+	fsfr_chown_meta(&m,w->uid,w->gid,st,&imp);
+	// nothing to record where the real owner shows through anyway
+	if (m.uid==st->st_uid && !(imp.on && st->st_uid==imp.real_uid)) m.uid = -1;
+	if (m.gid==st->st_gid && !(imp.on && st->st_gid==imp.real_gid)) m.gid = -1;
+
+	struct stat now = *st;
+	now.st_mode = (st->st_mode & S_IFMT) | filemode;
+	int changed = !fsfr_meta_unchanged(&old,st,&m,&now,&imp);
+	if (!changed && filemode==(st->st_mode & 07777)) return;
+	if (verbose) printf("%s\n",path);
+	__atomic_add_fetch(&nchanged,1,__ATOMIC_RELAXED);
+	if (dryrun) return;
+	if (filemode!=(st->st_mode & 07777) && !S_ISLNK(st->st_mode) && chmod(path,filemode)) {
+		man_fail(path);
+		return;
+	}
+	if (!changed) return;
+	int rtn = S_ISLNK(st->st_mode) ? fsfr_proxysetmeta(st->st_dev,st->st_ino,&m)
+			: fsfr_lsetmeta(path,&m);
+	if (rtn) {
+		errno = rtn<0 ? -rtn : EIO;
+		man_fail(path);
+	}
+	return;
+
+mismatch:
+	fprintf(stderr,TOOL ": %s: is a %s, not a %s\n",path,
+			man_typename(st->st_mode),man_typename(w->type));
+	__atomic_add_fetch(&failed,1,__ATOMIC_RELAXED);
+}
+
+/****************************************************************
+ *  Import from a fakeroot save file
+ *  	dev=%llx,ino=%llu,mode=%llo,uid=%llu,gid=%llu,nlink=%llu,
+ *  	rdev=%llu per line, loaded into a hash on (dev, ino), then
+ *  	matched against the inodes found walking the tree.
+ ****************************************************************/
+struct fr_entry {
+	uint64_t dev;
+	uint64_t ino;		// 0: free slot
+	uint64_t mode, uid, gid, rdev;
+};
+
+static struct fr_entry *fr_table = NULL;
+static size_t fr_size = 0, fr_used = 0;
+
+static inline size_t fr_hash(uint64_t dev, uint64_t ino)
+{
+	uint64_t h = (dev * 0x9e3779b97f4a7c15ULL) ^ ino;
+	h *= 0xff51afd7ed558ccdULL;
+	return (size_t)(h ^ (h >> 32));
+}
+
+static struct fr_entry *fr_slot(uint64_t dev, uint64_t ino)
+{
+	size_t i = fr_hash(dev,ino) & (fr_size-1);
+	while (fr_table[i].ino && (fr_table[i].dev!=dev || fr_table[i].ino!=ino))
+		i = (i+1) & (fr_size-1);
+	return &fr_table[i];
+}
+
+static void fr_grow(void)
+{
+	struct fr_entry *old = fr_table;
+	size_t oldsize = fr_size, i;
+	fr_size = fr_size ? fr_size*2 : 1<<12;
+	fr_table = calloc(fr_size,sizeof(*fr_table));
+	if (!fr_table) {
+		perror(TOOL);
+		exit(1);
+	}
+	for (i=0; i<oldsize; i++) if (old[i].ino) *fr_slot(old[i].dev,old[i].ino) = old[i];
+	free(old);
+}
+
+static int fr_load(FILE *in)
+{
+	char *line = NULL;
+	size_t cap = 0;
+	long lineno = 0;
+	while (getline(&line,&cap,in) > 0) {
+		struct fr_entry e;
+		unsigned long long nlink;
+		lineno++;
+		if (sscanf(line,"dev=%llx,ino=%llu,mode=%llo,uid=%llu,gid=%llu,nlink=%llu,rdev=%llu",
+				(unsigned long long *)&e.dev,(unsigned long long *)&e.ino,
+				(unsigned long long *)&e.mode,(unsigned long long *)&e.uid,
+				(unsigned long long *)&e.gid,&nlink,(unsigned long long *)&e.rdev)!=7
+				|| !e.ino) {
+			fprintf(stderr,TOOL ": line %li: not a fakeroot save file entry\n",lineno);
+			free(line);
+			return -1;
+		}
+		if ((fr_used+1)*2 > fr_size) fr_grow();
+		struct fr_entry *slot = fr_slot(e.dev,e.ino);
+		if (!slot->ino) fr_used++;
+		*slot = e;	// a later entry for the same inode wins, as in fakeroot
+	}
+	free(line);
+	return 0;
+}
+
+static void fr_visit(int dirfd, const char *name, const char *path,
+		const struct stat *st, void *arg)
+{
+	if (!fr_size) return;
+	struct fr_entry *e = fr_slot(st->st_dev,st->st_ino);
+	if (!e->ino) return;
+	struct man_want w;
+	w.type = e->mode & S_IFMT;
+	w.mode = e->mode & 07777;
+	w.uid = e->uid;
+	w.gid = e->gid;
+	w.rdev = e->rdev;
+	w.has_rdev = S_ISCHR(e->mode) || S_ISBLK(e->mode);
+	import_apply(path,st,&w);
+}
+
+/****************************************************************
+ *  Import from an mtree manifest
+ *  	Full-path entries ("./dir/file ...") only, as written by
+ *  	fsfr-export, bsdtar and mtree -C; /set and /unset are
+ *  	understood, keywords other than type, uid, gid, uname,
+ *  	gname, mode and device are ignored. Lines are parsed by
+ *  	the reader and applied by the threads.
+ ****************************************************************/
+struct mt_entry {
+	char *path;
+	struct man_want w;
+};
+
+struct mt_batch {
+	int n;
+	struct mt_entry e[MAN_BATCH];
+};
+
+static struct mt_batch *mt_queue[MAN_QUEUE];
+static int mt_head = 0, mt_count = 0, mt_done = 0;
+static pthread_mutex_t mt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mt_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t mt_room = PTHREAD_COND_INITIALIZER;
+static const char *mt_root;
+
+static void mt_put(struct mt_batch *b)
+{
+	pthread_mutex_lock(&mt_lock);
+	while (mt_count==MAN_QUEUE) pthread_cond_wait(&mt_room,&mt_lock);
+	mt_queue[(mt_head+mt_count++) % MAN_QUEUE] = b;
+	pthread_cond_signal(&mt_ready);
+	pthread_mutex_unlock(&mt_lock);
+}
+
+static struct mt_batch *mt_get(void)
+{
+	struct mt_batch *b = NULL;
+	pthread_mutex_lock(&mt_lock);
+	while (!mt_count && !mt_done) pthread_cond_wait(&mt_ready,&mt_lock);
+	if (mt_count) {
+		b = mt_queue[mt_head];
+		mt_head = (mt_head+1) % MAN_QUEUE;
+		mt_count--;
+		pthread_cond_signal(&mt_room);
+	}
+	pthread_mutex_unlock(&mt_lock);
+	return b;
+}
+
+static void *mt_worker(void *arg)
+{
+	struct mt_batch *b;
+	int i;
+	while ((b = mt_get())) {
+		for (i=0; i<b->n; i++) {
+			struct mt_entry *e = &b->e[i];
+			struct stat st;
+			__atomic_add_fetch(&nseen,1,__ATOMIC_RELAXED);
+			if (lstat(e->path,&st)) man_fail(e->path);
+			else import_apply(e->path,&st,&e->w);
+			free(e->path);
+		}
+		free(b);
+	}
+	return NULL;
+}
+
+// undo mtree_quote, in place; also takes the C-style escapes
+static void mtree_unquote(char *s)
+{
+	char *dst = s;
+	while (*s) {
+		if (*s!='\\' || !s[1]) {
+			*dst++ = *s++;
+			continue;
+		}
+		s++;
+		if (s[0]>='0' && s[0]<='3' && s[1]>='0' && s[1]<='7' && s[2]>='0' && s[2]<='7') {
+			*dst++ = (s[0]-'0')<<6 | (s[1]-'0')<<3 | (s[2]-'0');
+			s += 3;
+			continue;
+		}
+		switch (*s) {
+		case 's': *dst++ = ' '; break;
+		case 't': *dst++ = '\t'; break;
+		case 'n': *dst++ = '\n'; break;
+		case 'r': *dst++ = '\r'; break;
+		default: *dst++ = *s;
+		}
+		s++;
+	}
+	*dst = '\0';
+}
+
+static int mtree_type(const char *s, mode_t *type)
+{
+	static const struct { const char *name; mode_t type; } types[] = {
+		{"file",S_IFREG}, {"dir",S_IFDIR}, {"link",S_IFLNK}, {"block",S_IFBLK},
+		{"char",S_IFCHR}, {"fifo",S_IFIFO}, {"socket",S_IFSOCK},
+	};
+	int i;
+	for (i=0; i<sizeof(types)/sizeof(types[0]); i++) {
+		if (strcmp(s,types[i].name)) continue;
+		*type = types[i].type;
+		return 0;
+	}
+	return -1;
+}
+
+// "native,maj,min" (or any format name), or a plain number
+static int mtree_device(const char *s, dev_t *rdev)
+{
+	unsigned int maj, min;
+	char *end;
+	const char *comma = strchr(s,',');
+	if (comma) {
+		if (sscanf(comma+1,"%u,%u",&maj,&min)!=2) return -1;
+		*rdev = makedev(maj,min);
+		return 0;
+	}
+	*rdev = strtoull(s,&end,0);
+	return *end ? -1 : 0;
+}
+
+// one keyword=value into w, or out of it for /unset
+static int mtree_keyword(char *kw, struct man_want *w, int unset)
+{
+	char *val = strchr(kw,'=');
+	if (val) *val++ = '\0';
+	if (!strcmp(kw,"all") && unset) {
+		w->type = 0;
+		w->mode = w->uid = w->gid = -1;
+		w->has_rdev = 0;
+		return 0;
+	}
+	if (!unset && !val) return 0;	// a flag keyword (nochange, optional, ...)
+	if (val) mtree_unquote(val);
+	if (!strcmp(kw,"type")) {
+		if (unset) w->type = 0;
+		else if (mtree_type(val,&w->type)) return -1;
+	} else if (!strcmp(kw,"mode")) {
+		char *end;
+		if (unset) {
+			w->mode = -1;
+		} else {
+			w->mode = strtoul(val,&end,8) & 07777;
+			if (*end) return -1;
+		}
+	} else if (!strcmp(kw,"uid") || !strcmp(kw,"uname")) {
+		if (unset) w->uid = -1;
+		else if (kw[1]=='i') w->uid = strtoul(val,NULL,10);
+		else {
+			struct passwd *pw = getpwnam(val);
+			if (pw) w->uid = pw->pw_uid;
+		}
+	} else if (!strcmp(kw,"gid") || !strcmp(kw,"gname")) {
+		if (unset) w->gid = -1;
+		else if (kw[1]=='i') w->gid = strtoul(val,NULL,10);
+		else {
+			struct group *gr = getgrnam(val);
+			if (gr) w->gid = gr->gr_gid;
+		}
+	} else if (!strcmp(kw,"device")) {
+		if (unset) w->has_rdev = 0;
+		else if (mtree_device(val,&w->rdev)) return -1;
+		else w->has_rdev = 1;
+	}
+	return 0;
+}
+
+static int mtree_read(FILE *in)
+{
+	struct man_want defaults = { 0, -1, -1, -1, 0, 0 };
+	struct mt_batch *b = NULL;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	long lineno = 0;
+	int rtn = 0;
+	while ((len = getline(&line,&cap,in)) > 0) {
+		lineno++;
+		// a trailing backslash continues the line
+		while (len>1 && line[len-1]=='\n' && line[len-2]=='\\') {
+			char *more = NULL;
+			size_t morecap = 0;
+			ssize_t morelen = getline(&more,&morecap,in);
+			if (morelen<=0) {
+				free(more);
+				break;
+			}
+			lineno++;
+			line[len-2] = ' ';
+			line[len-1] = '\0';
+			if (len+morelen+1 > cap) {
+				cap = len+morelen+1;
+				line = realloc(line,cap);
+				if (!line) {
+					perror(TOOL);
+					exit(1);
+				}
+			}
+			memcpy(line+len-1,more,morelen+1);
+			len += morelen-1;
+			free(more);
+		}
+		char *save, *tok = strtok_r(line," \t\n",&save);
+		if (!tok || tok[0]=='#') continue;
+		if (!strcmp(tok,"/set") || !strcmp(tok,"/unset")) {
+			int unset = tok[1]=='u';
+			while ((tok = strtok_r(NULL," \t\n",&save)))
+				if (mtree_keyword(tok,&defaults,unset)) goto bad;
+			continue;
+		}
+		if (!strcmp(tok,"..") || !strchr(tok,'/')) {
+			if (!strcmp(tok,".")) goto entry;	// the root; fine either way
+			fprintf(stderr,TOOL ": line %li: nested mtree entries aren't supported;"
+					" use full paths (mtree -C)\n",lineno);
+			rtn = -1;
+			break;
+		}
+	entry:;
+		struct mt_entry e;
+		mtree_unquote(tok);
+		const char *rel = tok[0]=='.' && (!tok[1] || tok[1]=='/') ? tok+1 : tok;
+		while (*rel=='/') rel++;
+		e.path = *rel ? man_join(mt_root,rel) : strdup(mt_root);
+		e.w = defaults;
+		while ((tok = strtok_r(NULL," \t\n",&save))) {
+			if (mtree_keyword(tok,&e.w,0)) {
+				free(e.path);
+				goto bad;
+			}
+		}
+		if (!b) {
+			b = man_alloc(sizeof(*b));
+			b->n = 0;
+		}
+		b->e[b->n++] = e;
+		if (b->n==MAN_BATCH) {
+			mt_put(b);
+			b = NULL;
+		}
+		continue;
+	bad:
+		fprintf(stderr,TOOL ": line %li: bad keyword: %s\n",lineno,tok);
+		rtn = -1;
+		break;
+	}
+	if (b) mt_put(b);
+	free(line);
+	pthread_mutex_lock(&mt_lock);
+	mt_done = 1;
+	pthread_cond_broadcast(&mt_ready);
+	pthread_mutex_unlock(&mt_lock);
+	return rtn;
+}
+#endif /* FSFR_TOOL_IMPORT */
+
+/****************************************************************
+ *  Command line
+ ****************************************************************/
+static void usage(const char *name)
+{
+#ifdef FSFR_TOOL_IMPORT
+	fprintf(stderr,"usage: %s [-nv] [-f mtree|fakeroot] [-i file] [-j threads] <root>\n",name);
+	fprintf(stderr,"  Applies the fake owners, modes and device numbers in a manifest\n");
+	fprintf(stderr,"  (standard input, or -i file) to the tree at <root>.\n");
+	fprintf(stderr,"  -n: change nothing; with -v, list what would change\n");
+	fprintf(stderr,"  -v: list what was changed\n");
+#else
+	fprintf(stderr,"usage: %s [-f mtree|fakeroot|index] [-o file] [-j threads] <root>\n",name);
+	fprintf(stderr,"  Writes the fake owner, mode and device number of everything\n");
+	fprintf(stderr,"  under <root> as a manifest, to standard output or -o file.\n");
+	fprintf(stderr,"  -f index writes the base index read through FSFR_INDEX\n");
+#endif
+	fprintf(stderr,"  -f: manifest format; fakeroot is the fakeroot -s/-i save file\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *file = NULL;
+	int opt, i;
+	nthreads = ncpu < 1 ? 1 : ncpu > MAN_MAXTHREADS ? MAN_MAXTHREADS : ncpu;
+#ifdef FSFR_TOOL_IMPORT
+	const char *opts = "nvf:i:j:";
+#else
+	const char *opts = "f:o:j:";
+#endif
+	while ((opt = getopt(argc,argv,opts)) != -1) {
+		switch (opt) {
+		case 'f':
+			if (!strcmp(optarg,"mtree")) format = MAN_MTREE;
+			else if (!strcmp(optarg,"fakeroot")) format = MAN_FAKEROOT;
+#ifndef FSFR_TOOL_IMPORT
+			else if (!strcmp(optarg,"index")) format = MAN_INDEX;
+#endif
+			else usage(argv[0]);
+			break;
+		case 'i': case 'o': file = optarg; break;
+		case 'j': nthreads = atoi(optarg); break;
+#ifdef FSFR_TOOL_IMPORT
+		case 'n': dryrun = 1; break;
+		case 'v': verbose = 1; break;
+#endif
+		default: usage(argv[0]);
+		}
+	}
+	if (optind+1 != argc || nthreads < 1 || nthreads > MAN_MAXTHREADS) usage(argv[0]);
+	if (fsfr_daemon_refuse(TOOL)) return 1;
+	const char *root = argv[optind];
+	rootlen = strlen(root);
+	fsfr_implicit_load(&imp);
+
+	void *args[MAN_MAXTHREADS] = { NULL };
+#ifdef FSFR_TOOL_IMPORT
+	FILE *in = file && strcmp(file,"-") ? fopen(file,"r") : stdin;
+	if (!in) {
+		perror(file);
+		return 1;
+	}
+	if (format==MAN_FAKEROOT) {
+		if (fr_load(in)) return 1;
+		man_visit = fr_visit;
+		walk_tree(root,args);
+	} else {
+		struct stat st;
+		if (stat(root,&st) || !S_ISDIR(st.st_mode)) {
+			if (!errno) errno = ENOTDIR;
+			man_fail(root);
+			return 1;
+		}
+		mt_root = root;
+		pthread_t tids[MAN_MAXTHREADS];
+		for (i=0; i<nthreads; i++) pthread_create(&tids[i],NULL,mt_worker,NULL);
+		if (mtree_read(in)) __atomic_add_fetch(&failed,1,__ATOMIC_RELAXED);
+		for (i=0; i<nthreads; i++) pthread_join(tids[i],NULL);
+	}
+	if (in!=stdin) fclose(in);
+	if (verbose) fprintf(stderr,"%li entries, %li %s\n",nseen,nchanged,dryrun?"to change":"changed");
+#else
+	out = file && strcmp(file,"-") ? fopen(file,"w") : stdout;
+	if (!out) {
+		perror(file);
+		return 1;
+	}
+	while (rootlen && root[rootlen-1]=='/') rootlen--;
+	for (i=0; i<nthreads; i++) {
+		args[i] = man_alloc(sizeof(struct man_outbuf));
+		((struct man_outbuf *)args[i])->len = 0;
+	}
+	if (format==MAN_MTREE) fprintf(out,"#mtree\n");
+	man_visit = format==MAN_INDEX ? index_visit : export_visit;
+	walk_tree(root,args);
+	if (format==MAN_INDEX && index_write(root)) man_fail(root);
+	for (i=0; i<nthreads; i++) {
+		out_flush(args[i]);
+		free(args[i]);
+	}
+	if (fflush(out) || (out!=stdout && fclose(out))) {
+		man_fail(file);
+	}
+#endif
+	return failed?1:0;
+}
@@ -0,0 +1,90 @@
+/*
+ * fsfr_migrate.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+/****************************************************************
+ *  fsfr-migrate
+ *  	Convert the individual user.fsfr.* attributes written by
+ *  	older versions into the packed XATTR_META record, in place.
+ *  	Symlinks carry no xattrs of their own; run this on your
+ *  	FSFR_PROXY_DIR as well to convert the proxy files.
+ ****************************************************************/
+
+#include "fsfr.h"
+#include <ftw.h>
+#include <stdlib.h>
+
+static const char *legacy_names[] = {
+	XATTR_MODE, XATTR_MODEMASK, XATTR_UID, XATTR_GID, XATTR_RDEV
+};
+
+static int verbose = 0;
+static long migrated = 0;
+static long failed = 0;
+
+static int migrate_one(const char *fpath, const struct stat *st, int type, struct FTW *ftw)
+{
+	if (S_ISLNK(st->st_mode)) return 0;
+
+	char list[1024];
+	ssize_t len = llistxattr(fpath,list,sizeof(list));
+	if (len==0 || (len<0 && errno!=ERANGE)) return 0;
+	if (len>0 && !fsfr_legacy_present(list,len)) return 0;
+
+	// prefers an existing record over the individual attributes,
+	// same as the library does
+	struct fsfr_meta m;
+	fsfr_lgetmeta(fpath,&m);
+	m.version = FSFR_META_VERSION;
+	int rtn = fsfr_lsetmeta(fpath,&m);
+	if (rtn) {
+		fprintf(stderr,"%s: %s\n",fpath,strerror(-rtn));
+		failed++;
+		return 0;
+	}
+	int i;
+	for (i=0; i<sizeof(legacy_names)/sizeof(legacy_names[0]); i++)
+		fsfr_lunset_attr(fpath,legacy_names[i]);
+	if (verbose) printf("%s\n",fpath);
+	migrated++;
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,"usage: %s [-v] <path>...\n",name);
+	fprintf(stderr,"  Converts fsfakeroot metadata under each <path> to the\n");
+	fprintf(stderr,"  single-attribute format. Include your FSFR_PROXY_DIR.\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	while ((opt = getopt(argc,argv,"v")) != -1) {
+		switch (opt) {
+		case 'v': verbose = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind >= argc) usage(argv[0]);
+	if (fsfr_daemon_refuse("fsfr-migrate")) return 1;
+
+	// the fallback is the whole point here
+	unsetenv("FSFR_LEGACY");
+
+	for (; optind < argc; optind++) {
+		if (nftw(argv[optind],migrate_one,64,FTW_PHYS)) {
+			perror(argv[optind]);
+			failed++;
+		}
+	}
+	if (verbose) fprintf(stderr,"%li migrated, %li failed\n",migrated,failed);
+	return failed?1:0;
+}
@@ -0,0 +1,304 @@
+/*
+ * fsfr_prefetch.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+#include "fsfr.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <signal.h>
+
+/****************************************************************
+ *  Directory-scan prefetch
+ *  	ls -l, find, du and tar all readdir() a directory and then
+ *  	stat every entry in it. With FSFR_PREFETCH=<threads> set,
+ *  	each entry handed back by readdir()/getdents64() is queued
+ *  	for a small pool of worker threads, which look up its
+ *  	metadata while the caller is still iterating. The results
+ *  	land in the metadata cache, so the stats that follow are
+ *  	hits.
+ *
+ *  	Workers address entries relative to a private dup of the
+ *  	directory fd, since the caller is free to close its own
+ *  	while we're still working.
+ *
+ *  	This is purely an optimization: when the queue is full,
+ *  	entries are dropped and the caller just takes a miss.
+ ****************************************************************/
+
+#define PF_QUEUE 16384		// power of 2
+#define PF_MAXTHREADS 32
+#define PF_DIRMAP 64		// power of 2
+#define PF_BATCH 64		// a ring's worth; see fsfr_uring.c
+#define PF_PATH 320			// /proc/self/fd/N/ and a 255-byte name
+
+struct fsfr_pf_dir {
+	int fd;
+	int refs;
+};
+
+struct fsfr_pf_item {
+	struct fsfr_pf_dir *dir;
+	char name[256];
+};
+
+// DIR* -> our dup of its fd
+struct fsfr_pf_dirmap {
+	void *key;
+	struct fsfr_pf_dir *dir;
+	struct fsfr_pf_dirmap *next;
+};
+
+static struct fsfr_pf_item pf_queue[PF_QUEUE];
+static unsigned int pf_head = 0, pf_tail = 0;
+static pthread_mutex_t pf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pf_cond = PTHREAD_COND_INITIALIZER;
+static struct fsfr_pf_dirmap *pf_dirmap[PF_DIRMAP];
+static int pf_threads = -1;
+static int pf_started = 0;
+static int pf_idle = 0;
+static int pf_useproc = 0;
+
+static void fsfr_pf_release(struct fsfr_pf_dir *dir)
+{
+	// called with pf_lock held
+	if (--dir->refs == 0) {
+		close(dir->fd);
+		free(dir);
+	}
+}
+
+static void fsfr_pf_fetch(struct fsfr_pf_item *item)
+{
+	struct stat st;
+	struct fsfr_meta m;
+	if (fsfr_base_fstatat(item->dir->fd,item->name,&st,AT_SYMLINK_NOFOLLOW)) return;
+	if (S_ISLNK(st.st_mode) || pf_useproc) {
+		char path[PATH_MAX];
+		snprintf(path,PATH_MAX,"/proc/self/fd/%i/%s",item->dir->fd,item->name);
+		fsfr_lgetmeta_stat(path,&m,&st);
+	} else if (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) {
+		// no /proc: open it, but only where that has no side effects
+		int fd = fsfr_base_openat(item->dir->fd,item->name,
+				O_RDONLY|O_NONBLOCK|O_NOFOLLOW|O_NOCTTY|O_CLOEXEC,0);
+		if (fd==-1) return;
+		fsfr_fgetmeta_stat(fd,&m,&st);
+		close(fd);
+	}
+}
+
+// With /proc, stat everything first and then fetch all the records
+// the journal and the cache don't already have in one batch. The
+// rest is what fsfr_lgetmeta_stat() would have done for each.
+static void fsfr_pf_fetch_batch(struct fsfr_pf_item *items, int n)
+{
+	struct fsfr_batch_op ops[PF_BATCH];
+	struct fsfr_meta recs[PF_BATCH], m;
+	struct stat st[PF_BATCH];
+	char paths[PF_BATCH][PF_PATH];
+	int i, k = 0, rtn;
+	if (!pf_useproc) {
+		for (i=0; i<n; i++) fsfr_pf_fetch(&items[i]);
+		return;
+	}
+	for (i=0; i<n; i++) {
+		if (fsfr_base_fstatat(items[i].dir->fd,items[i].name,&st[k],AT_SYMLINK_NOFOLLOW))
+			continue;
+		snprintf(paths[k],PF_PATH,"/proc/self/fd/%i/%s",items[i].dir->fd,items[i].name);
+		if (S_ISLNK(st[k].st_mode)) {
+			fsfr_lgetmeta_stat(paths[k],&m,&st[k]);
+			continue;
+		}
+		if (fsfr_journal_get(st[k].st_dev,st[k].st_ino,&m)) continue;
+		if (fsfr_cache_get(st[k].st_dev,st[k].st_ino,&st[k].st_ctim,&m,&rtn)) {
+			FSFR_STATS_COUNT(HIT,1);
+			continue;
+		}
+		FSFR_STATS_COUNT(MISS,1);
+		ops[k].op = FSFR_BATCH_GETXATTR;
+		ops[k].path = paths[k];
+		ops[k].name = XATTR_META;
+		ops[k].value = &recs[k];
+		ops[k].size = sizeof(recs[k]);
+		k++;
+	}
+	fsfr_batch(ops,k);
+	for (i=0; i<k; i++) {
+		if (ops[i].res==sizeof(recs[i]) && recs[i].version==FSFR_META_VERSION) {
+			m = recs[i];
+			rtn = 0;
+		} else {
+			rtn = fsfr_lgetmeta_legacy(paths[i],&m);
+		}
+		if (rtn==-1 && fsfr_index_on())
+			rtn = fsfr_index_get(AT_FDCWD,paths[i],&FSFR_INDEX_KEY(&st[i]),&m);
+		fsfr_cache_put(st[i].st_dev,st[i].st_ino,&st[i].st_ctim,&m,rtn);
+	}
+}
+
+// With FSFR_DAEMON, stat them all and ask for the lot at once.
+static void fsfr_pf_fetch_daemon(struct fsfr_pf_item *items, int n)
+{
+	struct stat st[PF_BATCH];
+	int i, k = 0;
+	for (i=0; i<n; i++)
+		if (!fsfr_base_fstatat(items[i].dir->fd,items[i].name,&st[k],AT_SYMLINK_NOFOLLOW)) k++;
+	fsfr_daemon_prefetch(st,k);
+}
+
+static void *fsfr_pf_worker(void *arg)
+{
+	struct fsfr_pf_item items[PF_BATCH];
+	int i, n;
+	pthread_mutex_lock(&pf_lock);
+	for (;;) {
+		while (pf_head==pf_tail) {
+			pf_idle++;
+			pthread_cond_wait(&pf_cond,&pf_lock);
+			pf_idle--;
+		}
+		// take a few at a time to keep the lock out of the way
+		for (n=0; n<PF_BATCH && pf_head!=pf_tail; n++)
+			items[n] = pf_queue[pf_tail++ & (PF_QUEUE-1)];
+		pthread_mutex_unlock(&pf_lock);
+		if (fsfr_daemon_on()) fsfr_pf_fetch_daemon(items,n);
+		else fsfr_pf_fetch_batch(items,n);
+		pthread_mutex_lock(&pf_lock);
+		for (i=0; i<n; i++) fsfr_pf_release(items[i].dir);
+	}
+	return NULL;
+}
+
+// worker threads don't survive fork(); start over in the child
+static void fsfr_pf_atfork_child(void)
+{
+	pthread_mutex_init(&pf_lock,NULL);
+	pthread_cond_init(&pf_cond,NULL);
+	pf_head = pf_tail = 0;
+	pf_started = 0;
+	pf_idle = 0;
+}
+
+static void fsfr_pf_init(void)
+{
+	char *env = getenv("FSFR_PREFETCH");
+	int n = env ? atoi(env) : 0;
+	if (n > PF_MAXTHREADS) n = PF_MAXTHREADS;
+	pf_useproc = fsfr_have_proc();
+	if (n > 0) pthread_atfork(NULL,NULL,fsfr_pf_atfork_child);
+	pf_threads = n > 0 ? n : 0;
+}
+
+static inline int fsfr_pf_on(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	if (pf_threads==-1) pthread_once(&once,fsfr_pf_init);
+	return pf_threads;
+}
+
+// called with pf_lock held
+static void fsfr_pf_start(void)
+{
+	sigset_t all, old;
+	int i;
+	pf_started = 1;
+	// keep the caller's signals off our threads
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK,&all,&old);
+	for (i=0; i<pf_threads; i++) {
+		pthread_t t;
+		if (!pthread_create(&t,NULL,fsfr_pf_worker,NULL)) pthread_detach(t);
+	}
+	pthread_sigmask(SIG_SETMASK,&old,NULL);
+}
+
+static struct fsfr_pf_dir *fsfr_pf_newdir(int fd)
+{
+	struct fsfr_pf_dir *dir = malloc(sizeof(*dir));
+	if (!dir) return NULL;
+	dir->fd = fcntl(fd,F_DUPFD_CLOEXEC,0);
+	if (dir->fd==-1) {
+		free(dir);
+		return NULL;
+	}
+	dir->refs = 1;
+	return dir;
+}
+
+// called with pf_lock held
+static void fsfr_pf_push(struct fsfr_pf_dir *dir, const char *name)
+{
+	if (name[0]=='.' && (!name[1] || (name[1]=='.' && !name[2]))) return;
+	if (pf_head - pf_tail >= PF_QUEUE) return;
+	struct fsfr_pf_item *item = &pf_queue[pf_head++ & (PF_QUEUE-1)];
+	item->dir = dir;
+	dir->refs++;
+	strncpy(item->name,name,sizeof(item->name)-1);
+	item->name[sizeof(item->name)-1] = 0;
+	if (!pf_started) fsfr_pf_start();
+	// a wakeup is a syscall; only bother when someone's waiting
+	if (pf_idle && (pf_head - pf_tail) % PF_BATCH == 1) pthread_cond_signal(&pf_cond);
+}
+
+static inline unsigned int fsfr_pf_hash(void *key)
+{
+	return (unsigned int)(((uintptr_t)key >> 4) & (PF_DIRMAP-1));
+}
+
+// queue one entry read from a DIR stream
+void fsfr_prefetch_dirent(DIR *d, const char *name)
+{
+	if (!fsfr_pf_on()) return;
+	pthread_mutex_lock(&pf_lock);
+	struct fsfr_pf_dirmap **bucket = &pf_dirmap[fsfr_pf_hash(d)];
+	struct fsfr_pf_dirmap *e;
+	for (e = *bucket; e && e->key!=d; e = e->next);
+	if (!e && (e = malloc(sizeof(*e)))) {
+		e->key = d;
+		e->dir = fsfr_pf_newdir(dirfd(d));
+		e->next = *bucket;
+		*bucket = e;
+	}
+	if (e && e->dir) fsfr_pf_push(e->dir,name);
+	pthread_mutex_unlock(&pf_lock);
+}
+
+void fsfr_prefetch_closedir(DIR *d)
+{
+	if (!fsfr_pf_on()) return;
+	pthread_mutex_lock(&pf_lock);
+	struct fsfr_pf_dirmap **p = &pf_dirmap[fsfr_pf_hash(d)];
+	for (; *p; p = &(*p)->next) {
+		if ((*p)->key!=d) continue;
+		struct fsfr_pf_dirmap *e = *p;
+		*p = e->next;
+		if (e->dir) fsfr_pf_release(e->dir);
+		free(e);
+		break;
+	}
+	pthread_mutex_unlock(&pf_lock);
+}
+
+// queue everything returned by one getdents64() call
+void fsfr_prefetch_getdents(int fd, const void *buf, ssize_t len)
+{
+	if (len<=0 || !fsfr_pf_on()) return;
+	pthread_mutex_lock(&pf_lock);
+	struct fsfr_pf_dir *dir = fsfr_pf_newdir(fd);
+	if (dir) {
+		const char *p = buf;
+		while (p < (const char *)buf + len) {
+			const struct dirent64 *de = (const struct dirent64 *)p;
+			fsfr_pf_push(dir,de->d_name);
+			p += de->d_reclen;
+		}
+		fsfr_pf_release(dir);
+	}
+	pthread_mutex_unlock(&pf_lock);
+}
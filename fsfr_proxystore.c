@@ -0,0 +1,375 @@
+/*
+ * fsfr_proxystore.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+#include "fsfr.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+/****************************************************************
+ *  Proxy store
+ *  	Symlink metadata kept in a single file named by
+ *  	FSFR_PROXY_STORE, instead of one empty proxy file per inode
+ *  	in FSFR_PROXY_DIR. The file is an open-addressing hash table
+ *  	keyed by (st_dev, st_ino), so links on different filesystems
+ *  	no longer share an entry.
+ *
+ *  	Readers never lock and make no syscalls once the file is
+ *  	mapped. Writers serialize on flock() across processes. A slot
+ *  	holds two copies of the metadata: an update fills in the one
+ *  	not in use and then bumps the slot's generation to switch
+ *  	over, and a new key is only published once its slot is
+ *  	complete, so a writer dying halfway leaves the old state.
+ *
+ *  	The table doesn't grow. Its size is fixed when the file is
+ *  	created (FSFR_PROXY_STORE_SLOTS, default 256k entries); the
+ *  	file is sparse, so unused slots cost no disk space.
+ *
+ *  	Removing an entry leaves a tombstone, so that lookups still
+ *  	get past it. Once the table is three-quarters full and enough
+ *  	of that is tombstones, the writer who notices compacts it in
+ *  	place (fsfr-prune does so after every sweep): entries move
+ *  	back into tombstones along their own probe chain, and then
+ *  	every tombstone no chain runs through is emptied. Each step
+ *  	leaves a valid table, and readers that miss while entries are
+ *  	being moved look again.
+ ****************************************************************/
+
+#define STORE_MAGIC 0x3154535246534631ULL	// "1FSFRST1"
+#define STORE_SLOTS (1<<18)
+
+#define SLOT_EMPTY 0
+#define SLOT_USED 1
+#define SLOT_DELETED 2	// keeps probe chains intact
+
+struct fsfr_store_slot {
+	uint32_t state;
+	uint32_t gen;		// low bit picks the live copy of meta
+	uint64_t dev;
+	uint64_t ino;
+	struct fsfr_meta meta[2];
+};
+
+struct fsfr_store_header {
+	uint64_t magic;
+	uint64_t nslots;
+	uint64_t used;		// SLOT_USED + SLOT_DELETED
+	uint64_t deleted;	// SLOT_DELETED
+	uint64_t moves;		// bumped as compaction moves each entry
+	char pad[24];
+};
+
+static struct fsfr_store_header *store_hdr = NULL;
+static struct fsfr_store_slot *store_slots = NULL;
+static uint64_t store_mask = 0;
+static const char *store_path = NULL;
+// flock() belongs to the open file, which a child shares with its
+// parent; each process takes its locks on a descriptor of its own
+static int store_lockfd = -1;
+static pid_t store_lockpid = 0;
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fsfr_store_attach(void)
+{
+	char *path = getenv("FSFR_PROXY_STORE");
+	char *env = getenv("FSFR_PROXY_STORE_SLOTS");
+	if (!path || !*path) return;
+	uint64_t nslots = 1;
+	uint64_t want = env && atol(env) > 0 ? atol(env) : STORE_SLOTS;
+	while (nslots < want && nslots < (1ULL<<32)) nslots <<= 1;
+
+	int fd = fsfr_base_open(path,O_RDWR|O_CREAT|O_CLOEXEC,0644);
+	if (fd==-1) {
+		fprintf(stderr,"fsfakeroot: %s: %s\n",path,strerror(errno));
+		return;
+	}
+	// creating and sizing it happens under the write lock
+	struct stat st;
+	flock(fd,LOCK_EX);
+	if (fsfr_base_fstat(fd,&st)) goto fail;
+	if (st.st_size >= sizeof(struct fsfr_store_header)) {
+		struct fsfr_store_header hdr;
+		if (pread(fd,&hdr,sizeof(hdr),0)!=sizeof(hdr) || hdr.magic!=STORE_MAGIC) {
+			fprintf(stderr,"fsfakeroot: %s is not a proxy store\n",path);
+			goto fail;
+		}
+		nslots = hdr.nslots;
+	} else {
+		struct fsfr_store_header hdr;
+		memset(&hdr,0,sizeof(hdr));
+		hdr.magic = STORE_MAGIC;
+		hdr.nslots = nslots;
+		if (ftruncate(fd,sizeof(hdr) + nslots*sizeof(struct fsfr_store_slot))
+				|| pwrite(fd,&hdr,sizeof(hdr),0)!=sizeof(hdr)) goto fail;
+	}
+	size_t size = sizeof(struct fsfr_store_header) + nslots*sizeof(struct fsfr_store_slot);
+	void *map = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	flock(fd,LOCK_UN);
+	if (map==MAP_FAILED) goto fail;
+	store_hdr = map;
+	store_slots = (struct fsfr_store_slot *)(store_hdr+1);
+	store_mask = nslots-1;
+	store_path = path;
+	store_lockfd = fd;
+	store_lockpid = getpid();
+	return;
+fail:
+	close(fd);
+}
+
+int fsfr_store_on(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once,fsfr_store_attach);
+	return store_slots!=NULL;
+}
+
+static inline uint64_t fsfr_store_hash(uint64_t dev, uint64_t ino)
+{
+	uint64_t h = (dev * 0x9e3779b97f4a7c15ULL) ^ ino;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	return h ^ (h >> 31);
+}
+
+// Slot holding (dev, ino), or NULL. With last set, the last of them:
+// a compaction that died halfway through a move leaves two behind.
+static struct fsfr_store_slot *fsfr_store_find(uint64_t dev, uint64_t ino, int last)
+{
+	struct fsfr_store_slot *found = NULL;
+	uint64_t h = fsfr_store_hash(dev,ino), i;
+	for (i=0; i<=store_mask; i++) {
+		struct fsfr_store_slot *s = &store_slots[(h+i) & store_mask];
+		uint32_t state = __atomic_load_n(&s->state,__ATOMIC_ACQUIRE);
+		if (state==SLOT_EMPTY) break;
+		if (state==SLOT_USED && s->dev==dev && s->ino==ino) {
+			found = s;
+			if (!last) break;
+		}
+	}
+	return found;
+}
+
+// Returns 0 and fills m if there's an entry, -1 if not
+int fsfr_store_get(dev_t dev, ino_t ino, struct fsfr_meta *m)
+{
+	fsfr_meta_init(m);
+	if (!fsfr_store_on()) return -1;
+	for (;;) {
+		// a miss only counts if no entry moved in the meantime
+		uint64_t moves = __atomic_load_n(&store_hdr->moves,__ATOMIC_ACQUIRE);
+		struct fsfr_store_slot *s = fsfr_store_find(dev,ino,0);
+		uint32_t gen = 0;
+		int mine = 0;
+		if (s) {
+			gen = __atomic_load_n(&s->gen,__ATOMIC_ACQUIRE);
+			*m = s->meta[gen & 1];
+			mine = s->dev==dev && s->ino==ino
+					&& __atomic_load_n(&s->state,__ATOMIC_RELAXED)==SLOT_USED;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			// the copy we read is only rewritten after gen has moved on
+			if (__atomic_load_n(&s->gen,__ATOMIC_RELAXED)!=gen) continue;
+			if (mine) return 0;
+		}
+		if (__atomic_load_n(&store_hdr->moves,__ATOMIC_ACQUIRE)!=moves) continue;
+		fsfr_meta_init(m);
+		return -1;
+	}
+}
+
+static int fsfr_store_lock(void)
+{
+	pthread_mutex_lock(&store_lock);
+	if (store_lockpid!=getpid()) {
+		int fd = fsfr_base_open(store_path,O_RDWR|O_CLOEXEC,0);
+		if (fd==-1) {
+			int err = errno;
+			pthread_mutex_unlock(&store_lock);
+			return -err;
+		}
+		close(store_lockfd);
+		store_lockfd = fd;
+		store_lockpid = getpid();
+	}
+	flock(store_lockfd,LOCK_EX);
+	return 0;
+}
+
+static void fsfr_store_unlock(void)
+{
+	flock(store_lockfd,LOCK_UN);
+	pthread_mutex_unlock(&store_lock);
+}
+
+// Publish (dev, ino) in a slot that isn't in use. A reader still
+// holding this slot from its old key sees the generation move and
+// goes away. Called with the lock held.
+static void fsfr_store_fill(struct fsfr_store_slot *s, uint64_t dev, uint64_t ino,
+		const struct fsfr_meta *m)
+{
+	uint32_t gen = s->gen;
+	if (s->state==SLOT_EMPTY) store_hdr->used++;
+	else if (store_hdr->deleted) store_hdr->deleted--;	// 0 in older files
+	s->meta[(gen+1) & 1] = *m;
+	s->dev = dev;
+	s->ino = ino;
+	__atomic_store_n(&s->gen,gen+1,__ATOMIC_RELEASE);
+	__atomic_store_n(&s->state,SLOT_USED,__ATOMIC_RELEASE);
+}
+
+static void fsfr_store_delete(struct fsfr_store_slot *s)
+{
+	__atomic_store_n(&s->state,SLOT_DELETED,__ATOMIC_RELEASE);
+	store_hdr->deleted++;
+}
+
+// Compact the table in place; called with the lock held. Offsets
+// below are counted from the slot after the first empty one, so a
+// probe chain never wraps around past the start.
+static void fsfr_store_compact(void)
+{
+	uint64_t nslots = store_mask+1, start = 0, i, lap = 0;
+	for (i=0; i<nslots; i++) {
+		if (store_slots[i].state==SLOT_EMPTY) {
+			start = i+1;
+			lap = 1;
+			break;
+		}
+	}
+
+	// Move each entry into the first tombstone between its home slot
+	// and where it is now. The copy is published before the original
+	// goes, and moves is bumped in between, so a reader can only miss
+	// it if moves has changed by the time it gives up.
+	uint32_t *holes = malloc(nslots*sizeof(*holes));	// tombstone offsets, ascending
+	uint64_t nholes = 0;
+	for (i=0; holes && i<nslots; i++) {
+		struct fsfr_store_slot *s = &store_slots[(start+i) & store_mask];
+		if (s->state==SLOT_EMPTY) {
+			nholes = 0;		// no chain runs through here
+			continue;
+		}
+		if (s->state==SLOT_DELETED) {
+			holes[nholes++] = i;
+			continue;
+		}
+		uint32_t home = (fsfr_store_hash(s->dev,s->ino) - start) & store_mask;
+		uint32_t *h = holes, *end = holes+nholes;
+		// first hole at or after home
+		while (h < end) {
+			uint32_t *mid = h + (end-h)/2;
+			if (*mid < home) h = mid+1;
+			else end = mid;
+		}
+		if (h==holes+nholes || *h >= i) continue;
+		struct fsfr_store_slot *d = &store_slots[(start+*h) & store_mask];
+		fsfr_store_fill(d,s->dev,s->ino,&s->meta[s->gen & 1]);
+		__atomic_add_fetch(&store_hdr->moves,1,__ATOMIC_RELEASE);
+		fsfr_store_delete(s);
+		memmove(h,h+1,(holes+nholes-h-1)*sizeof(*h));
+		holes[nholes-1] = i;	// still ascending: everything else is behind us
+	}
+	free(holes);
+
+	// Going backwards, need counts the slots ahead that some entry
+	// already passed still probes through. A tombstone nobody needs
+	// can be emptied. Without an empty slot to start from, a first lap
+	// goes round to see every entry before the second empties anything.
+	uint64_t need = 0, used = 0, deleted = 0;
+	for (; lap<2; lap++) {
+		for (i=nslots; i-- > 0; ) {
+			struct fsfr_store_slot *s = &store_slots[(start+i) & store_mask];
+			if (s->state==SLOT_EMPTY) {
+				need = 0;
+				continue;
+			}
+			if (s->state==SLOT_DELETED && !need && lap) {
+				__atomic_store_n(&s->state,SLOT_EMPTY,__ATOMIC_RELEASE);
+				continue;
+			}
+			if (need) need--;
+			if (s->state==SLOT_USED) {
+				uint64_t disp = ((start+i) - fsfr_store_hash(s->dev,s->ino)) & store_mask;
+				if (disp > need) need = disp;
+			}
+			if (lap) {
+				used++;
+				deleted += s->state==SLOT_DELETED;
+			}
+		}
+	}
+	store_hdr->used = used;
+	store_hdr->deleted = deleted;
+}
+
+// Empty metadata removes the entry. Returns 0 or -errno
+int fsfr_store_put(dev_t dev, ino_t ino, const struct fsfr_meta *m)
+{
+	if (!fsfr_store_on()) return -ENOENT;
+	// clearing what isn't there is common, and needs no lock
+	struct fsfr_meta cur;
+	if (fsfr_meta_isempty(m) && fsfr_store_get(dev,ino,&cur)) return 0;
+	int rtn = fsfr_store_lock();
+	if (rtn) return rtn;
+
+	struct fsfr_store_slot *s = fsfr_store_find(dev,ino,0);
+	if (s && fsfr_meta_isempty(m)) {
+		// any stray copy further down would show through
+		while ((s = fsfr_store_find(dev,ino,1))) fsfr_store_delete(s);
+	} else if (s) {
+		uint32_t gen = s->gen;
+		s->meta[(gen+1) & 1] = *m;
+		__atomic_store_n(&s->gen,gen+1,__ATOMIC_RELEASE);
+	} else if (!fsfr_meta_isempty(m)) {
+		// first free slot along the chain; reusing a deleted one
+		// is safe now that we know the key isn't further down
+		uint64_t h = fsfr_store_hash(dev,ino), i;
+		for (i=0; i<=store_mask; i++) {
+			s = &store_slots[(h+i) & store_mask];
+			if (s->state!=SLOT_USED) break;
+		}
+		if (i>store_mask) rtn = -ENOSPC;
+		else fsfr_store_fill(s,dev,ino,m);
+	}
+	// Compacting costs a pass over the table; only when it's due, or
+	// when there's no empty slot left to end a miss. Files from before
+	// deleted was kept start at 0, and get the exact count from then.
+	if (store_hdr->deleted && (store_hdr->used > store_mask
+			|| (store_hdr->used > store_mask/4*3 && store_hdr->deleted > store_mask/16)))
+		fsfr_store_compact();
+
+	fsfr_store_unlock();
+	return rtn;
+}
+
+// Drop every entry keep() says no to; returns how many, or -errno.
+// A dry run only counts them: it changes nothing, so it takes no lock
+// and the count is as of whenever each slot was looked at.
+long fsfr_store_sweep(int (*keep)(uint64_t dev, uint64_t ino, void *arg), void *arg,
+		int dryrun)
+{
+	if (!fsfr_store_on()) return -ENOENT;
+	int rtn = dryrun ? 0 : fsfr_store_lock();
+	if (rtn) return rtn;
+	long dropped = 0, deleted = 0;
+	uint64_t i;
+	for (i=0; i<=store_mask; i++) {
+		struct fsfr_store_slot *s = &store_slots[i];
+		if (s->state==SLOT_DELETED) deleted++;
+		if (s->state!=SLOT_USED || keep(s->dev,s->ino,arg)) continue;
+		if (!dryrun) fsfr_store_delete(s);
+		dropped++;
+	}
+	if (dryrun) return dropped;
+	if (dropped || deleted) fsfr_store_compact();
+	fsfr_store_unlock();
+	return dropped;
+}
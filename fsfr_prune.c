@@ -0,0 +1,253 @@
+/*
+ * fsfr_prune.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+/****************************************************************
+ *  fsfr-prune
+ *  	Remove proxy entries whose symlink no longer exists. The
+ *  	fake root is walked by a few threads at once, collecting the
+ *  	inode of every symlink into a hash set; then each proxy entry
+ *  	is kept or dropped with a single lookup. Handles both an
+ *  	FSFR_PROXY_DIR (one file per inode) and an FSFR_PROXY_STORE.
+ *
+ *  	Proxy files are named by inode alone, so in a proxy dir an
+ *  	entry survives if any symlink under the given roots has that
+ *  	inode. Store entries carry the device as well, and entries
+ *  	for devices not seen during the walk are left alone.
+ ****************************************************************/
+
+#include "fsfr.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+#define PRUNE_THREADS 8
+#define PRUNE_BATCH 256
+#define PRUNE_MAXDEVS 64
+
+struct prune_key {
+	uint64_t dev;
+	uint64_t ino;
+};
+
+// set of symlinks seen, open addressing; ino 0 marks a free slot
+static struct prune_key *seen = NULL;
+static size_t seen_size = 0, seen_used = 0;
+static uint64_t seen_devs[PRUNE_MAXDEVS];
+static int seen_ndevs = 0;
+static pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int bydev = 0;		// key on (dev, ino) rather than ino alone
+static int dryrun = 0;
+static int verbose = 0;
+static long failed = 0;
+
+static inline size_t prune_hash(const struct prune_key *k)
+{
+	uint64_t h = (k->dev * 0x9e3779b97f4a7c15ULL) ^ k->ino;
+	h *= 0xff51afd7ed558ccdULL;
+	return (size_t)(h ^ (h >> 32));
+}
+
+static void seen_insert(const struct prune_key *k)
+{
+	size_t i = prune_hash(k) & (seen_size-1);
+	while (seen[i].ino && (seen[i].dev!=k->dev || seen[i].ino!=k->ino))
+		i = (i+1) & (seen_size-1);
+	if (!seen[i].ino) {
+		seen[i] = *k;
+		seen_used++;
+	}
+}
+
+static void seen_grow(void)
+{
+	struct prune_key *old = seen;
+	size_t oldsize = seen_size, i;
+	seen_size = seen_size ? seen_size*2 : 1<<16;
+	seen = calloc(seen_size,sizeof(*seen));
+	if (!seen) {
+		perror("fsfr-prune");
+		exit(1);
+	}
+	seen_used = 0;
+	for (i=0; i<oldsize; i++) if (old[i].ino) seen_insert(&old[i]);
+	free(old);
+}
+
+static int seen_has(uint64_t dev, uint64_t ino)
+{
+	struct prune_key k = { bydev?dev:0, ino };
+	size_t i = prune_hash(&k) & (seen_size-1);
+	for (; seen[i].ino; i = (i+1) & (seen_size-1))
+		if (seen[i].dev==k.dev && seen[i].ino==k.ino) return 1;
+	return 0;
+}
+
+static void seen_add(const struct prune_key *keys, int n, uint64_t dev)
+{
+	int i;
+	pthread_mutex_lock(&seen_lock);
+	for (i=0; i<seen_ndevs && seen_devs[i]!=dev; i++);
+	if (i==seen_ndevs && seen_ndevs<PRUNE_MAXDEVS) seen_devs[seen_ndevs++] = dev;
+	for (i=0; i<n; i++) {
+		if ((seen_used+1)*2 > seen_size) seen_grow();
+		seen_insert(&keys[i]);
+	}
+	pthread_mutex_unlock(&seen_lock);
+}
+
+static char *path_join(const char *dir, const char *name)
+{
+	size_t len = strlen(dir) + strlen(name) + 2;
+	char *path = malloc(len);
+	if (!path) {
+		perror("fsfr-prune");
+		exit(1);
+	}
+	snprintf(path,len,"%s/%s",dir,name);
+	return path;
+}
+
+// one directory of the walk, see fsfr_walk.c
+static void scan_dir(const char *path, void *arg)
+{
+	struct prune_key keys[PRUNE_BATCH];
+	struct stat st;
+	int n = 0;
+	int fd = open(path,O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	DIR *d = fd==-1 ? NULL : fdopendir(fd);
+	if (!d || fstat(fd,&st)) {
+		perror(path);
+		if (fd!=-1) close(fd);
+		__atomic_add_fetch(&failed,1,__ATOMIC_RELAXED);
+		return;
+	}
+	uint64_t dev = st.st_dev;
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		const char *name = de->d_name;
+		if (name[0]=='.' && (!name[1] || (name[1]=='.' && !name[2]))) continue;
+		int type = de->d_type;
+		uint64_t ino = de->d_ino;
+		if (type==DT_UNKNOWN) {
+			struct stat est;
+			if (fstatat(fd,name,&est,AT_SYMLINK_NOFOLLOW)) continue;
+			type = IFTODT(est.st_mode);
+			ino = est.st_ino;
+		}
+		if (type==DT_DIR) {
+			fsfr_walk_push(path_join(path,name));
+		} else if (type==DT_LNK) {
+			keys[n].dev = bydev?dev:0;
+			keys[n].ino = ino;
+			if (++n==PRUNE_BATCH) {
+				seen_add(keys,n,dev);
+				n = 0;
+			}
+		}
+	}
+	closedir(d);
+	seen_add(keys,n,dev);
+}
+
+static int store_keep(uint64_t dev, uint64_t ino, void *arg)
+{
+	int i;
+	for (i=0; i<seen_ndevs && seen_devs[i]!=dev; i++);
+	if (i==seen_ndevs) return 1;	// not ours to judge
+	if (seen_has(dev,ino)) return 1;
+	if (verbose) printf("dev %llu ino %llu\n",(unsigned long long)dev,(unsigned long long)ino);
+	return 0;
+}
+
+static long prune_dir(const char *dir)
+{
+	long dropped = 0;
+	DIR *d = opendir(dir);
+	if (!d) {
+		perror(dir);
+		failed++;
+		return 0;
+	}
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		unsigned long long ino;
+		char suffix[8];
+		if (sscanf(de->d_name,"%llu.%7s",&ino,suffix)!=2 || strcmp(suffix,"fsfr")) continue;
+		if (seen_has(0,ino)) continue;
+		if (verbose) printf("%s/%s\n",dir,de->d_name);
+		if (!dryrun && unlinkat(dirfd(d),de->d_name,0)) {
+			perror(de->d_name);
+			failed++;
+			continue;
+		}
+		dropped++;
+	}
+	closedir(d);
+	return dropped;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,"usage: %s [-nv] [-j threads] [-d proxy_dir | -s proxy_store] <fake_root>...\n",name);
+	fprintf(stderr,"  Removes proxy entries for symlinks that no longer exist under\n");
+	fprintf(stderr,"  any <fake_root>. Defaults to $FSFR_PROXY_STORE, then $FSFR_PROXY_DIR.\n");
+	fprintf(stderr,"  -n: only list what would be removed (with -v)\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = getenv("FSFR_PROXY_DIR");
+	const char *store = getenv("FSFR_PROXY_STORE");
+	int threads = PRUNE_THREADS;
+	int opt, i;
+	while ((opt = getopt(argc,argv,"nvj:d:s:")) != -1) {
+		switch (opt) {
+		case 'n': dryrun = 1; break;
+		case 'v': verbose = 1; break;
+		case 'j': threads = atoi(optarg); break;
+		case 'd': dir = optarg; store = NULL; break;
+		case 's': store = optarg; dir = NULL; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind >= argc || threads < 1 || (!dir && !store)) usage(argv[0]);
+	if (store) {
+		setenv("FSFR_PROXY_STORE",store,1);
+		if (!fsfr_store_on()) {
+			fprintf(stderr,"%s: cannot open proxy store\n",store);
+			return 1;
+		}
+		bydev = 1;
+	}
+
+	seen_grow();
+	for (i=optind; i<argc; i++) fsfr_walk_push(strdup(argv[i]));
+	fsfr_walk(threads,scan_dir,NULL);
+	// a partial walk would make live entries look orphaned
+	if (failed) {
+		fprintf(stderr,"fsfr-prune: errors while scanning; nothing removed\n");
+		return 1;
+	}
+
+	long dropped = 0;
+	if (store) {
+		dropped = fsfr_store_sweep(store_keep,NULL,dryrun);
+		if (dropped < 0) {
+			fprintf(stderr,"%s: %s\n",store,strerror(-dropped));
+			return 1;
+		}
+	} else {
+		dropped = prune_dir(dir);
+	}
+	if (verbose) fprintf(stderr,"%zu symlinks, %li entries %s\n",seen_used,dropped,
+			dryrun?"orphaned":"removed");
+	return failed?1:0;
+}
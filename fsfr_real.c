@@ -0,0 +1,92 @@
+/*
+ * fsfr_real.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+#include "fsfr.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/****************************************************************
+ *  Real function table
+ *  	Everything in FSFR_REAL_SYMBOLS is looked up with
+ *  	dlsym(RTLD_NEXT) in one go from a constructor, and the
+ *  	table is then made read-only. Wrappers call through it
+ *  	directly: no lazy lookup, no NULL check, no race.
+ *
+ *  	Other libraries' constructors may run before ours and
+ *  	already call into us (libselinux stats files, for one), so
+ *  	every entry starts out pointing at a stub that fills in the
+ *  	table first and then makes the call.
+ *
+ *  	A symbol this libc doesn't have fails with ENOSYS when
+ *  	called, rather than taking the process down at load time:
+ *  	-1 or NULL and errno, as its own type returns an error, or
+ *  	the error itself for the posix_spawn() family, which
+ *  	returns it.
+ ****************************************************************/
+
+#define FSFR_REAL_STUB(NAME,RTN,PARAMS,ARGS)		\
+static RTN fsfr_stub_##NAME PARAMS					\
+{													\
+	fsfr_real_init();								\
+	return fsfr_real.NAME ARGS;						\
+}
+FSFR_REAL_SYMBOLS(FSFR_REAL_STUB)
+#undef FSFR_REAL_STUB
+
+union fsfr_real_page fsfr_real_page __attribute__((aligned(FSFR_REAL_PAGE))) = {
+	.table = {
+#define FSFR_REAL_STUB(NAME,RTN,PARAMS,ARGS) .NAME = fsfr_stub_##NAME,
+		FSFR_REAL_SYMBOLS(FSFR_REAL_STUB)
+#undef FSFR_REAL_STUB
+	}
+};
+
+// A symbol this libc lacks gets one of these in its place: NULL for
+// a pointer, -1 for anything else. A pointer type missing from the
+// list picks -1, which won't convert, so it can't be missed.
+#define FSFR_REAL_FAIL(RTN) _Generic((RTN)0,							\
+	struct dirent *: NULL, struct dirent64 *: NULL, default: -1)
+#define FSFR_REAL_MISSING(NAME,RTN,PARAMS,ARGS)			\
+static RTN fsfr_missing_##NAME PARAMS					\
+{														\
+	errno = ENOSYS;										\
+	return FSFR_REAL_FAIL(RTN);							\
+}
+FSFR_REAL_SYMBOLS(FSFR_REAL_MISSING)
+#undef FSFR_REAL_MISSING
+
+static int fsfr_real_nospawn(pid_t *pid, const char *p, const posix_spawn_file_actions_t *fa,
+		const posix_spawnattr_t *at, char *const *a, char *const *e)
+{
+	return ENOSYS;
+}
+
+static void fsfr_real_resolve(void)
+{
+	struct fsfr_real_table t;
+#define FSFR_REAL_LOOKUP(NAME,RTN,PARAMS,ARGS)			\
+	t.NAME = dlsym(RTLD_NEXT,#NAME);					\
+	if (!t.NAME) t.NAME = fsfr_missing_##NAME;
+	FSFR_REAL_SYMBOLS(FSFR_REAL_LOOKUP)
+#undef FSFR_REAL_LOOKUP
+	if (t.posix_spawn==fsfr_missing_posix_spawn) t.posix_spawn = fsfr_real_nospawn;
+	if (t.posix_spawnp==fsfr_missing_posix_spawnp) t.posix_spawnp = fsfr_real_nospawn;
+	fsfr_real = t;
+	if (sysconf(_SC_PAGESIZE)==FSFR_REAL_PAGE)
+		mprotect(&fsfr_real_page,FSFR_REAL_PAGE,PROT_READ);
+}
+
+void __attribute__((constructor)) fsfr_real_init(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once,fsfr_real_resolve);
+}
@@ -0,0 +1,155 @@
+/*
+ * fsfr_shmcache.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+#include "fsfr.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/****************************************************************
+ *  Shared metadata cache
+ *  	Second level behind the per-process cache, shared by every
+ *  	process that has FSFR_SHM_CACHE set to the same file (e.g.
+ *  	/dev/shm/fsfr.build). Since it's named by an environment
+ *  	variable, it carries across fork() and exec() and a build's
+ *  	short-lived processes don't each start out cold.
+ *
+ *  	The file is an open-addressing table keyed by (dev, ino)
+ *  	with the ctime stored alongside, same rules as fsfr_cache.c.
+ *  	Each slot is a seqlock: writers claim it with a CAS and
+ *  	readers retry or miss if it moved underneath them, so there
+ *  	are no locks and no syscalls once the file is mapped.
+ *
+ *  	Attaching is deferred to the first lookup, so processes that
+ *  	never stat anything don't pay for it.
+ ****************************************************************/
+
+#define SHM_MAGIC 0x314d485352465346ULL	// "FSFRSHM1"
+#define SHM_SLOTS (1<<18)				// ~24MB, sparse until touched
+#define SHM_PROBE 4
+
+struct fsfr_shm_slot {
+	uint32_t seq;		// odd while being written
+	int32_t rtn;
+	uint64_t dev;
+	uint64_t ino;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	struct fsfr_meta meta;
+};
+
+struct fsfr_shm_header {
+	uint64_t magic;
+	uint64_t nslots;
+	char pad[48];
+};
+
+static struct fsfr_shm_slot *shm_slots = NULL;
+static uint64_t shm_mask = 0;
+
+static void fsfr_shm_attach(void)
+{
+	char *path = getenv("FSFR_SHM_CACHE");
+	if (!path || !*path) return;
+	size_t size = sizeof(struct fsfr_shm_header) + SHM_SLOTS*sizeof(struct fsfr_shm_slot);
+	int fd = fsfr_base_open(path,O_RDWR|O_CREAT|O_CLOEXEC,0600);
+	if (fd==-1) return;
+	struct stat st;
+	// whoever gets here first sizes it; zero-filled means empty
+	if (fsfr_base_fstat(fd,&st) || (st.st_size < size && ftruncate(fd,size))) {
+		close(fd);
+		return;
+	}
+	struct fsfr_shm_header *hdr = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if (hdr==MAP_FAILED) return;
+	uint64_t magic = 0;
+	if (!__atomic_compare_exchange_n(&hdr->magic,&magic,SHM_MAGIC,0,
+			__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)) {
+		// nslots may still be 0 if the creator is right behind us
+		if (magic!=SHM_MAGIC || (hdr->nslots && hdr->nslots!=SHM_SLOTS)) {
+			fprintf(stderr,"fsfakeroot: %s is not a metadata cache\n",path);
+			munmap(hdr,size);
+			return;
+		}
+	} else {
+		hdr->nslots = SHM_SLOTS;
+	}
+	shm_mask = SHM_SLOTS-1;
+	shm_slots = (struct fsfr_shm_slot *)(hdr+1);
+}
+
+static inline int fsfr_shm_on(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once,fsfr_shm_attach);
+	return shm_slots!=NULL;
+}
+
+static inline uint64_t fsfr_shm_hash(dev_t dev, ino_t ino)
+{
+	uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	return h ^ (h >> 29);
+}
+
+int fsfr_shm_get(dev_t dev, ino_t ino, const struct timespec *ctime,
+		struct fsfr_meta *m, int *rtn)
+{
+	if (!fsfr_shm_on()) return 0;
+	uint64_t h = fsfr_shm_hash(dev,ino);
+	int i;
+	for (i=0; i<SHM_PROBE; i++) {
+		struct fsfr_shm_slot *s = &shm_slots[(h+i) & shm_mask];
+		uint32_t seq = __atomic_load_n(&s->seq,__ATOMIC_ACQUIRE);
+		if (seq & 1) continue;
+		if (s->dev!=dev || s->ino!=ino) continue;
+		struct fsfr_shm_slot copy = *s;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq,__ATOMIC_RELAXED)!=seq) return 0;
+		if (copy.ctime_sec!=ctime->tv_sec || copy.ctime_nsec!=ctime->tv_nsec)
+			return 0;
+		*m = copy.meta;
+		*rtn = copy.rtn;
+		return 1;
+	}
+	return 0;
+}
+
+void fsfr_shm_put(dev_t dev, ino_t ino, const struct timespec *ctime,
+		const struct fsfr_meta *m, int rtn)
+{
+	if (!fsfr_shm_on()) return;
+	uint64_t h = fsfr_shm_hash(dev,ino);
+	struct fsfr_shm_slot *s = NULL;
+	int i;
+	// reuse our own slot or an empty one, else evict the first
+	for (i=0; i<SHM_PROBE; i++) {
+		struct fsfr_shm_slot *p = &shm_slots[(h+i) & shm_mask];
+		if ((p->dev==dev && p->ino==ino) || (!p->dev && !p->ino)) {
+			s = p;
+			break;
+		}
+	}
+	if (!s) s = &shm_slots[h & shm_mask];
+
+	uint32_t seq = __atomic_load_n(&s->seq,__ATOMIC_RELAXED);
+	if (seq & 1) return;	// somebody else is on it; it's only a cache
+	if (!__atomic_compare_exchange_n(&s->seq,&seq,seq+1,0,
+			__ATOMIC_ACQUIRE,__ATOMIC_RELAXED)) return;
+	s->dev = dev;
+	s->ino = ino;
+	s->ctime_sec = ctime->tv_sec;
+	s->ctime_nsec = ctime->tv_nsec;
+	s->meta = *m;
+	s->rtn = rtn;
+	__atomic_store_n(&s->seq,seq+2,__ATOMIC_RELEASE);
+}
@@ -0,0 +1,299 @@
+/*
+ * fsfr_stats.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+#include "fsfr.h"
+
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/****************************************************************
+ *  Call statistics
+ *  	FSFR_STATS names a file that gets one line of JSON per
+ *  	process: for each wrapper, how often it was called, the
+ *  	xattr syscalls, proxy hits and cache hits and misses it
+ *  	cost, and a histogram of how long it took, in powers of two
+ *  	of nanoseconds (bucket i counts calls that took less than 2^i
+ *  	and at least 2^(i-1)).
+ *
+ *  	Every thread counts into a block of its own, with plain
+ *  	loads and stores: no locks, no shared cache lines. The
+ *  	blocks are only ever added to a list, and summed when the
+ *  	line is written: at exit, before an exec (after which the
+ *  	counts start over), and on FSFR_STATS_SIGNAL if set. A
+ *  	thread that exits leaves its block to the next new one.
+ *
+ *  	Anything not inside a wrapper (the prefetch workers, a
+ *  	journal flush at exit) is counted under "other".
+ ****************************************************************/
+
+#define STATS_BUCKETS 40
+#define STATS_BUFSIZE 65536
+
+struct fsfr_stats_counters {
+	uint64_t calls;
+	uint64_t count[FSFR_NSTATS];
+	uint64_t hist[STATS_BUCKETS];
+};
+
+struct fsfr_stats_block {
+	struct fsfr_stats_counters op[FSFR_NOPS];
+	int cur;		// the wrapper we're in, or FSFR_OP_other
+	int owned;		// by a live thread
+	struct fsfr_stats_block *next;
+};
+
+static char *stats_path = NULL;
+static struct fsfr_stats_block *stats_blocks = NULL;
+static __thread struct fsfr_stats_block *stats_mine = NULL;
+static pthread_key_t stats_key;
+static int stats_busy = 0;
+static char stats_buf[STATS_BUFSIZE];
+
+static const char *const stats_what[FSFR_NSTATS] = {
+	"xattr_calls", "proxy_hits", "cache_hits", "cache_misses"
+};
+
+// only the owning thread writes, so no lock prefix is needed
+static inline void fsfr_stats_bump(uint64_t *c, uint64_t n)
+{
+	__atomic_store_n(c,__atomic_load_n(c,__ATOMIC_RELAXED)+n,__ATOMIC_RELAXED);
+}
+
+static void fsfr_stats_thread_exit(void *arg)
+{
+	struct fsfr_stats_block *b = arg;
+	b->cur = FSFR_OP_other;
+	__atomic_store_n(&b->owned,0,__ATOMIC_RELEASE);
+}
+
+static struct fsfr_stats_block *fsfr_stats_block(void)
+{
+	struct fsfr_stats_block *b = stats_mine;
+	if (b) return b;
+	for (b = __atomic_load_n(&stats_blocks,__ATOMIC_ACQUIRE); b; b = b->next) {
+		int free = 0;
+		if (__atomic_compare_exchange_n(&b->owned,&free,1,0,
+				__ATOMIC_ACQUIRE,__ATOMIC_RELAXED)) break;
+	}
+	if (!b) {
+		b = mmap(NULL,sizeof(*b),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+		if (b==MAP_FAILED) return NULL;
+		b->cur = FSFR_OP_other;
+		b->owned = 1;
+		b->next = __atomic_load_n(&stats_blocks,__ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&stats_blocks,&b->next,b,1,
+				__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+	}
+	pthread_setspecific(stats_key,b);
+	stats_mine = b;
+	return b;
+}
+
+// Returns 1 if the call is to be counted, 0 if it's inside another
+// one (or there's nowhere to count it). See fsfr_call_enter
+int fsfr_stats_enter(enum fsfr_op op)
+{
+	struct fsfr_stats_block *b = fsfr_stats_block();
+	if (!b || b->cur!=FSFR_OP_other) return 0;
+	b->cur = op;
+	return 1;
+}
+
+// ns is how long it took
+void fsfr_stats_leave(uint64_t ns)
+{
+	struct fsfr_stats_block *b = stats_mine;
+	int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if (bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS-1;
+	fsfr_stats_bump(&b->op[b->cur].calls,1);
+	fsfr_stats_bump(&b->op[b->cur].hist[bucket],1);
+	b->cur = FSFR_OP_other;
+}
+
+void fsfr_stats_add(int what, uint64_t n)
+{
+	struct fsfr_stats_block *b = fsfr_stats_block();
+	if (b) fsfr_stats_bump(&b->op[b->cur].count[what],n);
+}
+
+/****************************************************************
+ *  Output
+ *  	Formatted by hand into a static buffer and written with a
+ *  	single append, so a signal handler can do it too, and lines
+ *  	from processes sharing the file don't interleave.
+ ****************************************************************/
+struct fsfr_stats_out {
+	char *p, *end;
+};
+
+static void fsfr_stats_puts(struct fsfr_stats_out *o, const char *s)
+{
+	while (*s && o->p < o->end) *o->p++ = *s++;
+}
+
+static void fsfr_stats_putu(struct fsfr_stats_out *o, uint64_t v)
+{
+	char tmp[24];
+	int n = sizeof(tmp);
+	tmp[--n] = '\0';
+	do {
+		tmp[--n] = '0' + v%10;
+		v /= 10;
+	} while (v);
+	fsfr_stats_puts(o,tmp+n);
+}
+
+// a JSON string, with anything unusual replaced
+static void fsfr_stats_putstr(struct fsfr_stats_out *o, const char *s)
+{
+	fsfr_stats_puts(o,"\"");
+	for (; *s && o->p < o->end; s++)
+		*o->p++ = (*s<' ' || *s>'~' || *s=='"' || *s=='\\') ? '?' : *s;
+	fsfr_stats_puts(o,"\"");
+}
+
+static void fsfr_stats_sum(struct fsfr_stats_counters *sum)
+{
+	struct fsfr_stats_block *b;
+	int i, j;
+	memset(sum,0,sizeof(struct fsfr_stats_counters)*FSFR_NOPS);
+	for (b = __atomic_load_n(&stats_blocks,__ATOMIC_ACQUIRE); b; b = b->next) {
+		for (i=0; i<FSFR_NOPS; i++) {
+			sum[i].calls += __atomic_load_n(&b->op[i].calls,__ATOMIC_RELAXED);
+			for (j=0; j<FSFR_NSTATS; j++)
+				sum[i].count[j] += __atomic_load_n(&b->op[i].count[j],__ATOMIC_RELAXED);
+			for (j=0; j<STATS_BUCKETS; j++)
+				sum[i].hist[j] += __atomic_load_n(&b->op[i].hist[j],__ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void fsfr_stats_reset(void)
+{
+	struct fsfr_stats_block *b;
+	for (b = __atomic_load_n(&stats_blocks,__ATOMIC_ACQUIRE); b; b = b->next)
+		memset(b->op,0,sizeof(b->op));
+}
+
+// event is what prompted it: "exit", "exec" or "signal"
+void fsfr_stats_dump(const char *event, int reset)
+{
+	static struct fsfr_stats_counters sum[FSFR_NOPS];
+	struct fsfr_stats_out o = { stats_buf, stats_buf+sizeof(stats_buf)-2 };
+	int i, j, first = 1;
+	if (!(fsfr_hooks & FSFR_HOOK_STATS)) return;
+	if (__atomic_exchange_n(&stats_busy,1,__ATOMIC_ACQUIRE)) return;
+	int err = errno;
+	fsfr_stats_sum(sum);
+	if (reset) fsfr_stats_reset();
+
+	fsfr_stats_puts(&o,"{\"pid\":");
+	fsfr_stats_putu(&o,getpid());
+	fsfr_stats_puts(&o,",\"comm\":");
+	fsfr_stats_putstr(&o,program_invocation_short_name);
+	fsfr_stats_puts(&o,",\"event\":");
+	fsfr_stats_putstr(&o,event);
+	fsfr_stats_puts(&o,",\"ops\":{");
+	for (i=0; i<FSFR_NOPS; i++) {
+		int nz = sum[i].calls!=0, last = 0;
+		for (j=0; j<FSFR_NSTATS; j++) nz |= sum[i].count[j]!=0;
+		if (!nz) continue;
+		if (!first) fsfr_stats_puts(&o,",");
+		first = 0;
+		fsfr_stats_putstr(&o,fsfr_op_names[i]);
+		fsfr_stats_puts(&o,":{\"calls\":");
+		fsfr_stats_putu(&o,sum[i].calls);
+		for (j=0; j<FSFR_NSTATS; j++) {
+			fsfr_stats_puts(&o,",");
+			fsfr_stats_putstr(&o,stats_what[j]);
+			fsfr_stats_puts(&o,":");
+			fsfr_stats_putu(&o,sum[i].count[j]);
+		}
+		// up to the last bucket anything landed in
+		for (j=0; j<STATS_BUCKETS; j++) if (sum[i].hist[j]) last = j+1;
+		fsfr_stats_puts(&o,",\"latency_log2_ns\":[");
+		for (j=0; j<last; j++) {
+			if (j) fsfr_stats_puts(&o,",");
+			fsfr_stats_putu(&o,sum[i].hist[j]);
+		}
+		fsfr_stats_puts(&o,"]}");
+	}
+	fsfr_stats_puts(&o,"}}");
+	// nothing to say (an execvp() working through $PATH), or a line
+	// cut short, which is better skipped than half-written
+	if (!first && o.p < o.end) {
+		*o.p++ = '\n';
+		int fd = fsfr_base_open(stats_path,O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC,0644);
+		if (fd!=-1) {
+			if (write(fd,stats_buf,o.p-stats_buf)) {}
+			fsfr_real.close(fd);
+		}
+	}
+	errno = err;
+	__atomic_store_n(&stats_busy,0,__ATOMIC_RELEASE);
+}
+
+static void fsfr_stats_signal(int sig)
+{
+	fsfr_stats_dump("signal",0);
+}
+
+// a number, or one of the signals nothing else is likely to want
+static int fsfr_stats_signum(const char *s)
+{
+	static const struct { const char *name; int sig; } names[] = {
+		{ "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "HUP", SIGHUP },
+		{ "WINCH", SIGWINCH }, { "PWR", SIGPWR },
+	};
+	char *end;
+	size_t i;
+	if (!strncmp(s,"SIG",3)) s += 3;
+	for (i=0; i<sizeof(names)/sizeof(names[0]); i++)
+		if (!strcmp(s,names[i].name)) return names[i].sig;
+	long n = strtol(s,&end,10);
+	return (*s && !*end && n>0 && n<NSIG) ? n : 0;
+}
+
+// fork() doesn't start a new count; the parent has them already
+static void fsfr_stats_atfork_child(void)
+{
+	fsfr_stats_reset();
+}
+
+static void __attribute__((constructor)) fsfr_stats_init(void)
+{
+	char *sig = getenv("FSFR_STATS_SIGNAL");
+	stats_path = getenv("FSFR_STATS");
+	if (!stats_path || !*stats_path) return;
+	// held on to: the environment may be changed under us before exit
+	stats_path = strdup(stats_path);
+	if (!stats_path || pthread_key_create(&stats_key,fsfr_stats_thread_exit)) return;
+	pthread_atfork(NULL,NULL,fsfr_stats_atfork_child);
+	if (sig && fsfr_stats_signum(sig)) {
+		struct sigaction sa;
+		memset(&sa,0,sizeof(sa));
+		sa.sa_handler = fsfr_stats_signal;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(fsfr_stats_signum(sig),&sa,NULL);
+	}
+	__atomic_or_fetch(&fsfr_hooks,FSFR_HOOK_STATS,__ATOMIC_RELEASE);
+}
+
+// whatever is still held back goes out first, so it's counted
+static void __attribute__((destructor)) fsfr_stats_fini(void)
+{
+	if (!(fsfr_hooks & FSFR_HOOK_STATS)) return;
+	fsfr_journal_flush();
+	fsfr_daemon_flush();
+	fsfr_stats_dump("exit",0);
+}
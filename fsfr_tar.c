@@ -0,0 +1,649 @@
+/*
+ * fsfr_tar.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+/****************************************************************
+ *  fsfr-tar
+ *  	Write a tree to a tar archive with its fake owners, modes and
+ *  	device nodes, without the preload. The output is what
+ *  	"tar --sort=name -cf" gives under fsfakeroot, byte for byte:
+ *  	GNU format, entries in name order, long names and link
+ *  	targets in ././@LongLink entries, hard links stored once.
+ *
+ *  	Directories are read one at a time, in order, and their
+ *  	entries sorted; the stat and metadata lookups for a whole
+ *  	directory are then shared out among the threads while the
+ *  	archive itself is written by the main thread alone. File
+ *  	contents go straight from file to archive in the kernel
+ *  	(copy_file_range, or sendfile, which splices into pipes)
+ *  	when they're large enough to be worth it.
+ ****************************************************************/
+
+#include "fsfr.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/sendfile.h>
+#include <sys/sysmacros.h>
+
+#define TAR_MAXTHREADS 64
+#define TAR_BLOCK 512
+#define TAR_RECORD 10240	// tar's default blocking factor of 20
+#define TAR_OUTBUF (1<<20)	// a multiple of TAR_RECORD isn't needed
+#define TAR_DIRECT 65536	// files at least this big bypass the buffer
+#define TAR_PARALLEL 16		// directories smaller than this aren't shared out
+
+struct tar_ent {
+	char *name;
+	struct stat st;		// with the fake metadata applied
+	int err;		// errno from the stat, if it failed
+};
+
+// GNU tar header, see tar.h; "ustar  \0" marks the GNU format
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[8];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char pad[167];
+};
+
+static int nthreads = 1;
+static int verbose = 0;
+static long failed = 0;
+static struct fsfr_implicit imp;
+
+static void tar_fail(const char *path)
+{
+	fprintf(stderr,"fsfr-tar: %s: %s\n",path,strerror(errno));
+	failed++;
+}
+
+static void *tar_alloc(size_t size)
+{
+	void *p = malloc(size);
+	if (!p) {
+		perror("fsfr-tar");
+		exit(1);
+	}
+	return p;
+}
+
+static char *tar_join(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir);
+	char *path = tar_alloc(dlen + strlen(name) + 2);
+	memcpy(path,dir,dlen);
+	if (dlen && dir[dlen-1]!='/') path[dlen++] = '/';
+	strcpy(path+dlen,name);
+	return path;
+}
+
+/****************************************************************
+ *  Output
+ *  	Everything goes through one buffer, except the contents of
+ *  	large files, which are copied in the kernel after flushing it.
+ ****************************************************************/
+static int out_fd = 1;
+static int out_isreg = 0;
+static char *out_buf;
+static size_t out_len = 0;
+static uint64_t out_total = 0;
+
+static void out_flush(void)
+{
+	size_t done = 0;
+	while (done < out_len) {
+		ssize_t n = write(out_fd,out_buf+done,out_len-done);
+		if (n==-1 && errno==EINTR) continue;
+		if (n<=0) {
+			perror("fsfr-tar: write");
+			exit(2);
+		}
+		done += n;
+	}
+	out_len = 0;
+}
+
+static void out_write(const void *data, size_t len)
+{
+	while (len) {
+		size_t n = TAR_OUTBUF-out_len < len ? TAR_OUTBUF-out_len : len;
+		memcpy(out_buf+out_len,data,n);
+		out_len += n;
+		out_total += n;
+		data = (const char *)data + n;
+		len -= n;
+		if (out_len==TAR_OUTBUF) out_flush();
+	}
+}
+
+static void out_zeros(size_t len)
+{
+	static const char zeros[TAR_BLOCK];
+	while (len) {
+		size_t n = len < TAR_BLOCK ? len : TAR_BLOCK;
+		out_write(zeros,n);
+		len -= n;
+	}
+}
+
+static void out_pad(void)
+{
+	if (out_total % TAR_BLOCK) out_zeros(TAR_BLOCK - out_total % TAR_BLOCK);
+}
+
+// size bytes of fd into the archive, then padding; zeros if it comes up short
+static int out_file(int fd, off_t size)
+{
+	off_t left = size;
+	if (size >= TAR_DIRECT) {
+		out_flush();
+		int how = out_isreg ? 0 : 1;	// copy_file_range, sendfile, then read()
+		while (left > 0 && how < 2) {
+			ssize_t n = how==0 ? copy_file_range(fd,NULL,out_fd,NULL,left,0)
+					: sendfile(out_fd,fd,NULL,left);
+			if (n > 0) {
+				left -= n;
+				out_total += n;
+			} else if (n==-1 && errno==EINTR) {
+				continue;
+			} else if (n==-1 && (errno==EXDEV || errno==EINVAL || errno==ENOSYS
+					|| errno==EOPNOTSUPP)) {
+				how++;
+			} else {
+				break;		// short file, or a read error; see below
+			}
+		}
+	}
+	while (left > 0) {
+		if (out_len==TAR_OUTBUF) out_flush();
+		size_t room = TAR_OUTBUF-out_len;
+		ssize_t n = read(fd,out_buf+out_len,left < room ? left : room);
+		if (n==-1 && errno==EINTR) continue;
+		if (n<=0) break;
+		out_len += n;
+		out_total += n;
+		left -= n;
+	}
+	int rtn = left ? -1 : 0;
+	if (left) out_zeros(left);	// the header promised size bytes
+	out_pad();
+	return rtn;
+}
+
+/****************************************************************
+ *  Headers
+ ****************************************************************/
+// octal, or base-256 where it doesn't fit, as GNU tar does
+static void tar_number(char *field, size_t len, uint64_t val)
+{
+	size_t i;
+	if (len-1 >= 22 || val < (1ULL << (3*(len-1)))) {
+		field[len-1] = '\0';
+		for (i=len-1; i>0; i--) {
+			field[i-1] = '0' + (val & 7);
+			val >>= 3;
+		}
+		return;
+	}
+	for (i=len; i>1; i--) {
+		field[i-1] = val & 0xff;
+		val >>= 8;
+	}
+	field[0] = (char)0x80;
+}
+
+// str into a fixed-width field, NUL-terminated only if it fits; the
+// header starts out zeroed
+static void tar_string(char *field, size_t len, const char *str)
+{
+	size_t n = strlen(str);
+	memcpy(field,str,n < len ? n : len);
+}
+
+// getpwuid() and getgrgid() each time would cost more than the rest
+struct tar_name {
+	unsigned int id;
+	char name[32];
+	struct tar_name *next;
+};
+static struct tar_name *unames = NULL, *gnames = NULL;
+
+static const char *tar_idname(unsigned int id, int group)
+{
+	struct tar_name **list = group ? &gnames : &unames, *n;
+	for (n=*list; n; n=n->next) if (n->id==id) return n->name;
+	n = tar_alloc(sizeof(*n));
+	n->id = id;
+	n->name[0] = '\0';
+	if (group) {
+		struct group *gr = getgrgid(id);
+		if (gr) snprintf(n->name,sizeof(n->name),"%s",gr->gr_name);
+	} else {
+		struct passwd *pw = getpwuid(id);
+		if (pw) snprintf(n->name,sizeof(n->name),"%s",pw->pw_name);
+	}
+	n->next = *list;
+	*list = n;
+	return n->name;
+}
+
+static void tar_header_init(struct tar_header *h, const char *name, char type)
+{
+	memset(h,0,sizeof(*h));
+	tar_string(h->name,sizeof(h->name),name);
+	h->typeflag = type;
+	memcpy(h->magic,"ustar  ",8);
+}
+
+static void tar_header_write(struct tar_header *h)
+{
+	unsigned int sum = 0;
+	size_t i;
+	memset(h->chksum,' ',sizeof(h->chksum));
+	for (i=0; i<sizeof(*h); i++) sum += ((unsigned char *)h)[i];
+	snprintf(h->chksum,7,"%06o",sum);	// then NUL, then the last space
+	out_write(h,sizeof(*h));
+}
+
+// a name or link target too long for its field goes in an entry of its own
+static void tar_longlink(const char *str, char type)
+{
+	struct tar_header h;
+	size_t len = strlen(str)+1;
+	tar_header_init(&h,"././@LongLink",type);
+	tar_number(h.mode,sizeof(h.mode),0644);
+	tar_number(h.uid,sizeof(h.uid),0);
+	tar_number(h.gid,sizeof(h.gid),0);
+	tar_number(h.size,sizeof(h.size),len);
+	tar_number(h.mtime,sizeof(h.mtime),0);
+	tar_string(h.uname,sizeof(h.uname),tar_idname(0,0));
+	tar_string(h.gname,sizeof(h.gname),tar_idname(0,1));
+	tar_header_write(&h);
+	out_write(str,len);
+	out_pad();
+}
+
+/****************************************************************
+ *  Hard links
+ *  	The first name seen for an inode with more than one link
+ *  	gets the contents; later ones become links to it.
+ ****************************************************************/
+struct tar_link {
+	dev_t dev;
+	ino_t ino;
+	char *name;
+	struct tar_link *next;
+};
+static struct tar_link **links = NULL;
+static size_t links_size = 0, links_used = 0;
+
+static const char *tar_link_find(const struct stat *st, const char *name)
+{
+	size_t i;
+	struct tar_link *l;
+	if (links_used*2 >= links_size) {
+		size_t size = links_size ? links_size*2 : 1024;
+		struct tar_link **table = calloc(size,sizeof(*table));
+		if (!table) {
+			perror("fsfr-tar");
+			exit(1);
+		}
+		for (i=0; i<links_size; i++) {
+			while ((l = links[i])) {
+				links[i] = l->next;
+				size_t j = (l->ino ^ l->dev*0x9e3779b97f4a7c15ULL) % size;
+				l->next = table[j];
+				table[j] = l;
+			}
+		}
+		free(links);
+		links = table;
+		links_size = size;
+	}
+	i = (st->st_ino ^ st->st_dev*0x9e3779b97f4a7c15ULL) % links_size;
+	for (l=links[i]; l; l=l->next)
+		if (l->ino==st->st_ino && l->dev==st->st_dev) return l->name;
+	l = tar_alloc(sizeof(*l));
+	l->dev = st->st_dev;
+	l->ino = st->st_ino;
+	l->name = strdup(name);
+	l->next = links[i];
+	links[i] = l;
+	links_used++;
+	return NULL;
+}
+
+/****************************************************************
+ *  Entries
+ ****************************************************************/
+// name is the member name; dirfd/fname reach the file, path is for messages
+static void tar_entry(int dirfd, const char *fname, const char *path,
+		const char *name, const struct stat *st)
+{
+	struct tar_header h;
+	char type;
+	char target[PATH_MAX] = "";
+	char *dirname = NULL;
+	off_t size = 0;
+	int fd = -1;
+
+	if (verbose) fprintf(stderr,"%s\n",name);
+	const char *linkto = S_ISDIR(st->st_mode) || st->st_nlink < 2 ? NULL : tar_link_find(st,name);
+	if (linkto) {
+		type = '1';
+		strncpy(target,linkto,sizeof(target)-1);
+	} else switch (st->st_mode & S_IFMT) {
+	case S_IFREG:
+		type = '0';
+		size = st->st_size;
+		if (!size) break;	// nothing to read
+		fd = openat(dirfd,fname,O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+		if (fd==-1) {
+			tar_fail(path);
+			return;
+		}
+		break;
+	case S_IFDIR:
+		type = '5';
+		dirname = tar_join(name,"");
+		name = dirname;
+		break;
+	case S_IFLNK: {
+		type = '2';
+		ssize_t len = readlinkat(dirfd,fname,target,sizeof(target)-1);
+		if (len==-1) {
+			tar_fail(path);
+			return;
+		}
+		target[len] = '\0';
+		break;
+	}
+	case S_IFCHR: type = '3'; break;
+	case S_IFBLK: type = '4'; break;
+	case S_IFIFO: type = '6'; break;
+	default:
+		fprintf(stderr,"fsfr-tar: %s: socket ignored\n",path);
+		return;
+	}
+
+	if (strlen(target) > sizeof(h.linkname)) tar_longlink(target,'K');
+	if (strlen(name) > sizeof(h.name)) tar_longlink(name,'L');
+	tar_header_init(&h,name,type);
+	tar_number(h.mode,sizeof(h.mode),st->st_mode & 07777);
+	tar_number(h.uid,sizeof(h.uid),st->st_uid);
+	tar_number(h.gid,sizeof(h.gid),st->st_gid);
+	tar_number(h.size,sizeof(h.size),size);
+	tar_number(h.mtime,sizeof(h.mtime),st->st_mtime < 0 ? 0 : st->st_mtime);
+	tar_string(h.linkname,sizeof(h.linkname),target);
+	tar_string(h.uname,sizeof(h.uname),tar_idname(st->st_uid,0));
+	tar_string(h.gname,sizeof(h.gname),tar_idname(st->st_gid,1));
+	if (type=='3' || type=='4') {
+		tar_number(h.devmajor,sizeof(h.devmajor),major(st->st_rdev));
+		tar_number(h.devminor,sizeof(h.devminor),minor(st->st_rdev));
+	}
+	tar_header_write(&h);
+	if (fd!=-1) {
+		if (out_file(fd,size)) {
+			fprintf(stderr,"fsfr-tar: %s: file shrank or could not be read; padded with zeros\n",path);
+			failed++;
+		}
+		close(fd);
+	}
+	free(dirname);
+}
+
+// the stat a tar under the preload would see
+static int tar_stat(int dirfd, const char *name, const char *path, struct stat *st)
+{
+	struct fsfr_meta m;
+	if (fstatat(dirfd,name,st,AT_SYMLINK_NOFOLLOW)) return -1;
+	fsfr_getmeta_walk(dirfd,name,path,st,&m);
+	fsfr_meta_apply(st,&m,&imp);
+	return 0;
+}
+
+/****************************************************************
+ *  Shared lookups
+ *  	The main thread posts a directory's entries and takes its
+ *  	share like everyone else; the threads take entries off a
+ *  	counter until they run out.
+ ****************************************************************/
+struct tar_job {
+	int dirfd;
+	const char *dir;	// path to it, for the fallback
+	struct tar_ent *ents;
+	int n;
+	int next;		// next entry to take
+	int done;		// entries finished
+	int users;		// threads still holding the job
+};
+
+static struct tar_job *job = NULL;
+static unsigned int job_gen = 0;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_go = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+static void job_run(struct tar_job *j)
+{
+	int i;
+	while ((i = __atomic_fetch_add(&j->next,1,__ATOMIC_RELAXED)) < j->n) {
+		struct tar_ent *e = &j->ents[i];
+		char *path = tar_join(j->dir,e->name);
+		e->err = tar_stat(j->dirfd,e->name,path,&e->st) ? errno : 0;
+		free(path);
+		__atomic_add_fetch(&j->done,1,__ATOMIC_RELEASE);
+	}
+}
+
+static void *job_worker(void *arg)
+{
+	unsigned int gen = 0;
+	pthread_mutex_lock(&job_lock);
+	for (;;) {
+		while (job_gen==gen) pthread_cond_wait(&job_go,&job_lock);
+		gen = job_gen;
+		struct tar_job *j = job;
+		if (!j) break;		// shutting down
+		j->users++;
+		pthread_mutex_unlock(&job_lock);
+		job_run(j);
+		pthread_mutex_lock(&job_lock);
+		if (!--j->users) pthread_cond_signal(&job_done);
+	}
+	pthread_mutex_unlock(&job_lock);
+	return NULL;
+}
+
+static void tar_lookup(int dirfd, const char *dir, struct tar_ent *ents, int n)
+{
+	struct tar_job j = { dirfd, dir, ents, n, 0, 0, 0 };
+	if (nthreads < 2 || n < TAR_PARALLEL) {
+		job_run(&j);
+		return;
+	}
+	pthread_mutex_lock(&job_lock);
+	job = &j;
+	job_gen++;
+	pthread_cond_broadcast(&job_go);
+	pthread_mutex_unlock(&job_lock);
+	job_run(&j);
+	pthread_mutex_lock(&job_lock);
+	while (j.users || __atomic_load_n(&j.done,__ATOMIC_ACQUIRE) < n)
+		pthread_cond_wait(&job_done,&job_lock);
+	job = NULL;
+	pthread_mutex_unlock(&job_lock);
+}
+
+/****************************************************************
+ *  Walk
+ ****************************************************************/
+static int tar_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct tar_ent *)a)->name,((const struct tar_ent *)b)->name);
+}
+
+// everything in the directory dirfd, whose member name is name
+static void tar_dir(int dirfd, const char *path, const char *name)
+{
+	struct tar_ent *ents = NULL;
+	size_t n = 0, cap = 0, i;
+	char buf[32768];
+	ssize_t len;
+	while ((len = getdents64(dirfd,buf,sizeof(buf))) > 0) {
+		char *p = buf;
+		while (p < buf+len) {
+			struct dirent64 *de = (struct dirent64 *)p;
+			p += de->d_reclen;
+			if (de->d_name[0]=='.' && (!de->d_name[1]
+					|| (de->d_name[1]=='.' && !de->d_name[2]))) continue;
+			if (n==cap) {
+				cap = cap ? cap*2 : 64;
+				ents = realloc(ents,cap*sizeof(*ents));
+				if (!ents) {
+					perror("fsfr-tar");
+					exit(1);
+				}
+			}
+			ents[n++].name = strdup(de->d_name);
+		}
+	}
+	if (len==-1) tar_fail(path);
+	qsort(ents,n,sizeof(*ents),tar_cmp);
+	tar_lookup(dirfd,path,ents,n);
+
+	for (i=0; i<n; i++) {
+		struct tar_ent *e = &ents[i];
+		char *subpath = tar_join(path,e->name);
+		char *subname = tar_join(name,e->name);
+		if (e->err) {
+			errno = e->err;
+			tar_fail(subpath);
+		} else {
+			tar_entry(dirfd,e->name,subpath,subname,&e->st);
+			if (S_ISDIR(e->st.st_mode)) {
+				int fd = openat(dirfd,e->name,O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+				if (fd==-1) tar_fail(subpath);
+				else {
+					tar_dir(fd,subpath,subname);
+					close(fd);
+				}
+			}
+		}
+		free(subpath);
+		free(subname);
+		free(e->name);
+	}
+	free(ents);
+}
+
+// one of the files named on the command line
+static void tar_root(const char *path)
+{
+	struct stat st;
+	char *name = strdup(path), *end;
+	const char *member = name;
+	// like tar: no leading slashes, and none at the end either
+	while (*member=='/') member++;
+	for (end = name+strlen(name); end > member+1 && end[-1]=='/'; end--) end[-1] = '\0';
+	if (!*member) member = ".";
+	if (tar_stat(AT_FDCWD,path,path,&st)) {
+		tar_fail(path);
+	} else {
+		tar_entry(AT_FDCWD,path,path,member,&st);
+		if (S_ISDIR(st.st_mode)) {
+			int fd = open(path,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+			if (fd==-1) tar_fail(path);
+			else {
+				tar_dir(fd,path,member);
+				close(fd);
+			}
+		}
+	}
+	free(name);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,"usage: %s [-v] [-C dir] [-f archive] [-j threads] <path>...\n",name);
+	fprintf(stderr,"  Writes a GNU tar archive of each <path> with its fake owners,\n");
+	fprintf(stderr,"  modes and device nodes, in name order; the same archive\n");
+	fprintf(stderr,"  \"tar --sort=name -cf\" makes under fsfakeroot.\n");
+	fprintf(stderr,"  -f: the archive, or - for standard output (the default)\n");
+	fprintf(stderr,"  -v: list the entries on standard error\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *archive = "-";
+	const char *chdir_to = NULL;
+	int opt, i;
+	nthreads = ncpu < 1 ? 1 : ncpu > TAR_MAXTHREADS ? TAR_MAXTHREADS : ncpu;
+	while ((opt = getopt(argc,argv,"vC:f:j:")) != -1) {
+		switch (opt) {
+		case 'v': verbose = 1; break;
+		case 'C': chdir_to = optarg; break;
+		case 'f': archive = optarg; break;
+		case 'j': nthreads = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind >= argc || nthreads < 1 || nthreads > TAR_MAXTHREADS) usage(argv[0]);
+	if (fsfr_daemon_refuse("fsfr-tar")) return 2;
+	if (strcmp(archive,"-")) {
+		out_fd = open(archive,O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0666);
+		if (out_fd==-1) {
+			perror(archive);
+			return 2;
+		}
+	}
+	if (chdir_to && chdir(chdir_to)) {
+		perror(chdir_to);
+		return 2;
+	}
+	struct stat st;
+	out_isreg = !fstat(out_fd,&st) && S_ISREG(st.st_mode);
+	out_buf = tar_alloc(TAR_OUTBUF);
+	fsfr_implicit_load(&imp);
+
+	pthread_t tids[TAR_MAXTHREADS];
+	for (i=1; i<nthreads; i++) pthread_create(&tids[i],NULL,job_worker,NULL);
+	for (i=optind; i<argc; i++) tar_root(argv[i]);
+	pthread_mutex_lock(&job_lock);
+	job = NULL;
+	job_gen++;
+	pthread_cond_broadcast(&job_go);
+	pthread_mutex_unlock(&job_lock);
+	for (i=1; i<nthreads; i++) pthread_join(tids[i],NULL);
+
+	// two empty blocks, then out to a whole record
+	out_zeros(2*TAR_BLOCK);
+	if (out_total % TAR_RECORD) out_zeros(TAR_RECORD - out_total % TAR_RECORD);
+	out_flush();
+	if (out_fd!=1 && close(out_fd)) {
+		perror(archive);
+		return 2;
+	}
+	return failed?1:0;
+}
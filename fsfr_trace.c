@@ -0,0 +1,207 @@
+/*
+ * fsfr_trace.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+#include "fsfr.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/****************************************************************
+ *  Call hooks and the trace ring
+ *  	Where FSFR_CALL and FSFR_XATTR (see fsfr.h) end up when
+ *  	FSFR_STATS or FSFR_TRACE is set. The USDT probes need none
+ *  	of this: they're there whether or not anything is.
+ *
+ *  	FSFR_TRACE names a directory. Each thread that makes a call
+ *  	gets a file of its own there, fsfr.<pid>.<tid>.<n>.trace,
+ *  	mapped shared, holding a header and a ring of fixed-size
+ *  	records: one per wrapper call and one per xattr syscall, the
+ *  	last FSFR_TRACE_SIZE (65536 by default) of them. Writing one
+ *  	is a few stores into memory; the kernel writes the file back
+ *  	whenever it likes, and a process that dies still leaves its
+ *  	records behind. fsfr-trace turns the files into a timeline.
+ ****************************************************************/
+
+#define TRACE_DEFAULT_SIZE 65536
+
+int fsfr_hooks = 0;
+
+const char *const fsfr_op_names[FSFR_NOPS] = {
+#define FSFR_OP_NAME(NAME) #NAME,
+	FSFR_OPS(FSFR_OP_NAME)
+#undef FSFR_OP_NAME
+};
+
+struct fsfr_trace_ring {
+	struct fsfr_trace_header *h;
+	struct fsfr_trace_rec *rec;
+	size_t len;
+	unsigned int gen;
+	int tried;
+};
+
+static char *trace_dir = NULL;
+static uint32_t trace_nrec = TRACE_DEFAULT_SIZE;
+static unsigned int trace_gen = 0;		// bumped in a fork() child
+static pthread_key_t trace_key;
+static __thread struct fsfr_trace_ring trace_mine;
+static __thread int call_cur = FSFR_OP_other;	// the outermost wrapper
+
+static uint64_t fsfr_trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void fsfr_trace_thread_exit(void *arg)
+{
+	struct fsfr_trace_ring *r = arg;
+	if (r->h) munmap(r->h,r->len);
+	r->h = NULL;
+}
+
+static void fsfr_trace_atfork_child(void)
+{
+	trace_gen++;
+}
+
+static struct fsfr_trace_ring *fsfr_trace_ring(void)
+{
+	struct fsfr_trace_ring *r = &trace_mine;
+	char path[PATH_MAX];
+	int fd = -1, n;
+	if (r->tried && r->gen==trace_gen) return r->h ? r : NULL;
+	// the parent's, in a fork() child; not ours to write to
+	if (r->h) munmap(r->h,r->len);
+	r->h = NULL;
+	r->tried = 1;
+	r->gen = trace_gen;
+
+	pid_t pid = getpid();
+	pid_t tid = syscall(SYS_gettid);
+	// an exec keeps both ids, so the new program needs a new number
+	for (n=0; n<1000 && fd==-1; n++) {
+		snprintf(path,sizeof(path),"%s/fsfr.%i.%i.%i.trace",trace_dir,pid,tid,n);
+		fd = fsfr_base_open(path,O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC,0644);
+		if (fd==-1 && errno!=EEXIST) return NULL;
+	}
+	if (fd==-1) return NULL;
+	size_t len = sizeof(struct fsfr_trace_header) + trace_nrec*sizeof(struct fsfr_trace_rec);
+	void *map = MAP_FAILED;
+	if (!ftruncate(fd,len))
+		map = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	fsfr_real.close(fd);
+	if (map==MAP_FAILED) {
+		fsfr_base_unlinkat(AT_FDCWD,path,0);
+		return NULL;
+	}
+	r->h = map;
+	r->rec = (struct fsfr_trace_rec *)(r->h+1);
+	r->len = len;
+	r->h->magic = FSFR_TRACE_MAGIC;
+	r->h->recsize = sizeof(struct fsfr_trace_rec);
+	r->h->nrec = trace_nrec;
+	r->h->pid = pid;
+	r->h->tid = tid;
+	strncpy(r->h->comm,program_invocation_short_name,sizeof(r->h->comm)-1);
+	pthread_setspecific(trace_key,r);
+	return r;
+}
+
+static void fsfr_trace_put(int kind, int op, uint64_t start, uint64_t dur,
+		const char *path, int fd, const char *attr, int64_t rtn, int err)
+{
+	struct fsfr_trace_ring *r = fsfr_trace_ring();
+	if (!r) return;
+	uint64_t head = r->h->head;
+	struct fsfr_trace_rec *rec = &r->rec[head & (r->h->nrec-1)];
+	memset(rec,0,sizeof(*rec));
+	rec->start = start;
+	rec->dur = dur > UINT32_MAX ? UINT32_MAX : dur;
+	rec->op = op;
+	rec->kind = kind;
+	rec->fd = fd;
+	rec->rtn = rtn;
+	rec->err = rtn==-1 ? err : 0;
+	if (attr) {
+		if (!strncmp(attr,XATTR_PREFIX,sizeof(XATTR_PREFIX)-1))
+			attr += sizeof(XATTR_PREFIX)-1;
+		strncpy(rec->attr,attr,sizeof(rec->attr)-1);
+	}
+	if (path) {
+		// the end of a path says more than the start
+		size_t len = strlen(path);
+		if (len >= sizeof(rec->path)) {
+			path += len - (sizeof(rec->path)-1);
+			rec->flags |= FSFR_TRACE_CUT;
+		}
+		strncpy(rec->path,path,sizeof(rec->path)-1);
+	}
+	__atomic_store_n(&r->h->head,head+1,__ATOMIC_RELEASE);
+}
+
+/****************************************************************
+ *  The hooks themselves
+ ****************************************************************/
+// Only called with something switched on; returns the start time
+uint64_t fsfr_call_enter(struct fsfr_call *c)
+{
+	if (call_cur==FSFR_OP_other) {
+		call_cur = c->op;
+		c->outer = 1;
+		if (fsfr_hooks & FSFR_HOOK_STATS) c->counted = fsfr_stats_enter(c->op);
+	}
+	return fsfr_trace_now();
+}
+
+void fsfr_call_leave(struct fsfr_call *c)
+{
+	int err = errno;
+	uint64_t ns = fsfr_trace_now() - c->t0;
+	if (c->counted) fsfr_stats_leave(ns);
+	if (fsfr_hooks & FSFR_HOOK_TRACE)
+		fsfr_trace_put(FSFR_TRACE_CALL,c->op,c->t0,ns,c->path,c->fd,NULL,c->rtn,err);
+	if (c->outer) call_cur = FSFR_OP_other;
+	errno = err;
+}
+
+uint64_t fsfr_xattr_enter(void)
+{
+	if (fsfr_hooks & FSFR_HOOK_STATS) fsfr_stats_add(FSFR_STAT_XATTR,1);
+	return (fsfr_hooks & FSFR_HOOK_TRACE) ? fsfr_trace_now() : 0;
+}
+
+void fsfr_xattr_leave(uint64_t t0, int kind, const char *path, int fd,
+		const char *attr, int64_t rtn)
+{
+	int err = errno;
+	fsfr_trace_put(kind,call_cur,t0,fsfr_trace_now()-t0,path,fd,attr,rtn,err);
+	errno = err;
+}
+
+static void __attribute__((constructor)) fsfr_trace_init(void)
+{
+	char *dir = getenv("FSFR_TRACE");
+	char *size = getenv("FSFR_TRACE_SIZE");
+	if (!dir || !*dir) return;
+	trace_dir = strdup(dir);
+	if (!trace_dir || pthread_key_create(&trace_key,fsfr_trace_thread_exit)) return;
+	if (size && atol(size) > 0) {
+		uint64_t want = atol(size);
+		trace_nrec = 64;
+		while (trace_nrec < want && trace_nrec < (1U<<30)) trace_nrec <<= 1;
+	}
+	pthread_atfork(NULL,NULL,fsfr_trace_atfork_child);
+	__atomic_or_fetch(&fsfr_hooks,FSFR_HOOK_TRACE,__ATOMIC_RELEASE);
+}
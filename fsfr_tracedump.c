@@ -0,0 +1,197 @@
+/*
+ * fsfr_tracedump.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+/****************************************************************
+ *  fsfr-trace
+ *  	Turn the files left in an FSFR_TRACE directory into one
+ *  	timeline. Every file holds the last so many records of one
+ *  	thread; they're merged by start time and printed relative to
+ *  	the first, one line per call, with the xattr syscalls made
+ *  	on its behalf indented under it.
+ *
+ *  	Files may be given by name, or a directory for all of the
+ *  	traces in it. A file still being written is read as it is.
+ ****************************************************************/
+
+#include "fsfr.h"
+#include <stdlib.h>
+#include <sys/mman.h>
+
+struct trace_file {
+	const char *name;
+	struct fsfr_trace_header *h;
+	size_t len;
+};
+
+struct trace_ent {
+	const struct fsfr_trace_rec *rec;
+	const struct trace_file *file;
+};
+
+static struct trace_file *files = NULL;
+static size_t nfiles = 0, files_size = 0;
+static int calls_only = 0;
+static int errors_only = 0;
+
+static const char *const xattr_kinds[] = { "call", "get", "set", "remove", "list" };
+
+static void *xrealloc(void *p, size_t len)
+{
+	p = realloc(p,len);
+	if (!p) {
+		perror("fsfr-trace");
+		exit(1);
+	}
+	return p;
+}
+
+static void trace_load(const char *name)
+{
+	struct stat st;
+	int fd = open(name,O_RDONLY|O_CLOEXEC);
+	if (fd==-1 || fstat(fd,&st)) {
+		perror(name);
+		if (fd!=-1) close(fd);
+		return;
+	}
+	void *map = st.st_size < (off_t)sizeof(struct fsfr_trace_header) ? MAP_FAILED
+		: mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	struct fsfr_trace_header *h = map;
+	if (map==MAP_FAILED || h->magic!=FSFR_TRACE_MAGIC
+			|| h->recsize!=sizeof(struct fsfr_trace_rec) || !h->nrec
+			|| (h->nrec & (h->nrec-1))
+			|| sizeof(*h) + (uint64_t)h->nrec*h->recsize > (uint64_t)st.st_size) {
+		fprintf(stderr,"%s: not an fsfr trace\n",name);
+		if (map!=MAP_FAILED) munmap(map,st.st_size);
+		return;
+	}
+	if (nfiles==files_size) {
+		files_size = files_size ? files_size*2 : 16;
+		files = xrealloc(files,files_size*sizeof(*files));
+	}
+	files[nfiles].name = name;
+	files[nfiles].h = h;
+	files[nfiles].len = st.st_size;
+	nfiles++;
+}
+
+static void trace_load_dir(const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	if (!d) {
+		perror(dir);
+		return;
+	}
+	while ((de = readdir(d))) {
+		size_t len = strlen(de->d_name);
+		if (strncmp(de->d_name,"fsfr.",5) || len<6
+				|| strcmp(de->d_name+len-6,".trace")) continue;
+		char *path = xrealloc(NULL,strlen(dir)+len+2);
+		sprintf(path,"%s/%s",dir,de->d_name);
+		trace_load(path);
+	}
+	closedir(d);
+}
+
+static int trace_cmp(const void *a, const void *b)
+{
+	const struct trace_ent *x = a, *y = b;
+	if (x->rec->start != y->rec->start) return x->rec->start < y->rec->start ? -1 : 1;
+	// a call starts before the xattr calls inside it, and ends after them
+	return (x->rec->kind!=FSFR_TRACE_CALL) - (y->rec->kind!=FSFR_TRACE_CALL);
+}
+
+// the string fields are only terminated if they fit
+static void trace_print_str(const char *s, size_t len)
+{
+	printf("%.*s",(int)strnlen(s,len),s);
+}
+
+static void trace_print(const struct trace_ent *e, uint64_t t0)
+{
+	const struct fsfr_trace_rec *r = e->rec;
+	const struct fsfr_trace_header *h = e->file->h;
+	uint64_t t = r->start - t0;
+	printf("%4llu.%06llu %6i/%-6i ",(unsigned long long)(t/1000000000),
+		(unsigned long long)(t%1000000000/1000),h->pid,h->tid);
+	if (r->kind==FSFR_TRACE_CALL) {
+		printf("%-10s",r->op<FSFR_NOPS ? fsfr_op_names[r->op] : "?");
+	} else {
+		printf("  xattr %s",r->kind<sizeof(xattr_kinds)/sizeof(xattr_kinds[0])
+			? xattr_kinds[r->kind] : "?");
+		if (r->attr[0]) {
+			printf(" ");
+			trace_print_str(r->attr,sizeof(r->attr));
+		}
+	}
+	if (r->fd!=-1 && r->fd!=AT_FDCWD) printf(" fd %i",r->fd);
+	if (r->path[0]) {
+		printf(" %s",r->flags & FSFR_TRACE_CUT ? "..." : "");
+		trace_print_str(r->path,sizeof(r->path));
+	}
+	printf(" = %lli",(long long)r->rtn);
+	if (r->rtn==-1 && r->err) printf(" %s",strerror(r->err));
+	printf(" <%u.%03uus>\n",r->dur/1000,r->dur%1000);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,"Usage: fsfr-trace [-c] [-e] TRACE|DIR...\n"
+		"  -c   calls only, without the xattr syscalls they made\n"
+		"  -e   only what failed\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_ent *ents = NULL;
+	size_t nents = 0, i;
+	int opt;
+	while ((opt = getopt(argc,argv,"ce")) != -1) {
+		switch (opt) {
+		case 'c': calls_only = 1; break;
+		case 'e': errors_only = 1; break;
+		default: usage();
+		}
+	}
+	if (optind >= argc) usage();
+	for (; optind<argc; optind++) {
+		struct stat st;
+		if (!stat(argv[optind],&st) && S_ISDIR(st.st_mode))
+			trace_load_dir(argv[optind]);
+		else
+			trace_load(argv[optind]);
+	}
+
+	for (i=0; i<nfiles; i++) {
+		const struct fsfr_trace_header *h = files[i].h;
+		const struct fsfr_trace_rec *rec = (const struct fsfr_trace_rec *)(h+1);
+		uint64_t head = __atomic_load_n(&h->head,__ATOMIC_ACQUIRE);
+		uint64_t n = head < h->nrec ? 0 : head - h->nrec;
+		if (head > h->nrec)
+			fprintf(stderr,"%s: %llu older records overwritten\n",files[i].name,
+				(unsigned long long)(head - h->nrec));
+		ents = xrealloc(ents,(nents + head - n)*sizeof(*ents));
+		for (; n<head; n++) {
+			const struct fsfr_trace_rec *r = &rec[n & (h->nrec-1)];
+			if (calls_only && r->kind!=FSFR_TRACE_CALL) continue;
+			if (errors_only && r->rtn!=-1) continue;
+			ents[nents].rec = r;
+			ents[nents].file = &files[i];
+			nents++;
+		}
+	}
+	if (!nents) return nfiles ? 0 : 1;
+	qsort(ents,nents,sizeof(*ents),trace_cmp);
+	for (i=0; i<nents; i++) trace_print(&ents[i],ents[0].rec->start);
+	return 0;
+}
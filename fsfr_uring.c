@@ -0,0 +1,288 @@
+/*
+ * fsfr_uring.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+#include "fsfr.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/****************************************************************
+ *  Batched xattr calls
+ *  	fsfr_batch() runs a list of getxattr/setxattr/close calls.
+ *  	Where the kernel has io_uring with the xattr opcodes (5.19
+ *  	and later), the whole list goes in at once and costs one
+ *  	io_uring_enter() per FSFR_URING_DEPTH calls. Otherwise, or
+ *  	with FSFR_URING=0, the calls are simply made one at a time.
+ *
+ *  	There's no liburing dependency; the ring is set up by hand
+ *  	with the raw syscalls. Each thread gets a ring of its own
+ *  	the first time it has a batch worth submitting. Rings don't
+ *  	carry over into a fork() child, which sets up its own.
+ ****************************************************************/
+
+#if defined(SYS_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_SETUP_SQE128	// same release as the xattr opcodes
+#define FSFR_URING
+#endif
+#endif
+
+#define FSFR_URING_DEPTH 64
+#define FSFR_URING_MIN 4	// fewer than this aren't worth a ring
+
+// what a call returns, or -errno, the way the kernel reports it
+static long fsfr_batch_sync(struct fsfr_batch_op *op)
+{
+	long rtn;
+	switch (op->op) {
+	case FSFR_BATCH_GETXATTR:
+		rtn = op->path ? getxattr(op->path,op->name,op->value,op->size)
+				: fgetxattr(op->fd,op->name,op->value,op->size);
+		break;
+	case FSFR_BATCH_SETXATTR:
+		rtn = op->path ? setxattr(op->path,op->name,op->value,op->size,0)
+				: fsetxattr(op->fd,op->name,op->value,op->size,0);
+		break;
+	case FSFR_BATCH_CLOSE:
+		rtn = fsfr_real.close(op->fd);
+		break;
+	default:
+		errno = EINVAL;
+		rtn = -1;
+	}
+	return rtn==-1 ? -errno : rtn;
+}
+
+#ifdef FSFR_URING
+
+struct fsfr_uring {
+	int fd;
+	unsigned int gen;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_size, cq_size, sqes_size;
+};
+
+static int uring_enabled = -1;	// until the first probe
+static unsigned int uring_gen = 0;	// bumped in a fork() child
+static __thread struct fsfr_uring *uring_mine = NULL;
+static pthread_key_t uring_key;
+
+static void fsfr_uring_free(struct fsfr_uring *r)
+{
+	if (r->sqes) munmap(r->sqes,r->sqes_size);
+	if (r->cq_map && r->cq_map!=r->sq_map) munmap(r->cq_map,r->cq_size);
+	if (r->sq_map) munmap(r->sq_map,r->sq_size);
+	fsfr_real.close(r->fd);
+	free(r);
+}
+
+static void fsfr_uring_thread_exit(void *arg)
+{
+	fsfr_uring_free(arg);
+}
+
+static void fsfr_uring_atfork_child(void)
+{
+	uring_gen++;
+}
+
+static struct fsfr_uring *fsfr_uring_setup(void)
+{
+	struct io_uring_params p;
+	memset(&p,0,sizeof(p));
+	int fd = syscall(SYS_io_uring_setup,FSFR_URING_DEPTH,&p);
+	if (fd==-1) return NULL;
+	struct fsfr_uring *r = calloc(1,sizeof(*r));
+	if (!r) {
+		fsfr_real.close(fd);
+		return NULL;
+	}
+	r->fd = fd;
+	r->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned int);
+	r->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+		r->cq_size = r->sq_size;
+	}
+	r->sq_map = mmap(NULL,r->sq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+			fd,IORING_OFF_SQ_RING);
+	if (r->sq_map==MAP_FAILED) goto fail_sq;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_map = r->sq_map;
+	} else {
+		r->cq_map = mmap(NULL,r->cq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+				fd,IORING_OFF_CQ_RING);
+		if (r->cq_map==MAP_FAILED) goto fail_cq;
+	}
+	r->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL,r->sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+			fd,IORING_OFF_SQES);
+	if (r->sqes==MAP_FAILED) goto fail_sqes;
+
+	char *sq = r->sq_map, *cq = r->cq_map;
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->gen = uring_gen;
+	return r;
+
+fail_sqes:
+	r->sqes = NULL;
+fail_cq:
+	if (r->cq_map==MAP_FAILED) r->cq_map = NULL;
+fail_sq:
+	if (r->sq_map==MAP_FAILED) r->sq_map = NULL;
+	fsfr_uring_free(r);
+	return NULL;
+}
+
+// does this kernel have everything we submit?
+static int fsfr_uring_probe(struct fsfr_uring *r)
+{
+	int ops[] = { IORING_OP_GETXATTR, IORING_OP_FGETXATTR,
+			IORING_OP_SETXATTR, IORING_OP_FSETXATTR, IORING_OP_CLOSE };
+	size_t len = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1,len);
+	int i, ok = probe && !syscall(SYS_io_uring_register,r->fd,IORING_REGISTER_PROBE,probe,256);
+	for (i=0; ok && i<sizeof(ops)/sizeof(ops[0]); i++)
+		ok = ops[i] < probe->ops_len && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok;
+}
+
+static void fsfr_uring_init(void)
+{
+	char *env = getenv("FSFR_URING");
+	uring_enabled = 0;
+	if (env && !strcmp(env,"0")) return;
+	struct fsfr_uring *r = fsfr_uring_setup();
+	if (!r) return;
+	int ok = fsfr_uring_probe(r);
+	fsfr_uring_free(r);
+	if (!ok || pthread_key_create(&uring_key,fsfr_uring_thread_exit)) return;
+	pthread_atfork(NULL,NULL,fsfr_uring_atfork_child);
+	uring_enabled = 1;
+}
+
+static struct fsfr_uring *fsfr_uring_get(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	if (uring_enabled==-1) pthread_once(&once,fsfr_uring_init);
+	if (!uring_enabled) return NULL;
+	struct fsfr_uring *r = uring_mine;
+	if (r && r->gen!=uring_gen) {
+		// the parent's; our copy of it is no use to anyone
+		fsfr_uring_free(r);
+		r = NULL;
+	}
+	if (!r) {
+		r = fsfr_uring_setup();
+		pthread_setspecific(uring_key,r);
+		uring_mine = r;
+	}
+	return r;
+}
+
+static void fsfr_uring_prep(struct io_uring_sqe *sqe, struct fsfr_batch_op *op)
+{
+	memset(sqe,0,sizeof(*sqe));
+	switch (op->op) {
+	case FSFR_BATCH_GETXATTR:
+	case FSFR_BATCH_SETXATTR:
+		if (op->path) {
+			sqe->opcode = op->op==FSFR_BATCH_GETXATTR ? IORING_OP_GETXATTR : IORING_OP_SETXATTR;
+			sqe->addr3 = (uintptr_t)op->path;
+		} else {
+			sqe->opcode = op->op==FSFR_BATCH_GETXATTR ? IORING_OP_FGETXATTR : IORING_OP_FSETXATTR;
+			sqe->fd = op->fd;
+		}
+		sqe->addr = (uintptr_t)op->name;
+		sqe->addr2 = (uintptr_t)op->value;
+		sqe->len = op->size;
+		break;
+	case FSFR_BATCH_CLOSE:
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = op->fd;
+		break;
+	}
+}
+
+// submit up to a ring's worth and wait for all of it
+static int fsfr_uring_run(struct fsfr_uring *r, struct fsfr_batch_op *ops, int n)
+{
+	unsigned int tail = *r->sq_tail, mask = *r->sq_mask;
+	int i;
+	for (i=0; i<n; i++) {
+		unsigned int idx = (tail+i) & mask;
+		fsfr_uring_prep(&r->sqes[idx],&ops[i]);
+		r->sqes[idx].user_data = i;
+		r->sq_array[idx] = idx;
+	}
+	__atomic_store_n(r->sq_tail,tail+n,__ATOMIC_RELEASE);
+	int done = 0;
+	while (done < n) {
+		int rtn = syscall(SYS_io_uring_enter,r->fd,done ? 0 : n,n-done,
+				IORING_ENTER_GETEVENTS,NULL,0);
+		if (rtn==-1 && errno!=EINTR) return -1;
+		unsigned int head = *r->cq_head;
+		unsigned int ctail = __atomic_load_n(r->cq_tail,__ATOMIC_ACQUIRE);
+		for (; head!=ctail; head++, done++) {
+			struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+			ops[cqe->user_data].res = cqe->res;
+		}
+		__atomic_store_n(r->cq_head,head,__ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+#endif /* FSFR_URING */
+
+// Run every op, filling in op->res
+void fsfr_batch(struct fsfr_batch_op *ops, int n)
+{
+	int i = 0;
+	if (fsfr_hooks & FSFR_HOOK_STATS) {
+		int j, x = 0;
+		for (j=0; j<n; j++) x += ops[j].op!=FSFR_BATCH_CLOSE;
+		fsfr_stats_add(FSFR_STAT_XATTR,x);
+	}
+#ifdef FSFR_URING
+	struct fsfr_uring *r = n >= FSFR_URING_MIN ? fsfr_uring_get() : NULL;
+	while (r && i < n) {
+		int chunk = n-i < FSFR_URING_DEPTH ? n-i : FSFR_URING_DEPTH, j;
+		for (j=0; j<chunk; j++) ops[i+j].res = -EINPROGRESS;
+		if (fsfr_uring_run(r,ops+i,chunk)) {
+			// a ring in an unknown state is no use; drop it, and
+			// redo whatever didn't report back (a close may have
+			// happened anyway, and is better left alone)
+			fsfr_uring_free(r);
+			pthread_setspecific(uring_key,NULL);
+			uring_mine = NULL;
+			for (; i<n; i++)
+				if (ops[i].res==-EINPROGRESS && ops[i].op!=FSFR_BATCH_CLOSE)
+					ops[i].res = fsfr_batch_sync(&ops[i]);
+			return;
+		}
+		i += chunk;
+	}
+#endif
+	for (; i<n; i++) ops[i].res = fsfr_batch_sync(&ops[i]);
+}
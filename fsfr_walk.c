@@ -0,0 +1,88 @@
+/*
+ * fsfr_walk.c
+ *
+ * Copyright (c) 2010, Tyler Larson <devel@tlarson.com>
+ *
+ * This software is licensed under the terms of the MIT License.
+ * See the included file "LICENSE" for more information.
+ *
+ */
+
+#include "fsfr.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+/****************************************************************
+ *  Parallel directory walk
+ *  	Shared by fsfr-prune, fsfr-export, fsfr-import, fsfr-chown
+ *  	and fsfr-chmod: a stack of directories waiting to be read,
+ *  	taken one at a time by a few threads, each of which pushes
+ *  	the subdirectories it finds. The walk is over once the stack
+ *  	is empty with nobody reading.
+ ****************************************************************/
+
+struct fsfr_walk_work {
+	char *path;
+	struct fsfr_walk_work *next;
+};
+
+static struct fsfr_walk_work *work = NULL;
+static int work_busy = 0;		// threads in the middle of a directory
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static void (*walk_scan)(const char *path, void *arg);
+
+// path is malloc()ed, and freed once it has been scanned
+void fsfr_walk_push(char *path)
+{
+	struct fsfr_walk_work *w = malloc(sizeof(*w));
+	if (!w || !path) {
+		perror(program_invocation_short_name);
+		exit(1);
+	}
+	w->path = path;
+	pthread_mutex_lock(&work_lock);
+	w->next = work;
+	work = w;
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+}
+
+static void *fsfr_walk_worker(void *arg)
+{
+	pthread_mutex_lock(&work_lock);
+	for (;;) {
+		while (!work && work_busy) pthread_cond_wait(&work_cond,&work_lock);
+		if (!work) break;	// nothing queued, nobody left to queue more
+		struct fsfr_walk_work *w = work;
+		work = w->next;
+		work_busy++;
+		pthread_mutex_unlock(&work_lock);
+		walk_scan(w->path,arg);
+		free(w->path);
+		free(w);
+		pthread_mutex_lock(&work_lock);
+		work_busy--;
+	}
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+	return NULL;
+}
+
+// Scan everything pushed so far, and everything scan() pushes, with
+// nthreads threads; args holds each thread's arg, or is NULL
+void fsfr_walk(int nthreads, void (*scan)(const char *path, void *arg), void **args)
+{
+	pthread_t *tids = calloc(nthreads,sizeof(*tids));
+	int i;
+	if (!tids) {
+		perror(program_invocation_short_name);
+		exit(1);
+	}
+	walk_scan = scan;
+	for (i=0; i<nthreads; i++)
+		pthread_create(&tids[i],NULL,fsfr_walk_worker,args?args[i]:NULL);
+	for (i=0; i<nthreads; i++) pthread_join(tids[i],NULL);
+	free(tids);
+}